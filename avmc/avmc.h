@@ -37,6 +37,7 @@ typedef struct  {
     char *p_text; /* Parameter text from source file */
     param_type_t p_type; /* Type of parameter */
     uint32_t p_opcode; /* Defined or allocated opcode for parameter. */
+    uint64_t p_ext; /* Extension word(s), emitted if p_opcode is OP_FLAG_WIDE */
 } param_t;
 
 /* Globals */
@@ -48,6 +49,9 @@ static char avmc_errstr[2048];
 /* Prototypes from parser */
 int parser_init(int argc, char **argv);
 
+/* Debug level that traces each op and parameter as it's parsed */
+#define AVMC_DEBUG_OPS 4
+
 /* Protoypes exposed to parser */
 char *avmc_inst_start(char *instruction, char *file, int lineno);
 char *avmc_inst_param(param_type_t p_type, char *p_text);
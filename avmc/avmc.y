@@ -58,6 +58,7 @@ INPUT:
 
 LINE:  
     LINETERM  { /* ignore blank lines */ }
+    | MNEMONIC LINETERM { if (parser_result(avmc_inst_finish(),1)) YYERROR;}
     | MNEMONIC ARGS LINETERM { if (parser_result(avmc_inst_finish(),1)) YYERROR;}
     | DEFINE CLASSARG ARGS LINETERM { if (parser_result(avmc_inst_finish(),1)) YYERROR;}
     | DEFINE CLASSARG COMMA ARGS LINETERM { if (parser_result(avmc_inst_finish(),1)) YYERROR;}
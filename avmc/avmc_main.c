@@ -34,6 +34,8 @@ void avmc_seg_init(class_segment_t *seg);
 
 char *avmc_source_file = NULL; /* Input. */
 char *avmc_object_file = NULL; /* Output */
+int avmc_save_flags = 0; /* avmlib_segment_save() flags */
+char *avmc_native_file = NULL; /* C translation of the segment, if wanted */
 
 /* Globals */
 static op_t *cur_op = NULL; 
@@ -67,6 +69,21 @@ static struct option opts[] = {
          * and will select the label in the linked segments.
          */
     { "entrypoint", 1, NULL, 'e' },
+        /* "strip" leaves names nothing binds to at runtime (strings,
+         * buffers) out of the output image.
+         */
+    { "strip", 0, NULL, 's' },
+        /* "native" also writes the segment out as C (avmlib_aot.h),
+         * for the host compiler to build into a shared object the
+         * runtime can run in place of interpreting.
+         */
+    { "native", 1, NULL, 'n' },
+        /* "verbose" raises the debug level by one per use; at
+         * AVMC_DEBUG_OPS every op and parameter parsed is traced.
+         */
+    { "verbose", 0, NULL, 'v' },
+        /* "quiet" prints errors only. */
+    { "quiet", 0, NULL, 'q' },
     { NULL },
 
 };
@@ -82,9 +99,28 @@ main(
     char **argv
 )
 {
-    int i;
+    int i, c, quiet = 0;
     parser_init(argc,argv);
 
+    while (-1 != (c = getopt_long(argc,argv,"o:e:sn:vq",opts,NULL))) {
+        switch (c) {
+            case 'o': avmc_object_file = optarg; break;
+            case 'e': break; /* Entrypoint selection not implemented yet */
+            case 's': avmc_save_flags |= AVMLIB_SEGMENT_STRIP; break;
+            case 'n': avmc_native_file = optarg; break;
+            case 'v': avm_set_debuglevel(avmlib_debug_level + 1); break;
+            case 'q': quiet = 1; break;
+            default: return 1;
+        }
+    }
+    if (quiet) {
+        avm_set_loglevel(AVMLIB_LOG_QUIET);
+        avm_set_debuglevel(0);
+    }
+
+    /* Parse-time chatter is written behind us */
+    avmlib_log_async(1);
+
     /* Init global tables */
     avm = avmlib_machine_new();
     avmc_ops_init();
@@ -92,7 +128,7 @@ main(
     cur_seg.avm = avm;
 
     /* For now, just parse all command line args as input files */
-    for (i=1;(i<=(argc-1));i++) {
+    for (i=optind;(i<=(argc-1));i++) {
         avmc_source_file = strdup(argv[i]);
         avmc_log("PARSING: %s\n",avmc_source_file);
         yylineno = 1; /* Reset line number */
@@ -102,8 +138,20 @@ main(
         free(avmc_source_file);
     }
 
-    /* DEBUG: dump the segment */
-    avmlib_dump_seg(avm, &cur_seg);
+    /* DEBUG: dump the segment (printed directly, so after the log) */
+    avmlib_log_async(0);
+    if (!quiet) avmlib_dump_seg(avm, &cur_seg);
+
+    /* Emit the segment image */
+    if (avmc_object_file && (0 > avmlib_segment_save(&cur_seg,avmc_object_file,avmc_save_flags))) {
+        return 1;
+    }
+
+    /* Emit native code (after the image, which it doesn't change) */
+    if (avmc_native_file && (0 > avmlib_aot_translate(&cur_seg,avmc_native_file))) {
+        return 1;
+    }
+    return 0;
 }
 
 /**************************************************************************//**
@@ -151,9 +199,9 @@ avmc_inst_start(
          * file....
          */
     if (strcmp(instruction,i_def->i_token)) {
-        avmc_log("OP: %s (%s)\n",instruction, i_def->i_token);
+        avm_dbg(AVMC_DEBUG_OPS,"avmc","OP: %s (%s)\n",instruction, i_def->i_token);
     } else {
-        avmc_log("OP: %s\n",i_def->i_token);
+        avm_dbg(AVMC_DEBUG_OPS,"avmc","OP: %s\n",i_def->i_token);
     }
 
     return NULL; /* Success! */
@@ -214,7 +262,7 @@ avmc_inst_param(
 )
 {
     param_t *p;
-    avmc_log("   param: %s\n",p_text);
+    avm_dbg(AVMC_DEBUG_OPS,"avmc","   param: %s\n",p_text);
 
     /* Basic checks */
     if (cur_op->i_paramc >= 64) {
@@ -272,6 +320,8 @@ avmc_seg_init(
     int i;
     /* Unlinked.... */
     this->id = AVMM_SEGMENT_UNLINKED;
+    this->image = NULL;
+    this->state = AVMM_SEGMENT_RESIDENT;
     /* Internal entity map */
     avmlib_table_init(&entity_map,64);
     entity_map.compare = avmc_entity_map_compare;
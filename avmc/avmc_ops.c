@@ -43,6 +43,8 @@ opdef_t avmc_op_canon[] = {
     {"NOP",AVM_OP_NOP,0,NULL}, 
     {"STOR",AVM_OP_STOR,2,avmc_compile_stor},
     {"INS",AVM_OP_INS,3,NULL},
+    {"BEGIN",AVM_OP_BEGIN,0,avmlib_compile_begin},
+    {"COMMIT",AVM_OP_COMMIT,0,avmlib_compile_commit},
         /* Jumps */
     {"GOTO",AVM_OP_GOTO,1,avmlib_compile_jmp},
     {"JMP",AVM_OP_GOTO,1,avmlib_compile_jmp},
@@ -68,9 +70,10 @@ opdef_t avmc_op_canon[] = {
     {"CMP",AVM_OP_CMP,3,NULL},
 
         /* I/O ops */
-    {"FILE",AVM_OP_FILE,2,NULL},
-    {"IN",AVM_OP_IN,2,NULL},
+    {"FILE",AVM_OP_FILE,2,avmlib_compile_file},
+    {"IN",AVM_OP_IN,2,avmlib_compile_in},
     {"OUT",AVM_OP_OUT,2,avmlib_compile_out},
+    {"FLUSH",AVM_OP_FLUSH,0,avmlib_compile_flush},
     {NULL} /* Mark end */
 };
 
@@ -283,6 +286,7 @@ avmc_resolve_parameter(
             table_index = avmlib_table_add(t,obj);
             param->p_opcode = avmlib_entity_new(AVM_CLASS_STRING,table_index);
             param->p_opcode |= OP_FLAG_CONSTANT;
+            param->p_ext = (uint32_t)table_index;
             break;
         }
         case PARAM_TYPE_NUMBER: { /* Anonymous numeric constant */
@@ -291,24 +295,12 @@ avmc_resolve_parameter(
                 /* Error in conversion.... */
                 return -1; /* Leave errno */
             }
-            /* Check for immediate... */
-            if (ENTITY_INVALID == 
-                (param->p_opcode = avmlib_immediate_new(cvtval))) {
-                class_number_t *obj;
-                /*
-                 * Too big for immediate, so we'll create an anonymous
-                 * entry in the numeric variable table.
-                 *
-                 * CLEAN: TODO: Since these are constants, we could
-                 * theoretically fold multiple references into a single
-                 * entry.
-                 */
-                obj = avmlib_number_new(NULL,64,cvtval);
-                t = AVM_CLASS_TABLE(seg,AVM_CLASS_NUMBER);
-                table_index = avmlib_table_add(t,obj);
-                param->p_opcode = avmlib_entity_new(AVM_CLASS_NUMBER,table_index);
-                param->p_opcode |= OP_FLAG_CONSTANT;
-            }
+            /*
+             * Always an immediate; too big for the entity itself and it
+             * rides in the code stream after it.
+             */
+            param->p_opcode = avmlib_immediate_new(cvtval);
+            param->p_ext = (uint64_t)cvtval;
             break;
         }
         case PARAM_TYPE_REGISTER: {
@@ -318,22 +310,24 @@ avmc_resolve_parameter(
                 /* Not found? */
             if (table_index < 0) return -1;
             param->p_opcode = avmlib_entity_new(AVM_CLASS_REGISTER,table_index);
+            param->p_ext = (uint32_t)table_index;
             return 0;
         }
         case PARAM_TYPE_PORT: {
-            uint8_t seg_id = AVMM_SEGMENT_UNLINKED;
+            uint32_t local = OP_FLAG_LOCAL;
             /* Look in segment first... */
             t = AVM_CLASS_TABLE(seg,AVM_CLASS_PORT);
             table_index = avmlib_table_find(t,param->p_text);
             if (!t || (0 > table_index)) {
-                seg_id = 0;
+                local = 0;
                 t = AVM_CLASS_TABLE(seg->avm,AVM_CLASS_PORT);
                 table_index = avmlib_table_find(t,param->p_text);
             }
                 /* Not found? */
             if (table_index < 0) return -1;
             param->p_opcode = avmlib_entity_new(AVM_CLASS_PORT,table_index);
-            param->p_opcode |= ((uint32_t)seg_id) << 16;
+            param->p_opcode |= local;
+            param->p_ext = (uint32_t)table_index;
             return 0;
         }
         case PARAM_TYPE_NAME: {
@@ -344,6 +338,7 @@ avmc_resolve_parameter(
                 /* Found it.  Copy from cache */
                 em = (entity_map_t *)(&entity_map)->entries[table_index];
                 param->p_opcode = em->entity;
+                param->p_ext = em->ext;
             } else {
                 class_unresolved_t *obj;
             /* Not found?  Create an unresolved reference */
@@ -351,6 +346,7 @@ avmc_resolve_parameter(
                 t = AVM_CLASS_TABLE(seg,AVM_CLASS_UNRESOLVED);
                 table_index = avmlib_table_add(t,obj);
                 param->p_opcode = avmlib_entity_new(AVM_CLASS_UNRESOLVED,table_index);
+                param->p_ext = (uint32_t)table_index;
             }
             break;
         }
@@ -388,7 +384,7 @@ avmc_resolve_op_parameters(
             return avmc_err_ret("Cannot process parameter \"%s\".\n",
                                 op->i_params[i]->p_text);
         }
-        avm_dbg(3,"AVMC", "Param \"%s\" resolved to: 0x%08x\n",
+        avm_dbg(AVMC_DEBUG_OPS,"AVMC", "Param \"%s\" resolved to: 0x%08x\n",
                op->i_params[i]->p_text,
                op->i_params[i]->p_opcode);
     }
@@ -454,9 +450,13 @@ avmc_compile_def(
     }
 
     /* 
-     * Must start with a letter...
+     * Must start with a letter (ports with '@' and a letter)...
      */
-    if (!isalpha(*param->p_text)) {
+    if (class == AVM_CLASS_PORT) {
+        if ((*param->p_text != '@') || !isalpha(param->p_text[1])) {
+            return avmc_err_ret("Invalid port name \"%s\"; ports must be named \"@<name>\".\n",param->p_text);
+        }
+    } else if (!isalpha(*param->p_text)) {
         return avmc_err_ret("Invalid symbol name \"%s\"; defined symbols must start with a letter.\n",param->p_text);
     }
 
@@ -473,12 +473,38 @@ avmc_compile_def(
             }
             break;
         }
+        case AVM_CLASS_BUFFER:{
+            /* Empty until written, or mapped by a FILE instruction */
+            class_buffer_t *cb = avmtype_buffer_new(param->p_text,0);
+            if (cb != NULL) {
+                class_index = avmlib_table_add(AVM_CLASS_TABLE(seg,AVM_CLASS_BUFFER),cb);
+            } else {
+                return avmc_err_ret("Internal error creating buffer object.\n");
+            }
+            break;
+        }
+        case AVM_CLASS_PORT:{
+            /* Unopened until a FILE instruction names it */
+            table_t *t = AVM_CLASS_TABLE(seg,AVM_CLASS_PORT);
+            class_port_t *cp = avmlib_port_new(param->p_text,-1,NULL);
+            if (cp != NULL) {
+                t->compare = avmlib_port_compare;
+                class_index = avmlib_table_add(t,cp);
+            } else {
+                return avmc_err_ret("Internal error creating port object.\n");
+            }
+            break;
+        }
     }
     /* Cache it in the overall entity map */
     if (class_index >= 0) {
         entity_map_t *em = calloc(1,sizeof(*em));
         em->name = strdup(param->p_text);
         em->entity = avmlib_entity_new(class,class_index);
+        em->ext = (uint32_t)class_index;
+        if (class == AVM_CLASS_PORT) {
+            em->entity |= OP_FLAG_LOCAL;
+        }
         avmlib_table_add(&entity_map,em);
     }
     return NULL;
@@ -538,13 +564,13 @@ avmc_compile_stor(
         case AVM_CLASS_STRING:
         case AVM_CLASS_NUMBER:
             /* Good to go. Emit the opcode */
-            avmlib_table_add(t_i,param->p_opcode);
+            avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
             break;
         case AVM_CLASS_UNRESOLVED:
             /* Might be ok; we'll let the linker deal with it. */
             avm_dbg(2,"AVMC","Unresolved storage location \"%s\".  Hopefully the link will take care of it.\n",
                     param->p_text);
-            avmlib_table_add(t_i,param->p_opcode);
+            avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
             break;
         case AVM_CLASS_PORT:
             return avmc_err_ret("STOR: Symbol \"%s\" is a PORT entity.  To send output to a PORT, use \"OUT\" instead of \"STOR\".\n",
@@ -556,7 +582,7 @@ avmc_compile_stor(
     /* Step 3: Simple encode of the remaining parameters */
     for (i=1;i<op->i_paramc;i++) {
         param = op->i_params[i];
-        avmlib_table_add(t_i,param->p_opcode);
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
     }
 
     return NULL;
@@ -36,6 +36,7 @@ typedef struct op_s {
 typedef struct {
     char *name;
     uint32_t entity;
+    uint32_t ext; /* Extension word for OP_FLAG_WIDE entities */
 } entity_map_t;
 
 /**
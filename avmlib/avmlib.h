@@ -9,11 +9,28 @@
 #ifndef _AVMLIB_H_
 #define _AVMLIB_H_
 
+#include "avmlib_names.h"
 #include "avmlib_data.h"
 #include "avmlib_regs.h"
+#include "avmlib_shmregs.h"
+#include "avmlib_stats.h"
+#include "avmlib_txn.h"
 #include "avmlib_ports.h"
+#include "avmlib_evloop.h"
+#include "avmlib_fileio.h"
+#include "avmlib_epoch.h"
+#include "avmlib_segment.h"
 #include "avmlib_table.h"
+#include "avmlib_store.h"
+#include "avmlib_snapshot.h"
 #include "avmlib_machine.h"
+#include "avmlib_vm.h"
+#include "avmlib_pool.h"
+#include "avmlib_aot.h"
+#include "avmlib_jit.h"
+#include "avmlib_perf.h"
+#include "avmlib_prof.h"
+#include "avmlib_trace.h"
 #include "avmlib_log.h"
 #include "avmlib_utils.h"
 #include "avmlib_object.h"
@@ -0,0 +1,671 @@
+/**************************************************************************//**
+ * @file avmlib_aot.c
+ *
+ * @brief Ahead-of-time translation of segments to C
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_AOT_C_
+#define _AVMLIB_AOT_C_
+
+#include "avmlib.h"
+#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+
+/**
+ * How the translated code sees an operand
+ */
+#define AVMLIB_AOT_OTHER 0 /* Only the interpreter can use it */
+#define AVMLIB_AOT_IMM 1 /* Constant */
+#define AVMLIB_AOT_REG 2 /* Machine REGISTER, local r<index> */
+#define AVMLIB_AOT_GNUM 3 /* Machine NUMBER, local g<index> */
+#define AVMLIB_AOT_LNUM 4 /* Segment NUMBER, local l<index> */
+#define AVMLIB_AOT_KINDS 5
+
+/**
+ * How the translated code uses a local
+ */
+#define AVMLIB_AOT_READ 0x01
+#define AVMLIB_AOT_WRITE 0x02
+
+/**
+ * A decoded operand
+ */
+typedef struct {
+    uint32_t e; /* Entity word */
+    uint32_t index; /* Table index (entities) */
+    int64_t imm; /* Value (immediates) */
+} avmlib_aot_arg_t;
+
+/**
+ * Indices of one kind of local, with how each is used
+ */
+typedef struct {
+    uint8_t *use; /* AVMLIB_AOT_READ | AVMLIB_AOT_WRITE, by index */
+    uint32_t size;
+} avmlib_aot_set_t;
+
+/**
+ * Translation state
+ */
+typedef struct {
+    class_segment_t *seg;
+    const table_t *code;
+    const table_t *labels;
+    uint8_t *start; /* Nonzero at each code word an instruction starts at */
+    int regs; /* REGISTERs can live in locals (the segment has no transactions) */
+    avmlib_aot_set_t locals[AVMLIB_AOT_KINDS]; /* By kind */
+    uint32_t steps; /* Instructions left to the interpreter */
+    uint32_t branches; /* Jumps done natively */
+    int err; /* Alloc failure while scanning */
+    FILE *out; /* NULL while scanning */
+    char fn[AVMLIB_NAME_MAX + 8]; /* Function name, after the segment, for profilers */
+} avmlib_aot_t;
+
+/**
+ * Write translated code (nothing while scanning)
+ */
+#define avmlib_aot_emit(__aot, __format, __args...) \
+    do { if ((__aot)->out) fprintf((__aot)->out,__format, ##__args); } while (0)
+
+/**************************************************************************//**
+ * @brief Hash of a segment's code, to match compiled code to it.
+ *
+ * @details FNV-1a over the code words.
+ * */
+uint32_t
+avmlib_aot_hash(
+    const table_t *code
+)
+{
+    uint32_t h = 2166136261U, w, i, b;
+
+    for (i=0;i<code->size;i++) {
+        w = (uint32_t)code->entries[i];
+        for (b=0;b<4;b++,w>>=8) {
+            h ^= w & 0xFF;
+            h *= 16777619U;
+        }
+    }
+    return h;
+}
+
+/**************************************************************************//**
+ * @brief Decode the instruction at a code word.
+ *
+ * @returns Code words it occupies, or -1 if it isn't a well-formed
+ * instruction.
+ * */
+static int
+avmlib_aot_decode(
+    const table_t *code,
+    uint32_t pc,
+    uint32_t *op,
+    uint32_t *argc,
+    avmlib_aot_arg_t *args
+)
+{
+    uint32_t word = (uint32_t)code->entries[pc], n, at = pc + 1, w;
+
+    *op = (word >> 16) & 0xFF;
+    *argc = word & 0xFF;
+    if ((AVM_CLASS_INSTRUCTION != avmlib_entity_class(word)) || (*argc > AVMLIB_VM_ARGS)) return -1;
+    for (n=0;n<*argc;n++,at+=w) {
+        if (at >= code->size) return -1;
+        w = avmlib_operand_words(&code->entries[at]);
+        if (at + w > code->size) return -1;
+        args[n].e = (uint32_t)code->entries[at];
+        if (AVM_CLASS_IMMEDIATE == avmlib_entity_class(args[n].e)) {
+            avmlib_immediate_decode(&code->entries[at],&args[n].imm);
+        } else {
+            avmlib_entity_decode(&code->entries[at],&args[n].index);
+        }
+    }
+    return (int)(at - pc);
+}
+
+/**************************************************************************//**
+ * @brief How the translated code sees an operand.
+ * */
+static int
+avmlib_aot_kind(
+    const avmlib_aot_t *aot,
+    const avmlib_aot_arg_t *a
+)
+{
+    switch (avmlib_entity_class(a->e)) {
+        case AVM_CLASS_IMMEDIATE:
+            return AVMLIB_AOT_IMM;
+        case AVM_CLASS_REGISTER:
+            return (aot->regs && !(a->e & OP_FLAG_LOCAL)) ? AVMLIB_AOT_REG : AVMLIB_AOT_OTHER;
+        case AVM_CLASS_NUMBER:
+            return (a->e & OP_FLAG_LOCAL) ? AVMLIB_AOT_LNUM : AVMLIB_AOT_GNUM;
+    }
+    return AVMLIB_AOT_OTHER;
+}
+
+/**************************************************************************//**
+ * @brief Note a local's use and name it.
+ *
+ * @param aot Translation state
+ * @param a The operand (not AVMLIB_AOT_OTHER)
+ * @param how AVMLIB_AOT_READ or AVMLIB_AOT_WRITE
+ * @param buf Filled with its C expression (an int64_t for reads)
+ * @param size Size of buf
+ *
+ * @returns buf
+ * */
+static const char *
+avmlib_aot_ref(
+    avmlib_aot_t *aot,
+    const avmlib_aot_arg_t *a,
+    int how,
+    char *buf,
+    size_t size
+)
+{
+    static const char prefix[AVMLIB_AOT_KINDS] = { '?', '?', 'r', 'g', 'l' };
+    int kind = avmlib_aot_kind(aot,a);
+    avmlib_aot_set_t *set = &aot->locals[kind];
+    uint8_t *use;
+
+    if (AVMLIB_AOT_IMM == kind) {
+        snprintf(buf,size,"INT64_C(%" PRId64 ")",a->imm);
+        return buf;
+    }
+
+    /* Step 1: Note it (sets only grow while scanning) */
+    if (a->index >= set->size) {
+        if (NULL == (use = realloc(set->use,a->index + 1))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            aot->err = 1;
+        } else {
+            memset(use + set->size,0,a->index + 1 - set->size);
+            set->use = use;
+            set->size = a->index + 1;
+        }
+    }
+    if (a->index < set->size) set->use[a->index] |= (uint8_t)how;
+
+    /* Step 2: Name it */
+    if ((AVMLIB_AOT_REG == kind) && (AVMLIB_AOT_READ == how)) {
+        snprintf(buf,size,"(int64_t)r%u",a->index);
+    } else {
+        snprintf(buf,size,"%c%u",prefix[kind],a->index);
+    }
+    return buf;
+}
+
+/**************************************************************************//**
+ * @brief Store a value through an operand.
+ * */
+static void
+avmlib_aot_put(
+    avmlib_aot_t *aot,
+    const avmlib_aot_arg_t *a,
+    const char *value
+)
+{
+    char name[32];
+
+    avmlib_aot_ref(aot,a,AVMLIB_AOT_WRITE,name,sizeof(name));
+    if (AVMLIB_AOT_REG == avmlib_aot_kind(aot,a)) {
+        avmlib_aot_emit(aot,"    %s = (uint32_t)(%s);\n",name,value);
+    } else {
+        avmlib_aot_emit(aot,"    %s = %s;\n",name,value);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Where a jump operand goes, if it can be a goto.
+ *
+ * @returns 0 with *pc set, or -1 if the interpreter must take the jump
+ * (another segment's label, or one that isn't at an instruction).
+ * */
+static int
+avmlib_aot_target(
+    const avmlib_aot_t *aot,
+    const avmlib_aot_arg_t *a,
+    uint32_t *pc
+)
+{
+    const class_label_t *lbl;
+
+    if ((AVM_CLASS_LABEL != avmlib_entity_class(a->e)) || !(a->e & OP_FLAG_LOCAL) ||
+        (a->index >= aot->labels->size)) {
+        return -1;
+    }
+    lbl = (const class_label_t *)aot->labels->entries[a->index];
+    if ((lbl->offset > aot->code->size) || !aot->start[lbl->offset]) return -1;
+    *pc = lbl->offset;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Translate one instruction.
+ *
+ * @details Arithmetic, stores and branches on values that live in
+ * locals are done in C; everything else goes through the interpreter.
+ * */
+static void
+avmlib_aot_insn(
+    avmlib_aot_t *aot,
+    uint32_t pc,
+    uint32_t op,
+    uint32_t argc,
+    const avmlib_aot_arg_t *args
+)
+{
+    static const avmlib_aot_arg_t one = { (uint32_t)AVM_CLASS_IMMEDIATE << 24,0,1 };
+    const avmlib_aot_arg_t *b, *dst;
+    char x[48], y[48], value[128];
+    uint32_t target;
+    int k;
+
+    avmlib_aot_emit(aot,"w%u: /* opcode 0x%02x */\n",pc,op);
+    switch (op) {
+        case AVM_OP_NOP:
+            avmlib_aot_emit(aot,"    ret++;\n");
+            return;
+        case AVM_OP_STOR:
+            if ((argc < 2) || (AVMLIB_AOT_OTHER == avmlib_aot_kind(aot,&args[1]))) break;
+            k = avmlib_aot_kind(aot,&args[0]);
+            if ((AVMLIB_AOT_OTHER == k) || (AVMLIB_AOT_IMM == k)) break;
+            avmlib_aot_put(aot,&args[0],avmlib_aot_ref(aot,&args[1],AVMLIB_AOT_READ,x,sizeof(x)));
+            avmlib_aot_emit(aot,"    ret++;\n");
+            return;
+        case AVM_OP_ADD:
+        case AVM_OP_SUB:
+            if ((argc < 1) || (argc > 3)) break;
+            b = (argc > 1) ? &args[1] : &one;
+            dst = &args[(argc > 2) ? 2 : 0];
+            k = avmlib_aot_kind(aot,dst);
+            if ((AVMLIB_AOT_OTHER == avmlib_aot_kind(aot,&args[0])) ||
+                (AVMLIB_AOT_OTHER == avmlib_aot_kind(aot,b)) ||
+                (AVMLIB_AOT_OTHER == k) || (AVMLIB_AOT_IMM == k)) {
+                break;
+            }
+            snprintf(value,sizeof(value),"(int64_t)((uint64_t)%s %c (uint64_t)%s)",
+                     avmlib_aot_ref(aot,&args[0],AVMLIB_AOT_READ,x,sizeof(x)),
+                     (AVM_OP_ADD == op) ? '+' : '-',
+                     avmlib_aot_ref(aot,b,AVMLIB_AOT_READ,y,sizeof(y)));
+            avmlib_aot_put(aot,dst,value);
+            avmlib_aot_emit(aot,"    ret++;\n");
+            return;
+        case AVM_OP_GOTO:
+            if ((argc != 1) || (0 > avmlib_aot_target(aot,&args[0],&target))) break;
+            avmlib_aot_emit(aot,"    ret++;\n    AOT_BRANCH(%u);\n",target);
+            if (!aot->out) aot->branches++;
+            return;
+        case AVM_OP_JZ:
+        case AVM_OP_JNZ:
+            if ((argc != 2) || (AVMLIB_AOT_OTHER == avmlib_aot_kind(aot,&args[0])) ||
+                (0 > avmlib_aot_target(aot,&args[1],&target))) {
+                break;
+            }
+            avmlib_aot_emit(aot,"    ret++;\n    if (%s %s 0) AOT_BRANCH(%u);\n",
+                            avmlib_aot_ref(aot,&args[0],AVMLIB_AOT_READ,x,sizeof(x)),
+                            (AVM_OP_JZ == op) ? "==" : "!=",target);
+            if (!aot->out) aot->branches++;
+            return;
+    }
+    avmlib_aot_emit(aot,"    AOT_STEP(%u);\n",pc);
+    if (!aot->out) aot->steps++;
+}
+
+/**************************************************************************//**
+ * @brief One pass over the code.
+ *
+ * @details With @p insns zero, just finds where instructions start
+ * (and whether there are transactions); otherwise translates them.
+ * Anything undecodable is left to the interpreter, which will report
+ * it, and ends the pass.
+ * */
+static void
+avmlib_aot_pass(
+    avmlib_aot_t *aot,
+    int insns
+)
+{
+    avmlib_aot_arg_t args[AVMLIB_VM_ARGS];
+    uint32_t pc, op, argc;
+    int words;
+
+    for (pc=0;pc<aot->code->size;pc+=(uint32_t)words) {
+        if (0 > (words = avmlib_aot_decode(aot->code,pc,&op,&argc,args))) {
+            aot->start[pc] = 1;
+            if (insns) avmlib_aot_insn(aot,pc,AVM_OP_INVALID,0,args);
+            break;
+        }
+        if (!insns) {
+            aot->start[pc] = 1;
+            if ((AVM_OP_BEGIN == op) || (AVM_OP_COMMIT == op)) aot->regs = 0;
+            continue;
+        }
+        avmlib_aot_insn(aot,pc,op,argc,args);
+    }
+    aot->start[aot->code->size] = 1;
+}
+
+/**************************************************************************//**
+ * @brief Write the macros that move locals in and out of the machine.
+ * */
+static void
+avmlib_aot_macros(
+    avmlib_aot_t *aot
+)
+{
+    static const char *value[AVMLIB_AOT_KINDS] = {
+        NULL, NULL, "rp%u->value", "gs->number_values[%u]", "ls->number_values[%u]"
+    };
+    static const char prefix[AVMLIB_AOT_KINDS] = { '?', '?', 'r', 'g', 'l' };
+    avmlib_aot_set_t *set;
+    uint32_t i;
+    int k;
+
+    /* Step 1: Machine to locals */
+    avmlib_aot_emit(aot,"#define AOT_LOAD() do { \\\n");
+    for (k=AVMLIB_AOT_REG;k<AVMLIB_AOT_KINDS;k++) {
+        for (set=&aot->locals[k],i=0;i<set->size;i++) {
+            if (!set->use[i]) continue;
+            avmlib_aot_emit(aot,"    %c%u = ",prefix[k],i);
+            avmlib_aot_emit(aot,value[k],i);
+            avmlib_aot_emit(aot,"; \\\n");
+        }
+    }
+    avmlib_aot_emit(aot,"} while (0)\n");
+
+    /* Step 2: Written locals back to the machine */
+    avmlib_aot_emit(aot,"#define AOT_SPILL() do { \\\n    vm->retired = ret; \\\n");
+    for (k=AVMLIB_AOT_REG;k<AVMLIB_AOT_KINDS;k++) {
+        for (set=&aot->locals[k],i=0;i<set->size;i++) {
+            if (!(set->use[i] & AVMLIB_AOT_WRITE)) continue;
+            avmlib_aot_emit(aot,"    ");
+            avmlib_aot_emit(aot,value[k],i);
+            avmlib_aot_emit(aot," = %c%u; \\\n",prefix[k],i);
+        }
+    }
+    avmlib_aot_emit(aot,"} while (0)\n");
+
+    /* Step 3: Control */
+    avmlib_aot_emit(aot,
+        "#define AOT_EXIT(__pc,__status) do { \\\n"
+        "    AOT_SPILL(); \\\n"
+        "    vm->pc = (__pc); \\\n"
+        "    vm->status = (__status); \\\n"
+        "    return vm->status; \\\n"
+        "} while (0)\n"
+        "#define AOT_BRANCH(__pc) do { \\\n"
+        "    if (ret >= limit) AOT_EXIT(__pc,AVMLIB_VM_YIELDED); \\\n"
+        "    goto w##__pc; \\\n"
+        "} while (0)\n"
+        "#define AOT_STEP(__pc) do { \\\n"
+        "    AOT_SPILL(); \\\n"
+        "    vm->pc = (__pc); \\\n"
+        "    if (0 > (rc = api->step(vm))) return vm->status; \\\n"
+        "    if (vm->proc.segment != seg) return vm->status; \\\n"
+        "    ret = vm->retired; \\\n"
+        "    AOT_LOAD(); \\\n"
+        "    if (rc) { \\\n"
+        "        if (ret >= limit) { vm->status = AVMLIB_VM_YIELDED; return vm->status; } \\\n"
+        "        goto _dispatch; \\\n"
+        "    } \\\n"
+        "} while (0)\n\n");
+}
+
+/**************************************************************************//**
+ * @brief Write the function's locals and entry checks.
+ * */
+static void
+avmlib_aot_entry(
+    avmlib_aot_t *aot
+)
+{
+    avmlib_aot_set_t *set;
+    uint32_t i, last;
+    int k, mode, written;
+
+    avmlib_aot_emit(aot,
+        "__attribute__((noinline)) int\n"
+        "%s(\n"
+        "    avmlib_vm_t *vm,\n"
+        "    const avmlib_vm_native_api_t *api\n"
+        ")\n"
+        "{\n"
+        "    class_segment_t *seg = vm->proc.segment;\n"
+        "    avm_store_t *gs = &vm->avm->store, *ls = NULL;\n"
+        "    uint64_t ret = vm->retired, limit = vm->limit;\n"
+        "    int rc = 0;\n",aot->fn);
+    for (set=&aot->locals[AVMLIB_AOT_REG],i=0;i<set->size;i++) {
+        if (set->use[i]) avmlib_aot_emit(aot,"    class_register_t *rp%u;\n    uint32_t r%u;\n",i,i);
+    }
+    for (k=AVMLIB_AOT_GNUM;k<AVMLIB_AOT_KINDS;k++) {
+        for (set=&aot->locals[k],i=0;i<set->size;i++) {
+            if (set->use[i]) avmlib_aot_emit(aot,"    int64_t %c%u;\n",(AVMLIB_AOT_GNUM == k) ? 'g' : 'l',i);
+        }
+    }
+    avmlib_aot_emit(aot,"\n    (void)seg; (void)gs; (void)ls; (void)limit; (void)rc;\n\n");
+
+    /* Step 1: Registers must be plain values, and no transaction open */
+    avmlib_aot_emit(aot,"    /* What lives in locals must be plain memory, and ours */\n");
+    for (set=&aot->locals[AVMLIB_AOT_REG],i=0;i<set->size;i++) {
+        if (!set->use[i]) continue;
+        mode = ((set->use[i] & AVMLIB_AOT_READ) ? REGMODE_READ : 0) |
+               ((set->use[i] & AVMLIB_AOT_WRITE) ? REGMODE_WRITE : 0);
+        avmlib_aot_emit(aot,
+            "    if (vm->txn.depth || (NULL == (rp%u = api->own(vm->avm,AVM_CLASS_REGISTER,%u))) ||\n"
+            "        rp%u->get || rp%u->set || ((rp%u->mode & %d) != %d)) {\n"
+            "        return AVMLIB_VM_NATIVE_DECLINE;\n"
+            "    }\n",i,i,i,i,i,mode,mode);
+    }
+
+    /* Step 2: NUMBERs must exist, in a store we can write */
+    for (k=AVMLIB_AOT_GNUM;k<AVMLIB_AOT_KINDS;k++) {
+        set = &aot->locals[k];
+        for (written=0,last=0,i=0;i<set->size;i++) {
+            if (!set->use[i]) continue;
+            last = i + 1;
+            if (set->use[i] & AVMLIB_AOT_WRITE) written = 1;
+        }
+        if (!last) continue;
+        if (AVMLIB_AOT_LNUM == k) {
+            avmlib_aot_emit(aot,"    if (NULL == (ls = api->local_store(vm->avm,seg))) return AVMLIB_VM_NATIVE_DECLINE;\n");
+        }
+        avmlib_aot_emit(aot,"    if ((%cs->number_count < %u)%s) return AVMLIB_VM_NATIVE_DECLINE;\n",
+                        (AVMLIB_AOT_GNUM == k) ? 'g' : 'l',last,
+                        written ? ((AVMLIB_AOT_GNUM == k) ? " || api->store_own(gs)" : " || api->store_own(ls)") : "");
+    }
+    avmlib_aot_emit(aot,"    AOT_LOAD();\n\n");
+}
+
+/**************************************************************************//**
+ * @brief Write the jump into the code at the instance's pc.
+ * */
+static void
+avmlib_aot_dispatch(
+    avmlib_aot_t *aot
+)
+{
+    uint32_t pc;
+
+    if (aot->steps) avmlib_aot_emit(aot,"_dispatch:\n");
+    avmlib_aot_emit(aot,"    switch (vm->pc) {\n");
+    for (pc=0;pc<=aot->code->size;pc++) {
+        if (aot->start[pc]) avmlib_aot_emit(aot,"        case %u: goto w%u;\n",pc,pc);
+    }
+    avmlib_aot_emit(aot,
+        "    }\n"
+        "    AOT_SPILL(); /* Not an instruction; let the interpreter say so */\n"
+        "    return AVMLIB_VM_NATIVE_DECLINE;\n\n");
+}
+
+/**************************************************************************//**
+ * @brief Translate a segment's code to C.
+ *
+ * @details The segment's jumps to its own labels are resolved first
+ * (this changes its code the same way loading it would; see
+ * avmlib_segment_link()), so the hash the output records matches the
+ * segment as any machine loads it.
+ *
+ * @param seg A resident segment
+ * @param path C file to write
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_aot_translate(
+    class_segment_t *seg,
+    const char *path
+)
+{
+    avmlib_aot_t aot;
+    char *p;
+    int k, rc = -1;
+
+    memset(&aot,0,sizeof(aot));
+    aot.seg = seg;
+    aot.code = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    aot.labels = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    aot.regs = 1;
+
+    /* Step 1: Find the instructions and what lives in locals */
+    avmlib_segment_link(seg);
+    if (NULL == (aot.start = calloc(aot.code->size + 1,1))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return -1;
+    }
+    avmlib_aot_pass(&aot,0);
+    avmlib_aot_pass(&aot,1);
+    if (aot.err) goto _avmlib_aot_translate_out;
+
+    /* Step 2: Write it */
+    snprintf(aot.fn,sizeof(aot.fn),"avm_%s",avmm_entity_name(seg));
+    for (p=aot.fn;*p;p++) {
+        if (!isalnum((unsigned char)*p)) *p = '_';
+    }
+    if (NULL == (aot.out = fopen(path,"w"))) {
+        avmlib_err("%s: Can't create \"%s\" (%s).\n",__func__,path,strerror(errno));
+        goto _avmlib_aot_translate_out;
+    }
+    avmlib_aot_emit(&aot,
+        "/*\n"
+        " * Native code for AVM segment \"%s\" (%u code words), written by\n"
+        " * avmlib_aot_translate().  Build it with something like\n"
+        " *\n"
+        " *     cc -O2 -fPIC -shared -I<avm>/avmm -I<avm>/avmlib -I<avm>/avmc -o x.so x.c\n"
+        " *\n"
+        " * and attach it with avmlib_aot_load().  Don't edit it.\n"
+        " */\n"
+        "#include \"avmlib.h\"\n\n"
+        "const uint32_t " AVMLIB_AOT_SYM_ABI " = AVMLIB_VM_NATIVE_ABI;\n"
+        "const uint32_t " AVMLIB_AOT_SYM_VM_SIZE " = sizeof(avmlib_vm_t);\n"
+        "const uint32_t " AVMLIB_AOT_SYM_WORDS " = %uU;\n"
+        "const uint32_t " AVMLIB_AOT_SYM_HASH " = 0x%08xU;\n\n",
+        avmm_entity_name(seg),aot.code->size,aot.code->size,avmlib_aot_hash(aot.code));
+    avmlib_aot_macros(&aot);
+    avmlib_aot_entry(&aot);
+    avmlib_aot_dispatch(&aot);
+    avmlib_aot_pass(&aot,1);
+    avmlib_aot_emit(&aot,"w%u: /* end of code */\n    AOT_EXIT(%u,AVMLIB_VM_HALTED);\n}\n",
+                    aot.code->size,aot.code->size);
+    avmlib_aot_emit(&aot,
+        "\nint\n"
+        AVMLIB_AOT_SYM_RUN "(\n"
+        "    avmlib_vm_t *vm,\n"
+        "    const avmlib_vm_native_api_t *api\n"
+        ")\n"
+        "{\n"
+        "    return %s(vm,api);\n"
+        "}\n",aot.fn);
+    if (ferror(aot.out) | fclose(aot.out)) {
+        avmlib_err("%s: Can't write \"%s\".\n",__func__,path);
+        goto _avmlib_aot_translate_out;
+    }
+    avm_dbg(1,"AVMLIB","Segment \"%s\": %u branches native, %u instructions left to the interpreter.\n",
+            avmm_entity_name(seg),aot.branches,aot.steps);
+    rc = 0;
+
+_avmlib_aot_translate_out:
+    for (k=0;k<AVMLIB_AOT_KINDS;k++) free(aot.locals[k].use);
+    free(aot.start);
+    return rc;
+}
+
+/**************************************************************************//**
+ * @brief Release a compiled segment's shared object.
+ * */
+static void
+avmlib_aot_release(
+    void *handle
+)
+{
+    dlclose(handle);
+}
+
+/**************************************************************************//**
+ * @brief Attach compiled code to a segment.
+ *
+ * @details Load into the template machine, before making instances.
+ * The code stays with this version of the segment; a swap drops it.
+ *
+ * @param avm The machine
+ * @param id Segment ID
+ * @param path Shared object built from avmlib_aot_translate()'s output
+ *
+ * @returns 0 on success, -1 on failure (errno set; ENOEXEC if the
+ * object was built from other code or against another avmlib).
+ * */
+int
+avmlib_aot_load(
+    avm_t *avm,
+    uint16_t id,
+    const char *path
+)
+{
+    const uint32_t *abi, *vm_size, *words, *hash;
+    class_segment_t *seg;
+    const table_t *code;
+    void *handle, *run;
+
+    /* Step 1: The segment */
+    if (NULL == (seg = avmlib_segment_get(avm,id))) return -1;
+    if (seg->native) {
+        avmlib_err("%s: Segment %u already has native code.\n",__func__,id);
+        errno = EBUSY;
+        return -1;
+    }
+    code = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+
+    /* Step 2: The object, which must be for this code */
+    if (NULL == (handle = dlopen(path,RTLD_NOW | RTLD_LOCAL))) {
+        avmlib_err("%s: %s\n",__func__,dlerror());
+        errno = ENOENT;
+        return -1;
+    }
+    abi = dlsym(handle,AVMLIB_AOT_SYM_ABI);
+    vm_size = dlsym(handle,AVMLIB_AOT_SYM_VM_SIZE);
+    words = dlsym(handle,AVMLIB_AOT_SYM_WORDS);
+    hash = dlsym(handle,AVMLIB_AOT_SYM_HASH);
+    run = dlsym(handle,AVMLIB_AOT_SYM_RUN);
+    if (!abi || !vm_size || !words || !hash || !run ||
+        (AVMLIB_VM_NATIVE_ABI != *abi) || (sizeof(avmlib_vm_t) != *vm_size) ||
+        (code->size != *words) || (avmlib_aot_hash(code) != *hash)) {
+        avmlib_err("%s: \"%s\" isn't native code for segment %u (\"%s\").\n",__func__,
+                   path,id,avmm_entity_name(seg));
+        dlclose(handle);
+        errno = ENOEXEC;
+        return -1;
+    }
+
+    /* Step 3: Attach */
+    seg->native_handle = handle;
+    seg->native_release = avmlib_aot_release;
+    __atomic_store_n(&seg->native,run,__ATOMIC_RELEASE);
+    avm_dbg(2,"AVMLIB","Segment %u runs native code from %s.\n",id,path);
+    return 0;
+}
+
+#endif /* _AVMLIB_AOT_C_ */
@@ -0,0 +1,47 @@
+/**************************************************************************//**
+ * @file avmlib_aot.h
+ *
+ * @brief Ahead-of-time translation of segments to C.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * avmlib_aot_translate() writes a segment's code out as one C function
+ * (avmc --native does this at compile time).  Each instruction becomes
+ * a C label, jumps to the segment's own labels become gotos, and the
+ * REGISTERs and NUMBERs the code does arithmetic on live in C locals
+ * for as long as the function runs.  Anything else (port and buffer
+ * I/O, strings, transactions, jumps to other segments) is handed to
+ * the interpreter one instruction at a time, so translated code always
+ * behaves exactly as interpreted code does.  The function is named
+ * avm_<segment> so profilers can tell segments apart; the exported
+ * entry point calls it.
+ *
+ * The host compiler builds the file into a shared object, which
+ * avmlib_aot_load() attaches to the segment in a template machine;
+ * avmlib_vm_run() then runs it in place of interpreting.  The object
+ * records a hash of the code it was made from and is refused for any
+ * other code.  It is dropped with the segment version, so a swap
+ * (avmlib_segment_swap()) goes back to interpreting until the new
+ * version gets its own.
+ * */
+#ifndef _AVMLIB_AOT_H_
+#define _AVMLIB_AOT_H_
+
+#include "avmm_data.h"
+
+/**
+ * What a compiled segment exports
+ */
+#define AVMLIB_AOT_SYM_ABI "avm_native_abi" /* const uint32_t: AVMLIB_VM_NATIVE_ABI */
+#define AVMLIB_AOT_SYM_VM_SIZE "avm_native_vm_size" /* const uint32_t: sizeof(avmlib_vm_t) */
+#define AVMLIB_AOT_SYM_WORDS "avm_native_words" /* const uint32_t: code words */
+#define AVMLIB_AOT_SYM_HASH "avm_native_hash" /* const uint32_t: avmlib_aot_hash() of the code */
+#define AVMLIB_AOT_SYM_RUN "avm_native_run" /* avmlib_vm_native_fn */
+
+/* Prototypes */
+uint32_t avmlib_aot_hash(const table_t *code);
+int avmlib_aot_translate(class_segment_t *seg, const char *path);
+int avmlib_aot_load(avm_t *avm, uint16_t id, const char *path);
+
+#endif /* _AVMLIB_AOT_H_ */
@@ -81,9 +81,13 @@ avmlib_instruction_new(
 /**************************************************************************//**
  * @brief Create a new immediate number entity
  *
+ * @details Small values are encoded in the entity itself.  Anything
+ * else gets the wide (escape) form, and the value must follow the
+ * entity in the code stream (see avmlib_entity_emit()).
+ *
  * @param val The value to encode
  *
- * @returns New entity on success, ENTITY_INVALID on failure
+ * @returns New entity.
  *
  * @remarks
  * */
@@ -92,20 +96,53 @@ avmlib_immediate_new(
     int64_t val
 )
 {
-    int64_t v = val;
+    uint64_t v = (uint64_t)val;
     uint32_t code = (AVM_CLASS_IMMEDIATE << 24);
 
-    if (v < 0) {
+    if (val < 0) {
         v = -v;
         code |= (1<<20);
     }
-    if (v > 0xFFFFF)  return ENTITY_INVALID;
+    if (v > AVM_IMMEDIATE_MAX) {
+        code = (AVM_CLASS_IMMEDIATE << 24) | OP_FLAG_WIDE;
+        if ((val < INT32_MIN) || (val > INT32_MAX)) code |= AVM_IMMEDIATE_WIDE64;
+        return (entity_t)code;
+    }
 
-    code |= (uint32_t)(v & 0xFFFFF);
+    code |= (uint32_t)(v & AVM_IMMEDIATE_MAX);
 
     return (entity_t)code; 
 }
 
+/**************************************************************************//**
+ * @brief Decode an immediate operand from a code stream.
+ *
+ * @param code Points at the immediate entity (an instruction table entry)
+ * @param val Set to the value
+ *
+ * @returns Number of code words the operand occupies (1 to 3).
+ * */
+int
+avmlib_immediate_decode(
+    const entry_t *code,
+    int64_t *val
+)
+{
+    uint32_t e = (uint32_t)code[0];
+
+    if (!(e & OP_FLAG_WIDE)) {
+        *val = (int64_t)(e & AVM_IMMEDIATE_MAX);
+        if (e & (1<<20)) *val = -*val;
+        return 1;
+    }
+    if (e & AVM_IMMEDIATE_WIDE64) {
+        *val = (int64_t)((((uint64_t)(uint32_t)code[1]) << 32) | (uint32_t)code[2]);
+        return 3;
+    }
+    *val = (int64_t)(int32_t)(uint32_t)code[1];
+    return 2;
+}
+
 /**************************************************************************//**
  * @brief Common non-instruction entity creator
  *
@@ -117,7 +154,9 @@ avmlib_immediate_new(
  * @returns Result code indicating success or failure mode
  *
  * @remarks Entities with special values may be created with this and
- * then modified.
+ * then modified.  If the index doesn't fit the compact form, the entity
+ * is marked OP_FLAG_WIDE and the index must follow it in the code
+ * stream (see avmlib_entity_emit()).
  * */
 entity_t 
 avmlib_entity_new(
@@ -125,8 +164,112 @@ avmlib_entity_new(
     int table_index
 )
 {
-    return ((uint32_t)class << 24) | (((uint32_t)table_index) & 0xFFFF) ;
+    if ((uint32_t)table_index > AVM_ENTITY_INDEX_MASK) {
+        return ((uint32_t)class << 24) | OP_FLAG_WIDE;
+    }
+    return ((uint32_t)class << 24) | (((uint32_t)table_index) & AVM_ENTITY_INDEX_MASK) ;
+
+}
+
+/**************************************************************************//**
+ * @brief Append an entity to a code stream.
+ *
+ * @details Wide entities are followed by their extension word(s): the
+ * table index, or an immediate's value.
+ *
+ * @param code The instruction table
+ * @param e The entity
+ * @param ext Extension value (ignored unless e is wide)
+ *
+ * @returns Number of code words emitted.
+ * */
+int
+avmlib_entity_emit(
+    table_t *code,
+    entity_t e,
+    uint64_t ext
+)
+{
+    avmlib_table_add(code,e);
+    if (!avmlib_entity_is_wide(e)) return 1;
+    if ((AVM_CLASS_IMMEDIATE == avmlib_entity_class(e)) &&
+        (e & AVM_IMMEDIATE_WIDE64)) {
+        avmlib_table_add(code,(uint32_t)(ext >> 32));
+        avmlib_table_add(code,(uint32_t)ext);
+        return 3;
+    }
+    avmlib_table_add(code,(uint32_t)ext);
+    return 2;
+}
+
+/**************************************************************************//**
+ * @brief Decode an entity operand from a code stream.
+ *
+ * @param code Points at the entity (an instruction table entry)
+ * @param index Set to the entity's table index
+ *
+ * @returns Number of code words the operand occupies (1 or 2).
+ *
+ * @remarks Immediates have no index; use avmlib_immediate_decode().
+ * */
+int
+avmlib_entity_decode(
+    const entry_t *code,
+    uint32_t *index
+)
+{
+    if (avmlib_entity_is_wide(code[0])) {
+        *index = (uint32_t)code[1];
+        return 2;
+    }
+    *index = (uint32_t)code[0] & AVM_ENTITY_INDEX_MASK;
+    return 1;
+}
+
+/**************************************************************************//**
+ * @brief Size of the operand at a point in a code stream.
+ *
+ * @param code Points at the operand (an instruction table entry)
+ *
+ * @returns Number of code words the operand occupies (1 to 3).
+ * */
+int
+avmlib_operand_words(
+    const entry_t *code
+)
+{
+    uint32_t e = (uint32_t)code[0];
+
+    if (!avmlib_entity_is_wide(e)) return 1;
+    if ((AVM_CLASS_IMMEDIATE == avmlib_entity_class(e)) && (e & AVM_IMMEDIATE_WIDE64)) return 3;
+    return 2;
+}
+
+/**************************************************************************//**
+ * @brief Mnemonic of an opcode, for reports and traces.
+ *
+ * @param op The opcode
+ *
+ * @returns The name, or NULL if the opcode isn't one the machine runs.
+ * */
+const char *
+avmlib_op_name(
+    uint32_t op
+)
+{
+    static const char *names[] = {
+        [AVM_OP_NOP] = "NOP", [AVM_OP_STOR] = "STOR", [AVM_OP_INS] = "INS",
+        [AVM_OP_GOTO] = "GOTO", [AVM_OP_JZ] = "JZ", [AVM_OP_JE] = "JE",
+        [AVM_OP_JNZ] = "JNZ", [AVM_OP_FORK] = "FORK", [AVM_OP_KILL] = "KILL",
+        [AVM_OP_PUSH] = "PUSH", [AVM_OP_POP] = "POP", [AVM_OP_ADD] = "ADD",
+        [AVM_OP_SUB] = "SUB", [AVM_OP_MUL] = "MUL", [AVM_OP_DIV] = "DIV",
+        [AVM_OP_POW] = "POW", [AVM_OP_OR] = "OR", [AVM_OP_AND] = "AND",
+        [AVM_OP_CMP] = "CMP", [AVM_OP_INC] = "INC", [AVM_OP_DEC] = "DEC",
+        [AVM_OP_FILE] = "FILE", [AVM_OP_IN] = "IN", [AVM_OP_OUT] = "OUT",
+        [AVM_OP_BEGIN] = "BEGIN", [AVM_OP_COMMIT] = "COMMIT", [AVM_OP_FLUSH] = "FLUSH",
+    };
 
+    return (op < sizeof(names) / sizeof(names[0])) ? names[op] : NULL;
 }
 
 /**************************************************************************//**
@@ -149,7 +292,7 @@ avmlib_unresolved_new(
     class_unresolved_t *obj = calloc(1,sizeof(*obj));
     if (NULL == obj) return NULL;
 
-    strncpy(obj->header.symname, name, sizeof(obj->header.symname));
+    avmm_entity_name_set(obj,name);
     return obj;
 }
 
@@ -178,7 +321,7 @@ avmlib_register_new(
     class_register_t *obj = calloc(1,sizeof(*obj));
     if (NULL == obj) return NULL;
 
-    strncpy(obj->header.symname, name, sizeof(obj->header.symname));
+    avmm_entity_name_set(obj,name);
     obj->mode = mode;
     obj->private_data = priv;
     obj->reset = reset;
@@ -211,7 +354,7 @@ avmlib_number_new(
 
     /* Save name */
     if (NULL != name) {
-        strncpy(obj->header.symname, name, sizeof(obj->header.symname));
+        avmm_entity_name_set(obj,name);
     }
     obj->bitwidth = width;
     obj->value = value;
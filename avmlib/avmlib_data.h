@@ -21,6 +21,11 @@ int avmlib_entity_assert_class(entity_t e, int num_checks, ...);
 entity_t avmlib_instruction_new(avm_opcode_t op, uint8_t flags, uint8_t argc);
 entity_t avmlib_entity_new(avm_class_e class, int table_index);
 entity_t avmlib_immediate_new(int64_t val);
+int avmlib_immediate_decode(const entry_t *code, int64_t *val);
+int avmlib_entity_emit(table_t *code, entity_t e, uint64_t ext);
+int avmlib_entity_decode(const entry_t *code, uint32_t *index);
+int avmlib_operand_words(const entry_t *code);
+const char *avmlib_op_name(uint32_t op);
 
 /* Object operations */
 class_register_t *avmlib_register_new(char *name, 
@@ -38,4 +43,17 @@ class_unresolved_t *avmlib_unresolved_new(char *name);
  */
 #define avmlib_entity_class(__e) ((((uint32_t)(__e)) >> 24) & 0xFF)
 
+/**
+ * @brief Does an operand carry its index in the next code word?
+ */
+#define avmlib_entity_is_wide(__e) \
+    ((avmlib_entity_class(__e) != AVM_CLASS_INSTRUCTION) && \
+     (((uint32_t)(__e)) != ENTITY_INVALID) && \
+     (((uint32_t)(__e)) & OP_FLAG_WIDE))
+
+/**
+ * @brief Compact-form table index of an entity.
+ */
+#define avmlib_entity_index(__e) (((uint32_t)(__e)) & AVM_ENTITY_INDEX_MASK)
+
 #endif /* _AVMLIB_DATA_H_ */
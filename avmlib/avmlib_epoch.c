@@ -0,0 +1,248 @@
+/**************************************************************************//**
+ * @file avmlib_epoch.c
+ *
+ * @brief Epoch-based reclamation for lock-free readers
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * A reader's record holds the global epoch it saw on entry (0 when it's
+ * outside a critical section).  Retiring an object stamps it with the
+ * current epoch and advances the global one.  Any reader that could
+ * have loaded the object's pointer entered at or before that stamp, so
+ * the object is safe to free once every active reader's epoch is newer.
+ * */
+#ifndef _AVMLIB_EPOCH_C_
+#define _AVMLIB_EPOCH_C_
+
+#include "avmlib.h"
+#include <sched.h>
+
+/**************************************************************************//**
+ * @brief Create a reclamation domain.
+ *
+ * @returns The domain, or NULL on failure.
+ * */
+avmlib_epoch_t *
+avmlib_epoch_new(void)
+{
+    avmlib_epoch_t *dom;
+
+    if (NULL == (dom = calloc(1,sizeof(*dom)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+    dom->global = 1;
+    pthread_mutex_init(&dom->lock,NULL);
+    return dom;
+}
+
+/**************************************************************************//**
+ * @brief Destroy a domain, releasing everything still retired.
+ *
+ * @remarks No reader may be inside a critical section.
+ * */
+void
+avmlib_epoch_destroy(
+    avmlib_epoch_t *dom
+)
+{
+    avmlib_epoch_thread_t *thr, *tnext;
+    avmlib_epoch_node_t *node, *nnext;
+
+    if (!dom) return;
+    for (node = dom->retired; node; node = nnext) {
+        nnext = node->next;
+        node->release(node->ptr);
+        free(node);
+    }
+    for (thr = dom->threads; thr; thr = tnext) {
+        tnext = thr->next;
+        free(thr);
+    }
+    pthread_mutex_destroy(&dom->lock);
+    free(dom);
+}
+
+/**************************************************************************//**
+ * @brief Get a reader record for the calling thread.
+ *
+ * @details Records released by avmlib_epoch_unregister() are reused
+ * before a new one is allocated; the list only grows.
+ *
+ * @returns The record, or NULL on failure.
+ * */
+avmlib_epoch_thread_t *
+avmlib_epoch_register(
+    avmlib_epoch_t *dom
+)
+{
+    avmlib_epoch_thread_t *thr;
+    uint32_t free_rec;
+
+    /* Step 1: Claim a released record */
+    for (thr = __atomic_load_n(&dom->threads,__ATOMIC_ACQUIRE); thr; thr = thr->next) {
+        free_rec = 0;
+        if (__atomic_compare_exchange_n(&thr->in_use,&free_rec,1,
+                                        0,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED)) {
+            return thr;
+        }
+    }
+
+    /* Step 2: Push a new one */
+    if (NULL == (thr = calloc(1,sizeof(*thr)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+    thr->in_use = 1;
+    thr->next = __atomic_load_n(&dom->threads,__ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&dom->threads,&thr->next,thr,
+                                        1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    return thr;
+}
+
+/**************************************************************************//**
+ * @brief Give a reader record back.
+ * */
+void
+avmlib_epoch_unregister(
+    avmlib_epoch_thread_t *thr
+)
+{
+    __atomic_store_n(&thr->local,0,__ATOMIC_RELEASE);
+    __atomic_store_n(&thr->in_use,0,__ATOMIC_RELEASE);
+}
+
+/**************************************************************************//**
+ * @brief Begin a read-side critical section.
+ *
+ * @remarks The store must be ordered before the caller's loads of
+ * shared pointers, hence sequential consistency (it pairs with the
+ * writer's swap and its scan in avmlib_epoch_reclaim()).
+ * */
+void
+avmlib_epoch_enter(
+    avmlib_epoch_t *dom,
+    avmlib_epoch_thread_t *thr
+)
+{
+    __atomic_store_n(&thr->local,__atomic_load_n(&dom->global,__ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+}
+
+/**************************************************************************//**
+ * @brief End a read-side critical section.
+ * */
+void
+avmlib_epoch_exit(
+    avmlib_epoch_thread_t *thr
+)
+{
+    __atomic_store_n(&thr->local,0,__ATOMIC_RELEASE);
+}
+
+/**************************************************************************//**
+ * @brief Hand over an unlinked object to be released after its grace
+ * period.
+ *
+ * @details The object must already be unreachable for new readers.
+ * Reclamation is attempted straight away, so with no readers active
+ * it's released before this returns.  If the node can't be allocated
+ * the caller is stalled until the grace period has passed.
+ * */
+void
+avmlib_epoch_retire(
+    avmlib_epoch_t *dom,
+    void *ptr,
+    void (*release)(void *ptr)
+)
+{
+    avmlib_epoch_node_t *node;
+    uint64_t epoch;
+
+    /* Step 1: Stamp and advance */
+    epoch = __atomic_fetch_add(&dom->global,1,__ATOMIC_SEQ_CST);
+
+    /* Step 2: Queue it */
+    if (NULL == (node = calloc(1,sizeof(*node)))) {
+        avmlib_err("%s: Alloc failure; waiting out the grace period.\n",__func__);
+        for (;;) {
+            avmlib_epoch_thread_t *thr;
+            uint64_t local;
+            int busy = 0;
+            for (thr = __atomic_load_n(&dom->threads,__ATOMIC_ACQUIRE); thr; thr = thr->next) {
+                local = __atomic_load_n(&thr->local,__ATOMIC_SEQ_CST);
+                if (local && (local <= epoch)) busy = 1;
+            }
+            if (!busy) break;
+            sched_yield();
+        }
+        release(ptr);
+        return;
+    }
+    node->ptr = ptr;
+    node->release = release;
+    node->epoch = epoch;
+    pthread_mutex_lock(&dom->lock);
+    node->next = dom->retired;
+    dom->retired = node;
+    __atomic_add_fetch(&dom->pending,1,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&dom->lock);
+
+    /* Step 3: Reclaim what we can */
+    avmlib_epoch_reclaim(dom);
+}
+
+/**************************************************************************//**
+ * @brief Release every retired object whose grace period has passed.
+ *
+ * @details Safe to call from any thread at any time; pool workers call
+ * it between jobs to catch objects whose readers were still active when
+ * they were retired.  With nothing pending it's a single atomic load.
+ *
+ * @returns Number of objects still pending.
+ * */
+int
+avmlib_epoch_reclaim(
+    avmlib_epoch_t *dom
+)
+{
+    avmlib_epoch_thread_t *thr;
+    avmlib_epoch_node_t *node, **link, *done = NULL;
+    uint64_t oldest, local;
+    int pending;
+
+    if (0 == __atomic_load_n(&dom->pending,__ATOMIC_ACQUIRE)) return 0;
+
+    /* Step 1: Oldest epoch any active reader may be in */
+    oldest = __atomic_load_n(&dom->global,__ATOMIC_SEQ_CST);
+    for (thr = __atomic_load_n(&dom->threads,__ATOMIC_ACQUIRE); thr; thr = thr->next) {
+        local = __atomic_load_n(&thr->local,__ATOMIC_SEQ_CST);
+        if (local && (local < oldest)) oldest = local;
+    }
+
+    /* Step 2: Unlink whatever's older */
+    pthread_mutex_lock(&dom->lock);
+    for (link = &dom->retired; NULL != (node = *link); ) {
+        if (node->epoch < oldest) {
+            *link = node->next;
+            node->next = done;
+            done = node;
+            __atomic_sub_fetch(&dom->pending,1,__ATOMIC_RELEASE);
+        } else {
+            link = &node->next;
+        }
+    }
+    pending = dom->pending;
+    pthread_mutex_unlock(&dom->lock);
+
+    /* Step 3: Release outside the lock */
+    for (node = done; node; node = done) {
+        done = node->next;
+        node->release(node->ptr);
+        free(node);
+    }
+    return pending;
+}
+
+#endif /* _AVMLIB_EPOCH_C_ */
@@ -0,0 +1,65 @@
+/**************************************************************************//**
+ * @file avmlib_epoch.h
+ *
+ * @brief Epoch-based reclamation for lock-free readers.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Readers (worker threads) each register a record once, and bracket
+ * every lookup of a shared pointer with avmlib_epoch_enter() and
+ * avmlib_epoch_exit(); neither takes a lock.  A writer that unlinks an
+ * object hands it to avmlib_epoch_retire() instead of freeing it; the
+ * object is freed once every reader active at the time has exited, i.e.
+ * once no reader can still be holding the old pointer.
+ *
+ * Critical sections are meant to be short (a table lookup and a
+ * reference count bump), never a whole process slice.
+ * */
+#ifndef _AVMLIB_EPOCH_H_
+#define _AVMLIB_EPOCH_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * Per-thread reader record
+ */
+typedef struct _avmlib_epoch_thread_s {
+    struct _avmlib_epoch_thread_s *next; /* Domain's record list */
+    uint64_t local; /* Epoch seen on entry; 0 when quiescent */
+    uint32_t in_use; /* Claimed by a thread */
+} avmlib_epoch_thread_t;
+
+/**
+ * Object waiting for its grace period
+ */
+typedef struct _avmlib_epoch_node_s {
+    struct _avmlib_epoch_node_s *next;
+    void *ptr; /* The retired object */
+    void (*release)(void *ptr); /* How to free it */
+    uint64_t epoch; /* Global epoch when it was retired */
+} avmlib_epoch_node_t;
+
+/**
+ * Reclamation domain
+ */
+typedef struct {
+    uint64_t global; /* Current epoch (starts at 1) */
+    avmlib_epoch_thread_t *threads; /* Reader records (never unlinked) */
+    pthread_mutex_t lock; /* Guards retired; writers only */
+    avmlib_epoch_node_t *retired; /* Objects awaiting reclamation */
+    uint32_t pending; /* Length of retired (atomic; read without the lock) */
+} avmlib_epoch_t;
+
+/* Prototypes */
+avmlib_epoch_t *avmlib_epoch_new(void);
+void avmlib_epoch_destroy(avmlib_epoch_t *dom);
+avmlib_epoch_thread_t *avmlib_epoch_register(avmlib_epoch_t *dom);
+void avmlib_epoch_unregister(avmlib_epoch_thread_t *thr);
+void avmlib_epoch_enter(avmlib_epoch_t *dom, avmlib_epoch_thread_t *thr);
+void avmlib_epoch_exit(avmlib_epoch_thread_t *thr);
+void avmlib_epoch_retire(avmlib_epoch_t *dom, void *ptr, void (*release)(void *ptr));
+int avmlib_epoch_reclaim(avmlib_epoch_t *dom);
+
+#endif /* _AVMLIB_EPOCH_H_ */
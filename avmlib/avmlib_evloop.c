@@ -0,0 +1,439 @@
+/**************************************************************************//**
+ * @file avmlib_evloop.c
+ *
+ * @brief Event loop implementation (epoll)
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_EVLOOP_C_
+#define _AVMLIB_EVLOOP_C_
+
+#include "avmlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**************************************************************************//**
+ * @brief Append a process to the run queue.
+ *
+ * @remarks Caller holds the loop lock.
+ * */
+static void
+avmlib_evloop_enqueue(
+    avmlib_evloop_t *loop,
+    class_process_t *proc
+)
+{
+    proc->state = PROC_STATE_RUNNABLE;
+    proc->wait_port = NULL;
+    proc->next_ready = NULL;
+    if (loop->ready_tail) {
+        loop->ready_tail->next_ready = proc;
+    } else {
+        loop->ready_head = proc;
+    }
+    loop->ready_tail = proc;
+    avmlib_stats_gauge(ready,1);
+}
+
+/**************************************************************************//**
+ * @brief (Re)arm a port's one-shot interest for its current waiters.
+ *
+ * @remarks Caller holds the loop lock.
+ * */
+static int
+avmlib_evloop_arm(
+    avmlib_evloop_t *loop,
+    class_port_t *port
+)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLONESHOT;
+    if (port->rd_waiter) ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (port->wr_waiter) ev.events |= EPOLLOUT;
+    ev.data.ptr = port;
+    return epoll_ctl(loop->epfd,EPOLL_CTL_MOD,port->fd,&ev);
+}
+
+/**************************************************************************//**
+ * @brief Alloc and prepare a new event loop.
+ *
+ * @returns New loop on success, NULL on failure.
+ * */
+avmlib_evloop_t *
+avmlib_evloop_new(void)
+{
+    avmlib_evloop_t *loop;
+    struct epoll_event ev;
+
+    if (NULL == (loop = calloc(1,sizeof(*loop)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+    loop->wakefd = -1;
+    if (0 > (loop->epfd = epoll_create1(EPOLL_CLOEXEC))) {
+        avmlib_err("%s: epoll_create1 failed (%s).\n",__func__,strerror(errno));
+        free(loop);
+        return NULL;
+    }
+
+    /* The wake descriptor is the one event with no port */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if ((0 > (loop->wakefd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC))) ||
+        (0 > epoll_ctl(loop->epfd,EPOLL_CTL_ADD,loop->wakefd,&ev))) {
+        avmlib_err("%s: Can't make wake descriptor (%s).\n",__func__,strerror(errno));
+        if (0 <= loop->wakefd) close(loop->wakefd);
+        close(loop->epfd);
+        free(loop);
+        return NULL;
+    }
+    pthread_mutex_init(&loop->lock,NULL);
+    return loop;
+}
+
+/**************************************************************************//**
+ * @brief Release an event loop.
+ *
+ * @remarks Ports still registered are left in non-blocking mode.
+ * */
+void
+avmlib_evloop_destroy(
+    avmlib_evloop_t *loop
+)
+{
+    class_process_t *proc;
+
+    if (!loop) return;
+    for (proc=loop->ready_head;proc;proc=proc->next_ready) avmlib_stats_gauge(ready,-1);
+    avmlib_stats_gauge(parked,-(int64_t)loop->parked);
+    close(loop->wakefd);
+    close(loop->epfd);
+    pthread_mutex_destroy(&loop->lock);
+    free(loop);
+}
+
+/**************************************************************************//**
+ * @brief Register a descriptor port with an event loop.
+ *
+ * @details The port's descriptor is switched to non-blocking mode.
+ *
+ * @param loop The event loop
+ * @param port The port to add
+ *
+ * @returns 0 on success, -1 on failure.
+ *
+ * @remarks O_NONBLOCK is a property of the open file description, so
+ * adding an inherited descriptor (e.g. @stdin) affects other holders.
+ * */
+int
+avmlib_evloop_add_port(
+    avmlib_evloop_t *loop,
+    class_port_t *port
+)
+{
+    struct epoll_event ev;
+    int flags;
+
+    /* Step 1: Sanity check */
+    if (0 > port->fd) {
+        avmlib_err("%s: Port \"%s\" has no descriptor.\n",__func__,
+                   avmm_entity_name(port));
+        return -1;
+    }
+    if (port->evloop) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    /* Step 2: Non-blocking */
+    if ((0 > (flags = fcntl(port->fd,F_GETFL))) ||
+        (0 > fcntl(port->fd,F_SETFL,flags | O_NONBLOCK))) {
+        avmlib_err("%s: Can't set \"%s\" non-blocking (%s).\n",__func__,
+                   avmm_entity_name(port),strerror(errno));
+        return -1;
+    }
+
+    /* Step 3: Register, disarmed until someone parks */
+    ev.events = EPOLLONESHOT;
+    ev.data.ptr = port;
+    if (0 > epoll_ctl(loop->epfd,EPOLL_CTL_ADD,port->fd,&ev)) {
+        avmlib_err("%s: Can't register \"%s\" (%s).\n",__func__,
+                   avmm_entity_name(port),strerror(errno));
+        return -1;
+    }
+    port->evloop = loop;
+    port->rd_waiter = port->wr_waiter = NULL;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Remove a port from its event loop.
+ *
+ * @details Any processes parked on the port are made runnable, so they
+ * can retry (and see the error) themselves.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_evloop_remove_port(
+    avmlib_evloop_t *loop,
+    class_port_t *port
+)
+{
+    if (port->evloop != loop) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&loop->lock);
+    epoll_ctl(loop->epfd,EPOLL_CTL_DEL,port->fd,NULL);
+    if (port->rd_waiter) {
+        avmlib_evloop_enqueue(loop,port->rd_waiter);
+        port->rd_waiter = NULL;
+        loop->parked--;
+        avmlib_stats_gauge(parked,-1);
+    }
+    if (port->wr_waiter) {
+        avmlib_evloop_enqueue(loop,port->wr_waiter);
+        port->wr_waiter = NULL;
+        loop->parked--;
+        avmlib_stats_gauge(parked,-1);
+    }
+    port->evloop = NULL;
+    pthread_mutex_unlock(&loop->lock);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Park a process until a port becomes ready.
+ *
+ * @param loop The event loop
+ * @param proc The process to park
+ * @param port The port it's waiting on
+ * @param for_write Nonzero to wait for writability, zero for input
+ *
+ * @returns 0 on success, -1 on failure (EBUSY if another process is
+ * already parked on the same port in the same direction).
+ * */
+int
+avmlib_evloop_park(
+    avmlib_evloop_t *loop,
+    class_process_t *proc,
+    class_port_t *port,
+    int for_write
+)
+{
+    class_process_t **slot = for_write ? &port->wr_waiter : &port->rd_waiter;
+    int retval = 0;
+
+    if (port->evloop != loop) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&loop->lock);
+    if (*slot && (*slot != proc)) {
+        errno = EBUSY;
+        retval = -1;
+    } else {
+        *slot = proc;
+        proc->state = PROC_STATE_WAITING;
+        proc->wait_port = port;
+        loop->parked++;
+        avmlib_stats_gauge(parked,1);
+        if (0 > (retval = avmlib_evloop_arm(loop,port))) {
+            /* Couldn't arm; don't strand the process */
+            *slot = NULL;
+            loop->parked--;
+            avmlib_stats_gauge(parked,-1);
+            proc->state = PROC_STATE_RUNNABLE;
+            proc->wait_port = NULL;
+        }
+    }
+    pthread_mutex_unlock(&loop->lock);
+    return retval;
+}
+
+/**************************************************************************//**
+ * @brief Wait for port readiness and wake parked processes.
+ *
+ * @details Safe to call from several worker threads at once.  Before a
+ * parked writer is woken, its port's held output is drained; if the
+ * descriptor fills up again the writer stays parked.
+ *
+ * @param loop The event loop
+ * @param timeout_ms epoll timeout (-1 waits forever, 0 polls)
+ *
+ * @returns Number of processes made runnable (0 if woken by
+ * avmlib_evloop_wake() or timed out), or -1 on error.
+ * */
+int
+avmlib_evloop_poll(
+    avmlib_evloop_t *loop,
+    int timeout_ms
+)
+{
+    struct epoll_event evs[AVMLIB_EVLOOP_BATCH];
+    class_port_t *port;
+    eventfd_t wakes;
+    uint32_t e;
+    int woken = 0;
+    int n, i;
+
+    do {
+        n = epoll_wait(loop->epfd,evs,AVMLIB_EVLOOP_BATCH,timeout_ms);
+    } while ((n < 0) && (EINTR == errno));
+    if (n < 0) return -1;
+
+    pthread_mutex_lock(&loop->lock);
+    for (i=0;i<n;i++) {
+        port = (class_port_t *)evs[i].data.ptr;
+        e = evs[i].events;
+
+        /* Woken; just drain it */
+        if (!port) {
+            eventfd_read(loop->wakefd,&wakes);
+            continue;
+        }
+
+        /* Input side */
+        if (port->rd_waiter && (e & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))) {
+            avmlib_evloop_enqueue(loop,port->rd_waiter);
+            port->rd_waiter = NULL;
+            loop->parked--;
+            avmlib_stats_gauge(parked,-1);
+            woken++;
+        }
+
+        /* Output side; drain what's held first */
+        if (port->wr_waiter && (e & (EPOLLOUT|EPOLLHUP|EPOLLERR))) {
+            if (AVMLIB_IO_WOULDBLOCK != avmlib_port_flush(port)) {
+                avmlib_evloop_enqueue(loop,port->wr_waiter);
+                port->wr_waiter = NULL;
+                loop->parked--;
+                avmlib_stats_gauge(parked,-1);
+                woken++;
+            }
+        }
+
+        /* One-shot: re-arm for anyone still waiting */
+        if (port->rd_waiter || port->wr_waiter) {
+            avmlib_evloop_arm(loop,port);
+        }
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    return woken;
+}
+
+/**************************************************************************//**
+ * @brief Make a thread waiting in avmlib_evloop_poll() return.
+ *
+ * @details If nobody is waiting, the next poll returns at once.
+ * */
+void
+avmlib_evloop_wake(
+    avmlib_evloop_t *loop
+)
+{
+    eventfd_write(loop->wakefd,1);
+}
+
+/**************************************************************************//**
+ * @brief Put a process on the run queue.
+ *
+ * @remarks Used for newly-created processes and ones that yielded.
+ * */
+void
+avmlib_evloop_ready(
+    avmlib_evloop_t *loop,
+    class_process_t *proc
+)
+{
+    pthread_mutex_lock(&loop->lock);
+    avmlib_evloop_enqueue(loop,proc);
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/**************************************************************************//**
+ * @brief Take the next runnable process off the run queue.
+ *
+ * @returns A runnable process, or NULL if none is queued.
+ * */
+class_process_t *
+avmlib_evloop_next(
+    avmlib_evloop_t *loop
+)
+{
+    class_process_t *proc;
+
+    pthread_mutex_lock(&loop->lock);
+    if (NULL != (proc = loop->ready_head)) {
+        loop->ready_head = proc->next_ready;
+        if (!loop->ready_head) loop->ready_tail = NULL;
+        proc->next_ready = NULL;
+        avmlib_stats_gauge(ready,-1);
+    }
+    pthread_mutex_unlock(&loop->lock);
+    return proc;
+}
+
+/**************************************************************************//**
+ * @brief IN on an event-loop port.
+ *
+ * @details If the port has no data, the process is parked and the IN
+ * should be retried once the process is runnable again.
+ *
+ * @returns Bytes read (0 at end of input), AVMLIB_IO_WOULDBLOCK if the
+ * process was parked, or -1 on error.
+ * */
+int
+avmlib_evloop_read(
+    avmlib_evloop_t *loop,
+    class_process_t *proc,
+    class_port_t *port,
+    void *buf,
+    uint32_t len
+)
+{
+    int got = avmlib_port_read(port,buf,len);
+
+    if (AVMLIB_IO_WOULDBLOCK == got) {
+        if (0 > avmlib_evloop_park(loop,proc,port,0)) return -1;
+    }
+    return got;
+}
+
+/**************************************************************************//**
+ * @brief OUT on an event-loop port.
+ *
+ * @details Output is always accepted.  If the descriptor is full, the
+ * rest is held on the port and the process is parked until it drains;
+ * the OUT itself must not be retried.
+ *
+ * @returns Bytes accepted, AVMLIB_IO_WOULDBLOCK if the process was parked,
+ * or -1 on error.
+ * */
+ssize_t
+avmlib_evloop_write(
+    avmlib_evloop_t *loop,
+    class_process_t *proc,
+    class_port_t *port,
+    const void *data,
+    size_t len
+)
+{
+    ssize_t put = avmlib_port_write(port,data,len);
+
+    if (AVMLIB_IO_WOULDBLOCK == put) {
+        if (0 > avmlib_evloop_park(loop,proc,port,1)) return -1;
+    }
+    return put;
+}
+
+#endif /* _AVMLIB_EVLOOP_C_ */
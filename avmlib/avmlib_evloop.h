@@ -0,0 +1,58 @@
+/**************************************************************************//**
+ * @file avmlib_evloop.h
+ *
+ * @brief Event loop for asynchronous port I/O.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Descriptor-backed ports added to an event loop are switched to
+ * non-blocking mode.  When a process's IN (or OUT) on such a port
+ * can't make progress, the process is parked on the port instead of
+ * blocking the worker thread executing it: its state becomes WAITING
+ * and the port is armed in epoll.  Any worker thread may then call
+ * avmlib_evloop_poll(); when the descriptor becomes ready, the parked
+ * process goes back to RUNNABLE and onto the loop's run queue, from
+ * which workers take it with avmlib_evloop_next().
+ *
+ * Interest is registered one-shot, so each readiness event is handled
+ * by exactly one polling thread.  avmlib_evloop_wake() breaks a thread
+ * out of a waiting poll (new work for it, or time to stop).
+ * */
+#ifndef _AVMLIB_EVLOOP_H_
+#define _AVMLIB_EVLOOP_H_
+
+#include <pthread.h>
+#include "avmm_data.h"
+
+/**
+ * Most events handled per poll
+ */
+#define AVMLIB_EVLOOP_BATCH 64
+
+/**
+ * Event loop state
+ */
+typedef struct {
+    int epfd; /* epoll instance */
+    int wakefd; /* eventfd for avmlib_evloop_wake() */
+    pthread_mutex_t lock; /* Guards waiters and the run queue */
+    class_process_t *ready_head; /* Run queue (FIFO) */
+    class_process_t *ready_tail;
+    uint32_t parked; /* Processes currently WAITING */
+} avmlib_evloop_t;
+
+/* Prototypes */
+avmlib_evloop_t *avmlib_evloop_new(void);
+void avmlib_evloop_destroy(avmlib_evloop_t *loop);
+int avmlib_evloop_add_port(avmlib_evloop_t *loop, class_port_t *port);
+int avmlib_evloop_remove_port(avmlib_evloop_t *loop, class_port_t *port);
+int avmlib_evloop_park(avmlib_evloop_t *loop, class_process_t *proc, class_port_t *port, int for_write);
+int avmlib_evloop_poll(avmlib_evloop_t *loop, int timeout_ms);
+void avmlib_evloop_wake(avmlib_evloop_t *loop);
+void avmlib_evloop_ready(avmlib_evloop_t *loop, class_process_t *proc);
+class_process_t *avmlib_evloop_next(avmlib_evloop_t *loop);
+int avmlib_evloop_read(avmlib_evloop_t *loop, class_process_t *proc, class_port_t *port, void *buf, uint32_t len);
+ssize_t avmlib_evloop_write(avmlib_evloop_t *loop, class_process_t *proc, class_port_t *port, const void *data, size_t len);
+
+#endif /* _AVMLIB_EVLOOP_H_ */
@@ -0,0 +1,633 @@
+/**************************************************************************//**
+ * @file avmlib_fileio.c
+ *
+ * @brief Batched file port I/O (io_uring, with a thread pool fallback)
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_FILEIO_C_
+#define _AVMLIB_FILEIO_C_
+
+#include "avmlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**************************************************************************//**
+ * @brief Unmap and close a (possibly partially set up) ring.
+ * */
+static void
+avmlib_uring_teardown(
+    avmlib_uring_t *r
+)
+{
+    if (r->sqes) munmap(r->sqes,r->sqes_sz);
+    if (r->cq_ring && (r->cq_ring != r->sq_ring)) munmap(r->cq_ring,r->cq_ring_sz);
+    if (r->sq_ring) munmap(r->sq_ring,r->sq_ring_sz);
+    if (0 <= r->fd) close(r->fd);
+    r->sqes = NULL;
+    r->sq_ring = r->cq_ring = NULL;
+    r->fd = -1;
+}
+
+/**************************************************************************//**
+ * @brief Create and map an io_uring instance.
+ *
+ * @param r Ring state to fill in
+ * @param entries Requested submission queue size
+ *
+ * @returns 0 on success, -1 on failure (errno set).
+ * */
+static int
+avmlib_uring_setup(
+    avmlib_uring_t *r,
+    uint32_t entries
+)
+{
+    struct io_uring_params p;
+    void *m;
+    int err;
+
+    memset(r,0,sizeof(*r));
+    memset(&p,0,sizeof(p));
+
+    /* Step 1: Ring */
+    if (0 > (r->fd = (int)syscall(__NR_io_uring_setup,entries,&p))) return -1;
+
+    /* Step 2: Map submission and completion rings */
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_sz > r->sq_ring_sz) r->sq_ring_sz = r->cq_ring_sz;
+        r->cq_ring_sz = r->sq_ring_sz;
+    }
+    m = mmap(NULL,r->sq_ring_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+             r->fd,IORING_OFF_SQ_RING);
+    if (MAP_FAILED == m) goto _avmlib_uring_setup_fail;
+    r->sq_ring = m;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        m = mmap(NULL,r->cq_ring_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                 r->fd,IORING_OFF_CQ_RING);
+        if (MAP_FAILED == m) goto _avmlib_uring_setup_fail;
+        r->cq_ring = m;
+    }
+
+    /* Step 3: Map submission entries */
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    m = mmap(NULL,r->sqes_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+             r->fd,IORING_OFF_SQES);
+    if (MAP_FAILED == m) goto _avmlib_uring_setup_fail;
+    r->sqes = m;
+
+    /* Step 4: Ring pointers */
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (uint32_t *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (uint32_t *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (uint32_t *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (uint32_t *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (uint32_t *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (uint32_t *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (uint32_t *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    return 0;
+
+_avmlib_uring_setup_fail:
+    err = errno;
+    avmlib_uring_teardown(r);
+    errno = err;
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Put a request into the submission queue (no syscall).
+ *
+ * @returns 0 on success, -1 if the submission queue is full.
+ * */
+static int
+avmlib_uring_queue(
+    avmlib_uring_t *r,
+    avmlib_fileio_req_t *req
+)
+{
+    uint32_t tail = *r->sq_tail;
+    uint32_t head = __atomic_load_n(r->sq_head,__ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+    uint32_t idx;
+
+    if ((tail - head) >= r->sq_entries) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = req->for_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->port->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->off = req->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail,tail + 1,__ATOMIC_RELEASE);
+    r->to_submit++;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Submit queued entries and/or wait for completions.
+ *
+ * @param r The ring
+ * @param to_submit Entries to submit
+ * @param min_complete Completions to wait for
+ *
+ * @returns Entries submitted, or -1 on error.
+ * */
+static int
+avmlib_uring_enter(
+    avmlib_uring_t *r,
+    uint32_t to_submit,
+    uint32_t min_complete
+)
+{
+    uint32_t flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    do {
+        ret = (int)syscall(__NR_io_uring_enter,r->fd,to_submit,min_complete,
+                           flags,NULL,0);
+    } while ((ret < 0) && (EINTR == errno));
+    if (ret < 0) return -1;
+
+    r->to_submit -= ((uint32_t)ret <= r->to_submit) ? (uint32_t)ret : r->to_submit;
+    return ret;
+}
+
+/**************************************************************************//**
+ * @brief Collect all available completions.
+ *
+ * @returns List of completed requests (FIFO), possibly NULL.
+ * */
+static avmlib_fileio_req_t *
+avmlib_uring_reap(
+    avmlib_uring_t *r
+)
+{
+    uint32_t head = *r->cq_head;
+    uint32_t tail = __atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE);
+    avmlib_fileio_req_t *list = NULL, *last = NULL, *req;
+    struct io_uring_cqe *cqe;
+
+    while (head != tail) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        req = (avmlib_fileio_req_t *)(uintptr_t)cqe->user_data;
+        req->result = cqe->res;
+        req->next = NULL;
+        if (last) {
+            last->next = req;
+        } else {
+            list = req;
+        }
+        last = req;
+        head++;
+    }
+    __atomic_store_n(r->cq_head,head,__ATOMIC_RELEASE);
+    return list;
+}
+
+/**************************************************************************//**
+ * @brief Thread pool worker.
+ * */
+static void *
+avmlib_fileio_worker(
+    void *arg
+)
+{
+    avmlib_fileio_t *io = (avmlib_fileio_t *)arg;
+    avmlib_fileio_req_t *req;
+    ssize_t ret;
+
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->work_head && !io->stopping) {
+            pthread_cond_wait(&io->work_cv,&io->lock);
+        }
+        if (!io->work_head) break; /* Stopping, and nothing left */
+
+        req = io->work_head;
+        io->work_head = req->next;
+        if (!io->work_head) io->work_tail = NULL;
+        pthread_mutex_unlock(&io->lock);
+
+        do {
+            ret = req->for_write ?
+                write(req->port->fd,req->iov.iov_base,req->iov.iov_len) :
+                pread(req->port->fd,req->iov.iov_base,req->iov.iov_len,req->offset);
+        } while ((ret < 0) && (EINTR == errno));
+        req->result = (ret < 0) ? -errno : (int)ret;
+
+        pthread_mutex_lock(&io->lock);
+        req->port->stat_syscalls++;
+        avmlib_stats_port(req->port,0,0,1);
+        req->next = io->done_head;
+        io->done_head = req;
+        pthread_cond_signal(&io->done_cv);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Finish a request: account, wake the process, release.
+ *
+ * @remarks Caller holds the backend lock.
+ * */
+static void
+avmlib_fileio_complete(
+    avmlib_fileio_t *io,
+    avmlib_fileio_req_t *req
+)
+{
+    class_port_t *port = req->port;
+
+    if (req->result > 0) {
+        if (req->for_write) {
+            port->stat_bytes_out += req->result;
+            avmlib_stats_port(port,0,(uint64_t)req->result,0);
+        } else {
+            port->stat_bytes_in += req->result;
+            avmlib_stats_port(port,(uint64_t)req->result,0,0);
+        }
+    }
+
+    /* A short read at the end of the queue gives back what it didn't
+     * get (end of file), so the next IN starts there */
+    if (!req->for_write && (req->result < (int)req->iov.iov_len) &&
+        (port->rd_offset == req->offset + req->iov.iov_len)) {
+        port->rd_offset = req->offset + ((req->result > 0) ? req->result : 0);
+    }
+
+    if (req->proc) {
+        avmlib_stats_gauge(parked,-1);
+        req->proc->io_result = req->result;
+        if (io->loop) {
+            avmlib_evloop_ready(io->loop,req->proc);
+        } else {
+            req->proc->state = PROC_STATE_RUNNABLE;
+            req->proc->wait_port = NULL;
+        }
+    }
+
+    if (req->for_write) free(req->iov.iov_base);
+    free(req);
+}
+
+/**************************************************************************//**
+ * @brief Queue a request and park its process.
+ *
+ * @returns AVMLIB_IO_WOULDBLOCK on success, -1 on failure.
+ * */
+static int
+avmlib_fileio_submit(
+    avmlib_fileio_t *io,
+    avmlib_fileio_req_t *req
+)
+{
+    /* Step 1: Stay within depth, reaping to make room */
+    for (;;) {
+        pthread_mutex_lock(&io->lock);
+        if (io->inflight < io->depth) break;
+        pthread_mutex_unlock(&io->lock);
+        if (0 > avmlib_fileio_poll(io,1)) return -1;
+    }
+
+    /* Step 2: Reads take the next stretch of the file now, so reads
+     * queued behind this one don't all start at the same offset */
+    if (!req->for_write) {
+        req->offset = req->port->rd_offset;
+        req->port->rd_offset += req->iov.iov_len;
+    }
+
+    /* Step 3: Queue it; no syscall until the next poll */
+    if (FILEIO_BACKEND_URING == io->backend) {
+        if ((0 > avmlib_uring_queue(&io->ring,req)) &&
+            ((0 > avmlib_uring_enter(&io->ring,io->ring.to_submit,0)) ||
+             (0 > avmlib_uring_queue(&io->ring,req)))) {
+            if (!req->for_write) req->port->rd_offset = req->offset;
+            pthread_mutex_unlock(&io->lock);
+            avmlib_err("%s: Can't queue request (%s).\n",__func__,strerror(errno));
+            return -1;
+        }
+    } else {
+        req->next = NULL;
+        if (io->queued_tail) {
+            io->queued_tail->next = req;
+        } else {
+            io->queued_head = req;
+        }
+        io->queued_tail = req;
+    }
+    io->inflight++;
+
+    /* Step 4: Park the process until completion */
+    if (req->proc) {
+        avmlib_stats_gauge(parked,1);
+        req->proc->state = PROC_STATE_WAITING;
+        req->proc->wait_port = req->port;
+    }
+    pthread_mutex_unlock(&io->lock);
+    return AVMLIB_IO_WOULDBLOCK;
+}
+
+/**************************************************************************//**
+ * @brief Create a batched file I/O backend.
+ *
+ * @param loop Event loop whose run queue receives completed processes
+ * (may be NULL, in which case processes are only marked RUNNABLE)
+ * @param backend Backend to use; AUTO prefers io_uring
+ * @param depth Most requests in flight; 0 selects AVMLIB_FILEIO_DEPTH
+ *
+ * @returns New backend on success, NULL on failure.
+ * */
+avmlib_fileio_t *
+avmlib_fileio_new(
+    avmlib_evloop_t *loop,
+    fileio_backend_t backend,
+    uint32_t depth
+)
+{
+    avmlib_fileio_t *io;
+    int i;
+
+    /* Step 1: Alloc and basics */
+    if (NULL == (io = calloc(1,sizeof(*io)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+    io->loop = loop;
+    io->depth = depth ? depth : AVMLIB_FILEIO_DEPTH;
+    io->ring.fd = -1;
+    pthread_mutex_init(&io->lock,NULL);
+    pthread_cond_init(&io->work_cv,NULL);
+    pthread_cond_init(&io->done_cv,NULL);
+
+    /* Step 2: Try io_uring */
+    if (FILEIO_BACKEND_THREADS != backend) {
+        if (0 == avmlib_uring_setup(&io->ring,io->depth)) {
+            if (io->depth > io->ring.sq_entries) io->depth = io->ring.sq_entries;
+            io->backend = FILEIO_BACKEND_URING;
+            return io;
+        }
+        if (FILEIO_BACKEND_URING == backend) {
+            avmlib_err("%s: io_uring unavailable (%s).\n",__func__,strerror(errno));
+            avmlib_fileio_destroy(io);
+            return NULL;
+        }
+        avm_dbg(1,"AVMLIB","io_uring unavailable (%s); using thread pool.\n",
+                strerror(errno));
+    }
+
+    /* Step 3: Fall back to the thread pool */
+    io->backend = FILEIO_BACKEND_THREADS;
+    for (i=0;i<AVMLIB_FILEIO_THREADS;i++) {
+        if (pthread_create(&io->threads[i],NULL,avmlib_fileio_worker,io)) break;
+    }
+    io->nthreads = i;
+    if (0 == io->nthreads) {
+        avmlib_err("%s: Can't start I/O threads.\n",__func__);
+        avmlib_fileio_destroy(io);
+        return NULL;
+    }
+    return io;
+}
+
+/**************************************************************************//**
+ * @brief Drain and release a backend.
+ *
+ * @details Outstanding requests are completed first.
+ * */
+void
+avmlib_fileio_destroy(
+    avmlib_fileio_t *io
+)
+{
+    int i;
+
+    if (!io) return;
+
+    /* Step 1: Let everything in flight finish */
+    while (io->inflight && (0 <= avmlib_fileio_poll(io,1)));
+
+    /* Step 2: Stop the pool */
+    pthread_mutex_lock(&io->lock);
+    io->stopping = 1;
+    pthread_cond_broadcast(&io->work_cv);
+    pthread_mutex_unlock(&io->lock);
+    for (i=0;i<io->nthreads;i++) {
+        pthread_join(io->threads[i],NULL);
+    }
+
+    /* Step 3: Ring and the rest */
+    if (0 <= io->ring.fd) avmlib_uring_teardown(&io->ring);
+    pthread_cond_destroy(&io->work_cv);
+    pthread_cond_destroy(&io->done_cv);
+    pthread_mutex_destroy(&io->lock);
+    free(io);
+}
+
+/**************************************************************************//**
+ * @brief Name of the active backend, for reporting.
+ * */
+const char *
+avmlib_fileio_backend_name(
+    avmlib_fileio_t *io
+)
+{
+    return (FILEIO_BACKEND_URING == io->backend) ? "io_uring" : "threads";
+}
+
+/**************************************************************************//**
+ * @brief Route a file port's IN/OUT through a backend.
+ *
+ * @details Writes carry no offset of their own, so a port that can be
+ * written must be open O_APPEND (as avmlib_port_open_file() opens it);
+ * otherwise io_uring would write every OUT at offset 0.
+ *
+ * @returns 0 on success, -1 on failure (errno is EINVAL for a writable
+ * descriptor without O_APPEND).
+ * */
+int
+avmlib_fileio_add_port(
+    avmlib_fileio_t *io,
+    class_port_t *port
+)
+{
+    int flags;
+
+    if (0 > port->fd) {
+        avmlib_err("%s: Port \"%s\" has no descriptor.\n",__func__,
+                   avmm_entity_name(port));
+        return -1;
+    }
+    if (0 > (flags = fcntl(port->fd,F_GETFL))) {
+        avmlib_err("%s: Port \"%s\": %s.\n",__func__,avmm_entity_name(port),
+                   strerror(errno));
+        return -1;
+    }
+    if ((O_RDONLY != (flags & O_ACCMODE)) && !(flags & O_APPEND)) {
+        avmlib_err("%s: Port \"%s\" is writable but not O_APPEND.\n",__func__,
+                   avmm_entity_name(port));
+        errno = EINVAL;
+        return -1;
+    }
+    port->fileio = io;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Queue an IN on a file port.
+ *
+ * @details The process is parked; once the read completes it is made
+ * runnable with the byte count (or -errno) in proc->io_result, and buf
+ * holds the data.  Several reads may be queued on a port; each starts
+ * where the one before it asked to end.
+ *
+ * @returns AVMLIB_IO_WOULDBLOCK if queued, -1 on failure.
+ * */
+int
+avmlib_fileio_read(
+    avmlib_fileio_t *io,
+    class_process_t *proc,
+    class_port_t *port,
+    void *buf,
+    uint32_t len
+)
+{
+    avmlib_fileio_req_t *req;
+
+    if (NULL == (req = calloc(1,sizeof(*req)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return -1;
+    }
+    req->proc = proc;
+    req->port = port;
+    req->iov.iov_base = buf;
+    req->iov.iov_len = len;
+    req->for_write = 0;
+    return avmlib_fileio_submit(io,req);
+}
+
+/**************************************************************************//**
+ * @brief Queue an OUT on a file port.
+ *
+ * @details The data is copied, so the source may change once this
+ * returns.  The process is parked until the write completes.
+ *
+ * @returns AVMLIB_IO_WOULDBLOCK if queued, -1 on failure.
+ * */
+int
+avmlib_fileio_write(
+    avmlib_fileio_t *io,
+    class_process_t *proc,
+    class_port_t *port,
+    const void *data,
+    uint32_t len
+)
+{
+    avmlib_fileio_req_t *req;
+
+    if (NULL == (req = calloc(1,sizeof(*req))) ||
+        NULL == (req->iov.iov_base = malloc(len ? len : 1))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        free(req);
+        return -1;
+    }
+    memcpy(req->iov.iov_base,data,len);
+    req->iov.iov_len = len;
+    req->proc = proc;
+    req->port = port;
+    req->offset = 0; /* Ignored: add_port requires O_APPEND */
+    req->for_write = 1;
+    return avmlib_fileio_submit(io,req);
+}
+
+/**************************************************************************//**
+ * @brief Submit the queued batch and reap completions.
+ *
+ * @details Everything queued since the last poll goes to the kernel (or
+ * the pool) at once.  Completed processes are moved to the run queue.
+ *
+ * @param io The backend
+ * @param wait Nonzero to block until at least one request completes
+ * (if any are in flight)
+ *
+ * @returns Number of requests completed, or -1 on error.
+ * */
+int
+avmlib_fileio_poll(
+    avmlib_fileio_t *io,
+    int wait
+)
+{
+    avmlib_fileio_req_t *done, *next;
+    int n = 0;
+
+    pthread_mutex_lock(&io->lock);
+    if (FILEIO_BACKEND_URING == io->backend) {
+        /* Step 1: Submit the batch */
+        if (io->ring.to_submit) {
+            io->stat_batches++;
+            if (0 > avmlib_uring_enter(&io->ring,io->ring.to_submit,0)) {
+                pthread_mutex_unlock(&io->lock);
+                avmlib_err("%s: io_uring_enter failed (%s).\n",__func__,strerror(errno));
+                return -1;
+            }
+        }
+        /* Step 2: Reap, waiting (unlocked) if asked and nothing's done */
+        done = avmlib_uring_reap(&io->ring);
+        if (!done && wait && io->inflight) {
+            io->stat_batches++;
+            pthread_mutex_unlock(&io->lock);
+            avmlib_uring_enter(&io->ring,0,1);
+            pthread_mutex_lock(&io->lock);
+            done = avmlib_uring_reap(&io->ring);
+        }
+    } else {
+        /* Step 1: Release the batch to the pool */
+        if (io->queued_head) {
+            if (io->work_tail) {
+                io->work_tail->next = io->queued_head;
+            } else {
+                io->work_head = io->queued_head;
+            }
+            io->work_tail = io->queued_tail;
+            io->queued_head = io->queued_tail = NULL;
+            pthread_cond_broadcast(&io->work_cv);
+            io->stat_batches++;
+        }
+        /* Step 2: Reap, waiting if asked and nothing's done */
+        while (!io->done_head && wait && io->inflight) {
+            pthread_cond_wait(&io->done_cv,&io->lock);
+        }
+        done = io->done_head;
+        io->done_head = NULL;
+    }
+
+    /* Step 3: Finish everything reaped */
+    for (;done;done=next) {
+        next = done->next;
+        io->inflight--;
+        avmlib_fileio_complete(io,done);
+        n++;
+    }
+    pthread_mutex_unlock(&io->lock);
+    return n;
+}
+
+#endif /* _AVMLIB_FILEIO_C_ */
@@ -0,0 +1,109 @@
+/**************************************************************************//**
+ * @file avmlib_fileio.h
+ *
+ * @brief Batched I/O for file ports.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Regular files are always "ready" as far as epoll is concerned, so the
+ * event loop can't keep file I/O from blocking a worker thread.  File
+ * ports attached to a fileio backend instead queue their reads and
+ * writes; the issuing process is parked, and avmlib_fileio_poll()
+ * submits everything queued since the last poll in one batch, reaps
+ * completions, and moves finished processes onto the event loop's run
+ * queue with the result in proc->io_result.
+ *
+ * Two backends are provided:
+ *    + io_uring: one ring per backend; a batch is one io_uring_enter().
+ *    + threads: a small pool doing pread()/pwrite(); used automatically
+ *      when io_uring is unavailable (old kernel, seccomp, etc.)
+ * */
+#ifndef _AVMLIB_FILEIO_H_
+#define _AVMLIB_FILEIO_H_
+
+#include <pthread.h>
+#include <sys/uio.h>
+#include "avmm_data.h"
+#include "avmlib_evloop.h"
+
+/**
+ * Default ring depth (most requests in flight)
+ */
+#define AVMLIB_FILEIO_DEPTH 256
+
+/**
+ * Worker threads for the fallback backend
+ */
+#define AVMLIB_FILEIO_THREADS 4
+
+/**
+ * Backend selection
+ */
+typedef enum fileio_backend_e {
+    FILEIO_BACKEND_AUTO = 0, /* io_uring if available, else threads */
+    FILEIO_BACKEND_URING = 1, /* io_uring only */
+    FILEIO_BACKEND_THREADS = 2, /* Thread pool only */
+} fileio_backend_t;
+
+/**
+ * A queued or in-flight request
+ */
+typedef struct _avmlib_fileio_req_s {
+    struct _avmlib_fileio_req_s *next; /* Queue link */
+    class_process_t *proc; /* Process to wake on completion (may be NULL) */
+    class_port_t *port; /* Port the request is for */
+    struct iovec iov; /* Data (owned by the request for writes) */
+    uint64_t offset; /* File offset (reads) */
+    int for_write; /* Nonzero for a write */
+    int result; /* Bytes transferred, or -errno */
+} avmlib_fileio_req_t;
+
+/**
+ * io_uring ring state
+ */
+typedef struct {
+    int fd; /* Ring descriptor */
+    uint32_t sq_entries; /* Submission queue size */
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring; /* Ring mappings */
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz; /* Mapping sizes */
+    uint32_t to_submit; /* SQEs prepared but not yet submitted */
+} avmlib_uring_t;
+
+/**
+ * Backend state
+ */
+typedef struct {
+    fileio_backend_t backend; /* Active backend (never AUTO) */
+    avmlib_evloop_t *loop; /* Run queue for completed processes */
+    pthread_mutex_t lock; /* Guards everything below */
+    uint32_t depth; /* Most requests in flight */
+    uint32_t inflight; /* Requests submitted or queued, not yet reaped */
+    uint64_t stat_batches; /* io_uring_enter() calls / batches released to the pool */
+    /* io_uring */
+    avmlib_uring_t ring;
+    /* Thread pool */
+    pthread_cond_t work_cv; /* Work released to the pool */
+    pthread_cond_t done_cv; /* Work completed by the pool */
+    avmlib_fileio_req_t *queued_head, *queued_tail; /* Not yet released */
+    avmlib_fileio_req_t *work_head, *work_tail; /* Released to workers */
+    avmlib_fileio_req_t *done_head; /* Completed, not yet reaped */
+    pthread_t threads[AVMLIB_FILEIO_THREADS];
+    int nthreads;
+    int stopping;
+} avmlib_fileio_t;
+
+/* Prototypes */
+avmlib_fileio_t *avmlib_fileio_new(avmlib_evloop_t *loop, fileio_backend_t backend, uint32_t depth);
+void avmlib_fileio_destroy(avmlib_fileio_t *io);
+const char *avmlib_fileio_backend_name(avmlib_fileio_t *io);
+int avmlib_fileio_add_port(avmlib_fileio_t *io, class_port_t *port);
+int avmlib_fileio_read(avmlib_fileio_t *io, class_process_t *proc, class_port_t *port, void *buf, uint32_t len);
+int avmlib_fileio_write(avmlib_fileio_t *io, class_process_t *proc, class_port_t *port, const void *data, uint32_t len);
+int avmlib_fileio_poll(avmlib_fileio_t *io, int wait);
+
+#endif /* _AVMLIB_FILEIO_H_ */
@@ -0,0 +1,986 @@
+/**************************************************************************//**
+ * @file avmlib_jit.c
+ *
+ * @brief Baseline x86-64 JIT for hot segments
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Register use in generated code: rbx holds the frame, r13 the
+ * retired count and r14 the budget limit, all callee-saved, so they
+ * survive calls into the helpers here.  rax and rcx are scratch.
+ * */
+#ifndef _AVMLIB_JIT_C_
+#define _AVMLIB_JIT_C_
+
+#include "avmlib.h"
+#include <errno.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(AVM_NOJIT) || !defined(__x86_64__)
+
+/**************************************************************************//**
+ * @brief Turn the JIT on or off.  (Not built in.)
+ * */
+void
+avmlib_jit_enable(
+    int on
+)
+{
+}
+
+/**************************************************************************//**
+ * @brief Is the JIT on?  (Not built in.)
+ * */
+int
+avmlib_jit_enabled(void)
+{
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Compile a segment.  (Not built in.)
+ *
+ * @returns -1 (errno ENOTSUP).
+ * */
+int
+avmlib_jit_compile(
+    class_segment_t *seg
+)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+#else
+
+/**
+ * Most REGISTERs and NUMBERs one segment's frame holds
+ */
+#define AVMLIB_JIT_SLOTS 4096
+
+/**
+ * What a slot holds
+ */
+#define AVMLIB_JIT_REG 0 /* Machine REGISTER */
+#define AVMLIB_JIT_GNUM 1 /* Machine NUMBER */
+#define AVMLIB_JIT_LNUM 2 /* Segment NUMBER */
+#define AVMLIB_JIT_KINDS 3
+#define AVMLIB_JIT_IMM (-2) /* Not a slot: a constant */
+#define AVMLIB_JIT_OTHER (-1) /* Not a slot: only the interpreter can use it */
+
+/**
+ * How the code uses a slot
+ */
+#define AVMLIB_JIT_READ 0x01
+#define AVMLIB_JIT_WRITE 0x02
+
+/**
+ * Out-of-line code at the end of every function
+ */
+#define AVMLIB_JIT_STUB_EXIT 0 /* Stop; esi = pc, edx = status */
+#define AVMLIB_JIT_STUB_EPILOGUE 1 /* Return eax */
+#define AVMLIB_JIT_STUB_DECLINE 2 /* Return AVMLIB_VM_NATIVE_DECLINE */
+#define AVMLIB_JIT_STUB_RC 3 /* Return frame->rc */
+#define AVMLIB_JIT_STUBS 4
+
+/**
+ * A decoded operand
+ */
+typedef struct {
+    uint32_t e; /* Entity word */
+    uint32_t index; /* Table index (entities) */
+    int64_t imm; /* Value (immediates) */
+} avmlib_jit_arg_t;
+
+/**
+ * A frame slot
+ */
+typedef struct {
+    uint8_t kind; /* AVMLIB_JIT_REG... */
+    uint8_t use; /* AVMLIB_JIT_READ | AVMLIB_JIT_WRITE */
+    uint32_t index; /* Entity index */
+} avmlib_jit_slot_t;
+
+/**
+ * A compiled segment (its native_handle)
+ */
+typedef struct {
+    uint8_t *code; /* Executable mapping */
+    size_t size; /* Bytes mapped */
+    uint32_t words; /* Segment code words */
+    uint32_t *at; /* Machine code offset of each code word (words + 1), or UINT32_MAX */
+    uint32_t nslots;
+    avmlib_jit_slot_t *slots;
+} avmlib_jit_t;
+
+/**
+ * Generated code's stack frame
+ */
+typedef struct {
+    avmlib_vm_t *vm;
+    const avmlib_vm_native_api_t *api;
+    const avmlib_jit_t *jit;
+    class_segment_t *seg; /* Segment the code is for */
+    avm_store_t *gs; /* Machine store */
+    avm_store_t *ls; /* Segment store, if any slot needs it */
+    uint64_t ret; /* Retired count (r13 while in machine code) */
+    uint64_t limit; /* Budget (r14) */
+    int64_t rc; /* What to return once a helper has stopped the run */
+    int64_t slot[]; /* nslots values, then nslots register pointers */
+} avmlib_jit_frame_t;
+
+/**
+ * A pre-assembled code fragment with at most one field to patch
+ */
+typedef struct {
+    uint8_t len;
+    uint8_t hole; /* Offset of the field */
+    uint8_t width; /* Its size: 0 (none), 1, 4 or 8 */
+    uint8_t bytes[15];
+} avmlib_jit_tmpl_t;
+
+/**
+ * The fragments
+ */
+static const avmlib_jit_tmpl_t
+    /* push rbx; push r13; push r14; sub rsp,FRAME */
+    avmlib_jit_t_prologue = { 12,8,4,{ 0x53,0x41,0x55,0x41,0x56,0x48,0x81,0xEC } },
+    /* mov rbx,rsp; mov rdx,rsi; mov rsi,rdi */
+    avmlib_jit_t_frame = { 9,0,0,{ 0x48,0x89,0xE3,0x48,0x89,0xF2,0x48,0x89,0xFE } },
+    /* mov rdi,rbx */
+    avmlib_jit_t_arg_frame = { 3,0,0,{ 0x48,0x89,0xDF } },
+    /* mov rcx,IMM64 */
+    avmlib_jit_t_rcx_imm = { 10,2,8,{ 0x48,0xB9 } },
+    /* mov rax,IMM64 */
+    avmlib_jit_t_rax_imm = { 10,2,8,{ 0x48,0xB8 } },
+    /* call rax */
+    avmlib_jit_t_call = { 2,0,0,{ 0xFF,0xD0 } },
+    /* test rax,rax; jz REL32 */
+    avmlib_jit_t_jnull = { 9,5,4,{ 0x48,0x85,0xC0,0x0F,0x84 } },
+    /* jmp rax */
+    avmlib_jit_t_jmp_rax = { 2,0,0,{ 0xFF,0xE0 } },
+    /* mov r13,[rbx+DISP32] */
+    avmlib_jit_t_get_ret = { 7,3,4,{ 0x4C,0x8B,0xAB } },
+    /* mov [rbx+DISP32],r13 */
+    avmlib_jit_t_put_ret = { 7,3,4,{ 0x4C,0x89,0xAB } },
+    /* mov r14,[rbx+DISP32] */
+    avmlib_jit_t_get_limit = { 7,3,4,{ 0x4C,0x8B,0xB3 } },
+    /* mov esi,IMM32 */
+    avmlib_jit_t_esi = { 5,1,4,{ 0xBE } },
+    /* mov edx,IMM32 */
+    avmlib_jit_t_edx = { 5,1,4,{ 0xBA } },
+    /* mov eax,IMM32 */
+    avmlib_jit_t_eax = { 5,1,4,{ 0xB8 } },
+    /* mov eax,[rbx+DISP32] */
+    avmlib_jit_t_eax_frame = { 6,2,4,{ 0x8B,0x83 } },
+    /* add rsp,FRAME; pop r14; pop r13; pop rbx; ret */
+    avmlib_jit_t_epilogue = { 13,3,4,{ 0x48,0x81,0xC4,0,0,0,0,0x41,0x5E,0x41,0x5D,0x5B,0xC3 } },
+    /* mov rax,[rbx+DISP32] */
+    avmlib_jit_t_rax_slot = { 7,3,4,{ 0x48,0x8B,0x83 } },
+    /* mov rcx,[rbx+DISP32] */
+    avmlib_jit_t_rcx_slot = { 7,3,4,{ 0x48,0x8B,0x8B } },
+    /* add rax,rcx */
+    avmlib_jit_t_add = { 3,0,0,{ 0x48,0x01,0xC8 } },
+    /* sub rax,rcx */
+    avmlib_jit_t_sub = { 3,0,0,{ 0x48,0x29,0xC8 } },
+    /* mov eax,eax (REGISTERs are 32 bits) */
+    avmlib_jit_t_trunc = { 2,0,0,{ 0x89,0xC0 } },
+    /* mov [rbx+DISP32],rax */
+    avmlib_jit_t_put_slot = { 7,3,4,{ 0x48,0x89,0x83 } },
+    /* inc r13 */
+    avmlib_jit_t_retire = { 3,0,0,{ 0x49,0xFF,0xC5 } },
+    /* test rax,rax; jz REL8 */
+    avmlib_jit_t_skip_zero = { 5,4,1,{ 0x48,0x85,0xC0,0x74 } },
+    /* test rax,rax; jnz REL8 */
+    avmlib_jit_t_skip_nonzero = { 5,4,1,{ 0x48,0x85,0xC0,0x75 } },
+    /* cmp r13,r14; jb REL32 */
+    avmlib_jit_t_jb_budget = { 9,5,4,{ 0x4D,0x39,0xF5,0x0F,0x82 } },
+    /* jmp REL32 */
+    avmlib_jit_t_jmp = { 5,1,4,{ 0xE9 } };
+
+/**
+ * Bytes of a budgeted jump (avmlib_jit_jump()), for skipping one
+ */
+#define AVMLIB_JIT_JUMP_LEN 24
+
+/**
+ * A branch to patch
+ */
+typedef struct {
+    uint32_t at; /* Offset of its rel32 */
+    uint32_t target; /* Code word, or stub */
+    int stub; /* Nonzero if target is an AVMLIB_JIT_STUB_* */
+} avmlib_jit_fixup_t;
+
+/**
+ * Compilation state
+ */
+typedef struct {
+    const table_t *code;
+    const table_t *labels;
+    int regs; /* REGISTERs can live in slots (the segment has no transactions) */
+    uint32_t *slotof[AVMLIB_JIT_KINDS]; /* Slot + 1 by entity index, or 0 */
+    uint32_t nslotof[AVMLIB_JIT_KINDS];
+    avmlib_jit_slot_t *slots;
+    uint32_t nslots;
+    uint32_t *at; /* As avmlib_jit_t.at; before the first pass, 0 marks an instruction */
+    uint32_t stub[AVMLIB_JIT_STUBS];
+    uint8_t *buf; /* Code being built */
+    size_t len, cap;
+    avmlib_jit_fixup_t *fix;
+    uint32_t nfix, capfix;
+    uint32_t frame; /* Frame bytes */
+    uint32_t steps; /* Instructions left to the interpreter */
+    int err;
+} avmlib_jit_build_t;
+
+static int avmlib_jit_on = -1;
+
+/**************************************************************************//**
+ * @brief Turn the JIT on or off for the process.
+ *
+ * @details Overrides AVMLIB_JIT_ENV.  Segments already compiled keep
+ * their code.
+ * */
+void
+avmlib_jit_enable(
+    int on
+)
+{
+    __atomic_store_n(&avmlib_jit_on,on ? 1 : 0,__ATOMIC_RELAXED);
+}
+
+/**************************************************************************//**
+ * @brief Is the JIT on?
+ *
+ * @details Off if AVMLIB_JIT_ENV is set (to anything but "0") when
+ * first asked, unless avmlib_jit_enable() says otherwise.
+ * */
+int
+avmlib_jit_enabled(void)
+{
+    int on = __atomic_load_n(&avmlib_jit_on,__ATOMIC_RELAXED);
+    const char *env;
+
+    if (0 > on) {
+        env = getenv(AVMLIB_JIT_ENV);
+        on = (env && *env && strcmp(env,"0")) ? 0 : 1;
+        __atomic_store_n(&avmlib_jit_on,on,__ATOMIC_RELAXED);
+    }
+    return on;
+}
+
+/*
+ * Runtime helpers, called from generated code
+ */
+
+/**************************************************************************//**
+ * @brief Slot values into the frame.
+ * */
+static void
+avmlib_jit_load(
+    avmlib_jit_frame_t *f
+)
+{
+    const avmlib_jit_t *jit = f->jit;
+    const avmlib_jit_slot_t *s;
+    uint32_t i;
+
+    for (i=0;i<jit->nslots;i++) {
+        s = &jit->slots[i];
+        switch (s->kind) {
+            case AVMLIB_JIT_REG:
+                f->slot[i] = ((class_register_t *)f->slot[jit->nslots + i])->value;
+                break;
+            case AVMLIB_JIT_GNUM:
+                f->slot[i] = f->gs->number_values[s->index];
+                break;
+            case AVMLIB_JIT_LNUM:
+                f->slot[i] = f->ls->number_values[s->index];
+                break;
+        }
+    }
+}
+
+/**************************************************************************//**
+ * @brief Written slot values back to the machine.
+ * */
+static void
+avmlib_jit_spill(
+    avmlib_jit_frame_t *f
+)
+{
+    const avmlib_jit_t *jit = f->jit;
+    const avmlib_jit_slot_t *s;
+    uint32_t i;
+
+    f->vm->retired = f->ret;
+    for (i=0;i<jit->nslots;i++) {
+        s = &jit->slots[i];
+        if (!(s->use & AVMLIB_JIT_WRITE)) continue;
+        switch (s->kind) {
+            case AVMLIB_JIT_REG:
+                ((class_register_t *)f->slot[jit->nslots + i])->value = (uint32_t)f->slot[i];
+                break;
+            case AVMLIB_JIT_GNUM:
+                f->gs->number_values[s->index] = f->slot[i];
+                break;
+            case AVMLIB_JIT_LNUM:
+                f->ls->number_values[s->index] = f->slot[i];
+                break;
+        }
+    }
+}
+
+/**************************************************************************//**
+ * @brief Machine code for a code word, or NULL if it isn't an
+ * instruction.
+ * */
+static inline void *
+avmlib_jit_address(
+    const avmlib_jit_t *jit,
+    uint32_t pc
+)
+{
+    return ((pc > jit->words) || (UINT32_MAX == jit->at[pc])) ? NULL : jit->code + jit->at[pc];
+}
+
+/**************************************************************************//**
+ * @brief Set up the frame.
+ *
+ * @details What lives in slots must be plain memory the instance owns:
+ * registers without getters or setters and no transaction open, and
+ * NUMBERs in stores it may write.
+ *
+ * @returns Where to start, or NULL to decline.
+ * */
+static void *
+avmlib_jit_enter(
+    avmlib_jit_frame_t *f,
+    avmlib_vm_t *vm,
+    const avmlib_vm_native_api_t *api,
+    const avmlib_jit_t *jit
+)
+{
+    const avmlib_jit_slot_t *s;
+    class_register_t *reg;
+    int gwrite = 0, lwrite = 0, mode;
+    uint32_t i;
+
+    f->vm = vm;
+    f->api = api;
+    f->jit = jit;
+    f->seg = vm->proc.segment;
+    f->gs = &vm->avm->store;
+    f->ls = NULL;
+    f->ret = vm->retired;
+    f->limit = vm->limit;
+    f->rc = AVMLIB_VM_NATIVE_DECLINE;
+
+    for (i=0;i<jit->nslots;i++) {
+        s = &jit->slots[i];
+        switch (s->kind) {
+            case AVMLIB_JIT_REG:
+                mode = ((s->use & AVMLIB_JIT_READ) ? REGMODE_READ : 0) |
+                       ((s->use & AVMLIB_JIT_WRITE) ? REGMODE_WRITE : 0);
+                if (vm->txn.depth ||
+                    (NULL == (reg = api->own(vm->avm,AVM_CLASS_REGISTER,s->index))) ||
+                    reg->get || reg->set || ((reg->mode & mode) != mode)) {
+                    return NULL;
+                }
+                f->slot[jit->nslots + i] = (int64_t)(intptr_t)reg;
+                break;
+            case AVMLIB_JIT_GNUM:
+                if (s->index >= f->gs->number_count) return NULL;
+                if (s->use & AVMLIB_JIT_WRITE) gwrite = 1;
+                break;
+            case AVMLIB_JIT_LNUM:
+                if ((!f->ls && (NULL == (f->ls = api->local_store(vm->avm,f->seg)))) ||
+                    (s->index >= f->ls->number_count)) {
+                    return NULL;
+                }
+                if (s->use & AVMLIB_JIT_WRITE) lwrite = 1;
+                break;
+        }
+    }
+    if ((gwrite && api->store_own(f->gs)) || (lwrite && api->store_own(f->ls))) return NULL;
+
+    avmlib_jit_load(f);
+    return avmlib_jit_address(jit,vm->pc);
+}
+
+/**************************************************************************//**
+ * @brief Stop the run.
+ *
+ * @returns status
+ * */
+static int
+avmlib_jit_exit(
+    avmlib_jit_frame_t *f,
+    uint32_t pc,
+    int status
+)
+{
+    avmlib_jit_spill(f);
+    f->vm->pc = pc;
+    f->vm->status = (avmlib_vm_status_t)status;
+    return status;
+}
+
+/**************************************************************************//**
+ * @brief Have the interpreter execute one instruction.
+ *
+ * @returns Where to carry on, or NULL to return f->rc.
+ * */
+static void *
+avmlib_jit_step(
+    avmlib_jit_frame_t *f,
+    uint32_t pc
+)
+{
+    avmlib_vm_t *vm = f->vm;
+    void *next;
+    int rc;
+
+    avmlib_jit_spill(f);
+    vm->pc = pc;
+    if ((0 > (rc = f->api->step(vm))) || (vm->proc.segment != f->seg)) {
+        f->rc = vm->status;
+        return NULL;
+    }
+    f->ret = vm->retired;
+    avmlib_jit_load(f);
+    if (rc && (f->ret >= f->limit)) {
+        vm->status = AVMLIB_VM_YIELDED;
+        f->rc = vm->status;
+        return NULL;
+    }
+    if (NULL == (next = avmlib_jit_address(f->jit,vm->pc))) f->rc = AVMLIB_VM_NATIVE_DECLINE;
+    return next;
+}
+
+/*
+ * Compiler
+ */
+
+/**************************************************************************//**
+ * @brief Append a fragment.
+ *
+ * @returns Offset of its field.
+ * */
+static uint32_t
+avmlib_jit_emit(
+    avmlib_jit_build_t *b,
+    const avmlib_jit_tmpl_t *t,
+    uint64_t value
+)
+{
+    uint8_t *buf;
+    size_t cap;
+
+    if (b->len + t->len > b->cap) {
+        cap = b->cap ? b->cap * 2 : 4096;
+        if (NULL == (buf = realloc(b->buf,cap))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            b->err = 1;
+            return 0;
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len,t->bytes,t->len);
+    memcpy(b->buf + b->len + t->hole,&value,t->width); /* Little-endian */
+    b->len += t->len;
+    return (uint32_t)(b->len - t->len + t->hole);
+}
+
+/**************************************************************************//**
+ * @brief Append a fragment ending in a rel32 branch, to patch later.
+ * */
+static void
+avmlib_jit_branch(
+    avmlib_jit_build_t *b,
+    const avmlib_jit_tmpl_t *t,
+    uint32_t target,
+    int stub
+)
+{
+    avmlib_jit_fixup_t *fix;
+    uint32_t at = avmlib_jit_emit(b,t,0);
+
+    if (b->nfix == b->capfix) {
+        if (NULL == (fix = realloc(b->fix,sizeof(*fix) * (b->capfix ? b->capfix * 2 : 64)))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            b->err = 1;
+            return;
+        }
+        b->fix = fix;
+        b->capfix = b->capfix ? b->capfix * 2 : 64;
+    }
+    b->fix[b->nfix].at = at;
+    b->fix[b->nfix].target = target;
+    b->fix[b->nfix].stub = stub;
+    b->nfix++;
+}
+
+/**************************************************************************//**
+ * @brief Call a helper: mov rax,FN; call rax.
+ * */
+static void
+avmlib_jit_call(
+    avmlib_jit_build_t *b,
+    void *fn
+)
+{
+    avmlib_jit_emit(b,&avmlib_jit_t_rax_imm,(uint64_t)(uintptr_t)fn);
+    avmlib_jit_emit(b,&avmlib_jit_t_call,0);
+}
+
+/**************************************************************************//**
+ * @brief What an operand is to the generated code.
+ *
+ * @returns AVMLIB_JIT_REG... for slots, AVMLIB_JIT_IMM, or
+ * AVMLIB_JIT_OTHER.
+ * */
+static int
+avmlib_jit_kind(
+    const avmlib_jit_build_t *b,
+    const avmlib_jit_arg_t *a
+)
+{
+    switch (avmlib_entity_class(a->e)) {
+        case AVM_CLASS_IMMEDIATE:
+            return AVMLIB_JIT_IMM;
+        case AVM_CLASS_REGISTER:
+            return (b->regs && !(a->e & OP_FLAG_LOCAL)) ? AVMLIB_JIT_REG : AVMLIB_JIT_OTHER;
+        case AVM_CLASS_NUMBER:
+            return (a->e & OP_FLAG_LOCAL) ? AVMLIB_JIT_LNUM : AVMLIB_JIT_GNUM;
+    }
+    return AVMLIB_JIT_OTHER;
+}
+
+/**************************************************************************//**
+ * @brief Frame offset of an operand's slot, making the slot if need be.
+ * */
+static uint32_t
+avmlib_jit_slot(
+    avmlib_jit_build_t *b,
+    const avmlib_jit_arg_t *a,
+    int how
+)
+{
+    int kind = avmlib_jit_kind(b,a);
+    avmlib_jit_slot_t *slots;
+    uint32_t *map, n;
+
+    /* Step 1: Index to slot */
+    if (a->index >= b->nslotof[kind]) {
+        n = a->index + 1;
+        if (NULL == (map = realloc(b->slotof[kind],sizeof(*map) * n))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            b->err = 1;
+            return 0;
+        }
+        memset(map + b->nslotof[kind],0,sizeof(*map) * (n - b->nslotof[kind]));
+        b->slotof[kind] = map;
+        b->nslotof[kind] = n;
+    }
+
+    /* Step 2: New slot */
+    if (!b->slotof[kind][a->index]) {
+        if ((b->nslots >= AVMLIB_JIT_SLOTS) ||
+            (NULL == (slots = realloc(b->slots,sizeof(*slots) * (b->nslots + 1))))) {
+            avmlib_err("%s: Too many slots.\n",__func__);
+            b->err = 1;
+            return 0;
+        }
+        b->slots = slots;
+        b->slots[b->nslots].kind = (uint8_t)kind;
+        b->slots[b->nslots].use = 0;
+        b->slots[b->nslots].index = a->index;
+        b->slotof[kind][a->index] = ++b->nslots;
+    }
+
+    n = b->slotof[kind][a->index] - 1;
+    b->slots[n].use |= (uint8_t)how;
+    return (uint32_t)(offsetof(avmlib_jit_frame_t,slot) + n * sizeof(int64_t));
+}
+
+/**************************************************************************//**
+ * @brief Operand into rax (or rcx).
+ * */
+static void
+avmlib_jit_get(
+    avmlib_jit_build_t *b,
+    const avmlib_jit_arg_t *a,
+    int rcx
+)
+{
+    if (AVMLIB_JIT_IMM == avmlib_jit_kind(b,a)) {
+        avmlib_jit_emit(b,rcx ? &avmlib_jit_t_rcx_imm : &avmlib_jit_t_rax_imm,(uint64_t)a->imm);
+    } else {
+        avmlib_jit_emit(b,rcx ? &avmlib_jit_t_rcx_slot : &avmlib_jit_t_rax_slot,
+                        avmlib_jit_slot(b,a,AVMLIB_JIT_READ));
+    }
+}
+
+/**************************************************************************//**
+ * @brief rax into an operand.
+ * */
+static void
+avmlib_jit_put(
+    avmlib_jit_build_t *b,
+    const avmlib_jit_arg_t *a
+)
+{
+    if (AVMLIB_JIT_REG == avmlib_jit_kind(b,a)) avmlib_jit_emit(b,&avmlib_jit_t_trunc,0);
+    avmlib_jit_emit(b,&avmlib_jit_t_put_slot,avmlib_jit_slot(b,a,AVMLIB_JIT_WRITE));
+}
+
+/**************************************************************************//**
+ * @brief Taken jump: straight to the target while there's budget,
+ * else yield there (AVMLIB_JIT_JUMP_LEN bytes).
+ * */
+static void
+avmlib_jit_jump(
+    avmlib_jit_build_t *b,
+    uint32_t target
+)
+{
+    avmlib_jit_branch(b,&avmlib_jit_t_jb_budget,target,0);
+    avmlib_jit_emit(b,&avmlib_jit_t_esi,target);
+    avmlib_jit_emit(b,&avmlib_jit_t_edx,AVMLIB_VM_YIELDED);
+    avmlib_jit_branch(b,&avmlib_jit_t_jmp,AVMLIB_JIT_STUB_EXIT,1);
+}
+
+/**************************************************************************//**
+ * @brief Where a jump operand goes, if it can be a direct branch.
+ *
+ * @returns 0 with *pc set, or -1 if the interpreter must take it.
+ * */
+static int
+avmlib_jit_target(
+    const avmlib_jit_build_t *b,
+    const avmlib_jit_arg_t *a,
+    uint32_t *pc
+)
+{
+    const class_label_t *lbl;
+
+    if ((AVM_CLASS_LABEL != avmlib_entity_class(a->e)) || !(a->e & OP_FLAG_LOCAL) ||
+        (a->index >= b->labels->size)) {
+        return -1;
+    }
+    lbl = (const class_label_t *)b->labels->entries[a->index];
+    if ((lbl->offset > b->code->size) || (UINT32_MAX == b->at[lbl->offset])) return -1;
+    *pc = lbl->offset;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Compile one instruction.
+ * */
+static void
+avmlib_jit_insn(
+    avmlib_jit_build_t *b,
+    uint32_t pc,
+    uint32_t op,
+    uint32_t argc,
+    const avmlib_jit_arg_t *args
+)
+{
+    static const avmlib_jit_arg_t one = { (uint32_t)AVM_CLASS_IMMEDIATE << 24,0,1 };
+    const avmlib_jit_arg_t *src, *dst;
+    uint32_t target;
+
+    b->at[pc] = (uint32_t)b->len;
+    switch (op) {
+        case AVM_OP_NOP:
+            avmlib_jit_emit(b,&avmlib_jit_t_retire,0);
+            return;
+        case AVM_OP_STOR:
+            if ((argc < 2) || (AVMLIB_JIT_OTHER == avmlib_jit_kind(b,&args[1])) ||
+                (0 > avmlib_jit_kind(b,&args[0]))) {
+                break;
+            }
+            avmlib_jit_get(b,&args[1],0);
+            avmlib_jit_put(b,&args[0]);
+            avmlib_jit_emit(b,&avmlib_jit_t_retire,0);
+            return;
+        case AVM_OP_ADD:
+        case AVM_OP_SUB:
+            if ((argc < 1) || (argc > 3)) break;
+            src = (argc > 1) ? &args[1] : &one;
+            dst = &args[(argc > 2) ? 2 : 0];
+            if ((AVMLIB_JIT_OTHER == avmlib_jit_kind(b,&args[0])) ||
+                (AVMLIB_JIT_OTHER == avmlib_jit_kind(b,src)) ||
+                (0 > avmlib_jit_kind(b,dst))) {
+                break;
+            }
+            avmlib_jit_get(b,&args[0],0);
+            avmlib_jit_get(b,src,1);
+            avmlib_jit_emit(b,(AVM_OP_ADD == op) ? &avmlib_jit_t_add : &avmlib_jit_t_sub,0);
+            avmlib_jit_put(b,dst);
+            avmlib_jit_emit(b,&avmlib_jit_t_retire,0);
+            return;
+        case AVM_OP_GOTO:
+            if ((argc != 1) || (0 > avmlib_jit_target(b,&args[0],&target))) break;
+            avmlib_jit_emit(b,&avmlib_jit_t_retire,0);
+            avmlib_jit_jump(b,target);
+            return;
+        case AVM_OP_JZ:
+        case AVM_OP_JNZ:
+            if ((argc != 2) || (AVMLIB_JIT_OTHER == avmlib_jit_kind(b,&args[0])) ||
+                (0 > avmlib_jit_target(b,&args[1],&target))) {
+                break;
+            }
+            avmlib_jit_get(b,&args[0],0);
+            avmlib_jit_emit(b,&avmlib_jit_t_retire,0);
+            avmlib_jit_emit(b,(AVM_OP_JZ == op) ? &avmlib_jit_t_skip_nonzero : &avmlib_jit_t_skip_zero,
+                            AVMLIB_JIT_JUMP_LEN);
+            avmlib_jit_jump(b,target);
+            return;
+    }
+
+    /* Anything else: the interpreter does it, then says where to go */
+    avmlib_jit_emit(b,&avmlib_jit_t_put_ret,offsetof(avmlib_jit_frame_t,ret));
+    avmlib_jit_emit(b,&avmlib_jit_t_arg_frame,0);
+    avmlib_jit_emit(b,&avmlib_jit_t_esi,pc);
+    avmlib_jit_call(b,(void *)avmlib_jit_step);
+    avmlib_jit_branch(b,&avmlib_jit_t_jnull,AVMLIB_JIT_STUB_RC,1);
+    avmlib_jit_emit(b,&avmlib_jit_t_get_ret,offsetof(avmlib_jit_frame_t,ret));
+    avmlib_jit_emit(b,&avmlib_jit_t_jmp_rax,0);
+    b->steps++;
+}
+
+/**************************************************************************//**
+ * @brief Decode the instruction at a code word.
+ *
+ * @returns Code words it occupies, or -1 if it isn't well-formed.
+ * */
+static int
+avmlib_jit_decode(
+    const table_t *code,
+    uint32_t pc,
+    uint32_t *op,
+    uint32_t *argc,
+    avmlib_jit_arg_t *args
+)
+{
+    uint32_t word = (uint32_t)code->entries[pc], n, at = pc + 1, w;
+
+    *op = (word >> 16) & 0xFF;
+    *argc = word & 0xFF;
+    if ((AVM_CLASS_INSTRUCTION != avmlib_entity_class(word)) || (*argc > AVMLIB_VM_ARGS)) return -1;
+    for (n=0;n<*argc;n++,at+=w) {
+        if (at >= code->size) return -1;
+        w = avmlib_operand_words(&code->entries[at]);
+        if (at + w > code->size) return -1;
+        args[n].e = (uint32_t)code->entries[at];
+        if (AVM_CLASS_IMMEDIATE == avmlib_entity_class(args[n].e)) {
+            avmlib_immediate_decode(&code->entries[at],&args[n].imm);
+        } else {
+            avmlib_entity_decode(&code->entries[at],&args[n].index);
+        }
+    }
+    return (int)(at - pc);
+}
+
+/**************************************************************************//**
+ * @brief Compile the whole segment into b->buf.
+ *
+ * @details Run twice: the first pass finds the slots (and so the
+ * frame size), the second is kept.  Anything undecodable is left to
+ * the interpreter, which will report it, and ends the code.
+ * */
+static void
+avmlib_jit_pass(
+    avmlib_jit_build_t *b
+)
+{
+    avmlib_jit_arg_t args[AVMLIB_VM_ARGS];
+    uint32_t pc, op, argc, i, target;
+    int32_t rel;
+    int words;
+
+    b->len = 0;
+    b->nfix = 0;
+    b->steps = 0;
+
+    /* Step 1: Entry: set up the frame, then jump to the instance's pc */
+    avmlib_jit_emit(b,&avmlib_jit_t_prologue,b->frame);
+    avmlib_jit_emit(b,&avmlib_jit_t_frame,0);
+    avmlib_jit_emit(b,&avmlib_jit_t_arg_frame,0);
+    avmlib_jit_emit(b,&avmlib_jit_t_rcx_imm,0); /* The avmlib_jit_t, patched in once made */
+    avmlib_jit_call(b,(void *)avmlib_jit_enter);
+    avmlib_jit_branch(b,&avmlib_jit_t_jnull,AVMLIB_JIT_STUB_DECLINE,1);
+    avmlib_jit_emit(b,&avmlib_jit_t_get_ret,offsetof(avmlib_jit_frame_t,ret));
+    avmlib_jit_emit(b,&avmlib_jit_t_get_limit,offsetof(avmlib_jit_frame_t,limit));
+    avmlib_jit_emit(b,&avmlib_jit_t_jmp_rax,0);
+
+    /* Step 2: The code */
+    for (pc=0;pc<b->code->size;pc+=(uint32_t)words) {
+        if (0 > (words = avmlib_jit_decode(b->code,pc,&op,&argc,args))) {
+            avmlib_jit_insn(b,pc,AVM_OP_INVALID,0,args);
+            break;
+        }
+        avmlib_jit_insn(b,pc,op,argc,args);
+    }
+    b->at[b->code->size] = (uint32_t)b->len;
+    avmlib_jit_emit(b,&avmlib_jit_t_esi,b->code->size);
+    avmlib_jit_emit(b,&avmlib_jit_t_edx,AVMLIB_VM_HALTED);
+    avmlib_jit_branch(b,&avmlib_jit_t_jmp,AVMLIB_JIT_STUB_EXIT,1);
+
+    /* Step 3: Stubs */
+    b->stub[AVMLIB_JIT_STUB_EXIT] = (uint32_t)b->len;
+    avmlib_jit_emit(b,&avmlib_jit_t_put_ret,offsetof(avmlib_jit_frame_t,ret));
+    avmlib_jit_emit(b,&avmlib_jit_t_arg_frame,0);
+    avmlib_jit_call(b,(void *)avmlib_jit_exit);
+    b->stub[AVMLIB_JIT_STUB_EPILOGUE] = (uint32_t)b->len;
+    avmlib_jit_emit(b,&avmlib_jit_t_epilogue,b->frame);
+    b->stub[AVMLIB_JIT_STUB_DECLINE] = (uint32_t)b->len;
+    avmlib_jit_emit(b,&avmlib_jit_t_eax,(uint32_t)AVMLIB_VM_NATIVE_DECLINE);
+    avmlib_jit_branch(b,&avmlib_jit_t_jmp,AVMLIB_JIT_STUB_EPILOGUE,1);
+    b->stub[AVMLIB_JIT_STUB_RC] = (uint32_t)b->len;
+    avmlib_jit_emit(b,&avmlib_jit_t_eax_frame,offsetof(avmlib_jit_frame_t,rc));
+    avmlib_jit_branch(b,&avmlib_jit_t_jmp,AVMLIB_JIT_STUB_EPILOGUE,1);
+
+    /* Step 4: Patch branches */
+    for (i=0;!b->err && (i<b->nfix);i++) {
+        target = b->fix[i].stub ? b->stub[b->fix[i].target] : b->at[b->fix[i].target];
+        rel = (int32_t)target - (int32_t)(b->fix[i].at + 4);
+        memcpy(b->buf + b->fix[i].at,&rel,sizeof(rel));
+    }
+}
+
+/**************************************************************************//**
+ * @brief Release a compiled segment.
+ * */
+static void
+avmlib_jit_release(
+    void *handle
+)
+{
+    avmlib_jit_t *jit = (avmlib_jit_t *)handle;
+
+    munmap(jit->code,jit->size);
+    free(jit->at);
+    free(jit->slots);
+    free(jit);
+}
+
+/**************************************************************************//**
+ * @brief Compile a segment.
+ *
+ * @details Each segment version is tried once; later calls return at
+ * once.  The code is attached to the segment (class_segment_t.native)
+ * for every instance of the machine to use.  A segment that already
+ * has native code (avmlib_aot_load()) is left alone.
+ *
+ * @returns 0 if the segment has native code, -1 if not (errno set).
+ * */
+int
+avmlib_jit_compile(
+    class_segment_t *seg
+)
+{
+    avmlib_jit_build_t b;
+    avmlib_jit_t *jit = NULL;
+    avmlib_jit_arg_t args[AVMLIB_VM_ARGS];
+    uint32_t tried = 0, pc, op, argc, i;
+    void *none = NULL;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    int words, k, rc = -1;
+
+    if (!avmlib_jit_enabled()) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (!__atomic_compare_exchange_n(&seg->jit_tried,&tried,1,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&seg->native,__ATOMIC_ACQUIRE)) {
+        return __atomic_load_n(&seg->native,__ATOMIC_ACQUIRE) ? 0 : -1;
+    }
+
+    memset(&b,0,sizeof(b));
+    b.code = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    b.labels = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    b.regs = 1;
+
+    /* Step 1: Where instructions start, and whether there are transactions */
+    if (NULL == (b.at = malloc(sizeof(*b.at) * (b.code->size + 1)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return -1;
+    }
+    for (i=0;i<=b.code->size;i++) b.at[i] = UINT32_MAX;
+    for (pc=0;pc<b.code->size;pc+=(uint32_t)words) {
+        b.at[pc] = 0;
+        if (0 > (words = avmlib_jit_decode(b.code,pc,&op,&argc,args))) break;
+        if ((AVM_OP_BEGIN == op) || (AVM_OP_COMMIT == op)) b.regs = 0;
+    }
+    b.at[b.code->size] = 0;
+
+    /* Step 2: Find the slots, then compile for real */
+    avmlib_jit_pass(&b);
+    b.frame = (uint32_t)((offsetof(avmlib_jit_frame_t,slot) + 2 * sizeof(int64_t) * b.nslots + 15) & ~15);
+    if (!b.err) avmlib_jit_pass(&b);
+    if (b.err) goto _avmlib_jit_compile_out;
+
+    /* Step 3: Make it executable */
+    if (NULL == (jit = calloc(1,sizeof(*jit)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        goto _avmlib_jit_compile_out;
+    }
+    jit->size = (b.len + page - 1) & ~(page - 1);
+    jit->words = b.code->size;
+    jit->nslots = b.nslots;
+    memcpy(b.buf + avmlib_jit_t_prologue.len + avmlib_jit_t_frame.len + avmlib_jit_t_arg_frame.len +
+           avmlib_jit_t_rcx_imm.hole,&jit,sizeof(jit));
+    if (MAP_FAILED == (jit->code = mmap(NULL,jit->size,PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS,-1,0))) {
+        avmlib_err("%s: Can't map code (%s).\n",__func__,strerror(errno));
+        free(jit);
+        jit = NULL;
+        goto _avmlib_jit_compile_out;
+    }
+    memcpy(jit->code,b.buf,b.len);
+    if (mprotect(jit->code,jit->size,PROT_READ | PROT_EXEC)) {
+        avmlib_err("%s: Can't make code executable (%s).\n",__func__,strerror(errno));
+        munmap(jit->code,jit->size);
+        free(jit);
+        jit = NULL;
+        goto _avmlib_jit_compile_out;
+    }
+    jit->at = b.at;
+    jit->slots = b.slots;
+    b.at = NULL;
+    b.slots = NULL;
+
+    /* Step 4: Attach (unless native code beat us to it) */
+    if (!__atomic_compare_exchange_n(&seg->native,&none,(void *)jit->code,0,
+                                     __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+        avmlib_jit_release(jit);
+        rc = 0;
+        goto _avmlib_jit_compile_out;
+    }
+    seg->native_handle = jit;
+    seg->native_release = avmlib_jit_release;
+    avmlib_perf_segment(seg,jit->code,b.len,jit->at);
+    avm_dbg(2,"AVMLIB","JIT: segment %u (\"%s\"): %zu bytes, %u slots, %u instructions interpreted.\n",
+            seg->id,avmm_entity_name(seg),b.len,b.nslots,b.steps);
+    rc = 0;
+
+_avmlib_jit_compile_out:
+    for (k=0;k<AVMLIB_JIT_KINDS;k++) free(b.slotof[k]);
+    free(b.slots);
+    free(b.at);
+    free(b.buf);
+    free(b.fix);
+    return rc;
+}
+
+#endif /* AVM_NOJIT */
+
+#endif /* _AVMLIB_JIT_C_ */
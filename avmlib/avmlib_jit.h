@@ -0,0 +1,48 @@
+/**************************************************************************//**
+ * @file avmlib_jit.h
+ *
+ * @brief Baseline x86-64 JIT for hot segments.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * When an instance has taken AVMLIB_JIT_HOT branches in a segment
+ * without leaving it, avmlib_vm_run() compiles the segment (once; all
+ * instances share the result) and runs the machine code from then on.
+ *
+ * The JIT is a template compiler: each instruction it handles is
+ * stitched together from pre-assembled x86-64 fragments, one per
+ * operation and operand class, with their displacements and immediates
+ * patched in; jumps to the segment's own labels are patched into
+ * direct branches once every instruction's address is known.  The
+ * REGISTERs and NUMBERs the code does arithmetic on live in slots in
+ * the machine code's stack frame.  Anything else goes to the
+ * interpreter one instruction at a time, exactly as with ahead-of-time
+ * code (avmlib_aot.h), and the generated function has the same
+ * contract (avmlib_vm_native_fn).
+ *
+ * Set AVM_NOJIT in the environment (or call avmlib_jit_enable()) to
+ * turn it off at run time, or build with -DAVM_NOJIT to leave it out.
+ * It is also left out on anything but x86-64.
+ * */
+#ifndef _AVMLIB_JIT_H_
+#define _AVMLIB_JIT_H_
+
+#include "avmm_data.h"
+
+/**
+ * Taken branches in one segment before an instance JITs it
+ */
+#define AVMLIB_JIT_HOT 1000
+
+/**
+ * Environment variable that turns the JIT off
+ */
+#define AVMLIB_JIT_ENV "AVM_NOJIT"
+
+/* Prototypes */
+void avmlib_jit_enable(int on);
+int avmlib_jit_enabled(void);
+int avmlib_jit_compile(class_segment_t *seg);
+
+#endif /* _AVMLIB_JIT_H_ */
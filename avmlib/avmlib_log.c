@@ -10,12 +10,64 @@
 #define _AVMLIB_LOG_C_ 
 
 #include "avmlib_log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 /*
  * Configured targets
  */
 FILE *avmlib_logfile = NULL;
 FILE *avmlib_errfile = NULL;
+__thread FILE *avmlib_logfile_thread = NULL;
+__thread FILE *avmlib_errfile_thread = NULL;
+
+/**
+ * Most full buffers waiting for the writer; past this, threads logging
+ * wait for it to catch up
+ */
+#define AVMLIB_LOG_MAX_QUEUED 256
+
+/**
+ * Formatted messages for one target
+ */
+typedef struct avmlib_log_buf_s {
+    struct avmlib_log_buf_s *next; /* In the queue or the free list */
+    FILE *target;
+    size_t size; /* Bytes data holds (AVMLIB_LOG_BUF_SIZE, or more for one long message) */
+    size_t len; /* Bytes used */
+    char data[];
+} avmlib_log_buf_t;
+
+/**
+ * A thread that has logged asynchronously
+ */
+typedef struct avmlib_log_thread_s {
+    pthread_mutex_t lock; /* Its thread holds it to append, the writer to take buf */
+    avmlib_log_buf_t *buf; /* Being filled, or NULL */
+    struct avmlib_log_thread_s *next;
+} avmlib_log_thread_t;
+
+static int avmlib_log_async_on;
+static __thread avmlib_log_thread_t *avmlib_log_me;
+
+/* Everything below is guarded by the lock */
+static pthread_mutex_t avmlib_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t avmlib_log_work = PTHREAD_COND_INITIALIZER; /* Queue filled, or stop */
+static pthread_cond_t avmlib_log_done = PTHREAD_COND_INITIALIZER; /* Queue drained */
+static pthread_t avmlib_log_writer;
+static int avmlib_log_running, avmlib_log_stop, avmlib_log_exit_set;
+static pthread_key_t avmlib_log_key;
+static avmlib_log_thread_t *avmlib_log_threads; /* Every thread that has logged */
+static avmlib_log_buf_t *avmlib_log_head, *avmlib_log_tail; /* Waiting to be written */
+static uint32_t avmlib_log_queued;
+static uint64_t avmlib_log_total, avmlib_log_written; /* Buffers ever queued, and written */
+static avmlib_log_buf_t *avmlib_log_free; /* Spare standard-size buffers */
 
 /**************************************************************************//**
  * @brief Set the current error target
@@ -71,5 +123,375 @@ avmlib_log_set_log(
     return avmlib_logfile;
 }
 
+/**************************************************************************//**
+ * @brief Set the calling thread's own log and error targets
+ *
+ * @details Messages printed by this thread go to these instead of the
+ * process-wide targets.
+ *
+ * @param log Log target for this thread, or NULL to use the process's
+ * @param err Error target for this thread, or NULL to use the process's
+ * */
+void
+avmlib_log_set_thread(
+    FILE *log,
+    FILE *err
+)
+{
+    avmlib_logfile_thread = log;
+    avmlib_errfile_thread = err;
+}
+
+/**************************************************************************//**
+ * @brief Hand a buffer to the writer.
+ *
+ * @remarks Caller holds the lock.
+ * */
+static void
+avmlib_log_queue(
+    avmlib_log_buf_t *buf
+)
+{
+    buf->next = NULL;
+    if (avmlib_log_tail) {
+        avmlib_log_tail->next = buf;
+    } else {
+        avmlib_log_head = buf;
+    }
+    avmlib_log_tail = buf;
+    avmlib_log_queued++;
+    avmlib_log_total++;
+    pthread_cond_signal(&avmlib_log_work);
+}
+
+/**************************************************************************//**
+ * @brief Hand every thread's partly-filled buffer to the writer.
+ *
+ * @returns Threads skipped because they were busy appending.
+ *
+ * @remarks Caller holds the lock.  A thread appending holds its own
+ * lock and may be waiting for this one, so they're only tried.
+ * */
+static int
+avmlib_log_collect(void)
+{
+    avmlib_log_thread_t *t;
+    int skipped = 0;
+
+    for (t=avmlib_log_threads;t;t=t->next) {
+        if (pthread_mutex_trylock(&t->lock)) {
+            skipped++;
+            continue;
+        }
+        if (t->buf && t->buf->len) {
+            avmlib_log_queue(t->buf);
+            t->buf = NULL;
+        }
+        pthread_mutex_unlock(&t->lock);
+    }
+    return skipped;
+}
+
+/**************************************************************************//**
+ * @brief The writer thread.
+ * */
+static void *
+avmlib_log_writer_main(
+    void *arg
+)
+{
+    avmlib_log_buf_t *list, *buf;
+    struct timespec until;
+    uint32_t n;
+
+    pthread_mutex_lock(&avmlib_log_lock);
+    for (;;) {
+        /* Step 1: Wait for full buffers, or for the interval */
+        if (!avmlib_log_head && !avmlib_log_stop) {
+            clock_gettime(CLOCK_REALTIME,&until);
+            until.tv_nsec += AVMLIB_LOG_ASYNC_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            if (ETIMEDOUT == pthread_cond_timedwait(&avmlib_log_work,&avmlib_log_lock,&until)) {
+                avmlib_log_collect();
+            }
+        }
+        if (!avmlib_log_head) {
+            pthread_cond_broadcast(&avmlib_log_done);
+            if (avmlib_log_stop) break;
+            continue;
+        }
+
+        /* Step 2: Write them, in order, without the lock */
+        list = avmlib_log_head;
+        n = avmlib_log_queued;
+        avmlib_log_head = avmlib_log_tail = NULL;
+        avmlib_log_queued = 0;
+        pthread_cond_broadcast(&avmlib_log_done); /* Room in the queue */
+        pthread_mutex_unlock(&avmlib_log_lock);
+        for (buf=list;buf;buf=buf->next) {
+            fwrite(buf->data,1,buf->len,buf->target);
+            if (!buf->next || (buf->next->target != buf->target)) fflush(buf->target);
+        }
+        pthread_mutex_lock(&avmlib_log_lock);
+        avmlib_log_written += n;
+        pthread_cond_broadcast(&avmlib_log_done);
+
+        /* Step 3: Keep standard buffers for reuse */
+        while (NULL != (buf = list)) {
+            list = buf->next;
+            if (AVMLIB_LOG_BUF_SIZE != buf->size) {
+                free(buf);
+                continue;
+            }
+            buf->next = avmlib_log_free;
+            avmlib_log_free = buf;
+        }
+    }
+    pthread_mutex_unlock(&avmlib_log_lock);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Forget a thread that's exiting, handing on what it logged.
+ * */
+static void
+avmlib_log_thread_exit(
+    void *arg
+)
+{
+    avmlib_log_thread_t *me = arg, **t;
+
+    pthread_mutex_lock(&me->lock);
+    pthread_mutex_lock(&avmlib_log_lock);
+    if (me->buf) {
+        if (me->buf->len) {
+            avmlib_log_queue(me->buf);
+        } else {
+            free(me->buf);
+        }
+    }
+    for (t=&avmlib_log_threads;*t && (*t != me);t=&(*t)->next);
+    if (*t) *t = me->next;
+    pthread_mutex_unlock(&avmlib_log_lock);
+    pthread_mutex_unlock(&me->lock);
+    pthread_mutex_destroy(&me->lock);
+    free(me);
+}
+
+/**************************************************************************//**
+ * @brief Print what's left at exit.
+ * */
+static void
+avmlib_log_at_exit(void)
+{
+    avmlib_log_async(0);
+}
+
+/**************************************************************************//**
+ * @brief Get a buffer for the calling thread.
+ *
+ * @param need Bytes the message needs
+ *
+ * @returns The buffer, or NULL on alloc failure.
+ *
+ * @remarks Caller holds the lock.
+ * */
+static avmlib_log_buf_t *
+avmlib_log_buf_get(
+    FILE *target,
+    size_t need
+)
+{
+    avmlib_log_buf_t *buf;
+    size_t size = (need > AVMLIB_LOG_BUF_SIZE) ? need : AVMLIB_LOG_BUF_SIZE;
+
+    if ((AVMLIB_LOG_BUF_SIZE == size) && avmlib_log_free) {
+        buf = avmlib_log_free;
+        avmlib_log_free = buf->next;
+    } else if (NULL == (buf = malloc(sizeof(*buf) + size))) {
+        return NULL;
+    }
+    buf->next = NULL;
+    buf->target = target;
+    buf->size = size;
+    buf->len = 0;
+    return buf;
+}
+
+/**************************************************************************//**
+ * @brief Print a log or debug message.
+ *
+ * @details Synchronously, or into the calling thread's buffer while
+ * async output is on.  avm_log() and avm_dbg() call this once they've
+ * decided the message is wanted.
+ *
+ * @param target Where it goes
+ * @param format printf() format
+ * */
+void
+avmlib_log_print(
+    FILE *target,
+    const char *format,
+    ...
+)
+{
+    avmlib_log_thread_t *me = avmlib_log_me;
+    avmlib_log_buf_t *buf;
+    va_list ap;
+    int n;
+
+    /* Step 1: Synchronous output */
+    if (!__atomic_load_n(&avmlib_log_async_on,__ATOMIC_ACQUIRE)) {
+        va_start(ap,format);
+        vfprintf(target,format,ap);
+        va_end(ap);
+        return;
+    }
+
+    /* Step 2: This thread's record, made the first time */
+    if (!me) {
+        if (NULL == (me = calloc(1,sizeof(*me)))) {
+            va_start(ap,format);
+            vfprintf(target,format,ap);
+            va_end(ap);
+            return;
+        }
+        pthread_mutex_init(&me->lock,NULL);
+        pthread_mutex_lock(&avmlib_log_lock);
+        me->next = avmlib_log_threads;
+        avmlib_log_threads = me;
+        pthread_mutex_unlock(&avmlib_log_lock);
+        pthread_setspecific(avmlib_log_key,me);
+        avmlib_log_me = me;
+    }
+
+    /* Step 3: Format into its buffer, if the message fits */
+    pthread_mutex_lock(&me->lock);
+    buf = me->buf;
+    if (buf && (buf->target == target)) {
+        va_start(ap,format);
+        n = vsnprintf(buf->data + buf->len,buf->size - buf->len,format,ap);
+        va_end(ap);
+        if ((n >= 0) && ((size_t)n < buf->size - buf->len)) {
+            buf->len += (size_t)n;
+            pthread_mutex_unlock(&me->lock);
+            return;
+        }
+    }
+
+    /* Step 4: Otherwise hand it over and start another */
+    va_start(ap,format);
+    n = vsnprintf(NULL,0,format,ap);
+    va_end(ap);
+    if (n < 0) {
+        pthread_mutex_unlock(&me->lock);
+        return;
+    }
+    pthread_mutex_lock(&avmlib_log_lock);
+    if (buf) {
+        if (buf->len) {
+            avmlib_log_queue(buf);
+        } else {
+            buf->next = avmlib_log_free;
+            avmlib_log_free = buf;
+        }
+    }
+    while ((avmlib_log_queued >= AVMLIB_LOG_MAX_QUEUED) && avmlib_log_running) {
+        pthread_cond_wait(&avmlib_log_done,&avmlib_log_lock);
+    }
+    me->buf = buf = avmlib_log_buf_get(target,(size_t)n + 1);
+    pthread_mutex_unlock(&avmlib_log_lock);
+    if (!buf) {
+        pthread_mutex_unlock(&me->lock);
+        return;
+    }
+    va_start(ap,format);
+    vsnprintf(buf->data,buf->size,format,ap);
+    va_end(ap);
+    buf->len = (size_t)n;
+    pthread_mutex_unlock(&me->lock);
+}
+
+/**************************************************************************//**
+ * @brief Turn async output on or off.
+ *
+ * @details Turning it off prints everything held first and stops the
+ * writer.  Change it while nothing else is logging.
+ *
+ * @param on Nonzero for async output
+ *
+ * @returns 0 on success, -1 on failure (the writer couldn't be started;
+ * output stays synchronous).
+ * */
+int
+avmlib_log_async(
+    int on
+)
+{
+    int rc;
+
+    pthread_mutex_lock(&avmlib_log_lock);
+    if (on && !avmlib_log_running) {
+        if (!avmlib_log_exit_set) {
+            if (pthread_key_create(&avmlib_log_key,avmlib_log_thread_exit)) {
+                pthread_mutex_unlock(&avmlib_log_lock);
+                return -1;
+            }
+            atexit(avmlib_log_at_exit);
+            avmlib_log_exit_set = 1;
+        }
+        avmlib_log_stop = 0;
+        avmlib_log_total = avmlib_log_written = 0;
+        if (0 != (rc = pthread_create(&avmlib_log_writer,NULL,avmlib_log_writer_main,NULL))) {
+            pthread_mutex_unlock(&avmlib_log_lock);
+            avm_err("AVMLIB","%s: Can't start the log writer (%s).\n",__func__,strerror(rc));
+            return -1;
+        }
+        avmlib_log_running = 1;
+        __atomic_store_n(&avmlib_log_async_on,1,__ATOMIC_RELEASE);
+    } else if (!on && avmlib_log_running) {
+        __atomic_store_n(&avmlib_log_async_on,0,__ATOMIC_RELEASE);
+        while (avmlib_log_collect()) {
+            pthread_mutex_unlock(&avmlib_log_lock);
+            sched_yield();
+            pthread_mutex_lock(&avmlib_log_lock);
+        }
+        avmlib_log_stop = 1;
+        pthread_cond_signal(&avmlib_log_work);
+        pthread_mutex_unlock(&avmlib_log_lock);
+        pthread_join(avmlib_log_writer,NULL);
+        pthread_mutex_lock(&avmlib_log_lock);
+        avmlib_log_running = 0;
+    }
+    pthread_mutex_unlock(&avmlib_log_lock);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Print everything held, and wait until it has been.
+ *
+ * @details Messages other threads log meanwhile may or may not make it.
+ * */
+void
+avmlib_log_flush(void)
+{
+    uint64_t upto;
+
+    pthread_mutex_lock(&avmlib_log_lock);
+    if (avmlib_log_running) {
+        while (avmlib_log_collect()) {
+            pthread_mutex_unlock(&avmlib_log_lock);
+            sched_yield();
+            pthread_mutex_lock(&avmlib_log_lock);
+        }
+        upto = avmlib_log_total;
+        pthread_cond_signal(&avmlib_log_work);
+        while (avmlib_log_written < upto) pthread_cond_wait(&avmlib_log_done,&avmlib_log_lock);
+    }
+    pthread_mutex_unlock(&avmlib_log_lock);
+}
 
 #endif /* _AVMLIB_LOG_C_ */
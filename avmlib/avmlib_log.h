@@ -10,11 +10,27 @@
  * stdout (for log messages), and stderr (for error messages).  Either
  * may be updated, however.
  *
- * ERRORS are always sent to the configured error target
- * LOGS are always sent to the configured log target
- * DEBUG messages are sent to the configured log target iff debugging is
- * enabled, and the debug level is at least as high as the message's
- * debug level.
+ * A thread may set its own targets (avmlib_log_set_thread()), e.g. one
+ * per embedded machine; they take precedence over the process-wide
+ * ones for messages that thread prints.
+ *
+ * ERRORS are always sent to the configured error target, at once.
+ * LOGS are sent to the configured log target unless the log level is
+ * AVMLIB_LOG_QUIET.
+ * DEBUG messages are sent to the configured log target iff the debug
+ * level is at least as high as the message's debug level.
+ *
+ * Both levels can be changed at any time (avm_set_loglevel(),
+ * avm_set_debuglevel()); a filtered-out message costs one load and a
+ * branch, and its arguments aren't evaluated.  Building with AVM_QUIET
+ * compiles log and debug messages out altogether.
+ *
+ * By default messages are printed as they're made.  After
+ * avmlib_log_async(1) log and debug messages are formatted into a
+ * buffer belonging to the calling thread instead, and a background
+ * writer thread prints the buffers; messages from one thread stay in
+ * order, and are held at most AVMLIB_LOG_ASYNC_MS.  Call
+ * avmlib_log_flush() before printing to a log target directly.
  * */
 #ifndef _AVMLIB_LOG_H_
 #define _AVMLIB_LOG_H_
@@ -24,17 +40,35 @@
 /*
  * DEBUG
  *
- * To turn on debugging, define AVM_DEBUG in your build.
- * To modify the debug level, define AVM_DEBUG_LEVEL in your build.
+ * Debug messages print when their level is at most the debug level.
+ * AVM_DEBUG builds start at AVM_DEBUG_LEVEL, others at 0 (none).
  */
 #ifndef AVM_DEBUG_LEVEL 
 #define AVM_DEBUG_LEVEL 3
 #endif /* AVM_DEBUG_LEVEL */
 
+/*
+ * Log levels
+ */
+#define AVMLIB_LOG_QUIET 0 /* Errors only */
+#define AVMLIB_LOG_NORMAL 1 /* Errors and logs (the default) */
+
+/*
+ * Async output: per-thread buffer size, and longest a message waits
+ */
+#define AVMLIB_LOG_BUF_SIZE 16384
+#define AVMLIB_LOG_ASYNC_MS 50
+
 #ifdef _AVMLIB_LOG_C_
+#ifdef AVM_DEBUG
 int avmlib_debug_level = AVM_DEBUG_LEVEL;
+#else /* AVM_DEBUG */
+int avmlib_debug_level = 0;
+#endif /* AVM_DEBUG */
+int avmlib_log_level = AVMLIB_LOG_NORMAL;
 #else /* _AVMLIB_LOG_C_ */
 extern int avmlib_debug_level;
+extern int avmlib_log_level;
 #endif /* _AVMLIB_LOG_C_ */
 
 /*
@@ -42,35 +76,57 @@ extern int avmlib_debug_level;
  */
 extern FILE *avmlib_logfile;
 extern FILE *avmlib_errfile;
+extern __thread FILE *avmlib_logfile_thread;
+extern __thread FILE *avmlib_errfile_thread;
+
+/*
+ * Target a message goes to: this thread's, else the process's, else stdio
+ */
+#define avmlib_log_target() \
+    (avmlib_logfile_thread ? avmlib_logfile_thread : (avmlib_logfile ? avmlib_logfile : stdout))
+#define avmlib_err_target() \
+    (avmlib_errfile_thread ? avmlib_errfile_thread : (avmlib_errfile ? avmlib_errfile : stderr))
 
 /*
  * Prototypes
  */
 FILE *avmlib_log_set_log(FILE *newtarget);
 FILE *avmlib_log_set_err(FILE *newtarget);
+void avmlib_log_set_thread(FILE *log, FILE *err);
+void avmlib_log_print(FILE *target, const char *format, ...) __attribute__((format(printf,2,3)));
+int avmlib_log_async(int on);
+void avmlib_log_flush(void);
 
-
-#ifdef AVM_DEBUG
 #define avm_set_debuglevel(__lvl) \
     do { \
-        avmlib_debug_level = (__lvl); \
+        __atomic_store_n(&avmlib_debug_level,(__lvl),__ATOMIC_RELAXED); \
+    } while (0)
+
+#define avm_set_loglevel(__lvl) \
+    do { \
+        __atomic_store_n(&avmlib_log_level,(__lvl),__ATOMIC_RELAXED); \
     } while (0)
 
+#ifndef AVM_QUIET
 #define avm_dbg(__lvl, __token, __format_and_args...) \
     do { \
-        if (avmlib_debug_level >= (__lvl)) { \
-            fprintf(avmlib_logfile?avmlib_logfile:stdout, __token ": DEBUG: " __format_and_args); \
+        if (__atomic_load_n(&avmlib_debug_level,__ATOMIC_RELAXED) >= (__lvl)) { \
+            avmlib_log_print(avmlib_log_target(), __token ": DEBUG: " __format_and_args); \
         } \
     } while (0)
-#else
-#define avm_set_debuglevel(__lvl)
-#define avm_dbg(__lvl, __token, __format_and_args...)
-#endif /* AVM_DEBUG */
 
 #define avm_log(__token, __format_and_args...) \
-    fprintf(avmlib_logfile?avmlib_logfile:stdout, __token ": " __format_and_args)
+    do { \
+        if (__atomic_load_n(&avmlib_log_level,__ATOMIC_RELAXED) >= AVMLIB_LOG_NORMAL) { \
+            avmlib_log_print(avmlib_log_target(), __token ": " __format_and_args); \
+        } \
+    } while (0)
+#else
+#define avm_dbg(__lvl, __token, __format_and_args...) do { } while (0)
+#define avm_log(__token, __format_and_args...) do { } while (0)
+#endif /* AVM_QUIET */
 
 #define avm_err(__token, __format_and_args...) \
-    fprintf(avmlib_errfile?avmlib_errfile:stderr, __token ": ERROR: " __format_and_args)
+    fprintf(avmlib_err_target(), __token ": ERROR: " __format_and_args)
 
 #endif /* _AVMLIB_LOG_H_ */
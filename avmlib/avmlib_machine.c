@@ -29,8 +29,13 @@ avmlib_machine_init(
 {
     int i;
     /* Step 1: Setup defaults */
-    sprintf(avmm_entity_name(this),"AVM Machine Instance");
+    avmm_entity_name_set(this,"AVM Machine Instance");
     this->entrypoint = AVMM_DEFAULT_ENTRYPOINT;
+    memset(&this->store,0,sizeof(this->store)); /* Built once linked */
+    this->parent = NULL; /* Not a clone */
+    this->shared = 0;
+    this->nlocals = 0;
+    this->locals = NULL;
 
     /* Step 2: Prepare all tables */
     avmlib_table_init(&(this->tables),AVM_CLASS_MAX);
@@ -53,10 +58,17 @@ avmlib_machine_init(
         }
     }
 
+    AVM_CLASS_TABLE(this,AVM_CLASS_BUFFER)->destroy = avmtype_buffer_destroy;
+    AVM_CLASS_TABLE(this,AVM_CLASS_BUFFER)->serialize = avmtype_buffer_serialize;
+    AVM_CLASS_TABLE(this,AVM_CLASS_STRING)->serialize = avmtype_string_serialize;
+
     /* Step 3: Init default table entries */
     avmlib_regs_init(this);
     avmlib_ports_init(this);
 
+    /* Step 4: Reclamation for segments swapped out while running */
+    if (NULL == (this->epoch = avmlib_epoch_new())) return NULL;
+
     return this;
 }
 
@@ -91,5 +103,538 @@ avmlib_machine_new(void)
     return newmach;
 }
 
+/**************************************************************************//**
+ * @brief Classes a clone copies entities of on first write
+ * */
+#define AVMLIB_CLONE_LAZY ((1u << AVM_CLASS_REGISTER) | (1u << AVM_CLASS_NUMBER) | \
+                           (1u << AVM_CLASS_STRING) | (1u << AVM_CLASS_BUFFER))
+
+/**************************************************************************//**
+ * @brief Count an allocation made for a clone.
+ *
+ * @returns entry, so it can wrap a return.
+ * */
+static entry_t
+avmlib_machine_counted(
+    entry_t entry,
+    uint64_t bytes
+)
+{
+    if (entry) {
+        avmlib_stats_add(allocs,1);
+        avmlib_stats_add(alloc_bytes,bytes);
+    }
+    return entry;
+}
+
+/**************************************************************************//**
+ * @brief Private copy of an entity, for a clone.
+ *
+ * @returns The copy, or NULL on failure.
+ * */
+static entry_t
+avmlib_machine_entity_copy(
+    int class,
+    entry_t entry
+)
+{
+    switch (class) {
+        case AVM_CLASS_REGISTER: {
+            class_register_t *r = malloc(sizeof(*r));
+            if (r) *r = *(class_register_t *)entry;
+            return avmlib_machine_counted((entry_t)r,sizeof(*r));
+        }
+        case AVM_CLASS_NUMBER: {
+            class_number_t *n = malloc(sizeof(*n));
+            if (n) *n = *(class_number_t *)entry;
+            return avmlib_machine_counted((entry_t)n,sizeof(*n));
+        }
+        case AVM_CLASS_STRING: {
+            class_string_t *from = (class_string_t *)entry;
+            class_string_t *s = malloc(sizeof(*s));
+            if (!s) return 0;
+            *s = *from;
+            if (from->text && (NULL == (s->text = strdup(from->text)))) {
+                free(s);
+                return 0;
+            }
+            s->capacity = s->text ? strlen(s->text) : 0; /* What strdup() gave us */
+            return avmlib_machine_counted((entry_t)s,sizeof(*s) + (from->text ? strlen(from->text) + 1 : 0));
+        }
+        case AVM_CLASS_BUFFER: {
+            class_buffer_t *from = (class_buffer_t *)entry;
+            class_buffer_t *b = malloc(sizeof(*b));
+            if (!b) return 0;
+            *b = *from;
+            b->map = BUFFER_MAP_NONE;
+            b->advised = 0;
+            b->capacity = from->size;
+            b->buf = NULL;
+            if (from->size && (NULL == (b->buf = malloc((size_t)from->size)))) {
+                free(b);
+                return 0;
+            }
+            if (from->size) memcpy(b->buf,from->buf,(size_t)from->size);
+            return avmlib_machine_counted((entry_t)b,sizeof(*b) + from->size);
+        }
+        case AVM_CLASS_PORT:
+            return avmlib_machine_counted((entry_t)avmlib_port_clone((class_port_t *)entry),sizeof(class_port_t));
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Release a clone's private copy of an entity.
+ * */
+static void
+avmlib_machine_entity_free(
+    int class,
+    entry_t entry
+)
+{
+    switch (class) {
+        case AVM_CLASS_STRING:
+            avmtype_string_destroy(NULL,entry);
+            break;
+        case AVM_CLASS_BUFFER:
+            avmtype_buffer_destroy(NULL,entry);
+            break;
+        case AVM_CLASS_PORT:
+            avmlib_port_destroy(NULL,entry);
+            free((void *)entry);
+            break;
+        default:
+            free((void *)entry);
+            break;
+    }
+}
+
+/**************************************************************************//**
+ * @brief Copy a table's entry array (not the entities) for a clone.
+ *
+ * @returns The new table, or NULL on failure.
+ * */
+static table_t *
+avmlib_machine_table_copy(
+    const table_t *from
+)
+{
+    table_t *t;
+
+    if (NULL == (t = malloc(sizeof(*t)))) return NULL;
+    *t = *from;
+    t->capacity = from->size;
+    t->entries = NULL;
+    if (from->size) {
+        if (NULL == (t->entries = malloc(sizeof(entry_t) * from->size))) {
+            free(t);
+            return NULL;
+        }
+        memcpy(t->entries,from->entries,sizeof(entry_t) * from->size);
+    }
+    t->destroy = NULL; /* Entities are released by avmlib_machine_clone_free() */
+    avmlib_machine_counted((entry_t)t,sizeof(*t) + sizeof(entry_t) * from->size);
+    return t;
+}
+
+/**************************************************************************//**
+ * @brief Make a lightweight instance of a loaded machine.
+ *
+ * @details Code, segments, labels, groups and everything else
+ * read-only are shared with the parent.  Registers, NUMBERs, STRINGs
+ * and buffers are shared too until the clone writes them: each write
+ * goes through avmlib_machine_own() (objects) or
+ * avmlib_store_number_set() (NUMBER values), which copy just what's
+ * written.  Ports are copied up front, each with its own descriptor,
+ * and the clone starts with no processes.
+ *
+ * @param parent The machine to clone; fully loaded, and left unchanged
+ * for as long as it has clones
+ *
+ * @returns The clone, or NULL on failure.
+ *
+ * @remarks A clone can't be cloned, extended (new entities or
+ * segments go in the shared tables) or snapshotted.  Release it with
+ * avmlib_machine_clone_free().
+ * */
+avm_t *
+avmlib_machine_clone(
+    avm_t *parent
+)
+{
+    avm_t *clone;
+    table_t *from, *t;
+    uint32_t i;
+    int c;
+
+    if (parent->parent) {
+        avmlib_err("%s: Can't clone a clone.\n",__func__);
+        return NULL;
+    }
+
+    /* Step 1: Machine, sharing the parent's segments and reclamation */
+    if ((NULL == (clone = calloc(1,sizeof(*clone)))) ||
+        (NULL == avmlib_table_init(&clone->tables,AVM_CLASS_MAX))) {
+        free(clone);
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+    clone->header = parent->header;
+    clone->entrypoint = parent->entrypoint;
+    clone->epoch = parent->epoch;
+    clone->parent = parent;
+    avmlib_store_share(&clone->store,&parent->store);
+
+    /* Step 2: Tables; only ports and processes are the clone's own */
+    for (c=0;c<AVM_CLASS_MAX;c++) {
+        from = AVM_CLASS_TABLE(parent,c);
+        t = from;
+        if (AVM_CLASS_PORT == c) {
+            if (NULL != (t = avmlib_machine_table_copy(from))) {
+                for (i=0;i<from->size;i++) {
+                    t->entries[i] = (entry_t)avmlib_port_clone((class_port_t *)from->entries[i]);
+                    if (!t->entries[i]) break;
+                }
+                t->size = i; /* The ones we got, so they're freed on failure */
+            }
+        } else if (AVM_CLASS_PROCESS == c) {
+            if (NULL != (t = avmlib_table_new(AVMLIB_DEFAULT_TABLE_SIZE))) {
+                t->type_name = from->type_name;
+                t->compare = from->compare;
+                t->find = from->find;
+                t->destroy = from->destroy;
+            }
+        } else {
+            clone->shared |= 1u << c;
+        }
+        if ((NULL == t) || (0 > avmlib_table_add(&clone->tables,t)) || (t->size != from->size)) {
+            if (t && (AVM_CLASS_TABLE(clone,c) != t)) avmlib_table_destroy(t);
+            avmlib_err("%s: Clone failed.\n",__func__);
+            avmlib_machine_clone_free(clone);
+            return NULL;
+        }
+    }
+
+    avm_dbg(2,"AVMLIB","Cloned machine (%u ports).\n",AVM_CLASS_TABLE(clone,AVM_CLASS_PORT)->size);
+    return clone;
+}
+
+/**************************************************************************//**
+ * @brief Get an entity of a machine for writing.
+ *
+ * @details For a clone, the first write to a register, NUMBER, STRING
+ * or buffer copies it (and, the first time for its class, the table's
+ * entry array) so the parent and other clones don't see the change.
+ * For any other machine this is just the table lookup.
+ *
+ * @param avm The machine
+ * @param class Entity class
+ * @param index Entity index in the machine's (global) table
+ *
+ * @returns The writable entity, or NULL on failure (no such entity, a
+ * read-only class in a clone, or alloc failure).
+ *
+ * @remarks NUMBER values live in the store while running; write them
+ * with avmlib_store_number_set().
+ * */
+void *
+avmlib_machine_own(
+    avm_t *avm,
+    int class,
+    uint32_t index
+)
+{
+    table_t *t = AVM_CLASS_TABLE(avm,class), *pt;
+    entry_t copy;
+
+    if (index >= t->size) {
+        avmlib_err("%s: No %s entity %u.\n",__func__,t->type_name,index);
+        return NULL;
+    }
+    if (!avm->parent) return (void *)t->entries[index];
+    if (!(AVMLIB_CLONE_LAZY & (1u << class))) {
+        if (!(avm->shared & (1u << class))) return (void *)t->entries[index]; /* Ports, processes */
+        avmlib_err("%s: %s entities are shared read-only in a clone.\n",__func__,t->type_name);
+        return NULL;
+    }
+
+    /* Step 1: Our own entry array for this class */
+    if (avm->shared & (1u << class)) {
+        if (NULL == (t = avmlib_machine_table_copy(t))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return NULL;
+        }
+        avm->tables.entries[class] = (entry_t)t;
+        avm->shared &= ~(1u << class);
+    }
+
+    /* Step 2: Our own entity */
+    pt = AVM_CLASS_TABLE(avm->parent,class);
+    if ((index < pt->size) && (t->entries[index] == pt->entries[index]) && t->entries[index]) {
+        if (0 == (copy = avmlib_machine_entity_copy(class,t->entries[index]))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return NULL;
+        }
+        t->entries[index] = copy;
+    }
+    return (void *)t->entries[index];
+}
+
+/**************************************************************************//**
+ * @brief Drop a clone's private state for one segment.
+ * */
+static void
+avmlib_machine_local_drop(
+    avm_local_store_t *l
+)
+{
+    uint32_t i;
+    int c;
+
+    /* The segment version may be gone by now; only our own state is used */
+    for (c=0;c<AVM_CLASS_MAX;c++) {
+        if (!l->objects[c]) continue;
+        for (i=0;i<l->nobjects[c];i++) {
+            if (l->objects[c][i]) avmlib_machine_entity_free(c,l->objects[c][i]);
+        }
+        free(l->objects[c]);
+        l->objects[c] = NULL;
+        l->nobjects[c] = 0;
+    }
+    avmlib_store_free(&l->store);
+    l->seg = NULL;
+}
+
+/**************************************************************************//**
+ * @brief A clone's private state for a segment, made current.
+ *
+ * @details If the segment has been swapped since, what was copied
+ * from the old version is dropped with it.
+ *
+ * @returns The state, or NULL on alloc failure.
+ * */
+static avm_local_store_t *
+avmlib_machine_local_slot(
+    avm_t *avm,
+    class_segment_t *seg
+)
+{
+    avm_local_store_t *l;
+    uint32_t n;
+
+    /* Step 1: Room for this segment ID */
+    if (seg->id >= avm->nlocals) {
+        n = AVM_CLASS_TABLE(avm,AVM_CLASS_SEGMENT)->size;
+        if (n <= seg->id) n = seg->id + 1;
+        if (NULL == (l = realloc(avm->locals,n * sizeof(*l)))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return NULL;
+        }
+        memset(l + avm->nlocals,0,(n - avm->nlocals) * sizeof(*l));
+        avm->locals = l;
+        avm->nlocals = n;
+    }
+
+    /* Step 2: Current for this version? */
+    l = &avm->locals[seg->id];
+    if ((l->seg != seg) || (l->version != seg->version)) {
+        if (l->seg) avmlib_machine_local_drop(l);
+        avmlib_store_share(&l->store,&seg->store);
+        l->seg = seg;
+        l->version = seg->version;
+    }
+    return l;
+}
+
+/**************************************************************************//**
+ * @brief Get the store to write a segment's local NUMBERs through.
+ *
+ * @details A clone gets a private store for the segment, borrowing the
+ * segment's arrays until its first write; avmlib_store_of() finds it
+ * from then on.  If the segment is swapped, the private store is
+ * dropped with the old version.
+ *
+ * @param avm The machine
+ * @param seg The (resident) segment
+ *
+ * @returns The store, or NULL on alloc failure.
+ * */
+avm_store_t *
+avmlib_machine_local_store(
+    avm_t *avm,
+    class_segment_t *seg
+)
+{
+    avm_local_store_t *l;
+
+    if (!avm->parent) return &seg->store;
+    if (NULL == (l = avmlib_machine_local_slot(avm,seg))) return NULL;
+    return &l->store;
+}
+
+/**************************************************************************//**
+ * @brief Get one of a segment's own entities, as a machine sees it.
+ *
+ * @details A clone sees its private copy if it has written one (see
+ * avmlib_machine_own_local()), and the segment's otherwise.
+ *
+ * @returns The entity, or NULL if there's no such entity.
+ * */
+void *
+avmlib_machine_local(
+    avm_t *avm,
+    class_segment_t *seg,
+    int class,
+    uint32_t index
+)
+{
+    table_t *t = AVM_CLASS_TABLE(seg,class);
+    avm_local_store_t *l;
+
+    if (index >= t->size) return NULL;
+    if (avm->parent && (seg->id < avm->nlocals)) {
+        l = &avm->locals[seg->id];
+        if ((l->seg == seg) && (l->version == seg->version) &&
+            (index < l->nobjects[class]) && l->objects[class][index]) {
+            return (void *)l->objects[class][index];
+        }
+    }
+    return (void *)t->entries[index];
+}
+
+/**************************************************************************//**
+ * @brief Get one of a segment's own entities for writing.
+ *
+ * @details The segment-local counterpart of avmlib_machine_own(): in a
+ * clone, the first write to a local STRING, buffer or register copies
+ * it, and the first use of a local port gives the clone its own (so
+ * FILE, IN and OUT never touch the template's descriptors).
+ *
+ * @returns The writable entity, or NULL on failure.
+ * */
+void *
+avmlib_machine_own_local(
+    avm_t *avm,
+    class_segment_t *seg,
+    int class,
+    uint32_t index
+)
+{
+    table_t *t = AVM_CLASS_TABLE(seg,class);
+    avm_local_store_t *l;
+    entry_t copy;
+
+    if (index >= t->size) {
+        avmlib_err("%s: No local %s entity %u.\n",__func__,t->type_name,index);
+        return NULL;
+    }
+    if (!avm->parent) return (void *)t->entries[index];
+    if (!((AVMLIB_CLONE_LAZY | (1u << AVM_CLASS_PORT)) & (1u << class))) {
+        avmlib_err("%s: %s entities are shared read-only in a clone.\n",__func__,t->type_name);
+        return NULL;
+    }
+
+    /* Step 1: Our own slot for this class */
+    if (NULL == (l = avmlib_machine_local_slot(avm,seg))) return NULL;
+    if (!l->objects[class]) {
+        if (NULL == (l->objects[class] = calloc(t->size,sizeof(entry_t)))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return NULL;
+        }
+        l->nobjects[class] = t->size;
+    }
+
+    /* Step 2: Our own entity */
+    if (!l->objects[class][index]) {
+        if (0 == (copy = avmlib_machine_entity_copy(class,t->entries[index]))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return NULL;
+        }
+        l->objects[class][index] = copy;
+    }
+    return (void *)l->objects[class][index];
+}
+
+/**************************************************************************//**
+ * @brief Return a clone to the state it was cloned in.
+ *
+ * @details Everything the clone copied on write is released and it
+ * goes back to sharing with the parent; what it allocated up front
+ * (its ports and process table) is kept, so the clone can be reused
+ * for the next run at the cost of what that run writes.
+ * */
+void
+avmlib_machine_clone_reset(
+    avm_t *clone
+)
+{
+    table_t *t, *pt;
+    uint32_t i;
+    int c;
+
+    if (!clone || !clone->parent) return;
+
+    /* Step 1: Copied entities, and the tables holding them */
+    for (c=0;c<AVM_CLASS_MAX;c++) {
+        if (!(AVMLIB_CLONE_LAZY & (1u << c)) || (clone->shared & (1u << c))) continue;
+        t = AVM_CLASS_TABLE(clone,c);
+        pt = AVM_CLASS_TABLE(clone->parent,c);
+        for (i=0;i<t->size;i++) {
+            if (t->entries[i] && ((i >= pt->size) || (t->entries[i] != pt->entries[i]))) {
+                avmlib_machine_entity_free(c,t->entries[i]);
+            }
+        }
+        t->size = 0;
+        avmlib_table_destroy(t);
+        clone->tables.entries[c] = (entry_t)pt;
+        clone->shared |= 1u << c;
+    }
+
+    /* Step 2: Stores */
+    for (i=0;i<clone->nlocals;i++) {
+        if (clone->locals[i].seg) avmlib_machine_local_drop(&clone->locals[i]);
+    }
+    avmlib_store_free(&clone->store);
+    avmlib_store_share(&clone->store,&clone->parent->store);
+}
+
+/**************************************************************************//**
+ * @brief Release a clone and everything it copied.
+ *
+ * @details The parent is untouched.
+ * */
+void
+avmlib_machine_clone_free(
+    avm_t *clone
+)
+{
+    table_t *t;
+    uint32_t i;
+    int c;
+
+    if (!clone || !clone->parent) return;
+    avmlib_machine_clone_reset(clone);
+
+    /* Step 1: Tables we own */
+    for (c=0;c<(int)clone->tables.size;c++) {
+        t = AVM_CLASS_TABLE(clone,c);
+        if (!t || (clone->shared & (1u << c))) continue;
+        if (AVM_CLASS_PORT == c) {
+            for (i=0;i<t->size;i++) {
+                avmlib_port_destroy(t,t->entries[i]);
+                free((void *)t->entries[i]);
+            }
+            t->size = 0;
+        }
+        avmlib_table_destroy(t);
+    }
+
+    /* Step 2: Stores */
+    free(clone->locals);
+    avmlib_store_free(&clone->store);
+    free(clone->tables.entries);
+    free(clone);
+}
+
 #define _AVMLIB_MACHINE_C_ 
 #endif /* _AVMLIB_MACHINE_C_  */
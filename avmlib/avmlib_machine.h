@@ -21,5 +21,12 @@
 /* Prototypes */
 avm_t *avmlib_machine_init(avm_t *this);
 avm_t *avmlib_machine_new(void);
+avm_t *avmlib_machine_clone(avm_t *parent);
+void *avmlib_machine_own(avm_t *avm, int class, uint32_t index);
+avm_store_t *avmlib_machine_local_store(avm_t *avm, class_segment_t *seg);
+void *avmlib_machine_local(avm_t *avm, class_segment_t *seg, int class, uint32_t index);
+void *avmlib_machine_own_local(avm_t *avm, class_segment_t *seg, int class, uint32_t index);
+void avmlib_machine_clone_reset(avm_t *clone);
+void avmlib_machine_clone_free(avm_t *clone);
 
 #endif /* _AVMLIB_MACHINE_H_ */
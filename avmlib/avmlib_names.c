@@ -0,0 +1,271 @@
+/**************************************************************************//**
+ * @file avmlib_names.c
+ *
+ * @brief Shared, interned table of entity names
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_NAMES_C_
+#define _AVMLIB_NAMES_C_
+
+#include "avmlib.h"
+#include <pthread.h>
+
+/* Block storage (read lock-free through avmlib_name()) */
+char *avmlib_names_blocks[AVMLIB_NAMES_BLOCKS];
+
+/* Everything below is guarded by the lock */
+static pthread_mutex_t avmlib_names_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t avmlib_names_block; /* Block being filled */
+static uint32_t avmlib_names_pos; /* Next free byte in it */
+static uint32_t *avmlib_names_hash; /* Open-addressed offsets; 0 is empty */
+static uint32_t avmlib_names_hash_size; /* Slots (power of 2) */
+static uint32_t avmlib_names_count; /* Distinct names */
+static int avmlib_names_stale; /* Blocks adopted; hash not built yet */
+
+/**************************************************************************//**
+ * @brief FNV-1a over a name.
+ * */
+static uint32_t
+avmlib_names_hashfn(
+    const char *name,
+    size_t len
+)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i=0;i<len;i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**************************************************************************//**
+ * @brief Double the hash (or create it).
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_names_rehash(void)
+{
+    uint32_t size = avmlib_names_hash_size ? avmlib_names_hash_size * 2 : 1024;
+    uint32_t *hash, i, slot;
+    const char *n;
+
+    if (NULL == (hash = calloc(size,sizeof(*hash)))) return -1;
+    for (i=0;i<avmlib_names_hash_size;i++) {
+        if (!avmlib_names_hash[i]) continue;
+        n = avmlib_name(avmlib_names_hash[i]);
+        slot = avmlib_names_hashfn(n,strlen(n)) & (size - 1);
+        while (hash[slot]) slot = (slot + 1) & (size - 1);
+        hash[slot] = avmlib_names_hash[i];
+    }
+    free(avmlib_names_hash);
+    avmlib_names_hash = hash;
+    avmlib_names_hash_size = size;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Copy a name into block storage.
+ *
+ * @returns Its offset, or 0 on failure.
+ * */
+static uint32_t
+avmlib_names_store(
+    const char *name,
+    size_t len
+)
+{
+    char *block;
+    uint32_t off;
+
+    /* Step 1: Move to a fresh block if this one's full */
+    if (!avmlib_names_blocks[avmlib_names_block] ||
+        (avmlib_names_pos + len + 1 > AVMLIB_NAMES_BLOCK_SIZE)) {
+        uint32_t next = avmlib_names_blocks[avmlib_names_block] ?
+                        avmlib_names_block + 1 : avmlib_names_block;
+        if (next >= AVMLIB_NAMES_BLOCKS) return 0;
+        /* Zeroed, so a scan stops at the unused tail */
+        if (NULL == (block = calloc(1,AVMLIB_NAMES_BLOCK_SIZE))) return 0;
+        /* Position 0 of each block is empty; offset 0 is the empty name */
+        __atomic_store_n(&avmlib_names_blocks[next],block,__ATOMIC_RELEASE);
+        avmlib_names_block = next;
+        avmlib_names_pos = 1;
+    }
+
+    /* Step 2: Copy */
+    block = avmlib_names_blocks[avmlib_names_block];
+    off = (avmlib_names_block << AVMLIB_NAMES_BLOCK_SHIFT) | avmlib_names_pos;
+    memcpy(block + avmlib_names_pos,name,len);
+    block[avmlib_names_pos + len] = '\0';
+    avmlib_names_pos += len + 1;
+    return off;
+}
+
+/**************************************************************************//**
+ * @brief Rebuild the hash from the blocks after an adoption.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_names_rescan(void)
+{
+    uint32_t b, p, limit, off, slot;
+    const char *block, *n;
+    size_t len;
+
+    free(avmlib_names_hash);
+    avmlib_names_hash = NULL;
+    avmlib_names_hash_size = avmlib_names_count = 0;
+    for (b=0;(b<=avmlib_names_block) && avmlib_names_blocks[b];b++) {
+        block = avmlib_names_blocks[b];
+        limit = (b == avmlib_names_block) ? avmlib_names_pos : AVMLIB_NAMES_BLOCK_SIZE;
+        for (p=1;(p<limit) && block[p];p+=len+1) {
+            if ((2 * (avmlib_names_count + 1) > avmlib_names_hash_size) &&
+                (0 > avmlib_names_rehash())) {
+                return -1;
+            }
+            off = (b << AVMLIB_NAMES_BLOCK_SHIFT) | p;
+            n = block + p;
+            len = strnlen(n,limit - p);
+            slot = avmlib_names_hashfn(n,len) & (avmlib_names_hash_size - 1);
+            while (avmlib_names_hash[slot]) slot = (slot + 1) & (avmlib_names_hash_size - 1);
+            avmlib_names_hash[slot] = off;
+            avmlib_names_count++;
+        }
+    }
+    avmlib_names_stale = 0;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Get the offset of a name, adding it if it's new.
+ *
+ * @details Names longer than AVMLIB_NAME_MAX are truncated first, so
+ * they intern the same as their truncation.
+ *
+ * @param name The name (NULL or "" is the anonymous name)
+ *
+ * @returns The name's offset; 0 for the anonymous name or on failure.
+ * */
+uint32_t
+avmlib_name_intern(
+    const char *name
+)
+{
+    size_t len;
+    uint32_t h, slot, off;
+
+    if (!name || !name[0]) return 0;
+    len = strnlen(name,AVMLIB_NAME_MAX);
+    h = avmlib_names_hashfn(name,len);
+
+    pthread_mutex_lock(&avmlib_names_lock);
+
+    /* Step 1: Already have it? */
+    if ((avmlib_names_stale && (0 > avmlib_names_rescan())) ||
+        ((2 * (avmlib_names_count + 1) > avmlib_names_hash_size) &&
+         (0 > avmlib_names_rehash()))) {
+        pthread_mutex_unlock(&avmlib_names_lock);
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return 0;
+    }
+    for (slot = h & (avmlib_names_hash_size - 1);
+         0 != (off = avmlib_names_hash[slot]);
+         slot = (slot + 1) & (avmlib_names_hash_size - 1)) {
+        const char *n = avmlib_name(off);
+        if (!strncmp(n,name,len) && !n[len]) {
+            pthread_mutex_unlock(&avmlib_names_lock);
+            return off;
+        }
+    }
+
+    /* Step 2: Add it */
+    if (0 != (off = avmlib_names_store(name,len))) {
+        avmlib_names_hash[slot] = off;
+        avmlib_names_count++;
+    }
+    pthread_mutex_unlock(&avmlib_names_lock);
+
+    if (!off) avmlib_err("%s: Name table full or alloc failure.\n",__func__);
+    return off;
+}
+
+/**************************************************************************//**
+ * @brief Bytes of name storage in use (for stats).
+ * */
+uint64_t
+avmlib_names_bytes(void)
+{
+    uint64_t bytes;
+
+    pthread_mutex_lock(&avmlib_names_lock);
+    bytes = ((uint64_t)avmlib_names_block << AVMLIB_NAMES_BLOCK_SHIFT) + avmlib_names_pos;
+    pthread_mutex_unlock(&avmlib_names_lock);
+    return bytes;
+}
+
+/**************************************************************************//**
+ * @brief Use name blocks from a restored machine image as the table.
+ *
+ * @details Offsets in the image then mean the same here, with no
+ * per-entity work: the blocks are used in place, and the hash is
+ * rebuilt on the next avmlib_name_intern().  This works if nothing has
+ * been interned yet, or if the table already holds exactly the image's
+ * names (the same image restored twice).
+ *
+ * @param base First block in the image (blocks are contiguous)
+ * @param bytes avmlib_names_bytes() of the process that wrote the image
+ *
+ * @returns 0 if the image's offsets are valid here, -1 if not (the
+ * caller must re-intern the image's names).
+ *
+ * @remarks The blocks must stay mapped for the life of the process.
+ * */
+int
+avmlib_names_adopt(
+    char *base,
+    uint64_t bytes
+)
+{
+    uint32_t nblocks = bytes ? (uint32_t)(bytes >> AVMLIB_NAMES_BLOCK_SHIFT) + 1 : 0;
+    uint64_t cur;
+    uint32_t b;
+    int rc = -1;
+
+    if (nblocks > AVMLIB_NAMES_BLOCKS) return -1;
+    pthread_mutex_lock(&avmlib_names_lock);
+    cur = avmlib_names_blocks[0] ?
+          ((uint64_t)avmlib_names_block << AVMLIB_NAMES_BLOCK_SHIFT) + avmlib_names_pos : 0;
+
+    if (!cur) {
+        /* Step 1: Empty; take the image's blocks */
+        for (b=0;b<nblocks;b++) {
+            __atomic_store_n(&avmlib_names_blocks[b],base + ((uint64_t)b << AVMLIB_NAMES_BLOCK_SHIFT),
+                             __ATOMIC_RELEASE);
+        }
+        if (nblocks) {
+            avmlib_names_block = nblocks - 1;
+            avmlib_names_pos = (uint32_t)(bytes & (AVMLIB_NAMES_BLOCK_SIZE - 1));
+            avmlib_names_stale = 1;
+        }
+        rc = 0;
+    } else if (cur == bytes) {
+        /* Step 2: Same names already? */
+        for (b=0,rc=0;(b<nblocks) && !rc;b++) {
+            uint64_t len = (b == nblocks - 1) ? (bytes & (AVMLIB_NAMES_BLOCK_SIZE - 1)) :
+                                                AVMLIB_NAMES_BLOCK_SIZE;
+            if (memcmp(avmlib_names_blocks[b],base + ((uint64_t)b << AVMLIB_NAMES_BLOCK_SHIFT),len)) {
+                rc = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&avmlib_names_lock);
+    return rc;
+}
+
+#endif /* _AVMLIB_NAMES_C_ */
@@ -0,0 +1,54 @@
+/**************************************************************************//**
+ * @file avmlib_names.h
+ *
+ * @brief Shared, interned table of entity names.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Entity names are cold data: the compiler, linker and debug dumps use
+ * them, the executor never does.  So instead of every entity carrying
+ * its name inline, its header holds a 32-bit offset into this table,
+ * and each distinct name is stored once for the whole process.
+ *
+ * Offset 0 is the empty name, so a zeroed (calloc'd) header is an
+ * anonymous entity.  The table only grows: storage is carved from
+ * fixed-size blocks that never move, so avmlib_name() is a lock-free
+ * lookup and the pointers it returns stay valid for the life of the
+ * process.  Interning takes a lock and is meant for creation time.
+ * */
+#ifndef _AVMLIB_NAMES_H_
+#define _AVMLIB_NAMES_H_
+
+#include <stdint.h>
+
+/**
+ * Longest name kept (longer ones are truncated)
+ */
+#define AVMLIB_NAME_MAX 63
+
+/**
+ * Name storage geometry: offset is (block << 16) | position
+ */
+#define AVMLIB_NAMES_BLOCK_SHIFT 16
+#define AVMLIB_NAMES_BLOCK_SIZE (1u << AVMLIB_NAMES_BLOCK_SHIFT)
+#define AVMLIB_NAMES_BLOCKS 4096 /* 256 MiB of names */
+
+/**
+ * Block array; only for avmlib_name()
+ */
+extern char *avmlib_names_blocks[AVMLIB_NAMES_BLOCKS];
+
+/**
+ * Name at an offset ("" for 0)
+ */
+#define avmlib_name(__offset) \
+    ((__offset) ? (const char *)avmlib_names_blocks[(__offset) >> AVMLIB_NAMES_BLOCK_SHIFT] + \
+                  ((__offset) & (AVMLIB_NAMES_BLOCK_SIZE - 1)) : "")
+
+/* Prototypes */
+uint32_t avmlib_name_intern(const char *name);
+uint64_t avmlib_names_bytes(void);
+int avmlib_names_adopt(char *base, uint64_t bytes);
+
+#endif /* _AVMLIB_NAMES_H_ */
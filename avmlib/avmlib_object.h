@@ -14,19 +14,30 @@
 
 /* LABEL */
 char *avmlib_compile_label(class_segment_t *seg, op_t *op);
-class_label_t *avmlib_new_label(char *name, uint8_t target_segment, uint32_t location);
+class_label_t *avmlib_new_label(char *name, uint16_t target_segment, uint32_t location);
 
 /* META */
 char *avmlib_compile_size(class_segment_t *seg, op_t *op);
 
+/* FILE */
+char *avmlib_compile_file(class_segment_t *seg, op_t *op);
+
+/* IN */
+char *avmlib_compile_in(class_segment_t *seg, op_t *op);
+
 /* OUT */
 char *avmlib_compile_out(class_segment_t *seg, op_t *op);
+char *avmlib_compile_flush(class_segment_t *seg, op_t *op);
 
 /* JUMPs */
 char *avmlib_compile_jmp(class_segment_t *seg, op_t *op);
 char *avmlib_compile_jz(class_segment_t *seg, op_t *op);
 char *avmlib_compile_jnz(class_segment_t *seg, op_t *op);
 
+/* TXN */
+char *avmlib_compile_begin(class_segment_t *seg, op_t *op);
+char *avmlib_compile_commit(class_segment_t *seg, op_t *op);
+
 /* MATH */
 char *avmlib_compile_add(class_segment_t *seg, op_t *op);
 char *avmlib_compile_sub(class_segment_t *seg, op_t *op);
@@ -107,7 +107,7 @@ avmlib_compile_add(
     /*Simple encode of the parameters */
     for (i=0;i<op->i_paramc;i++) {
         param = op->i_params[i];
-        avmlib_table_add(t_i,param->p_opcode);
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
     }
 
     return NULL;
@@ -208,7 +208,7 @@ avmlib_compile_sub(
     /*Simple encode of the parameters */
     for (i=0;i<op->i_paramc;i++) {
         param = op->i_params[i];
-        avmlib_table_add(t_i,param->p_opcode);
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
     }
 
     return NULL;
@@ -0,0 +1,88 @@
+/**************************************************************************//**
+ * @file avmlib_object_file.c
+ *
+ * @brief Implement file-related operations
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+
+#ifndef _AVM_OBJECT_FILE_C_
+#define _AVM_OBJECT_FILE_C_
+
+#include "avmlib.h"
+
+/**************************************************************************//**
+ * @brief Implement compilation of a FILE instruction
+ *
+ * @details The FILE instruction opens a file as a PORT or BUFFER.
+ * On a port, reads start at the beginning of the file and writes
+ * append.  A buffer maps the file copy-on-write: IN consumes straight
+ * from the page cache, and writes never reach the file.
+ *
+ * @param seg The program segment we're building
+ * @param op The op description of the current line
+ *
+ * @returns NULL on success, error string on failure.
+ *
+ * @remarks Requires exactly 2 arguments (target and filename)
+ * */
+char *
+avmlib_compile_file(
+    class_segment_t *seg,
+    op_t *op
+)
+{
+    char *param_err;
+    param_t *param;
+    int i;
+    table_t *t_i;
+
+    if (!op || !seg) {
+        return avmc_err_ret("Internal corruption; no active seg or op.");
+    }
+
+    if (op->i_paramc != 2) {
+        return avmc_err_ret("Syntax: FILE requires a target and a filename.\n");
+    }
+
+    /* 
+     * Try to resolve all parameters
+     */
+    param_err = avmc_resolve_op_parameters(seg,op);
+    if (param_err != NULL) return param_err;
+
+    /*
+     * Target must be a port or buffer
+     */
+    param = op->i_params[0];
+    if (!avmlib_entity_assert_class(param->p_opcode,3,
+                                    AVM_CLASS_PORT,
+                                    AVM_CLASS_BUFFER,
+                                    AVM_CLASS_UNRESOLVED)) {
+        return avmc_err_ret("FILE: Target \"%s\" is not a PORT or BUFFER object.\n",param->p_text);
+    }
+
+    /*
+     * Filename must be a string
+     */
+    param = op->i_params[1];
+    if (!avmlib_entity_assert_class(param->p_opcode,2,
+                                    AVM_CLASS_STRING,
+                                    AVM_CLASS_UNRESOLVED)) {
+        return avmc_err_ret("FILE: Filename \"%s\" is not a STRING object.\n",param->p_text);
+    }
+
+    /* Emit basic op */
+    t_i = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(t_i,avmlib_instruction_new(AVM_OP_FILE,0,op->i_paramc));
+
+    /*Simple encode of the parameters */
+    for (i=0;i<op->i_paramc;i++) {
+        param = op->i_params[i];
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
+    }
+
+    return NULL;
+}
+#endif /* _AVM_OBJECT_FILE_C_ */
@@ -0,0 +1,111 @@
+/**************************************************************************//**
+ * @file avmlib_object_in.c
+ *
+ * @brief Implement in-related operations
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+
+#ifndef _AVM_OBJECT_IN_C_
+#define _AVM_OBJECT_IN_C_
+
+#include "avmlib.h"
+
+/**************************************************************************//**
+ * @brief Implement compilation of an IN instruction
+ *
+ * @details The IN instruction represents reading from a PORT or BUFFER
+ *
+ * @param seg The program segment we're building
+ * @param op The op description of the current line
+ *
+ * @returns NULL on success, error string on failure.
+ *
+ * @remarks Requires 2 arguments (source and storage object), and allows a
+ * third (number of bytes)
+ * */
+char *
+avmlib_compile_in(
+    class_segment_t *seg,
+    op_t *op
+)
+{   
+    char *param_err;
+    param_t *param;
+    int i;
+    table_t *t_i;
+
+    if (!op || !seg) {
+        return avmc_err_ret("Internal corruption; no active seg or op.");
+    }
+
+    /*
+     * Must have at least 2 parameters, source and storage (may have size)
+     */
+    if (op->i_paramc < 2) {
+        return avmc_err_ret("Syntax: IN requires at least a source and a storage location.\n");
+    }
+
+    if (op->i_paramc > 3) {
+        return avmc_err_ret("Syntax: IN cannot take more than 3 parameters.");
+    }
+
+    /* 
+     * Try to resolve all parameters
+     */
+    param_err = avmc_resolve_op_parameters(seg,op);
+    if (param_err != NULL) return param_err;
+
+    /*
+     * Validate that first is a port or buffer (or unresolved, in which cases it's up to the linker)
+     */
+    param = op->i_params[0];
+    if (!avmlib_entity_assert_class(param->p_opcode,3,
+                                    AVM_CLASS_PORT,
+                                    AVM_CLASS_BUFFER,
+                                    AVM_CLASS_UNRESOLVED)) {
+        return avmc_err_ret("IN: Source \"%s\" is not a PORT or BUFFER object.\n",param->p_text);
+    }
+
+    /*
+     * Second must be writable storage
+     */
+    param = op->i_params[1];
+    if (!avmlib_entity_assert_class(param->p_opcode,5,
+                                    AVM_CLASS_STRING,
+                                    AVM_CLASS_BUFFER,
+                                    AVM_CLASS_NUMBER,
+                                    AVM_CLASS_REGISTER,
+                                    AVM_CLASS_UNRESOLVED) ||
+        (param->p_opcode & OP_FLAG_CONSTANT)) {
+        return avmc_err_ret("IN: Target \"%s\" is not a writable storage location.\n",param->p_text);
+    }
+
+    /*
+     * If we have 3 args, the final one (size) must be a numeric.
+     */
+    if (op->i_paramc > 2) {
+        param = op->i_params[2];
+        if (!avmlib_entity_assert_class(param->p_opcode,4,
+                                        AVM_CLASS_NUMBER,
+                                        AVM_CLASS_IMMEDIATE,
+                                        AVM_CLASS_REGISTER,
+                                        AVM_CLASS_UNRESOLVED)) {
+            return avmc_err_ret("IN: Size reference \"%s\" is not a numeric object.\n",param->p_text);
+        }
+    }
+
+    /* Emit basic op */
+    t_i = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(t_i,avmlib_instruction_new(AVM_OP_IN,0,op->i_paramc));
+
+    /*Simple encode of the parameters */
+    for (i=0;i<op->i_paramc;i++) {
+        param = op->i_params[i];
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
+    }
+
+    return NULL;
+}
+#endif /* _AVM_OBJECT_IN_C_ */
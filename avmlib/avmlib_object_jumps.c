@@ -82,7 +82,7 @@ avmlib_compile_jz(
     /*Simple encode of the parameters */
     for (i=0;i<op->i_paramc;i++) {
         param = op->i_params[i];
-        avmlib_table_add(t_i,param->p_opcode);
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
     }
 
     return NULL;
@@ -158,7 +158,7 @@ avmlib_compile_jnz(
     /*Simple encode of the parameters */
     for (i=0;i<op->i_paramc;i++) {
         param = op->i_params[i];
-        avmlib_table_add(t_i,param->p_opcode);
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
     }
 
     return NULL;
@@ -221,7 +221,7 @@ avmlib_compile_jmp(
     /*Simple encode of the parameters */
     for (i=0;i<op->i_paramc;i++) {
         param = op->i_params[i];
-        avmlib_table_add(t_i,param->p_opcode);
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
     }
 
     return NULL;
@@ -26,7 +26,7 @@
 class_label_t * 
 avmlib_new_label(
     char *name,
-    uint8_t segment_id,
+    uint16_t segment_id,
     uint32_t location
 )
 {
@@ -34,7 +34,7 @@ avmlib_new_label(
     class_label_t *obj = calloc(1,sizeof(*obj));
     if (NULL == obj) return NULL;
 
-    strncpy(obj->header.symname, name, sizeof(obj->header.symname));
+    avmm_entity_name_set(obj,name);
 
     obj->segment = segment_id;
     obj->offset = location;
@@ -64,6 +64,10 @@ avmlib_compile_size(
                                     AVM_CLASS_UNRESOLVED)) {
         return avmc_err_ret("SIZE: Reference \"%s\" is not a numeric storage location.\n",param->p_text);
     }
+    if (AVM_CLASS_REGISTER == avmlib_entity_class(param->p_opcode)) {
+        avm_dbg(1,"AVMC","SIZE: Register \"%s\" holds 32 bits; sizes past 4 GiB need a NUMBER.\n",
+                param->p_text);
+    }
 
     /* Emit basic op */
     t_i = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
@@ -72,7 +76,7 @@ avmlib_compile_size(
     /*Simple encode of the parameters */
     for (i=0;i<op->i_paramc;i++) {
         param = op->i_params[i];
-        avmlib_table_add(t_i,param->p_opcode);
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
     }
 
     return NULL;
@@ -87,7 +87,73 @@ avmlib_compile_out(
     /*Simple encode of the parameters */
     for (i=0;i<op->i_paramc;i++) {
         param = op->i_params[i];
-        avmlib_table_add(t_i,param->p_opcode);
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
+    }
+
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Implement compilation of a FLUSH instruction
+ *
+ * @details The FLUSH instruction pushes any output held in a PORT's
+ * buffer out to the OS.
+ *
+ * @param seg The program segment we're building
+ * @param op The op description of the current line
+ *
+ * @returns NULL on success, error string on failure.
+ *
+ * @remarks Takes an optional PORT; with no argument, all ports are flushed.
+ * */
+char *
+avmlib_compile_flush(
+    class_segment_t *seg,
+    op_t *op
+)
+{   
+    char *param_err;
+    param_t *param;
+    int i;
+    table_t *t_i;
+
+    if (!op || !seg) {
+        return avmc_err_ret("Internal corruption; no active seg or op.");
+    }
+
+    /*
+     * At most one parameter, the port
+     */
+    if (op->i_paramc > 1) {
+        return avmc_err_ret("Syntax: FLUSH takes at most one port.\n");
+    }
+
+    /* 
+     * Try to resolve all parameters
+     */
+    param_err = avmc_resolve_op_parameters(seg,op);
+    if (param_err != NULL) return param_err;
+
+    /*
+     * Validate that the port is a port (or unresolved, in which cases it's up to the linker)
+     */
+    if (op->i_paramc == 1) {
+        param = op->i_params[0];
+        if (!avmlib_entity_assert_class(param->p_opcode,2,
+                                        AVM_CLASS_PORT,
+                                        AVM_CLASS_UNRESOLVED)) {
+            return avmc_err_ret("FLUSH: Target \"%s\" is not a PORT object.\n",param->p_text);
+        }
+    }
+
+    /* Emit basic op */
+    t_i = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(t_i,avmlib_instruction_new(AVM_OP_FLUSH,0,op->i_paramc));
+
+    /*Simple encode of the parameters */
+    for (i=0;i<op->i_paramc;i++) {
+        param = op->i_params[i];
+        avmlib_entity_emit(t_i,param->p_opcode,param->p_ext);
     }
 
     return NULL;
@@ -0,0 +1,87 @@
+/**************************************************************************//**
+ * @file avmlib_object_txn.c
+ *
+ * @brief Implement register transaction operations
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+
+#ifndef _AVM_OBJECT_TXN_C_
+#define _AVM_OBJECT_TXN_C_
+
+#include "avmlib.h"
+
+/**************************************************************************//**
+ * @brief Implement compilation of a BEGIN instruction
+ *
+ * @details The BEGIN instruction opens a register transaction; register
+ * writes are held until the matching COMMIT.
+ *
+ * @param seg The program segment we're building
+ * @param op The op description of the current line
+ *
+ * @returns NULL on success, error string on failure.
+ *
+ * @remarks Takes no parameters.
+ * */
+char *
+avmlib_compile_begin(
+    class_segment_t *seg,
+    op_t *op
+)
+{
+    table_t *t_i;
+
+    if (!op || !seg) {
+        return avmc_err_ret("Internal corruption; no active seg or op.");
+    }
+
+    if (op->i_paramc != 0) {
+        return avmc_err_ret("Syntax: BEGIN takes no parameters.\n");
+    }
+
+    /* Emit basic op */
+    t_i = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(t_i,avmlib_instruction_new(AVM_OP_BEGIN,0,0));
+
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Implement compilation of a COMMIT instruction
+ *
+ * @details The COMMIT instruction closes a register transaction, applying
+ * all held register writes in program order, batching consecutive writes
+ * that share a backend.
+ *
+ * @param seg The program segment we're building
+ * @param op The op description of the current line
+ *
+ * @returns NULL on success, error string on failure.
+ *
+ * @remarks Takes no parameters.
+ * */
+char *
+avmlib_compile_commit(
+    class_segment_t *seg,
+    op_t *op
+)
+{
+    table_t *t_i;
+
+    if (!op || !seg) {
+        return avmc_err_ret("Internal corruption; no active seg or op.");
+    }
+
+    if (op->i_paramc != 0) {
+        return avmc_err_ret("Syntax: COMMIT takes no parameters.\n");
+    }
+
+    /* Emit basic op */
+    t_i = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(t_i,avmlib_instruction_new(AVM_OP_COMMIT,0,0));
+
+    return NULL;
+}
+#endif /* _AVM_OBJECT_TXN_C_ */
@@ -0,0 +1,319 @@
+/**************************************************************************//**
+ * @file avmlib_perf.c
+ *
+ * @brief Symbols for Linux perf: perf maps and jitdump
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * The jitdump layout is perf's (tools/perf/Documentation/jitdump-
+ * specification.txt), version 1: a file header, then records, all in
+ * host byte order.  Only JIT_CODE_LOAD is written.
+ * */
+#ifndef _AVMLIB_PERF_C_
+#define _AVMLIB_PERF_C_
+
+#include "avmlib.h"
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Longest symbol written ("avm:" segment ":" label)
+ */
+#define AVMLIB_PERF_SYM_MAX (2 * AVMLIB_NAME_MAX + 8)
+
+/**
+ * jitdump constants
+ */
+#define AVMLIB_PERF_JD_MAGIC 0x4A695444
+#define AVMLIB_PERF_JD_VERSION 1
+#define AVMLIB_PERF_JD_CODE_LOAD 0
+
+#if defined(__x86_64__)
+#define AVMLIB_PERF_JD_MACH EM_X86_64
+#elif defined(__aarch64__)
+#define AVMLIB_PERF_JD_MACH EM_AARCH64
+#else
+#define AVMLIB_PERF_JD_MACH EM_NONE
+#endif
+
+/**
+ * jitdump file header
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size; /* Of this header */
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} avmlib_perf_jd_header_t;
+
+/**
+ * jitdump JIT_CODE_LOAD record, less the name and code that follow it
+ */
+typedef struct {
+    uint32_t id;
+    uint32_t total_size; /* Of the whole record */
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+} avmlib_perf_jd_load_t;
+
+/* Everything below is guarded by the lock */
+static pthread_mutex_t avmlib_perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static int avmlib_perf_what = -1; /* AVMLIB_PERF_..., or -1 until asked */
+static FILE *avmlib_perf_map; /* perf map, once opened */
+static int avmlib_perf_jd = -1; /* jitdump fd, once opened */
+static uint64_t avmlib_perf_index; /* Next JIT_CODE_LOAD's code_index */
+
+/**************************************************************************//**
+ * @brief Timestamp for jitdump (perf record -k mono).
+ * */
+static uint64_t
+avmlib_perf_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**************************************************************************//**
+ * @brief Write all of a buffer.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_perf_write(
+    int fd,
+    const void *buf,
+    size_t len
+)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len) {
+        if (0 > (n = write(fd,p,len))) {
+            if (EINTR == errno) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Create the jitdump file.  (Lock held.)
+ *
+ * @details perf finds the file through an executable mapping of it,
+ * so one page is mapped and left mapped.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_perf_jd_open(void)
+{
+    avmlib_perf_jd_header_t hdr;
+    char path[64];
+    int fd;
+
+    snprintf(path,sizeof(path),"/tmp/jit-%d.dump",(int)getpid());
+    if (0 > (fd = open(path,O_CREAT | O_TRUNC | O_RDWR,0666))) {
+        avmlib_err("%s: Can't create \"%s\" (%s).\n",__func__,path,strerror(errno));
+        return -1;
+    }
+    if (MAP_FAILED == mmap(NULL,(size_t)sysconf(_SC_PAGESIZE),PROT_READ | PROT_EXEC,MAP_PRIVATE,fd,0)) {
+        avmlib_err("%s: Can't map \"%s\" (%s).\n",__func__,path,strerror(errno));
+        close(fd);
+        return -1;
+    }
+    memset(&hdr,0,sizeof(hdr));
+    hdr.magic = AVMLIB_PERF_JD_MAGIC;
+    hdr.version = AVMLIB_PERF_JD_VERSION;
+    hdr.total_size = sizeof(hdr);
+    hdr.elf_mach = AVMLIB_PERF_JD_MACH;
+    hdr.pid = (uint32_t)getpid();
+    hdr.timestamp = avmlib_perf_now();
+    if (0 > avmlib_perf_write(fd,&hdr,sizeof(hdr))) {
+        avmlib_err("%s: Can't write \"%s\" (%s).\n",__func__,path,strerror(errno));
+        close(fd);
+        return -1;
+    }
+    avmlib_perf_jd = fd;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Choose what to write for the process.
+ *
+ * @details Overrides AVMLIB_PERF_ENV.  Only code made afterwards is
+ * written.
+ * */
+void
+avmlib_perf_enable(
+    int what
+)
+{
+    pthread_mutex_lock(&avmlib_perf_lock);
+    avmlib_perf_what = what & (AVMLIB_PERF_MAP | AVMLIB_PERF_JITDUMP);
+    pthread_mutex_unlock(&avmlib_perf_lock);
+}
+
+/**************************************************************************//**
+ * @brief What's being written (AVMLIB_PERF_...; 0 for nothing).
+ * */
+int
+avmlib_perf_enabled(void)
+{
+    const char *env;
+    int what;
+
+    pthread_mutex_lock(&avmlib_perf_lock);
+    if (0 > (what = avmlib_perf_what)) {
+        env = getenv(AVMLIB_PERF_ENV);
+        if (!env || !*env || !strcmp(env,"0")) {
+            what = 0;
+        } else if (!strcmp(env,"jitdump")) {
+            what = AVMLIB_PERF_MAP | AVMLIB_PERF_JITDUMP;
+        } else {
+            what = AVMLIB_PERF_MAP;
+        }
+        avmlib_perf_what = what;
+    }
+    pthread_mutex_unlock(&avmlib_perf_lock);
+    return what;
+}
+
+/**************************************************************************//**
+ * @brief Name a run of machine code for perf.
+ *
+ * @details The code must stay where it is, unchanged, for as long as
+ * perf may look at it.  Does nothing unless avmlib_perf_enabled().
+ * */
+void
+avmlib_perf_code(
+    const char *name,
+    const void *code,
+    size_t size
+)
+{
+    avmlib_perf_jd_load_t rec;
+    char path[64];
+    int what;
+
+    if (!size || !(what = avmlib_perf_enabled())) return;
+    pthread_mutex_lock(&avmlib_perf_lock);
+
+    /* Step 1: perf map */
+    if (what & AVMLIB_PERF_MAP) {
+        if (!avmlib_perf_map) {
+            snprintf(path,sizeof(path),"/tmp/perf-%d.map",(int)getpid());
+            if (NULL == (avmlib_perf_map = fopen(path,"a"))) {
+                avmlib_err("%s: Can't open \"%s\" (%s).\n",__func__,path,strerror(errno));
+                avmlib_perf_what &= ~AVMLIB_PERF_MAP;
+            }
+        }
+        if (avmlib_perf_map) {
+            fprintf(avmlib_perf_map,"%lx %zx %s\n",(unsigned long)(uintptr_t)code,size,name);
+            fflush(avmlib_perf_map);
+        }
+    }
+
+    /* Step 2: jitdump */
+    if (what & AVMLIB_PERF_JITDUMP) {
+        if ((0 > avmlib_perf_jd) && (0 > avmlib_perf_jd_open())) {
+            avmlib_perf_what &= ~AVMLIB_PERF_JITDUMP;
+        } else {
+            memset(&rec,0,sizeof(rec));
+            rec.id = AVMLIB_PERF_JD_CODE_LOAD;
+            rec.total_size = (uint32_t)(sizeof(rec) + strlen(name) + 1 + size);
+            rec.timestamp = avmlib_perf_now();
+            rec.pid = (uint32_t)getpid();
+            rec.tid = (uint32_t)syscall(SYS_gettid);
+            rec.vma = rec.code_addr = (uint64_t)(uintptr_t)code;
+            rec.code_size = size;
+            rec.code_index = avmlib_perf_index++;
+            if ((0 > avmlib_perf_write(avmlib_perf_jd,&rec,sizeof(rec))) ||
+                (0 > avmlib_perf_write(avmlib_perf_jd,name,strlen(name) + 1)) ||
+                (0 > avmlib_perf_write(avmlib_perf_jd,code,size))) {
+                avmlib_err("%s: Can't write jitdump (%s).\n",__func__,strerror(errno));
+                avmlib_perf_what &= ~AVMLIB_PERF_JITDUMP;
+            }
+        }
+    }
+    pthread_mutex_unlock(&avmlib_perf_lock);
+}
+
+/**************************************************************************//**
+ * @brief Name a segment's machine code for perf, label by label.
+ *
+ * @details at[] holds the offset into code of each of the segment's
+ * code words (code->size + 1 of them, the last being where the code
+ * falls off the end), or UINT32_MAX for words that don't start an
+ * instruction.  Each label's run is named "avm:<segment>:<label>";
+ * code before the first label and after the last word is named
+ * "avm:<segment>".
+ * */
+void
+avmlib_perf_segment(
+    class_segment_t *seg,
+    const uint8_t *code,
+    size_t len,
+    const uint32_t *at
+)
+{
+    const table_t *insns = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    const table_t *labels = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    const class_label_t *lbl;
+    const char **named, *name;
+    char sym[AVMLIB_PERF_SYM_MAX];
+    size_t start = 0;
+    uint32_t pc, i;
+
+    if (!avmlib_perf_enabled()) return;
+    if (NULL == (named = calloc(insns->size + 1,sizeof(*named)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return;
+    }
+
+    /* Step 1: Which words are labelled (the first name wins) */
+    for (i=0;i<labels->size;i++) {
+        lbl = (const class_label_t *)labels->entries[i];
+        if (lbl && (lbl->offset < insns->size) && (UINT32_MAX != at[lbl->offset]) &&
+            !named[lbl->offset] && *(name = avmm_entity_name(lbl))) {
+            named[lbl->offset] = name;
+        }
+    }
+
+    /* Step 2: One symbol per run between labels */
+    snprintf(sym,sizeof(sym),"avm:%s",avmm_entity_name(seg));
+    for (pc=0;pc<=insns->size;pc++) {
+        if ((pc < insns->size) && !named[pc]) continue;
+        avmlib_perf_code(sym,code + start,at[pc] - start);
+        start = at[pc];
+        if (pc < insns->size) {
+            snprintf(sym,sizeof(sym),"avm:%s:%s",avmm_entity_name(seg),named[pc]);
+        } else {
+            snprintf(sym,sizeof(sym),"avm:%s",avmm_entity_name(seg));
+        }
+    }
+    avmlib_perf_code(sym,code + start,len - start);
+    free(named);
+}
+
+#endif /* _AVMLIB_PERF_C_ */
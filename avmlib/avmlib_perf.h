@@ -0,0 +1,47 @@
+/**************************************************************************//**
+ * @file avmlib_perf.h
+ *
+ * @brief Symbols for Linux perf: perf maps and jitdump.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * perf can only name code it finds in an ELF file.  For machine code
+ * the JIT makes, avmlib_perf_segment() appends a line per label to
+ * /tmp/perf-<pid>.map ("avm:<segment>:<label>"), which perf report
+ * reads by itself, and optionally a JIT_CODE_LOAD record (with a copy
+ * of the code) to /tmp/jit-<pid>.dump for "perf inject --jit", which
+ * also makes perf annotate work.  Record with "perf record -k mono"
+ * when using the dump.
+ *
+ * Ahead-of-time code needs none of this: avmlib_aot_translate() names
+ * the function after its segment, and perf reads it from the shared
+ * object.  Interpreted code can't be told apart by address at all;
+ * it shows as the interpreter.
+ *
+ * Set AVMLIB_PERF_ENV to "map" (or anything but "0") for the map
+ * alone, or to "jitdump" for both, or call avmlib_perf_enable().
+ * */
+#ifndef _AVMLIB_PERF_H_
+#define _AVMLIB_PERF_H_
+
+#include "avmm_data.h"
+
+/**
+ * Environment variable that turns symbol output on
+ */
+#define AVMLIB_PERF_ENV "AVM_PERF"
+
+/**
+ * What to write
+ */
+#define AVMLIB_PERF_MAP 0x01 /* /tmp/perf-<pid>.map */
+#define AVMLIB_PERF_JITDUMP 0x02 /* /tmp/jit-<pid>.dump */
+
+/* Prototypes */
+void avmlib_perf_enable(int what);
+int avmlib_perf_enabled(void);
+void avmlib_perf_code(const char *name, const void *code, size_t size);
+void avmlib_perf_segment(class_segment_t *seg, const uint8_t *code, size_t len, const uint32_t *at);
+
+#endif /* _AVMLIB_PERF_H_ */
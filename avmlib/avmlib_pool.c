@@ -0,0 +1,437 @@
+/**************************************************************************//**
+ * @file avmlib_pool.c
+ *
+ * @brief A pool of program instances, one worker per core
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_POOL_C_
+#define _AVMLIB_POOL_C_
+
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#include "avmlib.h"
+#include <sched.h>
+#include <unistd.h>
+
+/**************************************************************************//**
+ * @brief Make an instance for a worker.
+ * */
+static avmlib_vm_t *
+avmlib_pool_instance(
+    avmlib_pool_worker_t *w
+)
+{
+    avmlib_vm_t *vm = avmlib_vm_new(w->pool->tmpl);
+
+    /* It's reset (and enters the entry segment) per job; until then it
+     * shouldn't keep a swapped-out version alive */
+    if (vm) {
+        avmlib_segment_leave(&vm->proc);
+        vm->fileio = w->io;
+    }
+    return vm;
+}
+
+/**************************************************************************//**
+ * @brief A job is over; report it and count it off.
+ * */
+static void
+avmlib_pool_finish(
+    avmlib_pool_worker_t *w,
+    avmlib_vm_t *vm,
+    avmlib_vm_status_t status
+)
+{
+    avmlib_pool_job_t *job = (avmlib_pool_job_t *)vm->host;
+    avmlib_pool_t *pool = w->pool;
+
+    if (job->done) job->done(vm,status,job->arg);
+    free(job);
+    vm->host = NULL;
+    w->jobs++;
+
+    /* Stop pinning its segment version, and free any swapped-out version
+     * whose grace period ran past the swap */
+    avmlib_segment_leave(&vm->proc);
+    avmlib_epoch_reclaim((avmlib_epoch_t *)pool->tmpl->epoch);
+
+    avmlib_stats_gauge(pending,-1);
+    if (0 == __atomic_sub_fetch(&pool->pending,1,__ATOMIC_ACQ_REL)) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Keep an instance whose job is over for a later one.
+ * */
+static void
+avmlib_pool_spare(
+    avmlib_pool_worker_t *w,
+    avmlib_vm_t *vm
+)
+{
+    avmlib_vm_t **spare;
+    int size;
+
+    if (w->nspare == w->spare_size) {
+        size = w->spare_size ? (w->spare_size * 2) : 4;
+        if (NULL == (spare = realloc(w->spare,size * sizeof(*spare)))) {
+            avmlib_vm_free(vm);
+            return;
+        }
+        w->spare = spare;
+        w->spare_size = size;
+    }
+    w->spare[w->nspare++] = vm;
+}
+
+/**************************************************************************//**
+ * @brief Park a BLOCKED instance on the worker's event loop.
+ *
+ * @details If it's the worker's current instance, the worker moves on
+ * to a spare (or new) one.  An instance waiting on the worker's file
+ * I/O backend is already bound for the loop's run queue.
+ *
+ * @returns 0 if parked, -1 if it can't be (the job is then over).
+ * */
+static int
+avmlib_pool_park(
+    avmlib_pool_worker_t *w,
+    avmlib_vm_t *vm
+)
+{
+    class_port_t *port = vm->proc.wait_port;
+    avmlib_vm_t *next = NULL;
+
+    /* Step 1: Something we can poll; a backend request is already
+     * on its way to the loop */
+    if (!vm->io_wait) {
+        if (!port || (0 > port->fd)) return -1;
+        if (!port->evloop && (0 > avmlib_evloop_add_port(w->loop,port))) return -1;
+        if (port->evloop != w->loop) return -1;
+    }
+
+    /* Step 2: An instance for the jobs behind this one */
+    if (vm == w->vm) {
+        if (w->nspare) {
+            next = w->spare[--w->nspare];
+        } else if (NULL == (next = avmlib_pool_instance(w))) {
+            return -1;
+        }
+    }
+
+    /* Step 3: Park */
+    if (!vm->io_wait && (0 > avmlib_evloop_park(w->loop,&vm->proc,port,vm->wait_write))) {
+        if (next) avmlib_pool_spare(w,next);
+        return -1;
+    }
+    if (next) w->vm = next;
+    pthread_mutex_lock(&w->lock);
+    w->parked++;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Run (or resume) a job's instance until it's done or parked.
+ * */
+static void
+avmlib_pool_exec(
+    avmlib_pool_worker_t *w,
+    avmlib_vm_t *vm
+)
+{
+    avmlib_vm_status_t status = avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED);
+
+    if ((AVMLIB_VM_BLOCKED == status) && (0 == avmlib_pool_park(w,vm))) return;
+    avmlib_pool_finish(w,vm,status);
+    if (vm != w->vm) avmlib_pool_spare(w,vm);
+}
+
+/**************************************************************************//**
+ * @brief Worker thread.
+ *
+ * @details Pins itself, makes its instance and event loop (so the
+ * instance's memory is allocated from the core it will run on), then
+ * runs jobs from its queue, and parked jobs as they become ready, until
+ * told to stop with nothing left queued or parked.
+ * */
+static void *
+avmlib_pool_worker(
+    void *arg
+)
+{
+    avmlib_pool_worker_t *w = (avmlib_pool_worker_t *)arg;
+    avmlib_pool_t *pool = w->pool;
+    avmlib_pool_job_t *job;
+    class_process_t *proc;
+    cpu_set_t cpus;
+    int i;
+
+    /* Step 1: Pin and make our instance */
+    if (0 <= w->cpu) {
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu,&cpus);
+        if (pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus)) {
+            avm_dbg(1,"AVMLIB","Pool worker can't pin to CPU %d.\n",w->cpu);
+        }
+    }
+    if ((NULL != (w->loop = avmlib_evloop_new())) &&
+        ((0 > pool->fileio) || (NULL != (w->io = avmlib_fileio_new(w->loop,(fileio_backend_t)pool->fileio,0))))) {
+        w->vm = avmlib_pool_instance(w);
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->started++;
+    if (!w->vm) pool->failed++;
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->idle_lock);
+    if (!w->vm) goto _avmlib_pool_worker_out;
+
+    for (;;) {
+        /* Step 2: Parked jobs whose ports are ready, or whose file I/O
+         * is done (submitting what's queued every so often) */
+        if (w->io && w->io->inflight && (++w->io_since >= AVMLIB_POOL_FILEIO_BATCH)) {
+            w->io_since = 0;
+            avmlib_fileio_poll(w->io,0);
+        }
+        if (w->parked) avmlib_evloop_poll(w->loop,0);
+        while (NULL != (proc = avmlib_evloop_next(w->loop))) {
+            pthread_mutex_lock(&w->lock);
+            w->parked--;
+            pthread_mutex_unlock(&w->lock);
+            avmlib_pool_exec(w,AVMLIB_VM_OF(proc));
+        }
+
+        /* Step 3: Next job, or wait for one (or for a port) */
+        pthread_mutex_lock(&w->lock);
+        if (!w->head) {
+            if (w->parked) {
+                pthread_mutex_unlock(&w->lock);
+                if (w->io && w->io->inflight) {
+                    w->io_since = 0;
+                    avmlib_fileio_poll(w->io,1);
+                } else {
+                    avmlib_evloop_poll(w->loop,-1);
+                }
+                continue;
+            }
+            if (w->stop) {
+                pthread_mutex_unlock(&w->lock);
+                break;
+            }
+            pthread_cond_wait(&w->wake,&w->lock);
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+        job = w->head;
+        if (NULL == (w->head = job->next)) w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        /* Step 4: Run it */
+        w->vm->host = job;
+        if ((0 == avmlib_vm_reset(w->vm)) &&
+            (!job->setup || (0 == job->setup(w->vm,job->arg)))) {
+            avmlib_pool_exec(w,w->vm);
+        } else {
+            avmlib_pool_finish(w,w->vm,AVMLIB_VM_ERROR);
+        }
+    }
+
+_avmlib_pool_worker_out:
+    for (i=0;i<w->nspare;i++) avmlib_vm_free(w->spare[i]);
+    free(w->spare);
+    w->spare = NULL;
+    w->nspare = w->spare_size = 0;
+    avmlib_vm_free(w->vm);
+    w->vm = NULL;
+    avmlib_fileio_destroy(w->io);
+    w->io = NULL;
+    avmlib_evloop_destroy(w->loop);
+    w->loop = NULL;
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief The file I/O backend AVMLIB_POOL_FILEIO_ENV asks for.
+ *
+ * @returns A fileio_backend_t, or -1 for none.
+ * */
+static int
+avmlib_pool_fileio(void)
+{
+    const char *env = getenv(AVMLIB_POOL_FILEIO_ENV);
+
+    if (!env || !*env || !strcmp(env,"0")) return -1;
+    if (!strcmp(env,"uring")) return FILEIO_BACKEND_URING;
+    if (!strcmp(env,"threads")) return FILEIO_BACKEND_THREADS;
+    if (strcmp(env,"auto")) {
+        avmlib_err("%s: Unknown %s \"%s\"; using auto.\n",__func__,AVMLIB_POOL_FILEIO_ENV,env);
+    }
+    return FILEIO_BACKEND_AUTO;
+}
+
+/**************************************************************************//**
+ * @brief Make a pool of instances of a loaded template.
+ *
+ * @param tmpl The template machine (see avmlib_vm_program())
+ * @param nworkers Workers to start; 0 for one per online core
+ *
+ * @returns The pool, with every worker's instance made, or NULL on
+ * failure.
+ * */
+avmlib_pool_t *
+avmlib_pool_new(
+    avm_t *tmpl,
+    int nworkers
+)
+{
+    avmlib_pool_t *pool;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (ncpu < 1) ncpu = 1;
+    if (nworkers <= 0) nworkers = (int)ncpu;
+
+    /* Step 1: Pool */
+    if ((NULL == (pool = calloc(1,sizeof(*pool)))) ||
+        (NULL == (pool->workers = calloc(nworkers,sizeof(*pool->workers))))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        free(pool);
+        return NULL;
+    }
+    pool->tmpl = tmpl;
+    pool->fileio = avmlib_pool_fileio();
+    pthread_mutex_init(&pool->idle_lock,NULL);
+    pthread_cond_init(&pool->idle,NULL);
+
+    /* Step 2: Workers */
+    for (i=0;i<nworkers;i++) {
+        avmlib_pool_worker_t *w = &pool->workers[i];
+        w->pool = pool;
+        w->cpu = (int)(i % ncpu);
+        pthread_mutex_init(&w->lock,NULL);
+        pthread_cond_init(&w->wake,NULL);
+        if (pthread_create(&w->thread,NULL,avmlib_pool_worker,w)) {
+            avmlib_err("%s: Can't start worker %d.\n",__func__,i);
+            pthread_mutex_destroy(&w->lock);
+            pthread_cond_destroy(&w->wake);
+            break;
+        }
+        pool->nworkers++;
+    }
+
+    /* Step 3: Wait for their instances */
+    pthread_mutex_lock(&pool->idle_lock);
+    while (pool->started < pool->nworkers) pthread_cond_wait(&pool->idle,&pool->idle_lock);
+    pthread_mutex_unlock(&pool->idle_lock);
+    if ((pool->nworkers < nworkers) || pool->failed) {
+        avmlib_err("%s: Only %d of %d workers started.\n",__func__,
+                   pool->nworkers - pool->failed,nworkers);
+        avmlib_pool_free(pool);
+        return NULL;
+    }
+
+    avm_dbg(2,"AVMLIB","Pool of %d workers on %ld CPUs.\n",nworkers,ncpu);
+    return pool;
+}
+
+/**************************************************************************//**
+ * @brief Queue one run of the program.
+ *
+ * @param pool The pool
+ * @param setup Called on the worker before the run, or NULL
+ * @param done Called on the worker after the run, or NULL
+ * @param arg Passed to both
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_pool_run(
+    avmlib_pool_t *pool,
+    avmlib_pool_setup_fn setup,
+    avmlib_pool_done_fn done,
+    void *arg
+)
+{
+    avmlib_pool_worker_t *w;
+    avmlib_pool_job_t *job;
+
+    if (NULL == (job = malloc(sizeof(*job)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return -1;
+    }
+    job->setup = setup;
+    job->done = done;
+    job->arg = arg;
+    job->next = NULL;
+
+    w = &pool->workers[__atomic_fetch_add(&pool->next,1,__ATOMIC_RELAXED) % pool->nworkers];
+    __atomic_add_fetch(&pool->pending,1,__ATOMIC_ACQ_REL);
+    avmlib_stats_gauge(pending,1);
+    pthread_mutex_lock(&w->lock);
+    if (w->tail) {
+        w->tail->next = job;
+    } else {
+        w->head = job;
+    }
+    w->tail = job;
+    pthread_cond_signal(&w->wake);
+    if (w->parked) avmlib_evloop_wake(w->loop);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Wait until every queued job is done.
+ * */
+void
+avmlib_pool_wait(
+    avmlib_pool_t *pool
+)
+{
+    pthread_mutex_lock(&pool->idle_lock);
+    while (__atomic_load_n(&pool->pending,__ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&pool->idle,&pool->idle_lock);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/**************************************************************************//**
+ * @brief Stop the workers and release the pool.
+ *
+ * @details Jobs already queued are run first, and parked jobs are
+ * waited for.  The template is untouched.
+ * */
+void
+avmlib_pool_free(
+    avmlib_pool_t *pool
+)
+{
+    avmlib_pool_worker_t *w;
+    int i;
+
+    if (!pool) return;
+    for (i=0;i<pool->nworkers;i++) {
+        w = &pool->workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->wake);
+        if (w->parked) avmlib_evloop_wake(w->loop);
+        pthread_mutex_unlock(&w->lock);
+    }
+    for (i=0;i<pool->nworkers;i++) {
+        w = &pool->workers[i];
+        pthread_join(w->thread,NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->wake);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->workers);
+    free(pool);
+}
+
+#endif /* _AVMLIB_POOL_C_ */
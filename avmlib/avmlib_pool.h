@@ -0,0 +1,119 @@
+/**************************************************************************//**
+ * @file avmlib_pool.h
+ *
+ * @brief A pool of program instances, one worker per core.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Each worker thread is pinned to a core and owns one instance of the
+ * template (avmlib_vm_new()), which it resets between jobs, so a job
+ * costs a reset plus whatever it writes rather than a machine.  Jobs
+ * are handed to workers round-robin; each worker has its own queue and
+ * lock, so workers never contend with each other, only with the
+ * submitter.
+ *
+ * A job is a pair of host callbacks around one run of the program:
+ * setup() to seed the instance (NUMBERs, registers, ports), and done()
+ * to collect results.  Both run on the worker.  After done(), the
+ * instance lets go of the segment it ran in, and the worker reclaims
+ * any segment versions swapped out (avmlib_segment_swap()) while jobs
+ * were still looking them up.
+ *
+ * A job that blocks on a non-blocking descriptor port (a socket or
+ * pipe setup() handed it) doesn't hold its worker: the instance is
+ * parked on the worker's event loop (avmlib_evloop.h) and the worker
+ * carries on with its queue on another instance, resuming the parked
+ * one once its port is ready.  A worker keeps the instances freed up
+ * this way for later jobs.  Jobs that block on a port that can't be
+ * polled (no descriptor, or one in another event loop) finish with
+ * AVMLIB_VM_BLOCKED, as does one that can't get a spare instance.
+ *
+ * Set AVMLIB_POOL_FILEIO_ENV to "uring", "threads" or "auto" to give
+ * each worker a file I/O backend (avmlib_fileio.h) of that kind: files
+ * the jobs open with FILE are then read and written through it, and a
+ * job waiting on file I/O is parked like one waiting on a socket, so a
+ * worker's jobs share batched submissions.  setup() can attach ports
+ * of its own with avmlib_fileio_add_port(vm->fileio,port).
+ * */
+#ifndef _AVMLIB_POOL_H_
+#define _AVMLIB_POOL_H_
+
+#include <pthread.h>
+#include "avmlib_vm.h"
+#include "avmlib_evloop.h"
+#include "avmlib_fileio.h"
+
+/**
+ * Environment variable selecting a per-worker file I/O backend
+ */
+#define AVMLIB_POOL_FILEIO_ENV "AVM_FILEIO"
+
+/**
+ * Jobs a busy worker starts between file I/O submissions, so requests
+ * from consecutive jobs go to the backend together
+ */
+#define AVMLIB_POOL_FILEIO_BATCH 32
+
+/**
+ * Host callbacks for a job
+ */
+typedef int (*avmlib_pool_setup_fn)(avmlib_vm_t *vm, void *arg);
+typedef void (*avmlib_pool_done_fn)(avmlib_vm_t *vm, avmlib_vm_status_t status, void *arg);
+
+/**
+ * A queued job
+ */
+typedef struct _avmlib_pool_job_s {
+    avmlib_pool_setup_fn setup; /* Optional; nonzero return skips the run */
+    avmlib_pool_done_fn done; /* Optional */
+    void *arg;
+    struct _avmlib_pool_job_s *next;
+} avmlib_pool_job_t;
+
+struct _avmlib_pool_s;
+
+/**
+ * A worker
+ */
+typedef struct {
+    struct _avmlib_pool_s *pool;
+    pthread_t thread;
+    int cpu; /* Core it's pinned to, or -1 */
+    avmlib_vm_t *vm; /* Instance the next job runs on */
+    avmlib_evloop_t *loop; /* Where its blocked jobs park */
+    avmlib_fileio_t *io; /* Its file I/O backend, or NULL */
+    avmlib_vm_t **spare; /* Instances whose parked jobs have finished */
+    int nspare, spare_size;
+    pthread_mutex_t lock; /* Guards the queue, stop and parked */
+    pthread_cond_t wake; /* Signalled with no jobs parked; else loop is woken */
+    avmlib_pool_job_t *head, *tail; /* Queue (FIFO) */
+    int stop;
+    int parked; /* Jobs parked on loop (or waiting on io) */
+    int io_since; /* Jobs started since io was last polled */
+    uint64_t jobs; /* Jobs completed */
+} avmlib_pool_worker_t;
+
+/**
+ * A pool
+ */
+typedef struct _avmlib_pool_s {
+    avm_t *tmpl; /* Template the instances were made from */
+    int nworkers;
+    avmlib_pool_worker_t *workers;
+    int fileio; /* Workers' file I/O backend (fileio_backend_t), or -1 for none */
+    uint32_t next; /* Round-robin cursor */
+    uint64_t pending; /* Jobs submitted and not yet done */
+    int started; /* Workers that have made their instance (or failed to) */
+    int failed; /* Workers that couldn't */
+    pthread_mutex_t idle_lock; /* Guards started and failed; for avmlib_pool_wait() */
+    pthread_cond_t idle;
+} avmlib_pool_t;
+
+/* Prototypes */
+avmlib_pool_t *avmlib_pool_new(avm_t *tmpl, int nworkers);
+int avmlib_pool_run(avmlib_pool_t *pool, avmlib_pool_setup_fn setup, avmlib_pool_done_fn done, void *arg);
+void avmlib_pool_wait(avmlib_pool_t *pool);
+void avmlib_pool_free(avmlib_pool_t *pool);
+
+#endif /* _AVMLIB_POOL_H_ */
@@ -12,7 +12,12 @@
 
 #include "avmlib.h"
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 /**************************************************************************//**
  * @brief Port comparison function
@@ -60,6 +65,13 @@ avmlib_port_destroy(
 {
     class_port_t *port = (class_port_t *)entry;
 
+    avmlib_port_flush(port);
+    if (port->evloop) avmlib_evloop_remove_port(port->evloop,port);
+    if (port->obuf) {
+        free(port->obuf);
+        port->obuf = NULL;
+        port->obuf_size = port->obuf_len = 0;
+    }
     if (port->path) {
         free(port->path);
         port->path = NULL;
@@ -75,6 +87,543 @@ avmlib_port_destroy(
     return;
 }
 
+/**************************************************************************//**
+ * @brief Create a port object for an already-open descriptor.
+ *
+ * @param name Port name (e.g. "@stdout")
+ * @param fd Descriptor, or -1
+ * @param file Stdio stream for fd, or NULL
+ *
+ * @returns New port object on success, NULL on failure.
+ *
+ * @remarks Ports start unbuffered.
+ * */
+class_port_t *
+avmlib_port_new(
+    char *name,
+    int fd,
+    FILE *file
+)
+{
+    class_port_t *obj = calloc(1,sizeof(*obj));
+    if (NULL == obj) return NULL;
+
+    avmm_entity_name_set(obj,name);
+    obj->path = NULL;
+    obj->fd = fd;
+    obj->file = file;
+    obj->bufmode = PORT_BUFMODE_NONE;
+    return obj;
+}
+
+/**************************************************************************//**
+ * @brief Copy a port for another machine.
+ *
+ * @details The copy has its own descriptor (a dup(), so the two can be
+ * closed independently), its own output buffer of the same size and
+ * policy, and zeroed statistics.  It isn't registered with any event
+ * loop or file I/O backend.
+ *
+ * @param port The port to copy; pending output is flushed first
+ *
+ * @returns New port object on success, NULL on failure.
+ * */
+class_port_t *
+avmlib_port_clone(
+    class_port_t *port
+)
+{
+    class_port_t *obj;
+
+    avmlib_port_flush(port);
+    if (NULL == (obj = malloc(sizeof(*obj)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+    *obj = *port;
+    obj->path = NULL;
+    obj->file = NULL;
+    obj->obuf = NULL;
+    obj->obuf_len = 0;
+    obj->stat_bytes_in = obj->stat_bytes_out = obj->stat_syscalls = 0;
+    obj->fileio = obj->evloop = NULL;
+    obj->rd_waiter = obj->wr_waiter = NULL;
+
+    /* Step 1: Descriptor */
+    if ((0 <= port->fd) && (0 > (obj->fd = fcntl(port->fd,F_DUPFD_CLOEXEC,3)))) {
+        avmlib_err("%s: Can't dup port \"%s\" (%s).\n",__func__,
+                   avmm_entity_name(port),strerror(errno));
+        free(obj);
+        return NULL;
+    }
+
+    /* Step 2: Path and buffer */
+    if ((port->path && (NULL == (obj->path = strdup(port->path)))) ||
+        (port->obuf && (NULL == (obj->obuf = malloc(port->obuf_size))))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        avmlib_port_destroy(NULL,(entry_t)obj);
+        free(obj);
+        return NULL;
+    }
+    return obj;
+}
+
+/**************************************************************************//**
+ * @brief Hold unwritten output after a non-blocking descriptor fills.
+ *
+ * @details The remaining segments are gathered into a (possibly larger)
+ * port buffer, so the output is accepted now and drained once the
+ * descriptor becomes writable again.
+ *
+ * @param port The port that would block
+ * @param iov Remaining segments; may point into the current port buffer
+ * @param iovcnt Number of remaining segments
+ *
+ * @returns AVMLIB_IO_WOULDBLOCK, or -1 on failure.
+ * */
+static int
+avmlib_port_backlog(
+    class_port_t *port,
+    struct iovec *iov,
+    int iovcnt
+)
+{
+    size_t need = 0;
+    size_t cap;
+    char *newbuf, *p;
+    int i;
+
+    for (i=0;i<iovcnt;i++) need += iov[i].iov_len;
+    if (need > UINT32_MAX) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    cap = (need > port->obuf_size) ? need : port->obuf_size;
+
+    /* New buffer, since the segments may live in the old one */
+    if (NULL == (newbuf = malloc(cap ? cap : 1))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return -1;
+    }
+    for (i=0,p=newbuf;i<iovcnt;i++) {
+        memcpy(p,iov[i].iov_base,iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    free(port->obuf);
+    port->obuf = newbuf;
+    port->obuf_size = cap;
+    port->obuf_len = need;
+    return AVMLIB_IO_WOULDBLOCK;
+}
+
+/**************************************************************************//**
+ * @brief Open a file as a port (the FILE instruction).
+ *
+ * @details The file is opened for reading from the start and appending
+ * at the end; it is created if missing.  Read-only files are opened
+ * for reading only.  Anything the port had open before is closed.
+ *
+ * @param port The port to (re)open
+ * @param path File to open
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_port_open_file(
+    class_port_t *port,
+    const char *path
+)
+{
+    char *newpath;
+    int fd;
+
+    /* Step 1: Open */
+    fd = open(path,O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,0644);
+    if ((0 > fd) && ((EACCES == errno) || (EROFS == errno) || (EISDIR == errno))) {
+        fd = open(path,O_RDONLY|O_CLOEXEC);
+    }
+    if (0 > fd) {
+        avmlib_err("%s: Can't open \"%s\" (%s).\n",__func__,path,strerror(errno));
+        return -1;
+    }
+    if (NULL == (newpath = strdup(path))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        close(fd);
+        return -1;
+    }
+
+    /* Step 2: Drop whatever was there */
+    avmlib_port_flush(port);
+    if (port->evloop) avmlib_evloop_remove_port(port->evloop,port);
+    if (port->file) {
+        fclose(port->file);
+    } else if (0 <= port->fd) {
+        close(port->fd);
+    }
+    free(port->path);
+
+    /* Step 3: Install */
+    port->fd = fd;
+    port->file = NULL;
+    port->path = newpath;
+    port->seekable = 1;
+    port->rd_offset = 0;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Give a port a descriptor the host opened (a socket, a pipe).
+ *
+ * @details Held output goes to the old descriptor first, and the port
+ * leaves any event loop or file I/O backend it was in.  The port owns
+ * fd from now on.
+ *
+ * @param port The port
+ * @param fd The new descriptor
+ * @param seekable Nonzero if reads should be positional (pread())
+ *
+ * @returns 0 on success, -1 on failure (fd is left open).
+ * */
+int
+avmlib_port_set_fd(
+    class_port_t *port,
+    int fd,
+    int seekable
+)
+{
+    if (0 > fd) {
+        errno = EBADF;
+        return -1;
+    }
+
+    avmlib_port_flush(port);
+    if (port->evloop) avmlib_evloop_remove_port(port->evloop,port);
+    if (port->file) {
+        fclose(port->file);
+    } else if (0 <= port->fd) {
+        close(port->fd);
+    }
+    free(port->path);
+
+    port->fd = fd;
+    port->file = NULL;
+    port->path = NULL;
+    port->fileio = NULL;
+    port->seekable = seekable ? 1 : 0;
+    port->rd_offset = 0;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Write an iovec array to a port's descriptor in full.
+ *
+ * @details Retries on EINTR and on short writes.  If a non-blocking
+ * descriptor fills up, whatever is left is held in the port buffer.
+ *
+ * @param port The port to write to
+ * @param iov Array of segments; on return, what's left of each
+ * @param iovcnt Number of segments
+ *
+ * @returns 0 on success, AVMLIB_IO_WOULDBLOCK if output is still held,
+ * -1 on error (errno set).
+ * */
+static int
+avmlib_port_writev(
+    class_port_t *port,
+    struct iovec *iov,
+    int iovcnt
+)
+{
+    ssize_t done;
+
+    while (iovcnt > 0) {
+        /* Skip empty segments */
+        if (0 == iov->iov_len) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        port->stat_syscalls++;
+        done = (1 == iovcnt) ? write(port->fd,iov->iov_base,iov->iov_len) :
+                               writev(port->fd,iov,iovcnt);
+        if (done < 0) {
+            avmlib_stats_port(port,0,0,1);
+            if (EINTR == errno) continue;
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+                return avmlib_port_backlog(port,iov,iovcnt);
+            }
+            return -1;
+        }
+        port->stat_bytes_out += done;
+        avmlib_stats_port(port,0,(uint64_t)done,1);
+        /* Consume what was written */
+        while ((iovcnt > 0) && ((size_t)done >= iov->iov_len)) {
+            done -= iov->iov_len;
+            iov->iov_base = (char *)iov->iov_base + iov->iov_len;
+            iov->iov_len = 0;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Map a writev status onto the OUT return convention.
+ * */
+static inline ssize_t
+avmlib_port_write_result(
+    int status,
+    size_t len
+)
+{
+    if (status < 0) return status; /* Error or WOULDBLOCK */
+    return (ssize_t)len;
+}
+
+/**************************************************************************//**
+ * @brief Keep held output that a failed drain didn't get to.
+ *
+ * @details After avmlib_port_writev() fails, iov is whatever it hadn't
+ * written; if that's still inside the port buffer, it moves back to the
+ * front so a later flush can retry it.
+ *
+ * @param port The port
+ * @param iov The held segment, as left by avmlib_port_writev()
+ * */
+static void
+avmlib_port_keep(
+    class_port_t *port,
+    const struct iovec *iov
+)
+{
+    char *at = (char *)iov->iov_base;
+
+    if (!port->obuf || (at < port->obuf) || (at > port->obuf + port->obuf_size)) return;
+    memmove(port->obuf,at,iov->iov_len);
+    port->obuf_len = iov->iov_len;
+}
+
+/**************************************************************************//**
+ * @brief Set a port's output buffering policy.
+ *
+ * @details Any output already held is flushed first.
+ *
+ * @param port The port to configure
+ * @param mode New buffering policy
+ * @param size Buffer size in bytes; 0 selects AVMLIB_PORT_BUFSIZE
+ *
+ * @returns 0 on success, -1 on failure.
+ *
+ * @remarks Only descriptor-backed ports can be buffered.
+ * */
+int
+avmlib_port_set_buffering(
+    class_port_t *port,
+    port_bufmode_t mode,
+    uint32_t size
+)
+{
+    char *newbuf = NULL;
+
+    /* Step 1: Sanity check */
+    if ((mode != PORT_BUFMODE_NONE) && (0 > port->fd)) {
+        avmlib_err("%s: Port \"%s\" has no descriptor to buffer.\n",
+                   __func__,avmm_entity_name(port));
+        return -1;
+    }
+    if (0 == size) size = AVMLIB_PORT_BUFSIZE;
+
+    /* Step 2: Drain whatever we have */
+    if (0 > avmlib_port_flush(port)) return -1;
+
+    /* Step 3: (Re)alloc buffer */
+    if ((mode != PORT_BUFMODE_NONE) && (size != port->obuf_size)) {
+        if (NULL == (newbuf = malloc(size))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return -1;
+        }
+        free(port->obuf);
+        port->obuf = newbuf;
+        port->obuf_size = size;
+    }
+    port->bufmode = mode;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Emit bytes to a port, honoring its buffering policy.
+ *
+ * @details This is the OUT path.  Output that fits is copied into the
+ * port buffer.  When the buffer must be drained -- it would overflow, or
+ * a line-buffered port sees a newline -- the held bytes and the new
+ * bytes go out together in a single writev(), so each drain costs one
+ * syscall regardless of how many OUTs were coalesced.
+ *
+ * @param port The port to write
+ * @param data Bytes to emit
+ * @param len Number of bytes
+ *
+ * @returns Number of bytes accepted, AVMLIB_IO_WOULDBLOCK if the bytes
+ * were accepted but the port's descriptor is full, or -1 on error.  On
+ * error, held output that wasn't written stays held.
+ * */
+ssize_t
+avmlib_port_write(
+    class_port_t *port,
+    const void *data,
+    size_t len
+)
+{
+    struct iovec iov[2];
+    size_t done;
+    int rc;
+
+    /* Non-descriptor ports use their own writer, an int's worth at a time */
+    if (0 > port->fd) {
+        if (!port->write) {
+            errno = EBADF;
+            return -1;
+        }
+        for (done=0;done<len;done+=rc) {
+            rc = port->write(port,(char *)data + done,(int)(((len - done) > INT_MAX) ? INT_MAX : (len - done)));
+            if (rc < 0) return done ? (ssize_t)done : rc;
+            if (0 == rc) break;
+        }
+        return (ssize_t)done;
+    }
+
+    /* Unbuffered, with nothing held back from an earlier full descriptor */
+    if (((PORT_BUFMODE_NONE == port->bufmode) || !port->obuf) && !port->obuf_len) {
+        iov[0].iov_base = (void *)data;
+        iov[0].iov_len = len;
+        return avmlib_port_write_result(avmlib_port_writev(port,iov,1),len);
+    }
+
+    /* Hold it if it fits and nothing forces a drain */
+    if ((PORT_BUFMODE_NONE != port->bufmode) &&
+        ((port->obuf_len + len) <= port->obuf_size) &&
+        ((PORT_BUFMODE_LINE != port->bufmode) || !memchr(data,'\n',len))) {
+        memcpy(port->obuf + port->obuf_len,data,len);
+        port->obuf_len += len;
+        return len;
+    }
+
+    /* Drain held bytes plus the new ones in one go */
+    if (port->file) fflush(port->file); /* Keep ordering with stdio users */
+    iov[0].iov_base = port->obuf;
+    iov[0].iov_len = port->obuf_len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    port->obuf_len = 0;
+    if (-1 == (rc = avmlib_port_writev(port,iov,2))) avmlib_port_keep(port,&iov[0]);
+    return avmlib_port_write_result(rc,len);
+}
+
+/**************************************************************************//**
+ * @brief Read bytes from a port.
+ *
+ * @details This is the IN path.  Descriptor ports read directly; other
+ * ports use their own reader.
+ *
+ * @param port The port to read
+ * @param buf Destination
+ * @param len Most bytes to read
+ *
+ * @returns Number of bytes read (0 at end of input), AVMLIB_IO_WOULDBLOCK
+ * if a non-blocking port has no data yet, or -1 on error.
+ * */
+int
+avmlib_port_read(
+    class_port_t *port,
+    void *buf,
+    uint32_t len
+)
+{
+    uint64_t calls = 0;
+    ssize_t got;
+
+    /* Non-descriptor ports use their own reader */
+    if (0 > port->fd) {
+        if (!port->read) {
+            errno = EBADF;
+            return -1;
+        }
+        return port->read(port,buf,len);
+    }
+
+    do {
+        port->stat_syscalls++;
+        calls++;
+        got = port->seekable ? pread(port->fd,buf,len,port->rd_offset) :
+                               read(port->fd,buf,len);
+    } while ((got < 0) && (EINTR == errno));
+
+    if (got < 0) {
+        avmlib_stats_port(port,0,0,calls);
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) return AVMLIB_IO_WOULDBLOCK;
+        return -1;
+    }
+    port->stat_bytes_in += got;
+    avmlib_stats_port(port,(uint64_t)got,0,calls);
+    port->rd_offset += got;
+    return (int)got;
+}
+
+/**************************************************************************//**
+ * @brief Send any held output of a port to the OS.
+ *
+ * @param port The port to flush
+ *
+ * @returns 0 on success, AVMLIB_IO_WOULDBLOCK if output is still held,
+ * -1 on error (what wasn't written stays held).
+ * */
+int
+avmlib_port_flush(
+    class_port_t *port
+)
+{
+    struct iovec iov;
+    int rc;
+
+    if (!port->obuf_len) return 0;
+
+    if (port->file) fflush(port->file);
+    iov.iov_base = port->obuf;
+    iov.iov_len = port->obuf_len;
+    port->obuf_len = 0;
+    if (-1 == (rc = avmlib_port_writev(port,&iov,1))) avmlib_port_keep(port,&iov);
+    return rc;
+}
+
+/**************************************************************************//**
+ * @brief Flush every port of a machine.
+ *
+ * @param avm The machine
+ *
+ * @returns 0 on success, -1 if any port failed to flush.
+ * */
+int
+avmlib_ports_flush(
+    avm_t *avm
+)
+{
+    table_t *ports = AVM_CLASS_TABLE(avm,AVM_CLASS_PORT);
+    int retval = 0;
+    int i;
+
+    for (i=0;i<avmlib_table_size(ports);i++) {
+        if (0 > avmlib_port_flush((class_port_t *)ports->entries[i])) {
+            retval = -1;
+        }
+    }
+    return retval;
+}
+
 /**************************************************************************//**
  * @brief
  *
@@ -104,41 +653,37 @@ avmlib_ports_init(
     ports->destroy = avmlib_port_destroy;
 
     /* Step 3: Special ports for std{in,out,err} */
-    if (NULL == (newport = malloc(sizeof(class_port_t)))) {
+    if (NULL == (newport = avmlib_port_new("@stdin",0,stdin))) {
         avmlib_err("%s: Alloc failure.\n",__func__);
         return;
-    } else {
-        sprintf(avmm_entity_name(newport),"@stdin");
-        newport->path = NULL;
-        newport->fd = 0;
-        newport->file = stdin;
     }
     avmlib_table_add(ports,newport);
-    if (NULL == (newport = malloc(sizeof(class_port_t)))) {
+    if (NULL == (newport = avmlib_port_new("@stdout",1,stdout))) {
         avmlib_err("%s: Alloc failure.\n",__func__);
         return;
-    } else {
-        sprintf(avmm_entity_name(newport),"@stdout");
-        newport->path = NULL;
-        newport->fd = 1;
-        newport->file = stdout;
     }
+        /* Same defaults as stdio: line-buffered on a terminal */
+    avmlib_port_set_buffering(newport,
+                              isatty(1) ? PORT_BUFMODE_LINE : PORT_BUFMODE_FULL,
+                              0);
     avmlib_table_add(ports,newport);
-    if (NULL == (newport = malloc(sizeof(class_port_t)))) {
+    if (NULL == (newport = avmlib_port_new("@stderr",2,stderr))) {
         avmlib_err("%s: Alloc failure.\n",__func__);
         return;
-    } else {
-        sprintf(avmm_entity_name(newport),"@stderr");
-        newport->path = NULL;
-        newport->fd = 2;
-        newport->file = stderr;
     }
     avmlib_table_add(ports,newport);
 
 
     /* Step 3: Load from defs */
-    for (i=0;AVM_PORT_VALID(&avm_global_ports[i]);i++) {
-        avmlib_table_add(ports,&avm_global_ports[i]);
+    for (i=0;AVM_PORT_DEF_VALID(&avm_global_ports[i]);i++) {
+        /* A copy per machine; the definitions are shared */
+        if (NULL == (newport = malloc(sizeof(*newport)))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return;
+        }
+        *newport = avm_global_ports[i].port;
+        avmm_entity_name_set(newport,avm_global_ports[i].name);
+        avmlib_table_add(ports,newport);
     }
 }
 
@@ -13,5 +13,27 @@
 #include "avmlib.h"
 #include "avmm_ports.h"
 
+/**
+ * Default output buffer size for buffered ports
+ */
+#define AVMLIB_PORT_BUFSIZE 65536
+
+/**
+ * Port I/O status: a non-blocking port can't make progress yet
+ */
+#define AVMLIB_IO_WOULDBLOCK (-2)
+
 void avmlib_ports_init( avm_t *avm);
+int avmlib_ports_flush(avm_t *avm);
+
+int avmlib_port_compare(table_t *this, entry_t left, intptr_t test);
+void avmlib_port_destroy(table_t *this, entry_t entry);
+class_port_t *avmlib_port_new(char *name, int fd, FILE *file);
+class_port_t *avmlib_port_clone(class_port_t *port);
+int avmlib_port_open_file(class_port_t *port, const char *path);
+int avmlib_port_set_fd(class_port_t *port, int fd, int seekable);
+int avmlib_port_set_buffering(class_port_t *port, port_bufmode_t mode, uint32_t size);
+ssize_t avmlib_port_write(class_port_t *port, const void *data, size_t len);
+int avmlib_port_flush(class_port_t *port);
+int avmlib_port_read(class_port_t *port, void *buf, uint32_t len);
 #endif /* _AVMLIB_PORTS_H_ */
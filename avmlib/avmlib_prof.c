@@ -0,0 +1,494 @@
+/**************************************************************************//**
+ * @file avmlib_prof.c
+ *
+ * @brief Execution profiler
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_PROF_C_
+#define _AVMLIB_PROF_C_
+
+#include "avmlib.h"
+#include <errno.h>
+#include <inttypes.h>
+
+#ifndef AVM_PROFILE
+
+/**************************************************************************//**
+ * @brief Make an empty profile.  (Not built in.)
+ * */
+avmlib_prof_t *
+avmlib_prof_new(void)
+{
+    errno = ENOTSUP;
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Profile an instance.  (Not built in.)
+ * */
+int
+avmlib_prof_attach(
+    avmlib_vm_t *vm,
+    avmlib_prof_t *prof
+)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Charge an instruction.  (Not built in.)
+ * */
+void
+avmlib_prof_insn(
+    avmlib_prof_t *prof,
+    const class_segment_t *seg,
+    uint32_t pc,
+    uint32_t op,
+    uint64_t ticks
+)
+{
+}
+
+/**************************************************************************//**
+ * @brief Charge port I/O.  (Not built in.)
+ * */
+void
+avmlib_prof_port(
+    avmlib_prof_t *prof,
+    const char *name,
+    uint32_t op,
+    uint64_t ticks
+)
+{
+}
+
+/**************************************************************************//**
+ * @brief Text report.  (Not built in.)
+ * */
+int
+avmlib_prof_report(
+    const avmlib_prof_t *prof,
+    FILE *out
+)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Collapsed stacks.  (Not built in.)
+ * */
+int
+avmlib_prof_collapsed(
+    const avmlib_prof_t *prof,
+    FILE *out
+)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Free a profile.  (Not built in.)
+ * */
+void
+avmlib_prof_free(
+    avmlib_prof_t *prof
+)
+{
+}
+
+#else /* AVM_PROFILE */
+
+/**
+ * A report line
+ */
+typedef struct {
+    const char *a; /* Name... */
+    const char *b; /* ...and its second part, if any */
+    const char *c; /* ...and third */
+    avmlib_prof_cell_t cell;
+} avmlib_prof_row_t;
+
+/**************************************************************************//**
+ * @brief Where an opcode is counted.
+ * */
+static inline uint32_t
+avmlib_prof_op(
+    uint32_t op
+)
+{
+    return (op < AVMLIB_PROF_OPS - 1) ? op : AVMLIB_PROF_OPS - 1;
+}
+
+/**************************************************************************//**
+ * @brief Report name of a counted opcode.
+ * */
+static const char *
+avmlib_prof_opname(
+    uint32_t i
+)
+{
+    static char unnamed[AVMLIB_PROF_OPS][8];
+
+    if (AVMLIB_PROF_OPS - 1 == i) return "(other)";
+    if (avmlib_op_name(i)) return avmlib_op_name(i);
+    if (!unnamed[i][0]) snprintf(unnamed[i],sizeof(unnamed[i]),"0x%02x",i);
+    return unnamed[i];
+}
+
+/**************************************************************************//**
+ * @brief Order offsets.
+ * */
+static int
+avmlib_prof_offset_cmp(
+    const void *a,
+    const void *b
+)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**************************************************************************//**
+ * @brief Order report lines, most time first.
+ * */
+static int
+avmlib_prof_row_cmp(
+    const void *a,
+    const void *b
+)
+{
+    const avmlib_prof_row_t *x = a, *y = b;
+
+    return (x->cell.ticks < y->cell.ticks) - (x->cell.ticks > y->cell.ticks);
+}
+
+/**************************************************************************//**
+ * @brief Make an empty profile.
+ *
+ * @returns The profile, or NULL on failure.
+ * */
+avmlib_prof_t *
+avmlib_prof_new(void)
+{
+    avmlib_prof_t *prof;
+
+    if (NULL == (prof = calloc(1,sizeof(*prof)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+    return prof;
+}
+
+/**************************************************************************//**
+ * @brief Profile an instance from now on, or stop (prof NULL).
+ *
+ * @details The profile must outlive its attachment.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_prof_attach(
+    avmlib_vm_t *vm,
+    avmlib_prof_t *prof
+)
+{
+    vm->prof = prof;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief A segment's label regions, set up when first seen.
+ *
+ * @returns The regions, or NULL on failure.
+ * */
+static avmlib_prof_seg_t *
+avmlib_prof_seg(
+    avmlib_prof_t *prof,
+    const class_segment_t *seg
+)
+{
+    const table_t *code = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    const table_t *labels = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    const class_label_t *lbl;
+    avmlib_prof_seg_t *s, *segs;
+    uint32_t *start, *at, i, n, r;
+
+    if ((prof->last < prof->nsegs) && (prof->segs[prof->last].seg == seg)) return &prof->segs[prof->last];
+    for (i=0;i<prof->nsegs;i++) {
+        if (prof->segs[i].seg == seg) {
+            prof->last = i;
+            return &prof->segs[i];
+        }
+    }
+
+    /* Step 1: Where regions start */
+    if (NULL == (start = malloc(sizeof(*start) * (labels->size + 1)))) return NULL;
+    start[0] = 0;
+    for (n=1,i=0;i<labels->size;i++) {
+        lbl = (const class_label_t *)labels->entries[i];
+        if (lbl && (lbl->offset < code->size) &&
+            ((lbl->segment == seg->id) || (AVMM_SEGMENT_UNLINKED == lbl->segment))) {
+            start[n++] = lbl->offset;
+        }
+    }
+    qsort(start,n,sizeof(*start),avmlib_prof_offset_cmp);
+    for (r=1,i=1;i<n;i++) {
+        if (start[i] != start[r - 1]) start[r++] = start[i];
+    }
+
+    /* Step 2: The record */
+    if (NULL == (segs = realloc(prof->segs,sizeof(*segs) * (prof->nsegs + 1)))) {
+        free(start);
+        return NULL;
+    }
+    prof->segs = segs;
+    s = &segs[prof->nsegs];
+    memset(s,0,sizeof(*s));
+    s->seg = seg;
+    s->name = avmm_entity_name(seg);
+    s->nregions = r;
+    s->start = start;
+    if ((NULL == (s->label = calloc(r,sizeof(*s->label)))) ||
+        (NULL == (s->cell = calloc((size_t)r * AVMLIB_PROF_OPS,sizeof(*s->cell))))) {
+        free(s->label);
+        free(start);
+        return NULL;
+    }
+    for (i=0;i<r;i++) s->label[i] = "";
+    for (i=0;i<labels->size;i++) {
+        lbl = (const class_label_t *)labels->entries[i];
+        if (!lbl || (lbl->offset >= code->size) ||
+            ((lbl->segment != seg->id) && (AVMM_SEGMENT_UNLINKED != lbl->segment))) {
+            continue;
+        }
+        at = bsearch(&lbl->offset,start,r,sizeof(*start),avmlib_prof_offset_cmp);
+        if (at && !*s->label[at - start]) s->label[at - start] = avmm_entity_name(lbl);
+    }
+    prof->last = prof->nsegs++;
+    return s;
+}
+
+/**************************************************************************//**
+ * @brief Charge an instruction to its opcode and label region.
+ * */
+void
+avmlib_prof_insn(
+    avmlib_prof_t *prof,
+    const class_segment_t *seg,
+    uint32_t pc,
+    uint32_t op,
+    uint64_t ticks
+)
+{
+    avmlib_prof_seg_t *s;
+    avmlib_prof_cell_t *c;
+    uint32_t lo, hi, mid;
+
+    if (NULL == (s = avmlib_prof_seg(prof,seg))) {
+        prof->err = 1;
+        return;
+    }
+    for (lo=0,hi=s->nregions;hi - lo > 1;) {
+        mid = lo + (hi - lo) / 2;
+        if (s->start[mid] <= pc) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    c = &s->cell[lo * AVMLIB_PROF_OPS + avmlib_prof_op(op)];
+    c->count++;
+    c->ticks += ticks;
+}
+
+/**************************************************************************//**
+ * @brief Charge I/O to a port (already charged to the instruction).
+ * */
+void
+avmlib_prof_port(
+    avmlib_prof_t *prof,
+    const char *name,
+    uint32_t op,
+    uint64_t ticks
+)
+{
+    avmlib_prof_port_t *p;
+    uint32_t i;
+
+    for (i=0;i<prof->nports;i++) {
+        if ((prof->ports[i].name == name) && (prof->ports[i].op == op)) break;
+    }
+    if (i == prof->nports) {
+        if (NULL == (p = realloc(prof->ports,sizeof(*p) * (prof->nports + 1)))) {
+            prof->err = 1;
+            return;
+        }
+        prof->ports = p;
+        memset(&p[i],0,sizeof(*p));
+        p[i].name = name;
+        p[i].op = op;
+        prof->nports++;
+    }
+    prof->ports[i].cell.count++;
+    prof->ports[i].cell.ticks += ticks;
+}
+
+/**************************************************************************//**
+ * @brief Write one section of the report.
+ * */
+static void
+avmlib_prof_section(
+    FILE *out,
+    const char *title,
+    avmlib_prof_row_t *rows,
+    uint32_t n,
+    uint64_t total
+)
+{
+    char name[3 * AVMLIB_NAME_MAX + 8];
+    uint32_t i;
+
+    qsort(rows,n,sizeof(*rows),avmlib_prof_row_cmp);
+    fprintf(out,"\n%-40s %14s %16s %7s %10s\n",title,"count","ticks","%","ticks/exec");
+    for (i=0;i<n;i++) {
+        snprintf(name,sizeof(name),"%s%s%s%s%s",rows[i].a,rows[i].b ? ":" : "",rows[i].b ? rows[i].b : "",
+                 rows[i].c ? " " : "",rows[i].c ? rows[i].c : "");
+        fprintf(out,"  %-38s %14" PRIu64 " %16" PRIu64 " %6.2f%% %10.1f\n",name,rows[i].cell.count,
+                rows[i].cell.ticks,total ? 100.0 * rows[i].cell.ticks / total : 0.0,
+                (double)rows[i].cell.ticks / rows[i].cell.count);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Write a text report: time by opcode, by label region and by
+ * port, most first.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_prof_report(
+    const avmlib_prof_t *prof,
+    FILE *out
+)
+{
+    avmlib_prof_cell_t ops[AVMLIB_PROF_OPS], *c;
+    avmlib_prof_row_t *rows;
+    const avmlib_prof_seg_t *s;
+    uint64_t count = 0, total = 0;
+    uint32_t nrows = AVMLIB_PROF_OPS + prof->nports, i, r, k, n;
+
+    for (i=0;i<prof->nsegs;i++) nrows += prof->segs[i].nregions;
+    if (NULL == (rows = calloc(nrows,sizeof(*rows)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return -1;
+    }
+
+    /* Step 1: Totals, and time by label region */
+    memset(ops,0,sizeof(ops));
+    for (n=0,i=0;i<prof->nsegs;i++) {
+        for (s=&prof->segs[i],r=0;r<s->nregions;r++) {
+            rows[n].a = *s->name ? s->name : "(anonymous)";
+            rows[n].b = *s->label[r] ? s->label[r] : "(entry)";
+            for (k=0;k<AVMLIB_PROF_OPS;k++) {
+                c = &s->cell[r * AVMLIB_PROF_OPS + k];
+                rows[n].cell.count += c->count;
+                rows[n].cell.ticks += c->ticks;
+                ops[k].count += c->count;
+                ops[k].ticks += c->ticks;
+            }
+            count += rows[n].cell.count;
+            total += rows[n].cell.ticks;
+            if (rows[n].cell.count) n++;
+        }
+    }
+    fprintf(out,"Profile: %" PRIu64 " instructions, %" PRIu64 " ticks (%s)%s\n",count,total,
+#if defined(__x86_64__)
+            "TSC cycles",
+#else
+            "ns",
+#endif
+            prof->err ? "; some lost to alloc failures" : "");
+    avmlib_prof_section(out,"By label",rows,n,total);
+
+    /* Step 2: By opcode */
+    memset(rows,0,sizeof(*rows) * nrows);
+    for (n=0,k=0;k<AVMLIB_PROF_OPS;k++) {
+        if (!ops[k].count) continue;
+        rows[n].a = avmlib_prof_opname(k);
+        rows[n++].cell = ops[k];
+    }
+    avmlib_prof_section(out,"By opcode",rows,n,total);
+
+    /* Step 3: By port */
+    if (prof->nports) {
+        memset(rows,0,sizeof(*rows) * nrows);
+        for (n=0;n<prof->nports;n++) {
+            rows[n].a = *prof->ports[n].name ? prof->ports[n].name : "(anonymous)";
+            rows[n].c = avmlib_prof_opname(avmlib_prof_op(prof->ports[n].op));
+            rows[n].cell = prof->ports[n].cell;
+        }
+        avmlib_prof_section(out,"By port",rows,n,total);
+    }
+    free(rows);
+    return ferror(out) ? -1 : 0;
+}
+
+/**************************************************************************//**
+ * @brief Write collapsed stacks, one "segment;label;OP ticks" line per
+ * opcode executed in each label region.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_prof_collapsed(
+    const avmlib_prof_t *prof,
+    FILE *out
+)
+{
+    const avmlib_prof_seg_t *s;
+    const avmlib_prof_cell_t *c;
+    uint32_t i, r, k;
+
+    for (i=0;i<prof->nsegs;i++) {
+        for (s=&prof->segs[i],r=0;r<s->nregions;r++) {
+            for (k=0;k<AVMLIB_PROF_OPS;k++) {
+                c = &s->cell[r * AVMLIB_PROF_OPS + k];
+                if (!c->count) continue;
+                fprintf(out,"%s;%s;%s %" PRIu64 "\n",*s->name ? s->name : "(anonymous)",
+                        *s->label[r] ? s->label[r] : "(entry)",avmlib_prof_opname(k),c->ticks);
+            }
+        }
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+/**************************************************************************//**
+ * @brief Free a profile (detach it first).
+ * */
+void
+avmlib_prof_free(
+    avmlib_prof_t *prof
+)
+{
+    uint32_t i;
+
+    if (!prof) return;
+    for (i=0;i<prof->nsegs;i++) {
+        free(prof->segs[i].start);
+        free(prof->segs[i].label);
+        free(prof->segs[i].cell);
+    }
+    free(prof->segs);
+    free(prof->ports);
+    free(prof);
+}
+
+#endif /* AVM_PROFILE */
+
+#endif /* _AVMLIB_PROF_C_ */
@@ -0,0 +1,106 @@
+/**************************************************************************//**
+ * @file avmlib_prof.h
+ *
+ * @brief Execution profiler: where an instance's time goes.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Build with -DAVM_PROFILE, attach a profile to an instance with
+ * avmlib_prof_attach(), and avmlib_vm_run() times every instruction
+ * it executes, charging it to its opcode and to the label region it
+ * sits in (from the label before it to the next one).  IN, OUT, FLUSH
+ * and FILE on a PORT are also charged to the port.  Time is in ticks:
+ * TSC cycles on x86-64, nanoseconds elsewhere.
+ *
+ * A profiled instance is always interpreted, so the profile is of the
+ * program rather than of whatever native code it has.  Each profile
+ * belongs to one instance at a time; profile pool workers separately.
+ *
+ * avmlib_prof_report() writes a text report; avmlib_prof_collapsed()
+ * writes "segment;label;OP ticks" lines, the collapsed-stack format
+ * flamegraph.pl and similar tools read.
+ *
+ * Without AVM_PROFILE none of the hooks are compiled in and these
+ * functions just fail with ENOTSUP.
+ * */
+#ifndef _AVMLIB_PROF_H_
+#define _AVMLIB_PROF_H_
+
+#include <stdio.h>
+#include <time.h>
+#include "avmm_data.h"
+#include "avmlib_vm.h"
+
+/**
+ * Opcodes counted separately; the rest share the last
+ */
+#define AVMLIB_PROF_OPS 32
+
+/**
+ * Executions and time
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t ticks;
+} avmlib_prof_cell_t;
+
+/**
+ * One segment's label regions
+ */
+typedef struct {
+    const class_segment_t *seg; /* Told apart by address */
+    const char *name; /* Segment name */
+    uint32_t nregions; /* Labels, plus the code before the first */
+    uint32_t *start; /* Code offset each region starts at, ascending; start[0] is 0 */
+    const char **label; /* Region names ("" for unlabelled code at the start) */
+    avmlib_prof_cell_t *cell; /* nregions x AVMLIB_PROF_OPS */
+} avmlib_prof_seg_t;
+
+/**
+ * I/O on one port
+ */
+typedef struct {
+    const char *name; /* Port name */
+    uint32_t op; /* IN, OUT, FLUSH or FILE */
+    avmlib_prof_cell_t cell;
+} avmlib_prof_port_t;
+
+/**
+ * A profile
+ */
+typedef struct avmlib_prof_s {
+    avmlib_prof_seg_t *segs;
+    uint32_t nsegs;
+    uint32_t last; /* Segment looked up last */
+    avmlib_prof_port_t *ports;
+    uint32_t nports;
+    int err; /* Lost samples to an alloc failure */
+} avmlib_prof_t;
+
+/**************************************************************************//**
+ * @brief Now, in ticks.
+ * */
+static inline uint64_t
+avmlib_prof_clock(void)
+{
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Prototypes */
+avmlib_prof_t *avmlib_prof_new(void);
+int avmlib_prof_attach(avmlib_vm_t *vm, avmlib_prof_t *prof);
+void avmlib_prof_insn(avmlib_prof_t *prof, const class_segment_t *seg, uint32_t pc, uint32_t op, uint64_t ticks);
+void avmlib_prof_port(avmlib_prof_t *prof, const char *name, uint32_t op, uint64_t ticks);
+int avmlib_prof_report(const avmlib_prof_t *prof, FILE *out);
+int avmlib_prof_collapsed(const avmlib_prof_t *prof, FILE *out);
+void avmlib_prof_free(avmlib_prof_t *prof);
+
+#endif /* _AVMLIB_PROF_H_ */
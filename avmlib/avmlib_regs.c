@@ -70,7 +70,9 @@ avmlib_reg_destroy(
  *
  * @remarks This only initializes the global registers, since the
  * per-core (process-local) registers are initialized with the
- * process.
+ * process.  Each machine gets its own copy of the definitions, so
+ * machines don't share register values; the definitions table itself
+ * is never written.
  * */
 void
 avmlib_regs_init(
@@ -88,8 +90,15 @@ avmlib_regs_init(
     regs->destroy = avmlib_reg_destroy;
 
     /* Step 3: Load from defs */
-    for (i=0;AVM_REG_VALID(&avm_global_regs[i]);i++) {
-        avmlib_table_add(regs,&avm_global_regs[i]);
+    for (i=0;AVM_REG_DEF_VALID(&avm_global_regs[i]);i++) {
+        class_register_t *reg = malloc(sizeof(*reg));
+        if (NULL == reg) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return;
+        }
+        *reg = avm_global_regs[i].reg;
+        avmm_entity_name_set(reg,avm_global_regs[i].name);
+        avmlib_table_add(regs,reg);
     }
 }
 
@@ -12,5 +12,14 @@
 
 #include "avmm_regs.h"
 
+/**
+ * Plain register access: through the handler if there is one, else
+ * the register's own value
+ */
+#define avmlib_reg_get(__reg) \
+    ((__reg)->get ? (__reg)->get(__reg) : (__reg)->value)
+#define avmlib_reg_set(__reg,__value) \
+    ((__reg)->set ? (__reg)->set((__reg),(__value)) : ((__reg)->value = (__value)))
+
 void avmlib_regs_init( avm_t *avm);
 #endif /* _AVMLIB_REGS_H_ */
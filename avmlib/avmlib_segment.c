@@ -0,0 +1,830 @@
+/**************************************************************************//**
+ * @file avmlib_segment.c
+ *
+ * @brief Segment images and on-demand segment loading
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_SEGMENT_C_
+#define _AVMLIB_SEGMENT_C_
+
+#include "avmlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**************************************************************************//**
+ * @brief Table handler for entries that are a single allocation.
+ * */
+static void
+avmlib_segment_entry_free(
+    table_t *this,
+    entry_t entry
+)
+{
+    free((void *)entry);
+}
+
+/**************************************************************************//**
+ * @brief Can a segment image carry entities of this class?
+ * */
+static int
+avmlib_segment_carried(
+    int class
+)
+{
+    switch (class) {
+        case AVM_CLASS_STRING:
+        case AVM_CLASS_LABEL:
+        case AVM_CLASS_PORT:
+        case AVM_CLASS_BUFFER:
+        case AVM_CLASS_UNRESOLVED:
+            return 1;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Build the (empty) table of tables for a segment.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_segment_tables_init(
+    class_segment_t *seg
+)
+{
+    table_t *t;
+    int i;
+
+    if (NULL == avmlib_table_init(&(seg->tables),AVM_CLASS_MAX)) return -1;
+    for (i=0;i<AVM_CLASS_MAX;i++) {
+        if (NULL == (t = avmlib_table_new(16))) return -1;
+        switch (i) {
+            case AVM_CLASS_INSTRUCTION: t->alloc_count = 128; break;
+            case AVM_CLASS_STRING: t->destroy = avmtype_string_destroy; break;
+            case AVM_CLASS_BUFFER: t->destroy = avmtype_buffer_destroy; break;
+            case AVM_CLASS_PORT:
+                t->compare = avmlib_port_compare;
+                t->destroy = avmlib_port_destroy;
+                break;
+            case AVM_CLASS_LABEL:
+            case AVM_CLASS_UNRESOLVED:
+                t->destroy = avmlib_segment_entry_free;
+                break;
+        }
+        avmlib_table_add(&(seg->tables),t);
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Release a segment's tables and everything in them.
+ * */
+static void
+avmlib_segment_tables_free(
+    class_segment_t *seg
+)
+{
+    int i;
+
+    for (i=0;i<seg->tables.size;i++) {
+        avmlib_table_destroy((table_t *)seg->tables.entries[i]);
+    }
+    free(seg->tables.entries);
+    seg->tables.entries = NULL;
+    seg->tables.size = seg->tables.capacity = 0;
+    avmlib_store_free(&seg->store);
+}
+
+/**************************************************************************//**
+ * @brief Encode one image record.
+ *
+ * @param class Class of the entry
+ * @param entry The entry
+ * @param flags AVMLIB_SEGMENT_* save flags
+ * @param out Where to put the record, or NULL to only size it
+ *
+ * @returns Size of the record in bytes.
+ * */
+static size_t
+avmlib_segment_record(
+    int class,
+    entry_t entry,
+    int flags,
+    char *out
+)
+{
+    const char *n = avmm_entity_name(entry);
+    size_t nlen = strnlen(n,AVMLIB_NAME_MAX) + 1;
+    size_t extra = 0;
+
+    /* Strings and buffers are only ever referenced by index at runtime */
+    if ((flags & AVMLIB_SEGMENT_STRIP) &&
+        ((AVM_CLASS_STRING == class) || (AVM_CLASS_BUFFER == class))) {
+        n = "";
+        nlen = 1;
+    }
+    if (out) {
+        memcpy(out,n,nlen - 1);
+        out[nlen - 1] = '\0';
+    }
+    switch (class) {
+        case AVM_CLASS_STRING: {
+            class_string_t *s = (class_string_t *)entry;
+            const char *text = s->text ? s->text : "";
+            extra = strlen(text) + 1;
+            if (out) memcpy(out + nlen,text,extra);
+            break;
+        }
+        case AVM_CLASS_LABEL: {
+            uint32_t offset = ((class_label_t *)entry)->offset;
+            extra = sizeof(offset);
+            if (out) memcpy(out + nlen,&offset,extra);
+            break;
+        }
+    }
+    return nlen + extra;
+}
+
+/**************************************************************************//**
+ * @brief Write a segment out as an image.
+ *
+ * @param seg The segment (resident)
+ * @param path Image file to create
+ * @param flags AVMLIB_SEGMENT_STRIP to leave out names nothing binds to
+ *
+ * @returns 0 on success, -1 on failure (ENOTSUP if the segment has
+ * entities an image can't carry).
+ * */
+int
+avmlib_segment_save(
+    class_segment_t *seg,
+    const char *path,
+    int flags
+)
+{
+    avmlib_segment_image_t hdr;
+    avmlib_segment_section_t sec;
+    table_t *t;
+    char *rec = NULL;
+    size_t len;
+    uint32_t w;
+    FILE *f;
+    int c, i;
+
+    /* Step 1: Header */
+    memset(&hdr,0,sizeof(hdr));
+    hdr.magic = AVMLIB_SEGMENT_MAGIC;
+    hdr.version = AVMLIB_SEGMENT_VERSION;
+    hdr.code_words = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION)->size;
+    strncpy(hdr.name,avmm_entity_name(seg),sizeof(hdr.name) - 1);
+    for (c=0;c<AVM_CLASS_MAX;c++) {
+        t = AVM_CLASS_TABLE(seg,c);
+        if (!t || !t->size || (AVM_CLASS_INSTRUCTION == c)) continue;
+        if (!avmlib_segment_carried(c)) {
+            avmlib_err("%s: Segment has %s entities; images can't carry them.\n",
+                       __func__,t->type_name ? t->type_name : "unsupported");
+            errno = ENOTSUP;
+            return -1;
+        }
+        hdr.nsections++;
+    }
+
+    if (NULL == (f = fopen(path,"wb"))) {
+        avmlib_err("%s: Can't create \"%s\" (%s).\n",__func__,path,strerror(errno));
+        return -1;
+    }
+    fwrite(&hdr,sizeof(hdr),1,f);
+
+    /* Step 2: Code */
+    t = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    for (i=0;i<t->size;i++) {
+        w = (uint32_t)t->entries[i];
+        fwrite(&w,sizeof(w),1,f);
+    }
+
+    /* Step 3: Sections, in table order so indices survive */
+    for (c=0;c<AVM_CLASS_MAX;c++) {
+        t = AVM_CLASS_TABLE(seg,c);
+        if (!t || !t->size || !avmlib_segment_carried(c)) continue;
+        sec.class = c;
+        sec.count = t->size;
+        sec.bytes = 0;
+        for (i=0;i<t->size;i++) {
+            sec.bytes += avmlib_segment_record(c,t->entries[i],flags,NULL);
+        }
+        fwrite(&sec,sizeof(sec),1,f);
+        for (i=0;i<t->size;i++) {
+            len = avmlib_segment_record(c,t->entries[i],flags,NULL);
+            if (NULL == (rec = realloc(rec,len))) {
+                avmlib_err("%s: Alloc failure.\n",__func__);
+                fclose(f);
+                return -1;
+            }
+            avmlib_segment_record(c,t->entries[i],flags,rec);
+            fwrite(rec,len,1,f);
+        }
+    }
+    free(rec);
+
+    if (ferror(f) | fclose(f)) {
+        avmlib_err("%s: Write to \"%s\" failed.\n",__func__,path);
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Bounded NUL-terminated string at p.
+ *
+ * @returns Length including NUL, or 0 if unterminated before end.
+ * */
+static size_t
+avmlib_segment_str(
+    const char *p,
+    const char *end
+)
+{
+    const char *nul = memchr(p,'\0',end - p);
+    return nul ? (size_t)(nul - p) + 1 : 0;
+}
+
+/**************************************************************************//**
+ * @brief Resolve references to the segment's own labels.
+ *
+ * @details The compiler leaves a jump to a label as an UNRESOLVED
+ * operand naming it.  Each such operand whose name is one of this
+ * segment's labels is rewritten in place as a local LABEL, keeping its
+ * width, so the executor never has to look names up.  Anything else
+ * stays unresolved.
+ *
+ * @returns Number of operands resolved.
+ * */
+uint32_t
+avmlib_segment_link(
+    class_segment_t *seg
+)
+{
+    table_t *code = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    table_t *labels = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    table_t *unres = AVM_CLASS_TABLE(seg,AVM_CLASS_UNRESOLVED);
+    uint32_t *target, i, j, idx, e, argc, resolved = 0;
+    uint32_t pc, n, w;
+
+    if (!unres->size || !labels->size) return 0;
+
+    /* Step 1: Unresolved index to label index (names are interned) */
+    if (NULL == (target = malloc(sizeof(*target) * unres->size))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return 0;
+    }
+    for (i=0;i<unres->size;i++) {
+        target[i] = ENTITY_INVALID;
+        for (j=0;j<labels->size;j++) {
+            if (((class_header_t *)unres->entries[i])->name ==
+                ((class_header_t *)labels->entries[j])->name) {
+                target[i] = j;
+                break;
+            }
+        }
+    }
+
+    /* Step 2: Rewrite operands */
+    for (pc=0;pc<code->size;) {
+        argc = (uint32_t)code->entries[pc] & 0xFF;
+        for (pc++,n=0;(n<argc) && (pc<code->size);n++,pc+=w) {
+            e = (uint32_t)code->entries[pc];
+            w = avmlib_operand_words(&code->entries[pc]);
+            if ((AVM_CLASS_UNRESOLVED != avmlib_entity_class(e)) || (pc + w > code->size)) continue;
+            avmlib_entity_decode(&code->entries[pc],&idx);
+            if ((idx >= unres->size) || (ENTITY_INVALID == target[idx])) continue;
+            if (1 == w) {
+                if (target[idx] > AVM_ENTITY_INDEX_MASK) continue;
+                code->entries[pc] = (entry_t)(avmlib_entity_new(AVM_CLASS_LABEL,target[idx]) | OP_FLAG_LOCAL);
+            } else {
+                code->entries[pc] = (entry_t)((AVM_CLASS_LABEL << 24) | OP_FLAG_WIDE | OP_FLAG_LOCAL);
+                code->entries[pc + 1] = (entry_t)target[idx];
+            }
+            resolved++;
+        }
+    }
+    free(target);
+    avm_dbg(2,"AVMLIB","Segment %u: %u label references resolved.\n",seg->id,resolved);
+    return resolved;
+}
+
+/**************************************************************************//**
+ * @brief Build a cold segment's tables from its image.
+ *
+ * @returns 0 on success, -1 on failure (errno set).
+ * */
+static int
+avmlib_segment_load(
+    class_segment_t *seg
+)
+{
+    const avmlib_segment_image_t *hdr;
+    avmlib_segment_section_t sec;
+    const char *base, *p, *end, *name;
+    struct stat st;
+    table_t *t;
+    entry_t obj;
+    size_t nlen, tlen;
+    uint32_t w, off, i, s;
+    int fd, err = EINVAL;
+
+    /* Step 1: Map the image */
+    if (0 > (fd = open(seg->image,O_RDONLY|O_CLOEXEC))) {
+        err = errno;
+        avmlib_err("%s: Can't open \"%s\" (%s).\n",__func__,seg->image,strerror(err));
+        errno = err;
+        return -1;
+    }
+    if ((0 > fstat(fd,&st)) || ((size_t)st.st_size < sizeof(*hdr))) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    base = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (MAP_FAILED == base) return -1;
+    end = base + st.st_size;
+
+    /* Step 2: Validate */
+    hdr = (const avmlib_segment_image_t *)base;
+    p = base + sizeof(*hdr);
+    if ((AVMLIB_SEGMENT_MAGIC != hdr->magic) ||
+        (AVMLIB_SEGMENT_VERSION != hdr->version) ||
+        ((uint64_t)hdr->code_words * sizeof(w) > (uint64_t)(end - p))) {
+        goto _avmlib_segment_load_fail;
+    }
+    if (0 > avmlib_segment_tables_init(seg)) {
+        err = ENOMEM;
+        goto _avmlib_segment_load_fail;
+    }
+    avmm_entity_name_set(seg,hdr->name);
+
+    /* Step 3: Code */
+    t = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    for (i=0;i<hdr->code_words;i++,p+=sizeof(w)) {
+        memcpy(&w,p,sizeof(w));
+        avmlib_table_add(t,w);
+    }
+
+    /* Step 4: Sections */
+    for (s=0;s<hdr->nsections;s++) {
+        if ((size_t)(end - p) < sizeof(sec)) goto _avmlib_segment_load_fail;
+        memcpy(&sec,p,sizeof(sec));
+        p += sizeof(sec);
+        if ((sec.class >= AVM_CLASS_MAX) || !avmlib_segment_carried(sec.class) ||
+            (sec.bytes > (uint64_t)(end - p))) {
+            goto _avmlib_segment_load_fail;
+        }
+        t = AVM_CLASS_TABLE(seg,sec.class);
+        for (i=0;i<sec.count;i++) {
+            if (0 == (nlen = avmlib_segment_str(p,end))) goto _avmlib_segment_load_fail;
+            name = p;
+            p += nlen;
+            switch (sec.class) {
+                case AVM_CLASS_STRING:
+                    if (0 == (tlen = avmlib_segment_str(p,end))) goto _avmlib_segment_load_fail;
+                    obj = (entry_t)avmtype_string_new((char *)name,(char *)p);
+                    p += tlen;
+                    break;
+                case AVM_CLASS_LABEL:
+                    if ((size_t)(end - p) < sizeof(off)) goto _avmlib_segment_load_fail;
+                    memcpy(&off,p,sizeof(off));
+                    p += sizeof(off);
+                    obj = (entry_t)avmlib_new_label((char *)name,seg->id,off);
+                    break;
+                case AVM_CLASS_PORT:
+                    obj = (entry_t)avmlib_port_new((char *)name,-1,NULL);
+                    break;
+                case AVM_CLASS_BUFFER:
+                    obj = (entry_t)avmtype_buffer_new((char *)name,0);
+                    break;
+                default:
+                    obj = (entry_t)avmlib_unresolved_new((char *)name);
+                    break;
+            }
+            if (!obj) {
+                err = ENOMEM;
+                goto _avmlib_segment_load_fail;
+            }
+            avmlib_table_add(t,obj);
+        }
+    }
+
+    avmlib_segment_link(seg);
+    if (0 > avmlib_store_build(&seg->store,seg)) {
+        err = ENOMEM;
+        goto _avmlib_segment_load_fail;
+    }
+
+    munmap((void *)base,st.st_size);
+    avm_dbg(2,"AVMLIB","Loaded segment %u (\"%s\") from %s.\n",seg->id,
+            avmm_entity_name(seg),seg->image);
+    return 0;
+
+_avmlib_segment_load_fail:
+    avmlib_err("%s: Bad segment image \"%s\".\n",__func__,seg->image);
+    avmlib_segment_tables_free(seg);
+    munmap((void *)base,st.st_size);
+    errno = err;
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Give a segment the next ID in a machine.
+ *
+ * @returns The new ID, or -1 if the machine is out of IDs.
+ * */
+static int
+avmlib_segment_slot(
+    avm_t *avm,
+    class_segment_t *seg
+)
+{
+    table_t *t = AVM_CLASS_TABLE(avm,AVM_CLASS_SEGMENT);
+
+    if (t->size > AVMM_SEGMENT_MAX) {
+        avmlib_err("%s: Machine is out of segment IDs.\n",__func__);
+        errno = ENOSPC;
+        return -1;
+    }
+    seg->id = (uint16_t)t->size;
+    seg->avm = avm;
+    return avmlib_table_add(t,seg);
+}
+
+/**************************************************************************//**
+ * @brief Bind labels still marked unlinked to a segment's ID, and
+ * resolve references to them.
+ * */
+static void
+avmlib_segment_bind(
+    class_segment_t *seg
+)
+{
+    table_t *t = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    int i;
+
+    for (i=0;t && (i<t->size);i++) {
+        class_label_t *lbl = (class_label_t *)t->entries[i];
+        if (AVMM_SEGMENT_UNLINKED == lbl->segment) lbl->segment = seg->id;
+    }
+    avmlib_segment_link(seg);
+}
+
+/**************************************************************************//**
+ * @brief Add a segment built in memory to a machine.
+ *
+ * @details Labels still marked unlinked are bound to the new ID, and
+ * the segment's runtime store is built.
+ *
+ * @returns The segment's ID, or -1 on failure.
+ * */
+int
+avmlib_segment_add(
+    avm_t *avm,
+    class_segment_t *seg
+)
+{
+    int id;
+
+    if (0 > (id = avmlib_segment_slot(avm,seg))) return -1;
+    avmlib_segment_bind(seg);
+    if (0 > avmlib_store_build(&seg->store,seg)) return -1;
+    seg->state = AVMM_SEGMENT_RESIDENT;
+    return id;
+}
+
+/**************************************************************************//**
+ * @brief Allocate a cold segment for an image.
+ *
+ * @returns The segment, or NULL on failure.
+ * */
+static class_segment_t *
+avmlib_segment_stub(
+    const char *path
+)
+{
+    class_segment_t *seg;
+    const char *base = strrchr(path,'/');
+
+    if ((NULL == (seg = calloc(1,sizeof(*seg)))) ||
+        (NULL == (seg->image = strdup(path)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        free(seg);
+        return NULL;
+    }
+    avmm_entity_name_set(seg,base ? base + 1 : path);
+    seg->state = AVMM_SEGMENT_COLD;
+    return seg;
+}
+
+/**************************************************************************//**
+ * @brief Free a segment no longer in its machine's table.
+ * */
+static void
+avmlib_segment_free(
+    void *ptr
+)
+{
+    class_segment_t *seg = (class_segment_t *)ptr;
+
+    if (seg->mapped) return; /* Part of a machine image */
+    avm_dbg(2,"AVMLIB","Freeing segment %u version %u.\n",seg->id,seg->version);
+    avmlib_segment_tables_free(seg);
+    if (seg->native_release) seg->native_release(seg->native_handle);
+    free(seg->image);
+    free(seg);
+}
+
+/**************************************************************************//**
+ * @brief Register a segment image without loading it.
+ *
+ * @details Only the path is recorded; the image is opened on first
+ * avmlib_segment_get().
+ *
+ * @returns The segment's ID, or -1 on failure.
+ * */
+int
+avmlib_segment_register(
+    avm_t *avm,
+    const char *path
+)
+{
+    class_segment_t *seg;
+    int id;
+
+    if (NULL == (seg = avmlib_segment_stub(path))) return -1;
+    if (0 > (id = avmlib_segment_slot(avm,seg))) {
+        free(seg->image);
+        free(seg);
+    }
+    return id;
+}
+
+/**************************************************************************//**
+ * @brief Get a segment by ID, loading it on first touch.
+ *
+ * @details This is the hook for cross-segment jumps and references.  A
+ * resident segment costs one atomic load; the first touch of a cold one
+ * loads it, and any other thread touching it meanwhile waits.
+ *
+ * @returns The resident segment, or NULL on failure.
+ *
+ * @remarks Segments should be added/registered before processes run;
+ * the SEGMENT table itself isn't guarded, only its slots.  Callers that
+ * may race a swap go through avmlib_segment_enter() instead.
+ * */
+class_segment_t *
+avmlib_segment_get(
+    avm_t *avm,
+    uint16_t id
+)
+{
+    table_t *t = AVM_CLASS_TABLE(avm,AVM_CLASS_SEGMENT);
+    class_segment_t *seg;
+    uint32_t state;
+
+    if (id >= t->size) {
+        errno = ENOENT;
+        return NULL;
+    }
+    seg = (class_segment_t *)__atomic_load_n(&t->entries[id],__ATOMIC_SEQ_CST);
+
+    for (;;) {
+        state = __atomic_load_n(&seg->state,__ATOMIC_ACQUIRE);
+        if (AVMM_SEGMENT_RESIDENT == state) return seg;
+        if ((AVMM_SEGMENT_COLD == state) &&
+            __atomic_compare_exchange_n(&seg->state,&state,AVMM_SEGMENT_LOADING,
+                                        0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) {
+            if (0 > avmlib_segment_load(seg)) {
+                __atomic_store_n(&seg->state,AVMM_SEGMENT_COLD,__ATOMIC_RELEASE);
+                return NULL;
+            }
+            __atomic_store_n(&seg->state,AVMM_SEGMENT_RESIDENT,__ATOMIC_RELEASE);
+            return seg;
+        }
+        sched_yield(); /* Another thread is loading it */
+    }
+}
+
+/**************************************************************************//**
+ * @brief Drop a resident segment's tables; it reloads on next touch.
+ *
+ * @returns 0 on success, -1 if the segment has no image to reload from,
+ * isn't resident, has processes executing in it (EBUSY), or is part of
+ * a restored machine image (EPERM).
+ *
+ * @remarks The caller must know nothing else holds references into the
+ * segment, and that no process is about to enter it.
+ * */
+int
+avmlib_segment_unload(
+    class_segment_t *seg
+)
+{
+    uint32_t state = AVMM_SEGMENT_RESIDENT;
+
+    if (__atomic_load_n(&seg->refs,__ATOMIC_ACQUIRE) & ~AVMM_SEGMENT_RETIRED) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (seg->mapped) {
+        errno = EPERM; /* Its tables live in a machine image */
+        return -1;
+    }
+    if (!seg->image ||
+        !__atomic_compare_exchange_n(&seg->state,&state,AVMM_SEGMENT_LOADING,
+                                     0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) {
+        errno = EINVAL;
+        return -1;
+    }
+    avmlib_segment_tables_free(seg);
+    __atomic_store_n(&seg->state,AVMM_SEGMENT_COLD,__ATOMIC_RELEASE);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Epoch callback for a swapped-out segment.
+ *
+ * @details The grace period is over, so no thread can take a new
+ * reference; mark it retired and free it now if nobody's executing in
+ * it, or leave that to the last avmlib_segment_leave().
+ * */
+static void
+avmlib_segment_retired(
+    void *ptr
+)
+{
+    class_segment_t *seg = (class_segment_t *)ptr;
+
+    if (0 == __atomic_fetch_or(&seg->refs,AVMM_SEGMENT_RETIRED,__ATOMIC_ACQ_REL)) {
+        avmlib_segment_free(seg);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Enter a segment on behalf of a process.
+ *
+ * @details This is the run loop's hook for entry into a segment (process
+ * start, cross-segment jump).  The current version in the segment's slot
+ * is referenced and becomes the process's; the process keeps executing
+ * in it until it leaves, even if the slot is swapped meanwhile.  Entering
+ * the segment the process is already in is a no-op.  No locks are taken.
+ *
+ * @param avm The machine
+ * @param thr The calling thread's record in avm->epoch
+ * @param proc The process
+ * @param id The segment
+ *
+ * @returns The segment version entered, or NULL on failure (the process
+ * stays where it was).
+ * */
+class_segment_t *
+avmlib_segment_enter(
+    avm_t *avm,
+    avmlib_epoch_thread_t *thr,
+    class_process_t *proc,
+    uint16_t id
+)
+{
+    class_segment_t *seg;
+
+    if (proc->segment && (proc->segment->id == id)) return proc->segment;
+
+    /* Step 1: Find and reference the current version */
+    avmlib_epoch_enter((avmlib_epoch_t *)avm->epoch,thr);
+    if (NULL != (seg = avmlib_segment_get(avm,id))) {
+        __atomic_add_fetch(&seg->refs,1,__ATOMIC_ACQ_REL);
+    }
+    avmlib_epoch_exit(thr);
+    if (!seg) return NULL;
+
+    /* Step 2: Drop the old one */
+    avmlib_segment_leave(proc);
+    proc->segment = seg;
+    return seg;
+}
+
+/**************************************************************************//**
+ * @brief Drop a process's reference on the segment it's executing in.
+ *
+ * @details Called when the process exits or moves to another segment.
+ * If the version has been swapped out and this was the last process in
+ * it, it's freed here.
+ * */
+void
+avmlib_segment_leave(
+    class_process_t *proc
+)
+{
+    class_segment_t *seg = proc->segment;
+
+    if (!seg) return;
+    proc->segment = NULL;
+    if ((AVMM_SEGMENT_RETIRED | 1) ==
+        __atomic_fetch_sub(&seg->refs,1,__ATOMIC_ACQ_REL)) {
+        avmlib_segment_free(seg);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Replace the segment in a slot while the machine runs.
+ *
+ * @details The new version takes over the old one's ID and is published
+ * with a single atomic store, so processes entering the segment from then
+ * on get it.  The old version is retired through the machine's epoch
+ * domain and freed once no thread can still be looking it up and the
+ * last process executing in it has left.
+ *
+ * @param avm The machine
+ * @param id The slot to replace
+ * @param next The new version (built in memory, or cold with an image)
+ *
+ * @returns 0 on success, -1 on failure.
+ *
+ * @remarks Both versions must be heap-allocated: the machine owns and
+ * eventually frees whatever is swapped out.  Entities in the old
+ * version's tables aren't carried over.
+ * */
+int
+avmlib_segment_swap(
+    avm_t *avm,
+    uint16_t id,
+    class_segment_t *next
+)
+{
+    table_t *t = AVM_CLASS_TABLE(avm,AVM_CLASS_SEGMENT);
+    class_segment_t *old;
+
+    if (!next || (id >= t->size)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Step 1: Take over the slot's identity */
+    next->id = id;
+    next->avm = avm;
+    next->refs = 0;
+    if (!next->image) next->state = AVMM_SEGMENT_RESIDENT;
+    if (AVMM_SEGMENT_RESIDENT == next->state) {
+        avmlib_segment_bind(next);
+        if (0 > avmlib_store_build(&next->store,next)) return -1;
+    }
+
+    /* Step 2: Publish */
+    old = (class_segment_t *)__atomic_load_n(&t->entries[id],__ATOMIC_ACQUIRE);
+    do {
+        next->version = old->version + 1;
+    } while (!__atomic_compare_exchange_n(&t->entries[id],(entry_t *)&old,(entry_t)next,
+                                          0,__ATOMIC_SEQ_CST,__ATOMIC_ACQUIRE));
+
+    /* Step 3: Retire the old version */
+    avm_dbg(1,"AVMLIB","Segment %u swapped to version %u.\n",id,next->version);
+    avmlib_epoch_retire((avmlib_epoch_t *)avm->epoch,old,avmlib_segment_retired);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Replace the segment in a slot with one loaded from an image.
+ *
+ * @details The image is loaded before the swap, so a bad image leaves
+ * the running version in place and the first process to enter the new
+ * version doesn't pay for the load.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_segment_replace(
+    avm_t *avm,
+    uint16_t id,
+    const char *path
+)
+{
+    class_segment_t *seg;
+
+    if (NULL == (seg = avmlib_segment_stub(path))) return -1;
+    seg->id = id;
+    seg->avm = avm;
+    if (0 > avmlib_segment_load(seg)) {
+        avmlib_segment_free(seg);
+        return -1;
+    }
+    seg->state = AVMM_SEGMENT_RESIDENT;
+    if (0 > avmlib_segment_swap(avm,id,seg)) {
+        avmlib_segment_free(seg);
+        return -1;
+    }
+    return 0;
+}
+
+#endif /* _AVMLIB_SEGMENT_C_ */
@@ -0,0 +1,86 @@
+/**************************************************************************//**
+ * @file avmlib_segment.h
+ *
+ * @brief Segment images and on-demand segment loading.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * A segment's ID is its index in the machine's SEGMENT table.  Segments
+ * built in memory (the compiler) are added resident; segments saved as
+ * images are registered cold, by path only, and nothing is read until
+ * avmlib_segment_get() first asks for them (a cross-segment jump or
+ * reference).  Unused handler segments therefore cost one table slot.
+ *
+ * A running machine's segments can be upgraded in place with
+ * avmlib_segment_swap() or avmlib_segment_replace().  The slot is
+ * switched atomically; processes entering the segment afterwards (see
+ * avmlib_segment_enter()) run the new version, while processes already
+ * in it hold a reference and finish on the old one.  The old version is
+ * reclaimed through the machine's epoch domain (avmlib_epoch.h), so the
+ * run loop never takes a lock to look a segment up.  A pool job leaves
+ * its segment when it finishes, and the worker then reclaims whatever
+ * a swap couldn't free yet.
+ *
+ * Image layout (host byte order):
+ *    + avmlib_segment_image_t header
+ *    + code_words 32-bit instruction words
+ *    + nsections sections, each an avmlib_segment_section_t followed by
+ *      its records, in table order:
+ *        STRING      name NUL text NUL
+ *        LABEL       name NUL, 32-bit offset
+ *        PORT, BUFFER, UNRESOLVED    name NUL
+ * Images saved with AVMLIB_SEGMENT_STRIP have empty STRING and BUFFER
+ * names; labels, ports and unresolved references keep theirs, since
+ * they're bound by name.
+ * */
+#ifndef _AVMLIB_SEGMENT_H_
+#define _AVMLIB_SEGMENT_H_
+
+#include "avmm_data.h"
+#include "avmlib_epoch.h"
+
+/**
+ * Image identification
+ */
+#define AVMLIB_SEGMENT_MAGIC ((uint32_t)0x41564D53) /* "AVMS" */
+#define AVMLIB_SEGMENT_VERSION 1
+
+/**
+ * avmlib_segment_save() flags
+ */
+#define AVMLIB_SEGMENT_STRIP 0x1 /* Production image: drop unbound names */
+
+/**
+ * Image header
+ */
+typedef struct {
+    uint32_t magic; /* AVMLIB_SEGMENT_MAGIC */
+    uint16_t version; /* AVMLIB_SEGMENT_VERSION */
+    uint16_t nsections; /* Sections following the code */
+    uint32_t code_words; /* Instruction words following the header */
+    char name[64]; /* Segment name */
+} avmlib_segment_image_t;
+
+/**
+ * Image section header
+ */
+typedef struct {
+    uint32_t class; /* Entity class of the records */
+    uint32_t count; /* Records in the section */
+    uint32_t bytes; /* Bytes of records following */
+} avmlib_segment_section_t;
+
+/* Prototypes */
+int avmlib_segment_save(class_segment_t *seg, const char *path, int flags);
+int avmlib_segment_add(avm_t *avm, class_segment_t *seg);
+int avmlib_segment_register(avm_t *avm, const char *path);
+class_segment_t *avmlib_segment_get(avm_t *avm, uint16_t id);
+int avmlib_segment_unload(class_segment_t *seg);
+class_segment_t *avmlib_segment_enter(avm_t *avm, avmlib_epoch_thread_t *thr, class_process_t *proc, uint16_t id);
+void avmlib_segment_leave(class_process_t *proc);
+int avmlib_segment_swap(avm_t *avm, uint16_t id, class_segment_t *next);
+int avmlib_segment_replace(avm_t *avm, uint16_t id, const char *path);
+uint32_t avmlib_segment_link(class_segment_t *seg);
+
+#endif /* _AVMLIB_SEGMENT_H_ */
@@ -0,0 +1,552 @@
+/**************************************************************************//**
+ * @file avmlib_shmregs.c
+ *
+ * @brief Shared-memory register bank implementation
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_SHMREGS_C_
+#define _AVMLIB_SHMREGS_C_
+
+#define _GNU_SOURCE /* memfd_create() */
+#include "avmlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**************************************************************************//**
+ * @brief Ease off the CPU while a bank's seqlock is held.
+ * */
+static inline void
+avmlib_shmregs_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**************************************************************************//**
+ * @brief Wait a little for a held seqlock, recovering it from a dead
+ * writer.
+ *
+ * @details Pauses for the first AVMLIB_SHMREGS_SPINS calls, then yields.
+ * Every AVMLIB_SHMREGS_STALE yields, if the lock is still held at seq by
+ * a writer whose pid no longer exists, it's released on that writer's
+ * behalf (see avmlib_shmregs.h).
+ *
+ * @param block The mapped block
+ * @param seq The sequence value seen (odd if held)
+ * @param spins Calls so far for this wait; start at 0
+ * */
+static void
+avmlib_shmregs_backoff(
+    avmlib_shmregs_block_t *block,
+    uint32_t seq,
+    uint32_t *spins
+)
+{
+    pid_t pid;
+
+    if (++*spins <= AVMLIB_SHMREGS_SPINS) {
+        avmlib_shmregs_pause();
+        return;
+    }
+    sched_yield();
+    if (!(seq & 1) || ((*spins - AVMLIB_SHMREGS_SPINS) % AVMLIB_SHMREGS_STALE)) return;
+
+    /* Is the writer still there?  (A new writer would have moved seq on) */
+    pid = (pid_t)__atomic_load_n(&block->owner,__ATOMIC_RELAXED);
+    if ((0 >= pid) || (0 == kill(pid,0)) || (ESRCH != errno)) return;
+    if (__atomic_compare_exchange_n(&block->seq,&seq,seq + 1,0,
+                                    __ATOMIC_RELEASE,__ATOMIC_RELAXED)) {
+        avmlib_err("%s: Writer %d died holding the bank; released.\n",__func__,(int)pid);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Take the writer side of a bank's seqlock.
+ *
+ * @details Waits until the sequence is even, then bumps it to odd and
+ * records our pid.  The lock is shared between processes, so this is
+ * the only writer serialization there is.
+ *
+ * @param block The mapped block
+ *
+ * @returns The (even) sequence value that was held before locking.
+ * */
+static uint32_t
+avmlib_shmregs_write_lock(
+    avmlib_shmregs_block_t *block
+)
+{
+    uint32_t seq, spins = 0;
+
+    for (;;) {
+        seq = __atomic_load_n(&block->seq,__ATOMIC_RELAXED);
+        if ((seq & 1) == 0 &&
+            __atomic_compare_exchange_n(&block->seq,&seq,seq + 1,0,
+                                        __ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) {
+            __atomic_store_n(&block->owner,(uint32_t)getpid(),__ATOMIC_RELAXED);
+            return seq;
+        }
+        avmlib_shmregs_backoff(block,seq,&spins);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Release the writer side of a bank's seqlock.
+ * */
+static void
+avmlib_shmregs_write_unlock(
+    avmlib_shmregs_block_t *block,
+    uint32_t seq
+)
+{
+    __atomic_store_n(&block->owner,0,__ATOMIC_RELAXED);
+    __atomic_store_n(&block->seq,seq + 2,__ATOMIC_RELEASE);
+}
+
+/**************************************************************************//**
+ * @brief Map a bank's backing descriptor.
+ *
+ * @param bank The bank, with fd already set.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_shmregs_map(
+    avmlib_shmregs_t *bank
+)
+{
+    uint32_t i;
+    void *p;
+
+    p = mmap(NULL,sizeof(avmlib_shmregs_block_t),PROT_READ|PROT_WRITE,
+             MAP_SHARED,bank->fd,0);
+    if (MAP_FAILED == p) {
+        avmlib_err("%s: mmap failed (%s).\n",__func__,strerror(errno));
+        return -1;
+    }
+    bank->block = p;
+
+    for (i=0;i<AVMLIB_SHMREGS_MAX;i++) {
+        bank->slots[i].bank = bank;
+        bank->slots[i].index = i;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Create a new shared register bank.
+ *
+ * @details The backing object is created with shm_open() if a name is
+ * given, otherwise with memfd_create().  A memfd is inherited across
+ * fork()/exec(), so a host can pass bank->fd to its child and have the
+ * child call avmlib_shmregs_attach(NULL,fd).
+ *
+ * @param name POSIX shm name (e.g. "/avm-regs"), or NULL for a memfd.
+ * @param count Number of registers in the bank.
+ *
+ * @returns New bank on success, NULL on failure.
+ *
+ * @remarks The creator owns a named object and unlinks it on destroy.
+ * */
+avmlib_shmregs_t *
+avmlib_shmregs_create(
+    const char *name,
+    uint32_t count
+)
+{
+    avmlib_shmregs_t *bank;
+
+    /* Step 1: Sanity check */
+    if ((0 == count) || (count > AVMLIB_SHMREGS_MAX)) {
+        avmlib_err("%s: Bad register count %u.\n",__func__,count);
+        return NULL;
+    }
+
+    /* Step 2: Alloc handle */
+    if (NULL == (bank = calloc(1,sizeof(*bank)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+
+    /* Step 3: Create backing object */
+    if (name) {
+        bank->name = strdup(name);
+        bank->fd = shm_open(name,O_RDWR|O_CREAT|O_EXCL,0600);
+    } else {
+        bank->fd = memfd_create("avm-regs",0);
+    }
+    if (0 > bank->fd) {
+        avmlib_err("%s: Can't create \"%s\" (%s).\n",__func__,
+                   name?name:"memfd",strerror(errno));
+        goto _avmlib_shmregs_create_fail;
+    }
+    bank->owner = 1;
+    if (0 > ftruncate(bank->fd,sizeof(avmlib_shmregs_block_t))) {
+        avmlib_err("%s: Can't size \"%s\" (%s).\n",__func__,
+                   name?name:"memfd",strerror(errno));
+        goto _avmlib_shmregs_create_fail;
+    }
+
+    /* Step 4: Map and fill in header; magic goes last so attachers
+     * never see a half-built block. */
+    if (0 > avmlib_shmregs_map(bank)) goto _avmlib_shmregs_create_fail;
+    bank->block->version = AVMLIB_SHMREGS_VERSION;
+    bank->block->count = bank->count = count;
+    bank->block->seq = 0;
+    bank->block->owner = 0;
+    __atomic_store_n(&bank->block->magic,AVMLIB_SHMREGS_MAGIC,__ATOMIC_RELEASE);
+
+    return bank;
+
+_avmlib_shmregs_create_fail:
+    avmlib_shmregs_destroy(bank);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Attach to an existing shared register bank.
+ *
+ * @param name POSIX shm name, or NULL to use fd.
+ * @param fd Inherited descriptor (memfd or otherwise), used if name is NULL.
+ *
+ * @returns Bank handle on success, NULL on failure.
+ *
+ * @remarks The descriptor is owned by the returned handle.
+ * */
+avmlib_shmregs_t *
+avmlib_shmregs_attach(
+    const char *name,
+    int fd
+)
+{
+    avmlib_shmregs_t *bank;
+    struct stat st;
+
+    /* Step 1: Alloc handle */
+    if (NULL == (bank = calloc(1,sizeof(*bank)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+
+    /* Step 2: Open backing object */
+    if (name) {
+        bank->name = strdup(name);
+        bank->fd = shm_open(name,O_RDWR,0);
+    } else {
+        bank->fd = fd;
+    }
+    if (0 > bank->fd) {
+        avmlib_err("%s: Can't open \"%s\" (%s).\n",__func__,
+                   name?name:"fd",strerror(errno));
+        goto _avmlib_shmregs_attach_fail;
+    }
+    if ((0 > fstat(bank->fd,&st)) ||
+        (st.st_size < (off_t)sizeof(avmlib_shmregs_block_t))) {
+        avmlib_err("%s: Object is not a register bank.\n",__func__);
+        goto _avmlib_shmregs_attach_fail;
+    }
+
+    /* Step 3: Map and validate.  The other side can rewrite the header
+     * at any time, so the count is read once and kept. */
+    if (0 > avmlib_shmregs_map(bank)) goto _avmlib_shmregs_attach_fail;
+    bank->count = __atomic_load_n(&bank->block->count,__ATOMIC_RELAXED);
+    if ((AVMLIB_SHMREGS_MAGIC != __atomic_load_n(&bank->block->magic,__ATOMIC_ACQUIRE)) ||
+        (AVMLIB_SHMREGS_VERSION != bank->block->version) ||
+        (0 == bank->count) || (bank->count > AVMLIB_SHMREGS_MAX)) {
+        avmlib_err("%s: Bad register bank header.\n",__func__);
+        goto _avmlib_shmregs_attach_fail;
+    }
+
+    return bank;
+
+_avmlib_shmregs_attach_fail:
+    avmlib_shmregs_destroy(bank);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Unmap and release a bank handle.
+ *
+ * @param bank The bank to release
+ *
+ * @remarks Registers bound to this bank must not be used afterward.
+ * */
+void
+avmlib_shmregs_destroy(
+    avmlib_shmregs_t *bank
+)
+{
+    if (!bank) return;
+
+    if (bank->block) {
+        munmap(bank->block,sizeof(avmlib_shmregs_block_t));
+        bank->block = NULL;
+    }
+    if (0 <= bank->fd) {
+        close(bank->fd);
+        bank->fd = -1;
+    }
+    if (bank->name) {
+        if (bank->owner) shm_unlink(bank->name);
+        free(bank->name);
+        bank->name = NULL;
+    }
+    free(bank);
+}
+
+/**************************************************************************//**
+ * @brief Read a single register from a bank.
+ *
+ * @param bank The bank
+ * @param index Slot to read
+ *
+ * @returns Register value; 0 for an out-of-range slot.
+ * */
+uint32_t
+avmlib_shmregs_read(
+    avmlib_shmregs_t *bank,
+    uint32_t index
+)
+{
+    if (index >= bank->count) return 0;
+    return __atomic_load_n(&bank->block->values[index],__ATOMIC_ACQUIRE);
+}
+
+/**************************************************************************//**
+ * @brief Write a single register in a bank.
+ *
+ * @param bank The bank
+ * @param index Slot to write
+ * @param value New value
+ * */
+void
+avmlib_shmregs_write(
+    avmlib_shmregs_t *bank,
+    uint32_t index,
+    uint32_t value
+)
+{
+    uint32_t seq;
+
+    if (index >= bank->count) return;
+
+    seq = avmlib_shmregs_write_lock(bank->block);
+    __atomic_store_n(&bank->block->values[index],value,__ATOMIC_RELAXED);
+    avmlib_shmregs_write_unlock(bank->block,seq);
+}
+
+/**************************************************************************//**
+ * @brief Take a consistent snapshot of a run of registers.
+ *
+ * @details Retries until no writer intervened during the copy.
+ *
+ * @param bank The bank
+ * @param first First slot to copy
+ * @param count Number of slots to copy
+ * @param values Destination array, at least count entries
+ *
+ * @returns Number of registers copied, or -1 if the range is invalid.
+ * */
+int
+avmlib_shmregs_snapshot(
+    avmlib_shmregs_t *bank,
+    uint32_t first,
+    uint32_t count,
+    uint32_t *values
+)
+{
+    avmlib_shmregs_block_t *block = bank->block;
+    uint32_t s1, s2, i, spins = 0;
+
+    if ((first > bank->count) || (count > (bank->count - first))) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    do {
+        s1 = __atomic_load_n(&block->seq,__ATOMIC_ACQUIRE);
+        if (s1 & 1) {
+            avmlib_shmregs_backoff(block,s1,&spins);
+            continue;
+        }
+        for (i=0;i<count;i++) {
+            values[i] = __atomic_load_n(&block->values[first + i],__ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&block->seq,__ATOMIC_RELAXED);
+    } while ((s1 & 1) || (s1 != s2));
+
+    return (int)count;
+}
+
+/**************************************************************************//**
+ * @brief Register getter for shared-memory registers.
+ * */
+uint32_t
+avmlib_shmregs_get(
+    class_register_t *reg
+)
+{
+    avmlib_shmregs_slot_t *slot = (avmlib_shmregs_slot_t *)reg->private_data;
+    return avmlib_shmregs_read(slot->bank,slot->index);
+}
+
+/**************************************************************************//**
+ * @brief Register setter for shared-memory registers.
+ *
+ * @returns The value written.
+ * */
+uint32_t
+avmlib_shmregs_set(
+    class_register_t *reg,
+    uint32_t value
+)
+{
+    avmlib_shmregs_slot_t *slot = (avmlib_shmregs_slot_t *)reg->private_data;
+    avmlib_shmregs_write(slot->bank,slot->index,value);
+    return value;
+}
+
+/**************************************************************************//**
+ * @brief Batched register setter for shared-memory registers.
+ *
+ * @details Consecutive registers from the same bank are written under a
+ * single hold of that bank's seqlock, so a host snapshot sees either
+ * none or all of them.
+ *
+ * @returns Number of registers written.
+ * */
+int
+avmlib_shmregs_set_many(
+    class_register_t **regs,
+    uint32_t *values,
+    int count
+)
+{
+    avmlib_shmregs_slot_t *slot;
+    avmlib_shmregs_t *bank;
+    uint32_t seq;
+    int i = 0;
+
+    while (i < count) {
+        bank = ((avmlib_shmregs_slot_t *)regs[i]->private_data)->bank;
+        seq = avmlib_shmregs_write_lock(bank->block);
+        for (;i<count;i++) {
+            slot = (avmlib_shmregs_slot_t *)regs[i]->private_data;
+            if (slot->bank != bank) break;
+            if (slot->index < bank->count) {
+                __atomic_store_n(&bank->block->values[slot->index],values[i],__ATOMIC_RELAXED);
+            }
+        }
+        avmlib_shmregs_write_unlock(bank->block,seq);
+    }
+    return count;
+}
+
+/**************************************************************************//**
+ * @brief Batched register getter for shared-memory registers.
+ *
+ * @details Consecutive registers from the same bank are read as one
+ * consistent snapshot.
+ *
+ * @returns Number of registers read.
+ * */
+int
+avmlib_shmregs_get_many(
+    class_register_t **regs,
+    uint32_t *values,
+    int count
+)
+{
+    avmlib_shmregs_slot_t *slot;
+    avmlib_shmregs_block_t *block;
+    uint32_t s1, s2, spins;
+    int first = 0;
+    int i;
+
+    while (first < count) {
+        block = ((avmlib_shmregs_slot_t *)regs[first]->private_data)->bank->block;
+        spins = 0;
+        do {
+            s1 = __atomic_load_n(&block->seq,__ATOMIC_ACQUIRE);
+            if (s1 & 1) {
+                avmlib_shmregs_backoff(block,s1,&spins);
+                continue;
+            }
+            for (i=first;i<count;i++) {
+                slot = (avmlib_shmregs_slot_t *)regs[i]->private_data;
+                if (slot->bank->block != block) break;
+                values[i] = (slot->index < slot->bank->count) ?
+                    __atomic_load_n(&block->values[slot->index],__ATOMIC_RELAXED) : 0;
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            s2 = __atomic_load_n(&block->seq,__ATOMIC_RELAXED);
+        } while ((s1 & 1) || (s1 != s2));
+        first = i;
+    }
+    return count;
+}
+
+/**************************************************************************//**
+ * @brief Expose every register of a bank as a machine register.
+ *
+ * @details Registers are named <prefix><n> (e.g. "SR0", "SR1", ...)
+ * and appended to the machine's global register table.
+ *
+ * @param avm The machine to extend
+ * @param bank The bank to expose
+ * @param prefix Register name prefix
+ *
+ * @returns Register table index of the first bank register, or -1 on
+ * failure.
+ *
+ * @remarks The bank must outlive the machine.
+ * */
+int
+avmlib_shmregs_bind(
+    avm_t *avm,
+    avmlib_shmregs_t *bank,
+    const char *prefix
+)
+{
+    table_t *regs = AVM_CLASS_TABLE(avm,AVM_CLASS_REGISTER);
+    class_register_t *reg;
+    char name[AVMLIB_NAME_MAX + 1];
+    int first = -1;
+    int idx;
+    uint32_t i;
+
+    for (i=0;i<bank->count;i++) {
+        snprintf(name,sizeof(name),"%s%u",prefix,i);
+        if (avmlib_table_contains(regs,name)) {
+            avmlib_err("%s: Register \"%s\" already defined.\n",__func__,name);
+            return -1;
+        }
+        reg = avmlib_register_new(name,REGMODE_RW,
+                                  (intptr_t)&bank->slots[i],
+                                  NULL,
+                                  avmlib_shmregs_get,
+                                  avmlib_shmregs_set);
+        if (NULL == reg) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return -1;
+        }
+        reg->get_many = avmlib_shmregs_get_many;
+        reg->set_many = avmlib_shmregs_set_many;
+        idx = avmlib_table_add(regs,reg);
+        if (first < 0) first = idx;
+    }
+    return first;
+}
+
+#endif /* _AVMLIB_SHMREGS_C_ */
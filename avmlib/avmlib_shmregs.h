@@ -0,0 +1,109 @@
+/**************************************************************************//**
+ * @file avmlib_shmregs.h
+ *
+ * @brief Shared-memory register bank.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * A shared-memory register bank is a block of 32-bit register values
+ * living in a POSIX shared-memory object (shm_open() by name, or an
+ * anonymous memfd handed to a child).  The machine sees each slot as
+ * an ordinary REGISTER entity; a host controller process maps the
+ * same object and reads/writes the values directly, with no syscalls
+ * on either side.
+ *
+ * Writers (host or machine) serialize through the block's sequence
+ * counter, which doubles as a seqlock so that readers can take a
+ * consistent snapshot of several registers at once.  Single-register
+ * reads are plain atomic loads.
+ *
+ * Anyone waiting on a held lock spins briefly, then yields the CPU.  A
+ * writer records its pid in the block while it holds the lock; a
+ * waiter that has yielded AVMLIB_SHMREGS_STALE times checks it with
+ * kill(pid,0), and if the process is gone releases the lock for it.
+ * Whatever the dead writer had stored stays, so a snapshot may see a
+ * batch it only half wrote.  Recovery can't help if the writer died
+ * before recording its pid, if its pid has been reused, or if it lives
+ * in a different pid namespace; those waiters spin (yielding) forever.
+ *
+ * Host-side usage:
+ *    bank = avmlib_shmregs_attach("/avm-regs", -1);
+ *    avmlib_shmregs_write(bank, 3, 0x1234);
+ *    v = avmlib_shmregs_read(bank, 4);
+ * */
+#ifndef _AVMLIB_SHMREGS_H_
+#define _AVMLIB_SHMREGS_H_
+
+#include "avmm_data.h"
+
+/**
+ * Block identification
+ */
+#define AVMLIB_SHMREGS_MAGIC ((uint32_t)0x41564D52) /* "AVMR" */
+#define AVMLIB_SHMREGS_VERSION ((uint32_t)2)
+
+/**
+ * Most registers a single bank can hold
+ */
+#define AVMLIB_SHMREGS_MAX 256
+
+/**
+ * Waiting on a held lock: pauses before yielding, and yields between
+ * checks that the writer holding it is still alive
+ */
+#define AVMLIB_SHMREGS_SPINS 128
+#define AVMLIB_SHMREGS_STALE 1024
+
+/**
+ * Layout of the shared block.  This is what a host maps; keep it
+ * stable.
+ */
+typedef struct {
+    uint32_t magic; /* AVMLIB_SHMREGS_MAGIC */
+    uint32_t version; /* AVMLIB_SHMREGS_VERSION */
+    uint32_t count; /* Number of valid slots in values[] */
+    uint32_t seq; /* Sequence/seqlock; odd while a write is in progress */
+    uint32_t owner; /* pid of the writer holding seq odd, or 0 */
+    uint32_t values[AVMLIB_SHMREGS_MAX]; /* Register values */
+} avmlib_shmregs_block_t;
+
+struct _avmlib_shmregs_s;
+
+/**
+ * Per-register binding, referenced from class_register_t.private_data
+ */
+typedef struct {
+    struct _avmlib_shmregs_s *bank; /* Owning bank */
+    uint32_t index; /* Slot within bank */
+} avmlib_shmregs_slot_t;
+
+/**
+ * Process-local handle for a mapped bank
+ */
+typedef struct _avmlib_shmregs_s {
+    char *name; /* shm_open() name, or NULL for memfd */
+    int fd; /* Backing descriptor */
+    int owner; /* Nonzero if we created (and should unlink) it */
+    avmlib_shmregs_block_t *block; /* Mapped block */
+    uint32_t count; /* Valid slots, fixed at create/attach; block->count isn't trusted after */
+    avmlib_shmregs_slot_t slots[AVMLIB_SHMREGS_MAX]; /* Register bindings */
+} avmlib_shmregs_t;
+
+/* Prototypes */
+    /* Bank management */
+avmlib_shmregs_t *avmlib_shmregs_create(const char *name, uint32_t count);
+avmlib_shmregs_t *avmlib_shmregs_attach(const char *name, int fd);
+void avmlib_shmregs_destroy(avmlib_shmregs_t *bank);
+    /* Direct access (host or machine) */
+uint32_t avmlib_shmregs_read(avmlib_shmregs_t *bank, uint32_t index);
+void avmlib_shmregs_write(avmlib_shmregs_t *bank, uint32_t index, uint32_t value);
+int avmlib_shmregs_snapshot(avmlib_shmregs_t *bank, uint32_t first, uint32_t count, uint32_t *values);
+    /* Machine binding */
+int avmlib_shmregs_bind(avm_t *avm, avmlib_shmregs_t *bank, const char *prefix);
+uint32_t avmlib_shmregs_get(class_register_t *reg);
+uint32_t avmlib_shmregs_set(class_register_t *reg, uint32_t value);
+int avmlib_shmregs_get_many(class_register_t **regs, uint32_t *values, int count);
+int avmlib_shmregs_set_many(class_register_t **regs, uint32_t *values, int count);
+
+#endif /* _AVMLIB_SHMREGS_H_ */
@@ -0,0 +1,985 @@
+/**************************************************************************//**
+ * @file avmlib_snapshot.c
+ *
+ * @brief Memory-mapped machine snapshots
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * The writer builds the image in one growable buffer.  Objects are
+ * referred to by offset while it's built; each pointer slot is written
+ * as AVMLIB_SNAPSHOT_BASE + offset and recorded, so the image can be
+ * relocated if it can't be mapped there.
+ * */
+#ifndef _AVMLIB_SNAPSHOT_C_
+#define _AVMLIB_SNAPSHOT_C_
+
+#define _GNU_SOURCE /* dl_iterate_phdr() */
+#include "avmlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/**
+ * Executable the image's host pointers are relative to
+ */
+typedef struct {
+    uintptr_t base; /* Load bias */
+    uintptr_t lo, hi; /* Mapped range */
+    uint64_t tag; /* Build identity */
+} avmlib_snapshot_host_t;
+
+/**
+ * Image under construction
+ */
+typedef struct {
+    char *buf;
+    uint64_t size, cap;
+    uint64_t *relocs;
+    uint64_t nrelocs, crelocs;
+    avmlib_snapshot_fixup_t *fixups;
+    uint64_t nfixups, cfixups;
+    uint64_t *headers;
+    uint64_t nheaders, cheaders;
+    uintptr_t *seen; /* Entities copied so far (open-addressed)... */
+    uint64_t *seen_off; /* ...and where they went */
+    uint64_t nseen, cseen;
+    avmlib_snapshot_host_t host;
+    uint64_t root; /* Offset of the avm_t */
+    int err; /* First errno hit; the image is abandoned */
+} avmlib_snapshot_writer_t;
+
+#define AVMLIB_SNAP_AT(__w,__off,__type) \
+    ((__type *)((__w)->buf + (__off)))
+
+/**************************************************************************//**
+ * @brief FNV-1a, 64-bit, continuing from h.
+ * */
+static uint64_t
+avmlib_snapshot_hash(
+    uint64_t h,
+    const void *data,
+    size_t len
+)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**************************************************************************//**
+ * @brief dl_iterate_phdr() callback; looks at the executable only.
+ * */
+static int
+avmlib_snapshot_host_cb(
+    struct dl_phdr_info *info,
+    size_t size,
+    void *data
+)
+{
+    avmlib_snapshot_host_t *host = (avmlib_snapshot_host_t *)data;
+    const ElfW(Phdr) *ph;
+    uintptr_t start, end;
+    int i;
+
+    host->base = info->dlpi_addr;
+    host->lo = UINTPTR_MAX;
+    host->tag = 14695981039346656037ULL;
+    for (i=0;i<info->dlpi_phnum;i++) {
+        ph = &info->dlpi_phdr[i];
+        start = info->dlpi_addr + ph->p_vaddr;
+        if (PT_LOAD == ph->p_type) {
+            end = start + ph->p_memsz;
+            if (start < host->lo) host->lo = start;
+            if (end > host->hi) host->hi = end;
+        } else if (PT_NOTE == ph->p_type) {
+            /* The build ID, if the linker left one */
+            const char *n = (const char *)start, *nend = n + ph->p_memsz;
+            while (n + sizeof(ElfW(Nhdr)) <= nend) {
+                const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)n;
+                const char *desc = n + sizeof(*nh) + ((nh->n_namesz + 3) & ~3);
+                if (NT_GNU_BUILD_ID == nh->n_type) {
+                    host->tag = avmlib_snapshot_hash(host->tag,desc,nh->n_descsz);
+                }
+                n = desc + ((nh->n_descsz + 3) & ~3);
+            }
+        }
+    }
+    return 1; /* The executable is always first */
+}
+
+/**************************************************************************//**
+ * @brief Identify the running executable.
+ * */
+static void
+avmlib_snapshot_host(
+    avmlib_snapshot_host_t *host
+)
+{
+    uint64_t anchor;
+
+    memset(host,0,sizeof(*host));
+    dl_iterate_phdr(avmlib_snapshot_host_cb,host);
+
+    /* Layout too, for executables without a build ID */
+    anchor = (uintptr_t)avmlib_snapshot_save - host->base;
+    host->tag = avmlib_snapshot_hash(host->tag,&anchor,sizeof(anchor));
+    anchor = host->hi - host->lo;
+    host->tag = avmlib_snapshot_hash(host->tag,&anchor,sizeof(anchor));
+}
+
+/**************************************************************************//**
+ * @brief Make room for need elements in a growable array.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_snapshot_grow(
+    void **arr,
+    uint64_t *cap,
+    uint64_t need,
+    size_t elem
+)
+{
+    uint64_t ncap;
+    void *n;
+
+    if (need <= *cap) return 0;
+    for (ncap = *cap ? *cap : 4096 / elem; ncap < need; ncap <<= 1);
+    if (NULL == (n = realloc(*arr,ncap * elem))) return -1;
+    *arr = n;
+    *cap = ncap;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Note a failure; the first one wins.
+ * */
+static void
+avmlib_snapshot_fail(
+    avmlib_snapshot_writer_t *w,
+    int err
+)
+{
+    if (!w->err) w->err = err;
+}
+
+/**************************************************************************//**
+ * @brief Append bytes (zeroes if src is NULL), 16-byte aligned.
+ *
+ * @returns Offset of the copy, or 0 if len is 0 or on failure.
+ * */
+static uint64_t
+avmlib_snapshot_put(
+    avmlib_snapshot_writer_t *w,
+    const void *src,
+    uint64_t len
+)
+{
+    uint64_t off = w->size;
+    uint64_t padded = (len + 15) & ~(uint64_t)15;
+
+    if (!len || w->err) return 0;
+    if (0 > avmlib_snapshot_grow((void **)&w->buf,&w->cap,off + padded,1)) {
+        avmlib_snapshot_fail(w,ENOMEM);
+        return 0;
+    }
+    if (src) {
+        memcpy(w->buf + off,src,len);
+    } else {
+        memset(w->buf + off,0,len);
+    }
+    memset(w->buf + off + len,0,padded - len);
+    w->size += padded;
+    return off;
+}
+
+/**************************************************************************//**
+ * @brief Point an image slot at an image offset (0 is NULL).
+ * */
+static void
+avmlib_snapshot_ptr(
+    avmlib_snapshot_writer_t *w,
+    uint64_t slot,
+    uint64_t target
+)
+{
+    if (w->err) return;
+    *AVMLIB_SNAP_AT(w,slot,uint64_t) = target ? AVMLIB_SNAPSHOT_BASE + target : 0;
+    if (!target) return;
+    if (0 > avmlib_snapshot_grow((void **)&w->relocs,&w->crelocs,w->nrelocs + 1,sizeof(uint64_t))) {
+        avmlib_snapshot_fail(w,ENOMEM);
+        return;
+    }
+    w->relocs[w->nrelocs++] = slot;
+}
+
+/**************************************************************************//**
+ * @brief Record host state to reconnect at an image offset.
+ * */
+static void
+avmlib_snapshot_fixup(
+    avmlib_snapshot_writer_t *w,
+    uint64_t slot,
+    avmlib_snapshot_fixup_kind_t kind
+)
+{
+    if (w->err) return;
+    if (0 > avmlib_snapshot_grow((void **)&w->fixups,&w->cfixups,w->nfixups + 1,
+                                 sizeof(avmlib_snapshot_fixup_t))) {
+        avmlib_snapshot_fail(w,ENOMEM);
+        return;
+    }
+    w->fixups[w->nfixups].slot = slot;
+    w->fixups[w->nfixups].kind = kind;
+    w->nfixups++;
+}
+
+/**************************************************************************//**
+ * @brief Store an executable address (function, literal) in a slot.
+ * */
+static void
+avmlib_snapshot_code(
+    avmlib_snapshot_writer_t *w,
+    uint64_t slot,
+    const void *addr
+)
+{
+    uintptr_t a = (uintptr_t)addr;
+
+    if (w->err) return;
+    *AVMLIB_SNAP_AT(w,slot,uint64_t) = 0;
+    if (!addr) return;
+    if ((a < w->host.lo) || (a >= w->host.hi)) {
+        avmlib_err("%s: Handler at %p isn't in the executable; can't snapshot it.\n",
+                   __func__,addr);
+        avmlib_snapshot_fail(w,ENOTSUP);
+        return;
+    }
+    *AVMLIB_SNAP_AT(w,slot,uint64_t) = a - w->host.base;
+    avmlib_snapshot_fixup(w,slot,AVMLIB_FIXUP_HOST);
+}
+
+/**************************************************************************//**
+ * @brief Copy a C string and point a slot at it.
+ * */
+static void
+avmlib_snapshot_str(
+    avmlib_snapshot_writer_t *w,
+    uint64_t slot,
+    const char *s
+)
+{
+    avmlib_snapshot_ptr(w,slot,s ? avmlib_snapshot_put(w,s,strlen(s) + 1) : 0);
+}
+
+/**************************************************************************//**
+ * @brief Note an entity header, for renaming on restore.
+ * */
+static void
+avmlib_snapshot_header(
+    avmlib_snapshot_writer_t *w,
+    uint64_t off
+)
+{
+    if (w->err) return;
+    if (0 > avmlib_snapshot_grow((void **)&w->headers,&w->cheaders,w->nheaders + 1,sizeof(uint64_t))) {
+        avmlib_snapshot_fail(w,ENOMEM);
+        return;
+    }
+    w->headers[w->nheaders++] = off;
+}
+
+/**************************************************************************//**
+ * @brief Find where an entity was copied, so shared ones are copied once.
+ *
+ * @returns Pointer to its offset slot (0 if not copied yet), or NULL on
+ * failure.
+ * */
+static uint64_t *
+avmlib_snapshot_seen(
+    avmlib_snapshot_writer_t *w,
+    uintptr_t entity
+)
+{
+    uint64_t slot, i;
+
+    /* Step 1: Keep it at most half full */
+    if (2 * (w->nseen + 1) > w->cseen) {
+        uint64_t cap = w->cseen ? w->cseen * 2 : 1024;
+        uintptr_t *seen = calloc(cap,sizeof(*seen));
+        uint64_t *off = calloc(cap,sizeof(*off));
+        if (!seen || !off) {
+            free(seen);
+            free(off);
+            avmlib_snapshot_fail(w,ENOMEM);
+            return NULL;
+        }
+        for (i=0;i<w->cseen;i++) {
+            if (!w->seen[i]) continue;
+            for (slot = (w->seen[i] >> 4) & (cap - 1); seen[slot]; slot = (slot + 1) & (cap - 1));
+            seen[slot] = w->seen[i];
+            off[slot] = w->seen_off[i];
+        }
+        free(w->seen);
+        free(w->seen_off);
+        w->seen = seen;
+        w->seen_off = off;
+        w->cseen = cap;
+    }
+
+    /* Step 2: Look it up, claiming a slot if it's new */
+    for (slot = (entity >> 4) & (w->cseen - 1);
+         w->seen[slot] && (w->seen[slot] != entity);
+         slot = (slot + 1) & (w->cseen - 1));
+    if (!w->seen[slot]) {
+        w->seen[slot] = entity;
+        w->seen_off[slot] = 0;
+        w->nseen++;
+    }
+    return &w->seen_off[slot];
+}
+
+/**************************************************************************//**
+ * @brief Copy a runtime store's arrays.
+ * */
+static void
+avmlib_snapshot_store(
+    avmlib_snapshot_writer_t *w,
+    uint64_t soff,
+    const avm_store_t *s
+)
+{
+    avmlib_snapshot_ptr(w,soff + offsetof(avm_store_t,number_values),
+        avmlib_snapshot_put(w,s->number_values,s->number_count * sizeof(int64_t)));
+    avmlib_snapshot_ptr(w,soff + offsetof(avm_store_t,number_width),
+        avmlib_snapshot_put(w,s->number_width,s->number_count * sizeof(uint32_t)));
+    avmlib_snapshot_ptr(w,soff + offsetof(avm_store_t,label_offset),
+        avmlib_snapshot_put(w,s->label_offset,s->label_count * sizeof(uint32_t)));
+    avmlib_snapshot_ptr(w,soff + offsetof(avm_store_t,label_segment),
+        avmlib_snapshot_put(w,s->label_segment,s->label_count * sizeof(uint16_t)));
+    if (!w->err) AVMLIB_SNAP_AT(w,soff,avm_store_t)->mapped = 1;
+}
+
+static void avmlib_snapshot_tables(avmlib_snapshot_writer_t *w, uint64_t ttoff, const table_t *tt);
+static void avmlib_snapshot_table(avmlib_snapshot_writer_t *w, uint64_t toff, const table_t *t, int class);
+
+/**************************************************************************//**
+ * @brief Copy one entity.
+ *
+ * @returns Offset of the copy, or 0 on failure.
+ * */
+static uint64_t
+avmlib_snapshot_entity(
+    avmlib_snapshot_writer_t *w,
+    int class,
+    entry_t entry
+)
+{
+    uint64_t off = 0, *seen;
+
+    if (!entry || w->err) return 0;
+    if (NULL == (seen = avmlib_snapshot_seen(w,(uintptr_t)entry))) return 0;
+    if (*seen) return *seen;
+    switch (class) {
+        case AVM_CLASS_REGISTER: {
+            class_register_t *r = (class_register_t *)entry;
+            if (r->private_data) {
+                avmlib_err("%s: Register \"%s\" has host data; bind it after restore.\n",
+                           __func__,avmm_entity_name(r));
+                avmlib_snapshot_fail(w,ENOTSUP);
+                return 0;
+            }
+            off = avmlib_snapshot_put(w,r,sizeof(*r));
+            avmlib_snapshot_code(w,off + offsetof(class_register_t,reset),(void *)r->reset);
+            avmlib_snapshot_code(w,off + offsetof(class_register_t,get),(void *)r->get);
+            avmlib_snapshot_code(w,off + offsetof(class_register_t,set),(void *)r->set);
+            avmlib_snapshot_code(w,off + offsetof(class_register_t,get_many),(void *)r->get_many);
+            avmlib_snapshot_code(w,off + offsetof(class_register_t,set_many),(void *)r->set_many);
+            break;
+        }
+        case AVM_CLASS_BUFFER: {
+            class_buffer_t *b = (class_buffer_t *)entry;
+            uint64_t data;
+            if ((BUFFER_MAP_NONE != b->map) && (BUFFER_MAP_IMAGE != b->map)) {
+                avmlib_err("%s: Buffer \"%s\" maps a file.\n",__func__,avmm_entity_name(b));
+                avmlib_snapshot_fail(w,ENOTSUP);
+                return 0;
+            }
+            off = avmlib_snapshot_put(w,b,sizeof(*b));
+            data = avmlib_snapshot_put(w,b->buf,b->size);
+            avmlib_snapshot_ptr(w,off + offsetof(class_buffer_t,buf),data);
+            if (w->err) return 0;
+            AVMLIB_SNAP_AT(w,off,class_buffer_t)->capacity = b->size;
+            AVMLIB_SNAP_AT(w,off,class_buffer_t)->advised = 0;
+            AVMLIB_SNAP_AT(w,off,class_buffer_t)->map = data ? BUFFER_MAP_IMAGE : BUFFER_MAP_NONE;
+            break;
+        }
+        case AVM_CLASS_PORT: {
+            class_port_t *p = (class_port_t *)entry, *c;
+            if (p->obuf_len || p->rd_waiter || p->wr_waiter) {
+                avmlib_err("%s: Port \"%s\" is busy.\n",__func__,avmm_entity_name(p));
+                avmlib_snapshot_fail(w,EBUSY);
+                return 0;
+            }
+            off = avmlib_snapshot_put(w,p,sizeof(*p));
+            avmlib_snapshot_str(w,off + offsetof(class_port_t,path),p->path);
+            avmlib_snapshot_code(w,off + offsetof(class_port_t,reset),(void *)p->reset);
+            avmlib_snapshot_code(w,off + offsetof(class_port_t,read),(void *)p->read);
+            avmlib_snapshot_code(w,off + offsetof(class_port_t,write),(void *)p->write);
+            if (w->err) return 0;
+            c = AVMLIB_SNAP_AT(w,off,class_port_t);
+            c->file = NULL;
+            c->obuf = NULL;
+            c->fileio = c->evloop = NULL;
+            c->stat_index = 0;
+            avmlib_snapshot_fixup(w,off,AVMLIB_FIXUP_PORT);
+            break;
+        }
+        case AVM_CLASS_STRING: {
+            class_string_t *s = (class_string_t *)entry;
+            off = avmlib_snapshot_put(w,s,sizeof(*s));
+            avmlib_snapshot_str(w,off + offsetof(class_string_t,text),s->text);
+            break;
+        }
+        case AVM_CLASS_LABEL:
+            off = avmlib_snapshot_put(w,(void *)entry,sizeof(class_label_t));
+            break;
+        case AVM_CLASS_NUMBER:
+            off = avmlib_snapshot_put(w,(void *)entry,sizeof(class_number_t));
+            break;
+        case AVM_CLASS_UNRESOLVED:
+            off = avmlib_snapshot_put(w,(void *)entry,sizeof(class_unresolved_t));
+            break;
+        case AVM_CLASS_ERROR:
+            off = avmlib_snapshot_put(w,(void *)entry,sizeof(class_error_t));
+            break;
+        case AVM_CLASS_GROUP: {
+            class_group_t *g = (class_group_t *)entry;
+            off = avmlib_snapshot_put(w,g,sizeof(*g));
+            avmlib_snapshot_table(w,off + offsetof(class_group_t,members),&g->members,
+                                  AVM_CLASS_INSTRUCTION); /* Members are entity values */
+            break;
+        }
+        case AVM_CLASS_SEGMENT: {
+            class_segment_t *s = (class_segment_t *)entry;
+            if (AVMM_SEGMENT_LOADING == __atomic_load_n(&s->state,__ATOMIC_ACQUIRE)) {
+                avmlib_snapshot_fail(w,EBUSY);
+                return 0;
+            }
+            off = avmlib_snapshot_put(w,s,sizeof(*s));
+            avmlib_snapshot_tables(w,off + offsetof(class_segment_t,tables),&s->tables);
+            avmlib_snapshot_str(w,off + offsetof(class_segment_t,image),s->image);
+            avmlib_snapshot_ptr(w,off + offsetof(class_segment_t,avm),w->root);
+            avmlib_snapshot_store(w,off + offsetof(class_segment_t,store),&s->store);
+            if (w->err) return 0;
+            AVMLIB_SNAP_AT(w,off,class_segment_t)->refs = 0;
+            AVMLIB_SNAP_AT(w,off,class_segment_t)->mapped = 1;
+            AVMLIB_SNAP_AT(w,off,class_segment_t)->native = NULL; /* Not in the image */
+            AVMLIB_SNAP_AT(w,off,class_segment_t)->native_handle = NULL;
+            AVMLIB_SNAP_AT(w,off,class_segment_t)->native_release = NULL;
+            AVMLIB_SNAP_AT(w,off,class_segment_t)->jit_tried = 0;
+            break;
+        }
+        default:
+            avmlib_err("%s: Can't snapshot class 0x%02x entities.\n",__func__,class);
+            avmlib_snapshot_fail(w,ENOTSUP);
+            return 0;
+    }
+    avmlib_snapshot_header(w,off);
+    /* The table above may have grown the hash */
+    if (NULL != (seen = avmlib_snapshot_seen(w,(uintptr_t)entry))) *seen = off;
+    return off;
+}
+
+/**************************************************************************//**
+ * @brief Copy a table's entries and handlers; the table_t is at toff.
+ *
+ * @param class Class of the entries; AVM_CLASS_INSTRUCTION for tables
+ * of plain values
+ * */
+static void
+avmlib_snapshot_table(
+    avmlib_snapshot_writer_t *w,
+    uint64_t toff,
+    const table_t *t,
+    int class
+)
+{
+    uint64_t eoff;
+    uint32_t i;
+    uintptr_t tn = (uintptr_t)t->type_name;
+
+    eoff = avmlib_snapshot_put(w,t->entries,(uint64_t)t->size * sizeof(entry_t));
+    avmlib_snapshot_ptr(w,toff + offsetof(table_t,entries),eoff);
+    *AVMLIB_SNAP_AT(w,toff + offsetof(table_t,add),uint64_t) = 0; /* Set on restore */
+    avmlib_snapshot_code(w,toff + offsetof(table_t,compare),(void *)t->compare);
+    avmlib_snapshot_code(w,toff + offsetof(table_t,find),(void *)t->find);
+    avmlib_snapshot_code(w,toff + offsetof(table_t,destroy),(void *)t->destroy);
+    avmlib_snapshot_code(w,toff + offsetof(table_t,serialize),(void *)t->serialize);
+    avmlib_snapshot_code(w,toff + offsetof(table_t,deserialize),(void *)t->deserialize);
+    if (tn && (tn >= w->host.lo) && (tn < w->host.hi)) {
+        avmlib_snapshot_code(w,toff + offsetof(table_t,type_name),t->type_name);
+    } else {
+        avmlib_snapshot_str(w,toff + offsetof(table_t,type_name),t->type_name);
+    }
+    if (w->err) return;
+    AVMLIB_SNAP_AT(w,toff,table_t)->capacity = t->size;
+    avmlib_snapshot_fixup(w,toff,AVMLIB_FIXUP_TABLE);
+
+    if (AVM_CLASS_INSTRUCTION == class) return;
+    for (i=0;(i<t->size) && !w->err;i++) {
+        avmlib_snapshot_ptr(w,eoff + i * sizeof(entry_t),
+                            avmlib_snapshot_entity(w,class,t->entries[i]));
+    }
+}
+
+/**************************************************************************//**
+ * @brief Copy a table of tables (embedded at ttoff) and its tables.
+ * */
+static void
+avmlib_snapshot_tables(
+    avmlib_snapshot_writer_t *w,
+    uint64_t ttoff,
+    const table_t *tt
+)
+{
+    uint64_t eoff, toff;
+    uint32_t c;
+
+    avmlib_snapshot_table(w,ttoff,tt,AVM_CLASS_INSTRUCTION);
+    eoff = *AVMLIB_SNAP_AT(w,ttoff + offsetof(table_t,entries),uint64_t);
+    if (!eoff || w->err) return;
+    eoff -= AVMLIB_SNAPSHOT_BASE;
+    for (c=0;(c<tt->size) && !w->err;c++) {
+        const table_t *t = (const table_t *)tt->entries[c];
+        toff = t ? avmlib_snapshot_put(w,t,sizeof(*t)) : 0;
+        avmlib_snapshot_ptr(w,eoff + c * sizeof(entry_t),toff);
+        if (toff) avmlib_snapshot_table(w,toff,t,c);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Write a machine out as a mappable image.
+ *
+ * @details Port output buffers are drained first.
+ *
+ * @param avm The machine; nothing may be running in it
+ * @param path Image file to create
+ *
+ * @returns 0 on success, -1 on failure (errno set; ENOTSUP if the
+ * machine holds something an image can't carry).
+ * */
+int
+avmlib_snapshot_save(
+    avm_t *avm,
+    const char *path
+)
+{
+    avmlib_snapshot_writer_t w;
+    avmlib_snapshot_hdr_t *hdr;
+    uint64_t bytes, nblocks, b, page = (uint64_t)sysconf(_SC_PAGESIZE);
+    ssize_t n = 0;
+    int fd, err;
+
+    if (avm->parent) {
+        avmlib_err("%s: Can't snapshot a clone; snapshot its parent.\n",__func__);
+        errno = ENOTSUP;
+        return -1;
+    }
+    memset(&w,0,sizeof(w));
+    avmlib_snapshot_host(&w.host);
+    avmlib_ports_flush(avm);
+
+    /* Step 1: Header, then the machine and everything it reaches */
+    avmlib_snapshot_put(&w,NULL,sizeof(avmlib_snapshot_hdr_t));
+    w.root = avmlib_snapshot_put(&w,avm,sizeof(*avm));
+    avmlib_snapshot_header(&w,w.root);
+    avmlib_snapshot_tables(&w,w.root + offsetof(avm_t,tables),&avm->tables);
+    avmlib_snapshot_store(&w,w.root + offsetof(avm_t,store),&avm->store);
+    if (!w.err) *AVMLIB_SNAP_AT(&w,w.root + offsetof(avm_t,epoch),uint64_t) = 0;
+    avmlib_snapshot_fixup(&w,w.root,AVMLIB_FIXUP_EPOCH);
+
+    /* Step 2: Name blocks, whole, so offsets carry over */
+    bytes = avmlib_names_bytes();
+    nblocks = bytes ? (bytes >> AVMLIB_NAMES_BLOCK_SHIFT) + 1 : 0;
+    if (!w.err) AVMLIB_SNAP_AT(&w,0,avmlib_snapshot_hdr_t)->names = w.size;
+    for (b=0;b<nblocks;b++) {
+        avmlib_snapshot_put(&w,avmlib_names_blocks[b],AVMLIB_NAMES_BLOCK_SIZE);
+    }
+
+    /* Step 3: Restore lists */
+    if (!w.err) {
+        uint64_t relocs = avmlib_snapshot_put(&w,w.relocs,w.nrelocs * sizeof(uint64_t));
+        uint64_t fixups = avmlib_snapshot_put(&w,w.fixups,w.nfixups * sizeof(avmlib_snapshot_fixup_t));
+        uint64_t headers = avmlib_snapshot_put(&w,w.headers,w.nheaders * sizeof(uint64_t));
+        if (!w.err) {
+            hdr = AVMLIB_SNAP_AT(&w,0,avmlib_snapshot_hdr_t);
+            hdr->magic = AVMLIB_SNAPSHOT_MAGIC;
+            hdr->version = AVMLIB_SNAPSHOT_VERSION;
+            hdr->base = AVMLIB_SNAPSHOT_BASE;
+            hdr->size = ((w.size + page - 1) / page) * page;
+            hdr->host = w.host.tag;
+            hdr->root = w.root;
+            hdr->name_bytes = bytes;
+            hdr->relocs = relocs;
+            hdr->nrelocs = w.nrelocs;
+            hdr->fixups = fixups;
+            hdr->nfixups = w.nfixups;
+            hdr->headers = headers;
+            hdr->nheaders = w.nheaders;
+        }
+    }
+
+    /* Step 4: Write */
+    if (!w.err) {
+        hdr = AVMLIB_SNAP_AT(&w,0,avmlib_snapshot_hdr_t);
+        if (0 > (fd = open(path,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644))) {
+            avmlib_snapshot_fail(&w,errno);
+        } else {
+            for (b=0;(b<w.size) && !w.err;b+=(uint64_t)n) {
+                if (0 > (n = write(fd,w.buf + b,w.size - b))) {
+                    if (EINTR == errno) n = 0; else avmlib_snapshot_fail(&w,errno);
+                }
+            }
+            if (!w.err && (0 > ftruncate(fd,(off_t)hdr->size))) avmlib_snapshot_fail(&w,errno);
+            if ((0 > close(fd)) && !w.err) avmlib_snapshot_fail(&w,errno);
+        }
+        if (w.err) {
+            avmlib_err("%s: Can't write \"%s\" (%s).\n",__func__,path,strerror(w.err));
+            if (0 <= fd) unlink(path);
+        } else {
+            avm_dbg(1,"AVMLIB","Snapshot %s: %llu bytes, %llu relocs, %llu fixups.\n",path,
+                    (unsigned long long)hdr->size,(unsigned long long)w.nrelocs,
+                    (unsigned long long)w.nfixups);
+        }
+    }
+
+    err = w.err;
+    free(w.buf);
+    free(w.relocs);
+    free(w.fixups);
+    free(w.headers);
+    free(w.seen);
+    free(w.seen_off);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief add() handler for tables restored from an image.
+ *
+ * @details The entries can't be realloc'd in place, so the first add
+ * moves them to the heap and hands the table back to the default.
+ * */
+static int
+avmlib_snapshot_table_add(
+    table_t *this,
+    entry_t entry
+)
+{
+    uint32_t grow = this->alloc_count ? this->alloc_count : AVMLIB_DEFAULT_TABLE_SIZE;
+    entry_t *entries;
+
+    if (NULL == (entries = malloc(sizeof(entry_t) * (this->size + grow)))) return -1;
+    if (this->size) memcpy(entries,this->entries,sizeof(entry_t) * this->size);
+    this->entries = entries;
+    this->capacity = this->size + grow;
+    this->add = avmlib_table_default_add;
+    return this->add(this,entry);
+}
+
+/**************************************************************************//**
+ * @brief Reconnect a restored port.
+ * */
+static void
+avmlib_snapshot_port(
+    class_port_t *port
+)
+{
+    char *path = port->path;
+    uint64_t rd_offset = port->rd_offset;
+    int fd = port->fd;
+
+    port->path = NULL;
+    port->fd = -1;
+    port->rd_waiter = port->wr_waiter = NULL;
+
+    /* Step 1: Descriptor */
+    if (path) {
+        if (0 == avmlib_port_open_file(port,path)) port->rd_offset = rd_offset;
+    } else if ((0 <= fd) && (fd <= 2)) {
+        port->fd = fd;
+        port->file = (0 == fd) ? stdin : ((1 == fd) ? stdout : stderr);
+    }
+
+    /* Step 2: Output buffer */
+    if (port->obuf_size && (NULL == (port->obuf = malloc(port->obuf_size)))) {
+        port->obuf_size = 0;
+        port->bufmode = PORT_BUFMODE_NONE;
+    }
+}
+
+/**************************************************************************//**
+ * @brief Whether count objects of each bytes at off lie inside the image.
+ * */
+static int
+avmlib_snapshot_within(
+    uint64_t size,
+    uint64_t off,
+    uint64_t count,
+    uint64_t each
+)
+{
+    if (off > size) return 0;
+    return !each || (count <= (size - off) / each);
+}
+
+/**************************************************************************//**
+ * @brief Size of the object a fixup of this kind touches (0 if unknown).
+ * */
+static uint64_t
+avmlib_snapshot_fixup_size(
+    uint64_t kind
+)
+{
+    switch (kind) {
+        case AVMLIB_FIXUP_HOST: return sizeof(uint64_t);
+        case AVMLIB_FIXUP_TABLE: return sizeof(table_t);
+        case AVMLIB_FIXUP_PORT: return sizeof(class_port_t);
+        case AVMLIB_FIXUP_EPOCH: return sizeof(avm_t);
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Check the fixup and header lists of a mapped (and relocated)
+ * image before anything is done with them.
+ *
+ * @returns 0 if every slot, port path and name lies inside the image,
+ * -1 if not.
+ * */
+static int
+avmlib_snapshot_check(
+    char *img,
+    const avmlib_snapshot_hdr_t *hdr
+)
+{
+    const avmlib_snapshot_fixup_t *fx = (const avmlib_snapshot_fixup_t *)(img + hdr->fixups);
+    const uint64_t *list = (const uint64_t *)(img + hdr->headers);
+    const char *names = img + hdr->names;
+    uint64_t i, len, name_span = hdr->name_bytes ?
+        ((hdr->name_bytes >> AVMLIB_NAMES_BLOCK_SHIFT) + 1) << AVMLIB_NAMES_BLOCK_SHIFT : 0;
+    const class_header_t *h;
+    const class_port_t *port;
+    uintptr_t path;
+
+    /* Step 1: Fixups, and the paths of ports to reopen */
+    for (i=0;i<hdr->nfixups;i++) {
+        if (!(len = avmlib_snapshot_fixup_size(fx[i].kind)) ||
+            !avmlib_snapshot_within(hdr->size,fx[i].slot,1,len)) {
+            return -1;
+        }
+        if (AVMLIB_FIXUP_PORT != fx[i].kind) continue;
+        port = (const class_port_t *)(img + fx[i].slot);
+        if (NULL == port->path) continue;
+        path = (uintptr_t)port->path;
+        if ((path < (uintptr_t)img) || (path >= (uintptr_t)img + hdr->size) ||
+            !memchr(port->path,'\0',(uintptr_t)img + hdr->size - path)) {
+            return -1;
+        }
+    }
+
+    /* Step 2: Entity headers, and the names they point at */
+    for (i=0;i<hdr->nheaders;i++) {
+        if (!avmlib_snapshot_within(hdr->size,list[i],1,sizeof(class_header_t))) return -1;
+        h = (const class_header_t *)(img + list[i]);
+        if (h->name && ((h->name >= hdr->name_bytes) ||
+                        !memchr(names + h->name,'\0',name_span - h->name))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Undo the host state the first n fixups reconnected.
+ * */
+static void
+avmlib_snapshot_unwind(
+    char *img,
+    const avmlib_snapshot_fixup_t *fx,
+    uint64_t n
+)
+{
+    class_port_t *port;
+    uint64_t i;
+
+    for (i=0;i<n;i++) {
+        switch (fx[i].kind) {
+            case AVMLIB_FIXUP_PORT:
+                port = (class_port_t *)(img + fx[i].slot);
+                if (port->path) {
+                    close(port->fd); /* Reopened; stdio ports weren't */
+                    free(port->path);
+                }
+                free(port->obuf);
+                break;
+            case AVMLIB_FIXUP_EPOCH:
+                avmlib_epoch_destroy((avmlib_epoch_t *)((avm_t *)(img + fx[i].slot))->epoch);
+                break;
+        }
+    }
+}
+
+/**************************************************************************//**
+ * @brief Map a machine image.
+ *
+ * @returns The restored machine, or NULL on failure (errno set).
+ *
+ * @remarks The image is mapped privately: the file isn't modified, and
+ * may be restored again.
+ * */
+avm_t *
+avmlib_snapshot_restore(
+    const char *path
+)
+{
+    avmlib_snapshot_hdr_t hdr;
+    avmlib_snapshot_host_t host;
+    const avmlib_snapshot_fixup_t *fx;
+    const uint64_t *list;
+    struct stat st;
+    char *img;
+    uint64_t i, delta;
+    int fd, err = EINVAL;
+
+    /* Step 1: Check the header */
+    avmlib_snapshot_host(&host);
+    if (0 > (fd = open(path,O_RDONLY|O_CLOEXEC))) {
+        err = errno;
+        avmlib_err("%s: Can't open \"%s\" (%s).\n",__func__,path,strerror(err));
+        errno = err;
+        return NULL;
+    }
+    if ((sizeof(hdr) != pread(fd,&hdr,sizeof(hdr),0)) || (0 > fstat(fd,&st)) ||
+        (AVMLIB_SNAPSHOT_MAGIC != hdr.magic) || (AVMLIB_SNAPSHOT_VERSION != hdr.version) ||
+        (hdr.size != (uint64_t)st.st_size)) {
+        avmlib_err("%s: \"%s\" isn't a machine image.\n",__func__,path);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!avmlib_snapshot_within(hdr.size,hdr.root,1,sizeof(avm_t)) ||
+        !avmlib_snapshot_within(hdr.size,hdr.names,hdr.name_bytes ? (hdr.name_bytes >> AVMLIB_NAMES_BLOCK_SHIFT) + 1 : 0,
+                                AVMLIB_NAMES_BLOCK_SIZE) ||
+        (hdr.relocs & 7) || !avmlib_snapshot_within(hdr.size,hdr.relocs,hdr.nrelocs,sizeof(uint64_t)) ||
+        (hdr.fixups & 7) || !avmlib_snapshot_within(hdr.size,hdr.fixups,hdr.nfixups,sizeof(avmlib_snapshot_fixup_t)) ||
+        (hdr.headers & 7) || !avmlib_snapshot_within(hdr.size,hdr.headers,hdr.nheaders,sizeof(uint64_t))) {
+        avmlib_err("%s: \"%s\" is damaged (lists run past its end).\n",__func__,path);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (hdr.host != host.tag) {
+        avmlib_err("%s: \"%s\" was written by a different executable.\n",__func__,path);
+        close(fd);
+        errno = ENOEXEC;
+        return NULL;
+    }
+
+    /* Step 2: Map, where the pointers expect if we can */
+    img = mmap((void *)(uintptr_t)hdr.base,hdr.size,PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_FIXED_NOREPLACE,fd,0);
+    if ((MAP_FAILED != img) && ((uintptr_t)img != hdr.base)) {
+        munmap(img,hdr.size); /* Kernel took it as a hint */
+        img = MAP_FAILED;
+    }
+    if (MAP_FAILED == img) {
+        img = mmap(NULL,hdr.size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+    }
+    err = errno;
+    close(fd);
+    if (MAP_FAILED == img) {
+        avmlib_err("%s: Can't map \"%s\" (%s).\n",__func__,path,strerror(err));
+        errno = err;
+        return NULL;
+    }
+
+    /* Step 3: Relocate if we had to move */
+    if ((uintptr_t)img != hdr.base) {
+        delta = (uintptr_t)img - hdr.base;
+        list = (const uint64_t *)(img + hdr.relocs);
+        for (i=0;i<hdr.nrelocs;i++) {
+            if (!avmlib_snapshot_within(hdr.size,list[i],1,sizeof(uint64_t))) goto _avmlib_snapshot_restore_fail;
+            *(uint64_t *)(img + list[i]) += delta;
+        }
+        avm_dbg(1,"AVMLIB","Snapshot %s relocated (%llu pointers).\n",path,
+                (unsigned long long)hdr.nrelocs);
+    }
+
+    /* Step 4: Host state, once everything it touches checks out */
+    if (0 > avmlib_snapshot_check(img,&hdr)) goto _avmlib_snapshot_restore_fail;
+    fx = (const avmlib_snapshot_fixup_t *)(img + hdr.fixups);
+    for (i=0;i<hdr.nfixups;i++) {
+        char *obj = img + fx[i].slot;
+        switch (fx[i].kind) {
+            case AVMLIB_FIXUP_HOST:
+                *(uint64_t *)obj += host.base;
+                break;
+            case AVMLIB_FIXUP_TABLE:
+                ((table_t *)obj)->add = avmlib_snapshot_table_add;
+                break;
+            case AVMLIB_FIXUP_PORT:
+                avmlib_snapshot_port((class_port_t *)obj);
+                break;
+            case AVMLIB_FIXUP_EPOCH:
+                if (NULL == (((avm_t *)obj)->epoch = avmlib_epoch_new())) {
+                    avmlib_snapshot_unwind(img,fx,i);
+                    munmap(img,hdr.size);
+                    errno = ENOMEM;
+                    return NULL;
+                }
+                break;
+        }
+    }
+
+    /* Step 5: Names; the image's offsets hold if nothing else is interned */
+    if (0 > avmlib_names_adopt(img + hdr.names,hdr.name_bytes)) {
+        const char *names = img + hdr.names;
+        list = (const uint64_t *)(img + hdr.headers);
+        for (i=0;i<hdr.nheaders;i++) {
+            class_header_t *h = (class_header_t *)(img + list[i]);
+            if (h->name) {
+                h->name = avmlib_name_intern(names + h->name); /* Blocks are contiguous */
+            }
+        }
+        avm_dbg(1,"AVMLIB","Snapshot %s: %llu names re-interned.\n",path,
+                (unsigned long long)hdr.nheaders);
+    }
+
+    return (avm_t *)(img + hdr.root);
+
+_avmlib_snapshot_restore_fail:
+    avmlib_err("%s: \"%s\" is damaged (offsets outside the image).\n",__func__,path);
+    munmap(img,hdr.size);
+    errno = EINVAL;
+    return NULL;
+}
+
+#endif /* _AVMLIB_SNAPSHOT_C_ */
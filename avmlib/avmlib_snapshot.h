@@ -0,0 +1,94 @@
+/**************************************************************************//**
+ * @file avmlib_snapshot.h
+ *
+ * @brief Memory-mapped machine snapshots.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * avmlib_snapshot_save() lays a fully initialized (and loaded) machine
+ * out as one relocatable image: the avm_t, its tables and every entity,
+ * its segments, the runtime stores, and the interned name blocks.
+ * Pointers inside the image are written for AVMLIB_SNAPSHOT_BASE.
+ *
+ * avmlib_snapshot_restore() maps the image privately at that address,
+ * so entities are paged in (and copied on write) as they're touched
+ * rather than rebuilt.  If the address is taken, the image is mapped
+ * elsewhere and every internal pointer is relocated, which is
+ * O(entities).  Either way a short fixup pass reconnects host state:
+ * function and type-name pointers (the image is tied to the executable
+ * that wrote it), stdio and file ports, table growth, and the machine's
+ * epoch domain.  Name offsets stay valid when the process hasn't
+ * interned anything yet (avmlib_names_adopt()); otherwise each name is
+ * re-interned.  Every list, slot and name offset is checked against
+ * the image's size first; a damaged image is refused with EINVAL, and
+ * nothing it reconnected is left open.
+ *
+ * Not carried: processes (the PROCESS table must be empty), registers
+ * with private data (e.g. shared-memory banks; bind them after restore),
+ * and file-mapped buffers.  Ports opened on a path are reopened; other
+ * descriptor ports (sockets, pipes) come back closed.
+ *
+ * A restored machine lives in its mapping for the life of the process.
+ * Its tables move to the heap when they grow, and buffers when they
+ * need more room; its segments are never freed or unloaded.
+ *
+ * Image layout: avmlib_snapshot_hdr_t at offset 0, then the objects,
+ * the name blocks, and the relocation, fixup and header lists.
+ * */
+#ifndef _AVMLIB_SNAPSHOT_H_
+#define _AVMLIB_SNAPSHOT_H_
+
+#include "avmm_data.h"
+
+/**
+ * Image identification
+ */
+#define AVMLIB_SNAPSHOT_MAGIC ((uint32_t)0x41564D49) /* "AVMI" */
+#define AVMLIB_SNAPSHOT_VERSION 1
+
+/**
+ * Address images are laid out for
+ */
+#define AVMLIB_SNAPSHOT_BASE ((uint64_t)0x200000000000ULL)
+
+/**
+ * Image header
+ */
+typedef struct {
+    uint32_t magic; /* AVMLIB_SNAPSHOT_MAGIC */
+    uint32_t version; /* AVMLIB_SNAPSHOT_VERSION */
+    uint64_t base; /* Address the image's pointers assume */
+    uint64_t size; /* Image bytes (page multiple) */
+    uint64_t host; /* Tag of the executable that wrote it */
+    uint64_t root; /* Offset of the avm_t */
+    uint64_t names; /* Offset of the name blocks */
+    uint64_t name_bytes; /* avmlib_names_bytes() when written */
+    uint64_t relocs; /* Offset of the image-pointer slot list */
+    uint64_t nrelocs;
+    uint64_t fixups; /* Offset of the avmlib_snapshot_fixup_t list */
+    uint64_t nfixups;
+    uint64_t headers; /* Offset of the entity header list (for names) */
+    uint64_t nheaders;
+} avmlib_snapshot_hdr_t;
+
+/**
+ * Host state to reconnect on restore
+ */
+typedef enum avmlib_snapshot_fixup_e {
+    AVMLIB_FIXUP_HOST = 1, /* Executable address, stored relative to its load base */
+    AVMLIB_FIXUP_TABLE = 2, /* table_t with its entries in the image */
+    AVMLIB_FIXUP_PORT = 3, /* class_port_t to reopen */
+    AVMLIB_FIXUP_EPOCH = 4, /* avm_t needing an epoch domain */
+} avmlib_snapshot_fixup_kind_t;
+
+typedef struct {
+    uint64_t slot; /* Offset of the pointer or object */
+    uint64_t kind; /* avmlib_snapshot_fixup_kind_t */
+} avmlib_snapshot_fixup_t;
+
+/* Prototypes */
+int avmlib_snapshot_save(avm_t *avm, const char *path);
+avm_t *avmlib_snapshot_restore(const char *path);
+
+#endif /* _AVMLIB_SNAPSHOT_H_ */
@@ -0,0 +1,381 @@
+/**************************************************************************//**
+ * @file avmlib_stats.c
+ *
+ * @brief Runtime statistics in shared memory
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_STATS_C_
+#define _AVMLIB_STATS_C_
+
+#define _GNU_SOURCE /* memfd_create() */
+#include "avmlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+avmlib_stats_block_t *avmlib_stats;
+__thread avmlib_stats_slot_t *avmlib_stats_mine;
+
+/* Everything below is guarded by the lock */
+static pthread_mutex_t avmlib_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static avmlib_stats_t *avmlib_stats_handle; /* The block being counted into */
+static int avmlib_stats_env_done; /* AVMLIB_STATS_ENV has been looked at */
+static int avmlib_stats_keyed; /* avmlib_stats_key has been made */
+static pthread_key_t avmlib_stats_key; /* Frees a thread's slot when it exits */
+
+/**************************************************************************//**
+ * @brief Map a handle's backing descriptor.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_stats_map(
+    avmlib_stats_t *stats,
+    int prot
+)
+{
+    void *p;
+
+    p = mmap(NULL,sizeof(avmlib_stats_block_t),prot,MAP_SHARED,stats->fd,0);
+    if (MAP_FAILED == p) {
+        avmlib_err("%s: mmap failed (%s).\n",__func__,strerror(errno));
+        return -1;
+    }
+    stats->block = p;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Free an exited thread's slot for the next thread to claim.
+ *
+ * @details Its counts stay, so sums over the slots never go down.
+ * */
+static void
+avmlib_stats_release(
+    void *slot
+)
+{
+    __atomic_store_n(&((avmlib_stats_slot_t *)slot)->tid,0,__ATOMIC_RELEASE);
+}
+
+/**************************************************************************//**
+ * @brief Start counting into a new shared block.
+ *
+ * @details The backing object is created with shm_open() if a name is
+ * given, otherwise with memfd_create(); a monitor finds a memfd as
+ * /proc/<pid>/fd/<stats->fd>.  Only one block per process; later calls
+ * fail with EBUSY.
+ *
+ * @param name POSIX shm name (e.g. "/avm-stats"), or NULL for a memfd.
+ *
+ * @returns The block's handle on success, NULL on failure.
+ *
+ * @remarks Counting goes on until the process exits; the handle is the
+ * runtime's, and avmlib_stats_close() on it only stops counting (and
+ * unlinks the name).
+ * */
+avmlib_stats_t *
+avmlib_stats_open(
+    const char *name
+)
+{
+    avmlib_stats_block_t *block;
+    avmlib_stats_t *stats;
+    struct timespec ts;
+
+    pthread_mutex_lock(&avmlib_stats_lock);
+
+    /* Step 1: Sanity check */
+    if (avmlib_stats_handle) {
+        pthread_mutex_unlock(&avmlib_stats_lock);
+        avmlib_err("%s: Statistics are already being kept.\n",__func__);
+        errno = EBUSY;
+        return NULL;
+    }
+
+    /* Step 2: Alloc handle, and the key that frees exited threads' slots */
+    if (!avmlib_stats_keyed && pthread_key_create(&avmlib_stats_key,avmlib_stats_release)) {
+        pthread_mutex_unlock(&avmlib_stats_lock);
+        avmlib_err("%s: Can't make a thread key.\n",__func__);
+        return NULL;
+    }
+    avmlib_stats_keyed = 1;
+    if (NULL == (stats = calloc(1,sizeof(*stats)))) {
+        pthread_mutex_unlock(&avmlib_stats_lock);
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+
+    /* Step 3: Create backing object */
+    if (name) {
+        stats->name = strdup(name);
+        stats->fd = shm_open(name,O_RDWR|O_CREAT|O_EXCL,0644);
+    } else {
+        stats->fd = memfd_create("avm-stats",0);
+    }
+    if (0 > stats->fd) {
+        avmlib_err("%s: Can't create \"%s\" (%s).\n",__func__,
+                   name?name:"memfd",strerror(errno));
+        goto _avmlib_stats_open_fail;
+    }
+    stats->owner = 1;
+    if (0 > ftruncate(stats->fd,sizeof(avmlib_stats_block_t))) {
+        avmlib_err("%s: Can't size \"%s\" (%s).\n",__func__,
+                   name?name:"memfd",strerror(errno));
+        goto _avmlib_stats_open_fail;
+    }
+
+    /* Step 4: Map and fill in header; magic goes last so monitors
+     * never see a half-built block. */
+    if (0 > avmlib_stats_map(stats,PROT_READ|PROT_WRITE)) goto _avmlib_stats_open_fail;
+    block = stats->block;
+    block->version = AVMLIB_STATS_VERSION;
+    block->size = sizeof(*block);
+    block->pid = (uint32_t)getpid();
+    block->nslots = AVMLIB_STATS_SLOTS;
+    block->nclasses = AVM_CLASS_MAX;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    block->started = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    __atomic_store_n(&block->magic,AVMLIB_STATS_MAGIC,__ATOMIC_RELEASE);
+
+    /* Step 5: Count */
+    avmlib_stats_handle = stats;
+    __atomic_store_n(&avmlib_stats,block,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&avmlib_stats_lock);
+    return stats;
+
+_avmlib_stats_open_fail:
+    pthread_mutex_unlock(&avmlib_stats_lock);
+    avmlib_stats_close(stats);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Open a block from AVMLIB_STATS_ENV, the first time it's asked.
+ *
+ * @details avmlib_vm_program() calls this, so a host gets statistics
+ * without calling avmlib_stats_open() itself.  "memfd" makes a memfd;
+ * anything else is a shm name.
+ * */
+void
+avmlib_stats_env(void)
+{
+    const char *env;
+
+    pthread_mutex_lock(&avmlib_stats_lock);
+    if (avmlib_stats_env_done) {
+        pthread_mutex_unlock(&avmlib_stats_lock);
+        return;
+    }
+    avmlib_stats_env_done = 1;
+    pthread_mutex_unlock(&avmlib_stats_lock);
+
+    env = getenv(AVMLIB_STATS_ENV);
+    if (!env || !*env || !strcmp(env,"0") || avmlib_stats) return;
+    avmlib_stats_open(strcmp(env,"memfd") ? env : NULL);
+}
+
+/**************************************************************************//**
+ * @brief Map a block for reading.
+ *
+ * @param name POSIX shm name, or a path (e.g. /proc/<pid>/fd/<n> for a
+ * memfd) if it has a second '/'.
+ *
+ * @returns Read-only handle on success, NULL on failure.
+ * */
+avmlib_stats_t *
+avmlib_stats_attach(
+    const char *name
+)
+{
+    avmlib_stats_t *stats;
+    struct stat st;
+
+    /* Step 1: Alloc handle */
+    if (NULL == (stats = calloc(1,sizeof(*stats)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+
+    /* Step 2: Open backing object */
+    stats->fd = strchr(name + 1,'/') ? open(name,O_RDONLY) : shm_open(name,O_RDONLY,0);
+    if (0 > stats->fd) {
+        avmlib_err("%s: Can't open \"%s\" (%s).\n",__func__,name,strerror(errno));
+        goto _avmlib_stats_attach_fail;
+    }
+    if ((0 > fstat(stats->fd,&st)) || (st.st_size < (off_t)sizeof(avmlib_stats_block_t))) {
+        avmlib_err("%s: \"%s\" is not a statistics block.\n",__func__,name);
+        goto _avmlib_stats_attach_fail;
+    }
+
+    /* Step 3: Map and validate */
+    if (0 > avmlib_stats_map(stats,PROT_READ)) goto _avmlib_stats_attach_fail;
+    if ((AVMLIB_STATS_MAGIC != __atomic_load_n(&stats->block->magic,__ATOMIC_ACQUIRE)) ||
+        (AVMLIB_STATS_VERSION != stats->block->version) ||
+        (stats->block->size < sizeof(avmlib_stats_block_t))) {
+        avmlib_err("%s: Bad statistics block header.\n",__func__);
+        goto _avmlib_stats_attach_fail;
+    }
+
+    return stats;
+
+_avmlib_stats_attach_fail:
+    avmlib_stats_close(stats);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Release a handle.
+ *
+ * @details For the runtime's own block this stops counting and unlinks
+ * its name, but leaves it mapped: other threads may be counting into it
+ * still.
+ * */
+void
+avmlib_stats_close(
+    avmlib_stats_t *stats
+)
+{
+    if (!stats) return;
+
+    pthread_mutex_lock(&avmlib_stats_lock);
+    if (stats == avmlib_stats_handle) {
+        __atomic_store_n(&avmlib_stats,NULL,__ATOMIC_RELEASE);
+        if (stats->name) shm_unlink(stats->name);
+        pthread_mutex_unlock(&avmlib_stats_lock);
+        return;
+    }
+    pthread_mutex_unlock(&avmlib_stats_lock);
+
+    if (stats->block) {
+        munmap(stats->block,sizeof(avmlib_stats_block_t));
+        stats->block = NULL;
+    }
+    if (0 <= stats->fd) {
+        close(stats->fd);
+        stats->fd = -1;
+    }
+    if (stats->name) {
+        if (stats->owner) shm_unlink(stats->name);
+        free(stats->name);
+        stats->name = NULL;
+    }
+    free(stats);
+}
+
+/**************************************************************************//**
+ * @brief Claim this thread's slot.
+ *
+ * @details Call only while avmlib_stats is set.  The slot is freed
+ * when the thread exits.
+ *
+ * @returns The slot (the shared last one if none is free).
+ * */
+avmlib_stats_slot_t *
+avmlib_stats_claim(void)
+{
+    avmlib_stats_block_t *block = avmlib_stats;
+    uint64_t tid = (uint64_t)syscall(SYS_gettid), none;
+    uint32_t i;
+
+    for (i=0;i<AVMLIB_STATS_SLOTS - 1;i++) {
+        none = 0;
+        if (__atomic_compare_exchange_n(&block->slot[i].tid,&none,tid,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+    }
+    if (AVMLIB_STATS_SLOTS - 1 == i) {
+        __atomic_store_n(&block->slot[i].tid,UINT64_MAX,__ATOMIC_RELAXED);
+    } else {
+        pthread_setspecific(avmlib_stats_key,&block->slot[i]);
+    }
+    avmlib_stats_mine = &block->slot[i];
+    return avmlib_stats_mine;
+}
+
+/**************************************************************************//**
+ * @brief Give a port its index in the block, by name.
+ *
+ * @details Ports with the same name (a template's and its clones')
+ * share an index.  The index is cached in port->stat_index.
+ *
+ * @returns The index.
+ * */
+uint32_t
+avmlib_stats_port_index(
+    class_port_t *port
+)
+{
+    avmlib_stats_block_t *block = avmlib_stats;
+    const char *name = avmm_entity_name(port);
+    char key[AVMLIB_STATS_NAME_MAX + 1];
+    uint32_t i;
+
+    if (!name || !*name) name = port->path ? port->path : "(unnamed)";
+    snprintf(key,sizeof(key),"%s",name);
+
+    pthread_mutex_lock(&avmlib_stats_lock);
+    for (i=0;(i<block->nports) && strcmp(block->port[i],key);i++);
+    if (i == block->nports) {
+        if (AVMLIB_STATS_PORTS == i) {
+            i = AVMLIB_STATS_PORTS - 1; /* Out of room; the last is everyone else's */
+            memcpy(block->port[i],"(other)",sizeof("(other)"));
+        } else {
+            memcpy(block->port[i],key,sizeof(key));
+            __atomic_store_n(&block->nports,i + 1,__ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&avmlib_stats_lock);
+    port->stat_index = i + 1;
+    return i;
+}
+
+/**************************************************************************//**
+ * @brief Entities in one of a machine's (or segment's) tables.
+ * */
+static uint64_t
+avmlib_stats_table_size(
+    const void *m,
+    uint32_t class
+)
+{
+    const avm_t *avm = m;
+
+    if ((class >= avm->tables.size) || !AVM_CLASS_TABLE(avm,class)) return 0;
+    return AVM_CLASS_TABLE(avm,class)->size;
+}
+
+/**************************************************************************//**
+ * @brief Publish a loaded program's table sizes.
+ *
+ * @details Each class counts the machine's own table plus those of its
+ * resident segments.
+ * */
+void
+avmlib_stats_tables(
+    avm_t *avm
+)
+{
+    avmlib_stats_block_t *block = avmlib_stats;
+    const table_t *segs = AVM_CLASS_TABLE(avm,AVM_CLASS_SEGMENT);
+    const class_segment_t *seg;
+    uint64_t n;
+    uint32_t c, s;
+
+    if (!block) return;
+    for (c=0;c<AVM_CLASS_MAX;c++) {
+        n = avmlib_stats_table_size(avm,c);
+        for (s=0;s<segs->size;s++) {
+            seg = (const class_segment_t *)segs->entries[s];
+            if (seg && (AVMM_SEGMENT_RESIDENT == seg->state)) n += avmlib_stats_table_size(seg,c);
+        }
+        __atomic_store_n(&block->tables[c],n,__ATOMIC_RELAXED);
+    }
+}
+
+#endif /* _AVMLIB_STATS_C_ */
@@ -0,0 +1,175 @@
+/**************************************************************************//**
+ * @file avmlib_stats.h
+ *
+ * @brief Runtime statistics in shared memory, for external monitoring.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Once a host calls avmlib_stats_open(), the runtime keeps live
+ * counters in a POSIX shared-memory object (shm_open() by name, or a
+ * memfd reachable as /proc/<pid>/fd/<n>).  Anything on the box can map
+ * it read-only and sample it while the VM runs, without stopping or
+ * signalling it; avmtools/avmstat does.
+ *
+ * Counters are kept per thread: each thread claims a slot the first
+ * time it counts something and only ever adds to its own, with relaxed
+ * atomic increments, so counting costs no shared cache lines.  Readers
+ * sum the slots.  Threads past AVMLIB_STATS_SLOTS share the last one.
+ * Gauges (queue depths, table sizes) are block-wide.
+ * A sample is a set of independent counters, not a snapshot: each is
+ * exact on its own, but two may be from slightly different moments.
+ *
+ * Before avmlib_stats_open() every hook is one load and a not-taken
+ * branch.
+ *
+ * The block layout is a stable interface: fields are only ever added
+ * at its end (readers check size), and anything else bumps
+ * AVMLIB_STATS_VERSION.  A process has one block for its lifetime.
+ * */
+#ifndef _AVMLIB_STATS_H_
+#define _AVMLIB_STATS_H_
+
+#include "avmm_data.h"
+
+/**
+ * Block identification
+ */
+#define AVMLIB_STATS_MAGIC ((uint32_t)0x41565354) /* "AVST" */
+#define AVMLIB_STATS_VERSION ((uint32_t)1)
+
+/**
+ * Environment variable: a shm name (or "memfd") to keep statistics in
+ * from the first avmlib_vm_program() on
+ */
+#define AVMLIB_STATS_ENV "AVM_STATS"
+
+/**
+ * Per-thread slots, and ports counted by name; ports past the last
+ * share it
+ */
+#define AVMLIB_STATS_SLOTS 64
+#define AVMLIB_STATS_PORTS 32
+#define AVMLIB_STATS_NAME_MAX 47
+
+/**
+ * Room for table sizes; classes are numbered well below this
+ */
+#define AVMLIB_STATS_CLASSES 32
+
+/**
+ * One thread's counters.  Only its thread writes it.
+ */
+typedef struct {
+    uint64_t tid; /* Owning thread (kernel ID), 0 if free; counts outlive their thread */
+    uint64_t retired; /* Instructions retired */
+    uint64_t runs; /* avmlib_vm_run() calls */
+    uint64_t instances; /* Instances made (avmlib_vm_new()) */
+    uint64_t frees; /* Instances freed */
+    uint64_t allocs; /* Runtime allocations: copies on write, clone tables, buffer growth */
+    uint64_t alloc_bytes; /* Bytes they took */
+    uint64_t bytes_in[AVMLIB_STATS_PORTS]; /* Per port: bytes read from the OS */
+    uint64_t bytes_out[AVMLIB_STATS_PORTS]; /* Bytes handed to the OS */
+    uint64_t syscalls[AVMLIB_STATS_PORTS]; /* read()/write()/writev() calls */
+} __attribute__((aligned(64))) avmlib_stats_slot_t;
+
+/**
+ * Layout of the shared block.  This is what monitors map; keep it
+ * stable.
+ */
+typedef struct {
+    uint32_t magic; /* AVMLIB_STATS_MAGIC; written last */
+    uint32_t version; /* AVMLIB_STATS_VERSION */
+    uint32_t size; /* sizeof(avmlib_stats_block_t) */
+    uint32_t pid; /* Process being counted */
+    uint32_t nslots; /* AVMLIB_STATS_SLOTS */
+    uint32_t nports; /* Entries of port[] in use */
+    uint32_t nclasses; /* Entries of tables[] in use (AVM_CLASS_MAX) */
+    uint32_t pad;
+    uint64_t started; /* CLOCK_REALTIME at avmlib_stats_open(), ns */
+    /* Gauges; signed, and off by whatever was queued at open */
+    int64_t ready; /* Processes on event loop run queues */
+    int64_t parked; /* Processes parked on ports */
+    int64_t pending; /* Pool jobs submitted and not finished */
+    uint64_t tables[AVMLIB_STATS_CLASSES]; /* Entities per class in the last program loaded */
+    char port[AVMLIB_STATS_PORTS][AVMLIB_STATS_NAME_MAX + 1]; /* Port names, by index */
+    avmlib_stats_slot_t slot[AVMLIB_STATS_SLOTS];
+} avmlib_stats_block_t;
+
+/**
+ * Process-local handle for a mapped block
+ */
+typedef struct {
+    char *name; /* shm_open() name, or NULL for memfd/path */
+    int fd; /* Backing descriptor */
+    int owner; /* Nonzero if we created (and should unlink) it */
+    avmlib_stats_block_t *block; /* Mapped block */
+} avmlib_stats_t;
+
+/**
+ * The block being counted into, once avmlib_stats_open() has made it
+ */
+extern avmlib_stats_block_t *avmlib_stats;
+extern __thread avmlib_stats_slot_t *avmlib_stats_mine;
+
+/* Prototypes */
+avmlib_stats_t *avmlib_stats_open(const char *name);
+avmlib_stats_t *avmlib_stats_attach(const char *name);
+void avmlib_stats_close(avmlib_stats_t *stats);
+void avmlib_stats_env(void);
+avmlib_stats_slot_t *avmlib_stats_claim(void);
+uint32_t avmlib_stats_port_index(class_port_t *port);
+void avmlib_stats_tables(avm_t *avm);
+
+/**************************************************************************//**
+ * @brief Add to one of this thread's counters.
+ *
+ * @param __field Member of avmlib_stats_slot_t
+ * @param __n Amount
+ * */
+#define avmlib_stats_add(__field, __n) do { \
+    if (avmlib_stats) { \
+        avmlib_stats_slot_t *__s = avmlib_stats_mine ? avmlib_stats_mine : avmlib_stats_claim(); \
+        __atomic_fetch_add(&__s->__field,(uint64_t)(__n),__ATOMIC_RELAXED); \
+    } \
+} while (0)
+
+/**************************************************************************//**
+ * @brief Move a gauge.
+ *
+ * @param __field Gauge member of avmlib_stats_block_t
+ * @param __n Signed amount
+ * */
+#define avmlib_stats_gauge(__field, __n) do { \
+    avmlib_stats_block_t *__b = avmlib_stats; \
+    if (__b) __atomic_fetch_add(&__b->__field,(int64_t)(__n),__ATOMIC_RELAXED); \
+} while (0)
+
+/**************************************************************************//**
+ * @brief Count I/O on a port.
+ *
+ * @param port The port
+ * @param in Bytes read
+ * @param out Bytes written
+ * @param calls Syscalls made
+ * */
+static inline void
+avmlib_stats_port(
+    class_port_t *port,
+    uint64_t in,
+    uint64_t out,
+    uint64_t calls
+)
+{
+    avmlib_stats_slot_t *s;
+    uint32_t i;
+
+    if (!avmlib_stats) return;
+    s = avmlib_stats_mine ? avmlib_stats_mine : avmlib_stats_claim();
+    i = port->stat_index ? port->stat_index - 1 : avmlib_stats_port_index(port);
+    if (in) __atomic_fetch_add(&s->bytes_in[i],in,__ATOMIC_RELAXED);
+    if (out) __atomic_fetch_add(&s->bytes_out[i],out,__ATOMIC_RELAXED);
+    if (calls) __atomic_fetch_add(&s->syscalls[i],calls,__ATOMIC_RELAXED);
+}
+
+#endif /* _AVMLIB_STATS_H_ */
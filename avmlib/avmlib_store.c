@@ -0,0 +1,162 @@
+/**************************************************************************//**
+ * @file avmlib_store.c
+ *
+ * @brief Struct-of-arrays runtime entity store
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_STORE_C_
+#define _AVMLIB_STORE_C_
+
+#include "avmlib.h"
+
+/**************************************************************************//**
+ * @brief Release a store's arrays.
+ * */
+void
+avmlib_store_free(
+    avm_store_t *store
+)
+{
+    if (!store->mapped) {
+        if (!(store->shared & AVMM_STORE_SHARED_VALUES)) free(store->number_values);
+        if (!(store->shared & AVMM_STORE_SHARED_CONST)) {
+            free(store->number_width);
+            free(store->label_offset);
+            free(store->label_segment);
+        }
+    }
+    memset(store,0,sizeof(*store));
+}
+
+/**************************************************************************//**
+ * @brief Build (or rebuild) a store from its owner's tables.
+ *
+ * @param store The store to fill
+ * @param owner Machine or segment whose tables to read
+ *
+ * @returns 0 on success, -1 on failure (the store is left empty).
+ *
+ * @remarks Values changed in the old store since the last
+ * avmlib_store_flush() are lost.
+ * */
+int
+avmlib_store_build(
+    avm_store_t *store,
+    void *owner
+)
+{
+    table_t *t;
+    uint32_t i;
+
+    avmlib_store_free(store);
+
+    /* Step 1: Numbers */
+    t = AVM_CLASS_TABLE(owner,AVM_CLASS_NUMBER);
+    if (t && t->size) {
+        if ((NULL == (store->number_values = malloc(t->size * sizeof(int64_t)))) ||
+            (NULL == (store->number_width = malloc(t->size * sizeof(uint32_t))))) {
+            goto _avmlib_store_build_fail;
+        }
+        for (i=0;i<t->size;i++) {
+            class_number_t *n = (class_number_t *)t->entries[i];
+            store->number_values[i] = n ? n->value : 0;
+            store->number_width[i] = n ? n->bitwidth : 0;
+        }
+        store->number_count = t->size;
+    }
+
+    /* Step 2: Labels */
+    t = AVM_CLASS_TABLE(owner,AVM_CLASS_LABEL);
+    if (t && t->size) {
+        if ((NULL == (store->label_offset = malloc(t->size * sizeof(uint32_t)))) ||
+            (NULL == (store->label_segment = malloc(t->size * sizeof(uint16_t))))) {
+            goto _avmlib_store_build_fail;
+        }
+        for (i=0;i<t->size;i++) {
+            class_label_t *l = (class_label_t *)t->entries[i];
+            store->label_offset[i] = l ? l->offset : 0;
+            store->label_segment[i] = l ? l->segment : AVMM_SEGMENT_UNLINKED;
+        }
+        store->label_count = t->size;
+    }
+    return 0;
+
+_avmlib_store_build_fail:
+    avmlib_err("%s: Alloc failure.\n",__func__);
+    avmlib_store_free(store);
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Make a store that borrows another's arrays.
+ *
+ * @details Reads see the other store's values until the first
+ * avmlib_store_number_set(), which copies them (avmlib_store_own()).
+ *
+ * @param store The store to fill (a clone's)
+ * @param from The store to borrow from; must outlive this one
+ * */
+void
+avmlib_store_share(
+    avm_store_t *store,
+    const avm_store_t *from
+)
+{
+    *store = *from;
+    store->mapped = 0;
+    store->shared = AVMM_STORE_SHARED_VALUES | AVMM_STORE_SHARED_CONST;
+}
+
+/**************************************************************************//**
+ * @brief Take a private copy of a borrowed store's NUMBER values.
+ *
+ * @returns 0 on success, -1 on failure (the store still borrows).
+ * */
+int
+avmlib_store_own(
+    avm_store_t *store
+)
+{
+    int64_t *values = NULL;
+
+    if (!(store->shared & AVMM_STORE_SHARED_VALUES)) return 0;
+    if (store->number_count) {
+        if (NULL == (values = malloc(store->number_count * sizeof(int64_t)))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return -1;
+        }
+        memcpy(values,store->number_values,store->number_count * sizeof(int64_t));
+    }
+    store->number_values = values;
+    store->shared &= ~AVMM_STORE_SHARED_VALUES;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Copy run-time values back into the owner's entity objects.
+ *
+ * @param store The store
+ * @param owner Machine or segment the store was built from
+ *
+ * @remarks Only NUMBER values change at run time; labels are read-only.
+ * A clone's store isn't flushed: the objects are its parent's.
+ * */
+void
+avmlib_store_flush(
+    avm_store_t *store,
+    void *owner
+)
+{
+    table_t *t = AVM_CLASS_TABLE(owner,AVM_CLASS_NUMBER);
+    uint32_t i;
+
+    if (store->shared) return;
+    for (i=0;t && (i<store->number_count) && (i<t->size);i++) {
+        class_number_t *n = (class_number_t *)t->entries[i];
+        if (n) n->value = store->number_values[i];
+    }
+}
+
+#endif /* _AVMLIB_STORE_C_ */
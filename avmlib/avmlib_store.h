@@ -0,0 +1,85 @@
+/**************************************************************************//**
+ * @file avmlib_store.h
+ *
+ * @brief Struct-of-arrays runtime entity store.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * The tables (AVM_CLASS_TABLE) are the build-time view of a machine or
+ * segment: one separately allocated object per entity, found through
+ * the table of tables.  Reaching a NUMBER's value that way is three
+ * dependent loads.  The store is the run-time view: the hot fields of
+ * NUMBER and LABEL entities copied into contiguous typed arrays embedded
+ * in the machine (global entities) and each segment (OP_FLAG_LOCAL
+ * ones), indexed by entity index.
+ *
+ * Once built, the store is authoritative for those fields while the
+ * machine runs; avmlib_store_flush() copies values back into the
+ * objects (for dumps, images, or before a rebuild).  Entities added to
+ * the tables after a build aren't in the store until it's rebuilt.
+ * Segments are built when added, loaded or swapped in; the machine's
+ * own store must be built once its global entities are defined.
+ *
+ * A clone's stores borrow their arrays from the parent's
+ * (avmlib_store_share()); write NUMBER values with
+ * avmlib_store_number_set(), which takes a private copy of the values
+ * on the first write.
+ * */
+#ifndef _AVMLIB_STORE_H_
+#define _AVMLIB_STORE_H_
+
+#include "avmm_data.h"
+
+/**
+ * Store holding an entity: the segment's if it's local, else the
+ * machine's
+ */
+#define avmlib_store_of(__avm,__seg,__entity) \
+    (((__entity) & OP_FLAG_LOCAL) ? avmlib_store_local(__avm,__seg) : &((__avm)->store))
+
+/**
+ * A segment's local store as a machine sees it: a clone's private copy
+ * if it has written one, else the segment's own
+ */
+static inline avm_store_t *
+avmlib_store_local(
+    avm_t *avm,
+    class_segment_t *seg
+)
+{
+    avm_local_store_t *l;
+
+    if (avm->locals && (seg->id < avm->nlocals)) {
+        l = &avm->locals[seg->id];
+        if ((l->seg == seg) && (l->version == seg->version)) return &l->store;
+    }
+    return &seg->store;
+}
+
+/**
+ * Hot field access by entity index
+ */
+#define avmlib_store_number(__store,__index) \
+    ((__store)->number_values[__index])
+#define avmlib_store_label_offset(__store,__index) \
+    ((__store)->label_offset[__index])
+#define avmlib_store_label_segment(__store,__index) \
+    ((__store)->label_segment[__index])
+
+/**
+ * Write a NUMBER value (store must be writable: the machine's own, or
+ * from avmlib_machine_local_store())
+ */
+#define avmlib_store_number_set(__store,__index,__value) \
+    ((((__store)->shared & AVMM_STORE_SHARED_VALUES) && (0 > avmlib_store_own(__store))) ? -1 : \
+     ((__store)->number_values[__index] = (__value), 0))
+
+/* Prototypes */
+int avmlib_store_build(avm_store_t *store, void *owner);
+void avmlib_store_flush(avm_store_t *store, void *owner);
+void avmlib_store_free(avm_store_t *store);
+void avmlib_store_share(avm_store_t *store, const avm_store_t *from);
+int avmlib_store_own(avm_store_t *store);
+
+#endif /* _AVMLIB_STORE_H_ */
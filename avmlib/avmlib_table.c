@@ -94,7 +94,7 @@ avmlib_table_default_string_compare(
     intptr_t test
 ) 
 {
-    char *ref = ((class_header_t *)entry)->symname;
+    const char *ref = avmm_entity_name(entry);
     char *chk = (char *)test;
     return strcmp(ref,chk);
 }
@@ -172,6 +172,8 @@ avmlib_table_init(
     this->compare = avmlib_table_default_string_compare;
     this->find = avmlib_table_default_find;
     this->destroy = NULL;
+    this->serialize = NULL;
+    this->deserialize = NULL;
 
     return this;
 }
@@ -56,9 +56,9 @@ typedef struct _table_s {
         /* Destroy an entry on table destruction */
     void (*destroy)(struct _table_s *tbl, entry_t entry);
         /* Serialize an entry to a buffer */
-    int (*serialize)(struct _table_s *tbl, entry_t entry, void *binbuf, int binsize);
+    int64_t (*serialize)(struct _table_s *tbl, entry_t entry, void *binbuf, int64_t binsize);
         /* Deserialize an entry from a buffer */
-    int (*deserialize)(struct _table_s *tbl, entry_t *entry, void *binbuf, int binsize);
+    int64_t (*deserialize)(struct _table_s *tbl, entry_t *entry, void *binbuf, int64_t binsize);
 } table_t;
 
 #define NULL_TABLE (table_t *)(NULL)
@@ -68,8 +68,8 @@ typedef struct _table_s {
 int avmlib_table_default_add(table_t *tbl, entry_t entry);
 int avmlib_table_default_compare(table_t *tbl, entry_t entry, intptr_t test);
 int avmlib_table_default_find(table_t *tbl, intptr_t test);
-int avmlib_table_default_serialize(table_t *tbl, entry_t entry, void *binbuf,int binsize);
-int avmlib_table_default_deserialize(table_t *tbl, entry_t *entry, void *binbuf,int binsize);
+int64_t avmlib_table_default_serialize(table_t *tbl, entry_t entry, void *binbuf, int64_t binsize);
+int64_t avmlib_table_default_deserialize(table_t *tbl, entry_t *entry, void *binbuf, int64_t binsize);
     /* Core API */
 table_t *avmlib_table_init(table_t *tbl, int initial_capacity);
 table_t *avmlib_table_new(int initial_capacity);
@@ -78,8 +78,8 @@ void     avmlib_table_destroy(table_t *tbl);
     /* Wrappers */
 int avmlib_table_add_wrapper(table_t *tbl, entry_t entry);
 int avmlib_table_find_wrapper(table_t *tbl, intptr_t test);
-int avmlib_table_serialize_wrapper(table_t *tbl, entry_t entry, void *binbuf, int binsize);
-int avmlib_table_deserialize_wrapper(table_t *tbl, entry_t *entry, void *binbuf, int binsize);
+int64_t avmlib_table_serialize_wrapper(table_t *tbl, entry_t entry, void *binbuf, int64_t binsize);
+int64_t avmlib_table_deserialize_wrapper(table_t *tbl, entry_t *entry, void *binbuf, int64_t binsize);
 
 #define avmlib_table_add(__tbl,__entry) \
     avmlib_table_add_wrapper((__tbl),((entry_t)__entry)) 
@@ -91,10 +91,10 @@ int avmlib_table_deserialize_wrapper(table_t *tbl, entry_t *entry, void *binbuf,
     (((table_t *)(__tbl))->size)
 
 #define avmlib_table_serialize(__tbl, __entry, __buf, __bufsz) \
-    avmlib_table_serialize_wrapper((__tbl), ((entry_t)__entry), ((void *)__buf, (int)__bufsz))
+    avmlib_table_serialize_wrapper((__tbl), ((entry_t)__entry), ((void *)__buf, (int64_t)__bufsz))
 
 #define avmlib_table_deserialize(__tbl, __entryp, __buf, __bufsz) \
-    avmlib_table_serialize_wrapper((__tbl), ((entry_t *)__entryp), ((void *)__buf, (int)__bufsz))
+    avmlib_table_serialize_wrapper((__tbl), ((entry_t *)__entryp), ((void *)__buf, (int64_t)__bufsz))
 
 /**************************************************************************//**
  * @brief Determine if a key is in a table already
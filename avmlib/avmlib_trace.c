@@ -0,0 +1,416 @@
+/**************************************************************************//**
+ * @file avmlib_trace.c
+ *
+ * @brief Execution trace
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Dumps must work from signal handlers, so everything a dump reads is
+ * built beforehand and published with one pointer store: the rings
+ * (pushed onto a list that only grows), the path, and the symbols
+ * (replaced whole, never freed, when segments are added).
+ * */
+#ifndef _AVMLIB_TRACE_C_
+#define _AVMLIB_TRACE_C_
+
+#include "avmlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/**
+ * Slots per ring when avmlib_trace_start() is given 0
+ */
+#define AVMLIB_TRACE_DEFAULT_RECORDS 65536
+
+/**
+ * Symbols, ready to write
+ */
+typedef struct {
+    size_t size;
+    uint8_t data[];
+} avmlib_trace_syms_t;
+
+/**
+ * A segment version already in the symbols
+ */
+typedef struct {
+    uint32_t id;
+    uint32_t version;
+} avmlib_trace_known_t;
+
+avmlib_trace_ring_t *avmlib_trace_rings;
+__thread avmlib_trace_ring_t *avmlib_trace_mine;
+int avmlib_trace_on;
+int avmlib_trace_all;
+
+/* Read by dumps; written under the lock */
+static char avmlib_trace_path[256];
+static avmlib_trace_syms_t *avmlib_trace_syms;
+static uint64_t avmlib_trace_slots; /* Per ring; set once, by the first avmlib_trace_start() */
+static pthread_key_t avmlib_trace_key; /* Frees a thread's ring when it exits */
+
+/* Everything below is guarded by the lock */
+static pthread_mutex_t avmlib_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static avmlib_trace_known_t *avmlib_trace_known; /* Segment versions in the symbols */
+static uint32_t avmlib_trace_nknown;
+
+/**************************************************************************//**
+ * @brief Write all of a buffer.  (Async-signal-safe.)
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_trace_write_all(
+    int fd,
+    const void *buf,
+    size_t len
+)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len) {
+        if (0 > (n = write(fd,p,len))) {
+            if (EINTR == errno) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Write the rings and symbols to a file.  (Async-signal-safe.)
+ *
+ * @details Rings made while this runs aren't written; the list is read
+ * once, and only ever grows at its head.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_trace_write(
+    const char *path
+)
+{
+    avmlib_trace_ring_t *rings = __atomic_load_n(&avmlib_trace_rings,__ATOMIC_ACQUIRE), *ring;
+    avmlib_trace_syms_t *syms = __atomic_load_n(&avmlib_trace_syms,__ATOMIC_ACQUIRE);
+    uint64_t slots = __atomic_load_n(&avmlib_trace_slots,__ATOMIC_ACQUIRE);
+    avmlib_trace_header_t hdr;
+    avmlib_trace_part_t part;
+    int fd, rc;
+
+    if (!slots || !*path) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (0 > (fd = open(path,O_CREAT | O_TRUNC | O_WRONLY,0644))) return -1;
+    memset(&hdr,0,sizeof(hdr));
+    memcpy(hdr.magic,AVMLIB_TRACE_MAGIC,sizeof(hdr.magic));
+    hdr.version = AVMLIB_TRACE_VERSION;
+    hdr.rec_size = sizeof(avmlib_trace_rec_t);
+    hdr.records = slots;
+    for (ring=rings;ring;ring=ring->next) hdr.rings++;
+    hdr.sym_size = syms ? syms->size : 0;
+    hdr.pid = (uint32_t)getpid();
+#if !defined(__x86_64__)
+    hdr.ns = 1;
+#endif
+    rc = avmlib_trace_write_all(fd,&hdr,sizeof(hdr));
+    for (ring=rings;ring && !rc;ring=ring->next) {
+        memset(&part,0,sizeof(part));
+        part.head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+        part.tid = __atomic_load_n(&ring->tid,__ATOMIC_RELAXED);
+        rc = avmlib_trace_write_all(fd,&part,sizeof(part));
+        if (!rc) rc = avmlib_trace_write_all(fd,ring->rec,sizeof(avmlib_trace_rec_t) * slots);
+    }
+    if (!rc && syms) rc = avmlib_trace_write_all(fd,syms->data,syms->size);
+    if (close(fd)) rc = -1;
+    return rc;
+}
+
+/**************************************************************************//**
+ * @brief Free an exited thread's ring for the next thread to claim.
+ *
+ * @details What it recorded stays in it until overwritten.
+ * */
+static void
+avmlib_trace_release(
+    void *ring
+)
+{
+    __atomic_store_n(&((avmlib_trace_ring_t *)ring)->tid,0,__ATOMIC_RELEASE);
+}
+
+/**************************************************************************//**
+ * @brief Claim this thread's ring.
+ *
+ * @details avmlib_trace_record() calls this the first time a thread
+ * records.  A ring freed by an exited thread is taken over if there is
+ * one, else a new one is made and pushed onto the list.  If that fails,
+ * tracing stops.
+ *
+ * @returns The ring, or NULL on failure.
+ * */
+avmlib_trace_ring_t *
+avmlib_trace_claim(void)
+{
+    uint32_t tid = (uint32_t)syscall(SYS_gettid), none;
+    uint64_t slots = __atomic_load_n(&avmlib_trace_slots,__ATOMIC_ACQUIRE);
+    avmlib_trace_ring_t *ring;
+
+    /* Step 1: A free ring */
+    for (ring=__atomic_load_n(&avmlib_trace_rings,__ATOMIC_ACQUIRE);ring;ring=ring->next) {
+        none = 0;
+        if (__atomic_compare_exchange_n(&ring->tid,&none,tid,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) break;
+    }
+
+    /* Step 2: Else a new one */
+    if (!ring) {
+        if (NULL == (ring = calloc(1,sizeof(*ring) + sizeof(avmlib_trace_rec_t) * slots))) {
+            avmlib_trace_stop();
+            avmlib_err("%s: Alloc failure; tracing stopped.\n",__func__);
+            return NULL;
+        }
+        ring->mask = slots - 1;
+        ring->tid = tid;
+        ring->next = __atomic_load_n(&avmlib_trace_rings,__ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&avmlib_trace_rings,&ring->next,ring,1,
+                                            __ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(avmlib_trace_key,ring);
+    avmlib_trace_mine = ring;
+    return ring;
+}
+
+/**************************************************************************//**
+ * @brief Dump on a signal, and carry on.
+ * */
+static void
+avmlib_trace_on_signal(
+    int sig
+)
+{
+    int err = errno;
+
+    avmlib_trace_write(avmlib_trace_path);
+    errno = err;
+}
+
+/**************************************************************************//**
+ * @brief Dump on a crash, then die of it.
+ * */
+static void
+avmlib_trace_on_crash(
+    int sig
+)
+{
+    avmlib_trace_on = 0;
+    avmlib_trace_write(avmlib_trace_path);
+    raise(sig); /* The handler was reset on entry */
+}
+
+/**************************************************************************//**
+ * @brief Start tracing.
+ *
+ * @details The first call sets the ring size for the life of the
+ * process; later calls only change the rest.  Each thread's ring is made
+ * when it first records.  Signal handlers installed here replace any
+ * the host had.
+ *
+ * @param records Slots per thread's ring (rounded up to a power of 2),
+ * or 0 for the default
+ * @param flags AVMLIB_TRACE_...
+ * @param dump_signal Signal that dumps the ring (e.g. SIGUSR2), or 0
+ * @param path Where dumps go, or NULL for /tmp/avm-trace-<pid>.bin
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_trace_start(
+    uint32_t records,
+    int flags,
+    int dump_signal,
+    const char *path
+)
+{
+    static const int crash[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    struct sigaction sa;
+    uint64_t n = 1;
+    size_t i;
+
+    pthread_mutex_lock(&avmlib_trace_lock);
+
+    /* Step 1: The ring size, and the key that frees exited threads' rings */
+    if (!avmlib_trace_slots) {
+        if (pthread_key_create(&avmlib_trace_key,avmlib_trace_release)) {
+            pthread_mutex_unlock(&avmlib_trace_lock);
+            avmlib_err("%s: Can't make a thread key.\n",__func__);
+            return -1;
+        }
+        if (!records) records = AVMLIB_TRACE_DEFAULT_RECORDS;
+        while (n < records) n <<= 1;
+        __atomic_store_n(&avmlib_trace_slots,n,__ATOMIC_RELEASE);
+    }
+
+    /* Step 2: Where dumps go */
+    if (path) {
+        snprintf(avmlib_trace_path,sizeof(avmlib_trace_path),"%s",path);
+    } else {
+        snprintf(avmlib_trace_path,sizeof(avmlib_trace_path),"/tmp/avm-trace-%d.bin",(int)getpid());
+    }
+
+    /* Step 3: When they happen */
+    memset(&sa,0,sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    if (dump_signal) {
+        sa.sa_handler = avmlib_trace_on_signal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(dump_signal,&sa,NULL);
+    }
+    if (flags & AVMLIB_TRACE_CRASH) {
+        sa.sa_handler = avmlib_trace_on_crash;
+        sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+        for (i=0;i<sizeof(crash)/sizeof(crash[0]);i++) sigaction(crash[i],&sa,NULL);
+    }
+
+    __atomic_store_n(&avmlib_trace_all,(flags & AVMLIB_TRACE_INTERPRET) ? 1 : 0,__ATOMIC_RELAXED);
+    __atomic_store_n(&avmlib_trace_on,1,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&avmlib_trace_lock);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Stop recording.  What's in the rings can still be dumped.
+ * */
+void
+avmlib_trace_stop(void)
+{
+    __atomic_store_n(&avmlib_trace_on,0,__ATOMIC_RELAXED);
+    __atomic_store_n(&avmlib_trace_all,0,__ATOMIC_RELAXED);
+}
+
+/**************************************************************************//**
+ * @brief Are a segment version's symbols in already?  (Under the lock.)
+ * */
+static int
+avmlib_trace_is_known(
+    const class_segment_t *seg
+)
+{
+    uint32_t k;
+
+    for (k=0;k<avmlib_trace_nknown;k++) {
+        if ((avmlib_trace_known[k].id == seg->id) && (avmlib_trace_known[k].version == seg->version)) return 1;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Add a machine's resident segments to what dumps carry.
+ *
+ * @details avmlib_vm_program() does this for its template; it does
+ * nothing until tracing has started.  Segments are told apart by ID
+ * and version, not address (a swapped-out version's memory can be
+ * reused by the next), so a swap followed by this adds the new
+ * version's names.  Records carry only the segment ID, so trace one
+ * program (or programs with distinct IDs).
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_trace_symbols(
+    avm_t *avm
+)
+{
+    const table_t *segs = AVM_CLASS_TABLE(avm,AVM_CLASS_SEGMENT);
+    const class_segment_t *seg;
+    avmlib_trace_known_t *known;
+    const class_label_t *lbl;
+    const table_t *labels;
+    avmlib_trace_syms_t *old, *syms;
+    avmlib_trace_sym_t *sym;
+    size_t size;
+    uint32_t s, i;
+
+    if (!__atomic_load_n(&avmlib_trace_slots,__ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&avmlib_trace_lock);
+    old = avmlib_trace_syms;
+
+    /* Step 1: How much there will be */
+    size = old ? old->size : 0;
+    for (s=0;s<segs->size;s++) {
+        seg = (const class_segment_t *)segs->entries[s];
+        if (!seg || (AVMM_SEGMENT_RESIDENT != seg->state) || avmlib_trace_is_known(seg)) continue;
+        size += sizeof(*sym) * (1 + AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL)->size);
+    }
+    if (old && (size == old->size)) {
+        pthread_mutex_unlock(&avmlib_trace_lock);
+        return 0;
+    }
+    if ((NULL == (syms = malloc(sizeof(*syms) + size))) ||
+        (NULL == (known = realloc(avmlib_trace_known,sizeof(*known) * (avmlib_trace_nknown + segs->size))))) {
+        free(syms);
+        pthread_mutex_unlock(&avmlib_trace_lock);
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return -1;
+    }
+    avmlib_trace_known = known;
+
+    /* Step 2: The old symbols, then the new segments' */
+    syms->size = old ? old->size : 0;
+    if (old) memcpy(syms->data,old->data,old->size);
+    for (s=0;s<segs->size;s++) {
+        seg = (const class_segment_t *)segs->entries[s];
+        if (!seg || (AVMM_SEGMENT_RESIDENT != seg->state) || avmlib_trace_is_known(seg)) continue;
+        avmlib_trace_known[avmlib_trace_nknown].id = seg->id;
+        avmlib_trace_known[avmlib_trace_nknown++].version = seg->version;
+        labels = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+        sym = (avmlib_trace_sym_t *)(syms->data + syms->size);
+        memset(sym,0,sizeof(*sym) * (1 + labels->size));
+        sym->id = seg->id;
+        snprintf(sym->name,sizeof(sym->name),"%s",avmm_entity_name(seg));
+        for (i=0;i<labels->size;i++) {
+            if (NULL == (lbl = (const class_label_t *)labels->entries[i])) {
+                sym[1 + i].id = UINT32_MAX;
+                continue;
+            }
+            sym[1 + i].id = lbl->offset;
+            snprintf(sym[1 + i].name,sizeof(sym->name),"%s",avmm_entity_name(lbl));
+        }
+        sym->count = labels->size;
+        syms->size += sizeof(*sym) * (1 + labels->size);
+    }
+
+    /* Step 3: Publish (the old copy may be mid-dump; it's kept) */
+    __atomic_store_n(&avmlib_trace_syms,syms,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&avmlib_trace_lock);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Dump the rings.
+ *
+ * @param path File to write, or NULL for the avmlib_trace_start() one
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_trace_dump(
+    const char *path
+)
+{
+    if (0 > avmlib_trace_write(path ? path : avmlib_trace_path)) {
+        avmlib_err("%s: Can't dump the trace (%s).\n",__func__,strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+#endif /* _AVMLIB_TRACE_C_ */
@@ -0,0 +1,166 @@
+/**************************************************************************//**
+ * @file avmlib_trace.h
+ *
+ * @brief Execution trace: the last instructions the process ran.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Once avmlib_trace_start() has been called, every instruction the
+ * interpreter executes, in any instance, is written to a ring of
+ * fixed-size records: when, which instance, where, the opcode and its
+ * first two operand words.  Each thread records into a ring of its own
+ * (made the first time it records, and handed to a later thread once
+ * it exits), so recording is a handful of plain stores with nothing
+ * shared between threads, and can stay on in production.  Entering and
+ * leaving native code (JIT or ahead-of-time) is recorded too, but not
+ * the instructions run natively, unless AVMLIB_TRACE_INTERPRET is
+ * given.
+ *
+ * avmlib_trace_dump() writes the rings to a file, as can a signal
+ * (dump_signal) or a crash (AVMLIB_TRACE_CRASH); both dump from the
+ * handler using only async-signal-safe calls.  The file carries each
+ * traced machine's segment and label names (avmlib_trace_symbols()),
+ * and avmtools/avmtrace decodes it offline, merging the rings into one
+ * timeline by their ticks.
+ *
+ * File layout: an avmlib_trace_header_t; for each of its rings an
+ * avmlib_trace_part_t and the ring's records slots, in slot order
+ * (slot i holds sequence numbers congruent to i); then the symbols: per segment an avmlib_trace_sym_t followed by one for
+ * each entry of its label table, in table order (offset and name;
+ * offset UINT32_MAX for empty entries).  Host byte order.
+ * */
+#ifndef _AVMLIB_TRACE_H_
+#define _AVMLIB_TRACE_H_
+
+#include "avmm_data.h"
+#include "avmlib_names.h"
+#include "avmlib_vm.h"
+#include "avmlib_prof.h"
+
+/**
+ * avmlib_trace_start() flags
+ */
+#define AVMLIB_TRACE_INTERPRET 0x01 /* Run everything interpreted, so every instruction is traced */
+#define AVMLIB_TRACE_CRASH 0x02 /* Dump on SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT */
+
+/**
+ * Opcodes of records that aren't instructions
+ */
+#define AVMLIB_TRACE_NATIVE_IN 0xFD /* Entered native code at pc; arg = retired count */
+#define AVMLIB_TRACE_NATIVE_OUT 0xFE /* Left it at pc; arg = retired count */
+
+/**
+ * File identification
+ */
+#define AVMLIB_TRACE_MAGIC "AVMTRACE"
+#define AVMLIB_TRACE_VERSION 2
+
+/**
+ * One record
+ */
+typedef struct {
+    uint64_t ticks; /* avmlib_prof_clock() */
+    uint32_t seq; /* Low 32 bits of its sequence number; written last */
+    uint16_t seg; /* Segment ID */
+    uint8_t op; /* Opcode, or AVMLIB_TRACE_NATIVE_... */
+    uint8_t argc; /* Operand count */
+    uint32_t pc; /* Code word */
+    uint32_t arg[2]; /* First two operand words (0 past the end of the code) */
+    uint32_t vm; /* Instance that ran it (from its address) */
+} avmlib_trace_rec_t;
+
+/**
+ * A thread's ring.  Only the thread writes it; rings are never freed.
+ */
+typedef struct avmlib_trace_ring_s {
+    struct avmlib_trace_ring_s *next; /* Every ring made, newest first */
+    uint64_t head; /* Next sequence number; stored after the record */
+    uint64_t mask; /* Slots - 1 */
+    uint32_t tid; /* Thread recording into it, or 0 (free) once that has exited */
+    uint32_t pad;
+    avmlib_trace_rec_t rec[];
+} avmlib_trace_ring_t;
+
+/**
+ * One ring in a dump; its records follow
+ */
+typedef struct {
+    uint64_t head; /* Next sequence number when dumped */
+    uint32_t tid; /* Thread recording into it when dumped, or 0 */
+    uint32_t pad;
+} avmlib_trace_part_t;
+
+/**
+ * Dump file header
+ */
+typedef struct {
+    char magic[8]; /* AVMLIB_TRACE_MAGIC */
+    uint32_t version; /* AVMLIB_TRACE_VERSION */
+    uint32_t rec_size; /* sizeof(avmlib_trace_rec_t) */
+    uint64_t records; /* Slots per ring */
+    uint64_t rings; /* Rings that follow */
+    uint64_t sym_size; /* Bytes of symbols after the ring */
+    uint32_t pid;
+    uint32_t ns; /* Ticks are nanoseconds (else TSC cycles) */
+} avmlib_trace_header_t;
+
+/**
+ * A segment, or one of its labels, in a dump
+ */
+typedef struct {
+    uint32_t id; /* Segment: its ID.  Label: its offset, or UINT32_MAX */
+    uint32_t count; /* Segment: its labels.  Label: 0 */
+    char name[AVMLIB_NAME_MAX + 1];
+} avmlib_trace_sym_t;
+
+/**
+ * Every thread's ring; this thread's, once it has recorded; whether to
+ * record; and whether to keep instances out of native code
+ */
+extern avmlib_trace_ring_t *avmlib_trace_rings;
+extern __thread avmlib_trace_ring_t *avmlib_trace_mine;
+extern int avmlib_trace_on;
+extern int avmlib_trace_all;
+
+/* Prototypes */
+int avmlib_trace_start(uint32_t records, int flags, int dump_signal, const char *path);
+void avmlib_trace_stop(void);
+int avmlib_trace_symbols(avm_t *avm);
+int avmlib_trace_dump(const char *path);
+avmlib_trace_ring_t *avmlib_trace_claim(void);
+
+/**************************************************************************//**
+ * @brief Record an instruction, or a trip to native code.
+ *
+ * @details Call only while avmlib_trace_on.
+ * */
+static inline void
+avmlib_trace_record(
+    const avmlib_vm_t *vm,
+    uint32_t op,
+    uint32_t argc,
+    uint32_t arg0,
+    uint32_t arg1
+)
+{
+    avmlib_trace_ring_t *ring = avmlib_trace_mine ? avmlib_trace_mine : avmlib_trace_claim();
+    avmlib_trace_rec_t *r;
+    uint64_t seq;
+
+    if (!ring) return;
+    seq = ring->head;
+    r = &ring->rec[seq & ring->mask];
+    r->ticks = avmlib_prof_clock();
+    r->seg = vm->proc.segment->id;
+    r->op = (uint8_t)op;
+    r->argc = (uint8_t)argc;
+    r->pc = vm->pc;
+    r->arg[0] = arg0;
+    r->arg[1] = arg1;
+    r->vm = (uint32_t)((uintptr_t)vm >> 4);
+    __atomic_store_n(&r->seq,(uint32_t)seq,__ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head,seq + 1,__ATOMIC_RELEASE);
+}
+
+#endif /* _AVMLIB_TRACE_H_ */
@@ -0,0 +1,283 @@
+/**************************************************************************//**
+ * @file avmlib_txn.c
+ *
+ * @brief Batched register transaction implementation
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_TXN_C_
+#define _AVMLIB_TXN_C_
+
+#include "avmlib.h"
+
+/**************************************************************************//**
+ * @brief Find the pending write slot for a register.
+ *
+ * @returns Index into the pending arrays, or -1 if not pending.
+ * */
+static int
+avmlib_txn_pending(
+    avmlib_txn_t *txn,
+    class_register_t *reg
+)
+{
+    int i;
+    for (i=0;i<txn->count;i++) {
+        if (txn->regs[i] == reg) return i;
+    }
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Push all pending writes to their backends.
+ *
+ * @details Writes go out in program order.  A run of consecutive
+ * writes sharing a set_many handler is one call; registers without a
+ * set_many handler are written individually.
+ *
+ * @param txn The transaction to flush
+ *
+ * @returns Number of registers written, or -1 if a backend wrote fewer
+ * than it was given.
+ * */
+static int
+avmlib_txn_flush(
+    avmlib_txn_t *txn
+)
+{
+    class_register_t *reg;
+    int i, n;
+    int written = 0;
+    int retval = 0;
+
+    for (i=0;i<txn->count;i+=n) {
+        reg = txn->regs[i];
+
+        /* Step 1: Unbatched register; plain setter */
+        if (!reg->set_many) {
+            avmlib_reg_set(reg,txn->values[i]);
+            written++;
+            n = 1;
+            continue;
+        }
+
+        /* Step 2: The run sharing this backend */
+        for (n=1;(i + n < txn->count) && (txn->regs[i + n]->set_many == reg->set_many);n++);
+        if (n != reg->set_many(&txn->regs[i],&txn->values[i],n)) {
+            avmlib_err("%s: Batched write of %d registers failed.\n",__func__,n);
+            retval = -1;
+        }
+        written += n;
+    }
+
+    txn->count = 0;
+    return (0 > retval) ? retval : written;
+}
+
+/**************************************************************************//**
+ * @brief Prepare a transaction struct for use.
+ * */
+void
+avmlib_txn_init(
+    avmlib_txn_t *txn
+)
+{
+    memset(txn,0,sizeof(*txn));
+}
+
+/**************************************************************************//**
+ * @brief Abandon any open transaction, keeping the log's storage.
+ * */
+void
+avmlib_txn_reset(
+    avmlib_txn_t *txn
+)
+{
+    txn->depth = 0;
+    txn->count = 0;
+}
+
+/**************************************************************************//**
+ * @brief Release a transaction's log (pending writes are dropped).
+ * */
+void
+avmlib_txn_free(
+    avmlib_txn_t *txn
+)
+{
+    free(txn->regs);
+    free(txn->values);
+    avmlib_txn_init(txn);
+}
+
+/**************************************************************************//**
+ * @brief Open a (possibly nested) transaction.
+ *
+ * @param txn The transaction state of the executing process
+ * */
+void
+avmlib_txn_begin(
+    avmlib_txn_t *txn
+)
+{
+    txn->depth++;
+}
+
+/**************************************************************************//**
+ * @brief Close a transaction.
+ *
+ * @details Only the outermost COMMIT actually writes anything.
+ *
+ * @param txn The transaction state of the executing process
+ *
+ * @returns Number of registers written, or -1 if no transaction is open.
+ * */
+int
+avmlib_txn_commit(
+    avmlib_txn_t *txn
+)
+{
+    if (txn->depth <= 0) {
+        avmlib_err("%s: COMMIT without BEGIN.\n",__func__);
+        return -1;
+    }
+    if (--txn->depth > 0) return 0;
+    return avmlib_txn_flush(txn);
+}
+
+/**************************************************************************//**
+ * @brief Write a register, deferring if a transaction is open.
+ *
+ * @details A rewrite of a pending register moves it to the end of the
+ * log, so the flush follows the order of last writes.
+ *
+ * @param txn The transaction state of the executing process
+ * @param reg The register to write
+ * @param value The value to write
+ *
+ * @returns 0 on success, -1 if the log couldn't grow (nothing is
+ * queued or written).
+ * */
+int
+avmlib_txn_set(
+    avmlib_txn_t *txn,
+    class_register_t *reg,
+    uint32_t value
+)
+{
+    class_register_t **regs;
+    uint32_t *values;
+    int i, size;
+
+    /* No transaction?  Straight through. */
+    if (txn->depth <= 0) {
+        avmlib_reg_set(reg,value);
+        return 0;
+    }
+
+    /* Rewrite of a pending register; take it out and requeue */
+    if (0 <= (i = avmlib_txn_pending(txn,reg))) {
+        memmove(&txn->regs[i],&txn->regs[i + 1],(txn->count - i - 1) * sizeof(*txn->regs));
+        memmove(&txn->values[i],&txn->values[i + 1],(txn->count - i - 1) * sizeof(*txn->values));
+        txn->count--;
+    }
+
+    /* Grow the log */
+    if (txn->count >= txn->size) {
+        size = txn->size ? (txn->size * 2) : AVMLIB_TXN_INIT;
+        if (NULL == (regs = realloc(txn->regs,size * sizeof(*regs)))) goto _avmlib_txn_set_fail;
+        txn->regs = regs;
+        if (NULL == (values = realloc(txn->values,size * sizeof(*values)))) goto _avmlib_txn_set_fail;
+        txn->values = values;
+        txn->size = size;
+    }
+    txn->regs[txn->count] = reg;
+    txn->values[txn->count] = value;
+    txn->count++;
+    return 0;
+
+_avmlib_txn_set_fail:
+    avmlib_err("%s: Alloc failure.\n",__func__);
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Read a register, seeing pending writes of an open transaction.
+ * */
+uint32_t
+avmlib_txn_get(
+    avmlib_txn_t *txn,
+    class_register_t *reg
+)
+{
+    int i;
+
+    if ((txn->depth > 0) && (0 <= (i = avmlib_txn_pending(txn,reg)))) {
+        return txn->values[i];
+    }
+    return avmlib_reg_get(reg);
+}
+
+/**************************************************************************//**
+ * @brief Read a set of registers, batching reads by backend.
+ *
+ * @details Registers with a pending write take the pending value; the
+ * rest are grouped by get_many handler and read one group at a time.
+ *
+ * @param txn The transaction state of the executing process
+ * @param regs Registers to read
+ * @param values Destination for the values, count entries
+ * @param count Number of registers (at most AVMLIB_TXN_MAX)
+ *
+ * @returns Number of registers read, or -1 on error.
+ * */
+int
+avmlib_txn_get_many(
+    avmlib_txn_t *txn,
+    class_register_t **regs,
+    uint32_t *values,
+    int count
+)
+{
+    class_register_t *group[AVMLIB_TXN_MAX];
+    uint32_t gvalues[AVMLIB_TXN_MAX];
+    int gslot[AVMLIB_TXN_MAX];
+    uint8_t done[AVMLIB_TXN_MAX];
+    int i, j, n, p;
+
+    if ((count < 0) || (count > AVMLIB_TXN_MAX)) return -1;
+
+    /* Step 1: Pending values and unbatched registers */
+    for (i=0;i<count;i++) {
+        done[i] = 1;
+        if ((txn->depth > 0) && (0 <= (p = avmlib_txn_pending(txn,regs[i])))) {
+            values[i] = txn->values[p];
+        } else if (!regs[i]->get_many) {
+            values[i] = avmlib_reg_get(regs[i]);
+        } else {
+            done[i] = 0;
+        }
+    }
+
+    /* Step 2: One call per batched backend */
+    for (i=0;i<count;i++) {
+        if (done[i]) continue;
+        for (j=i,n=0;j<count;j++) {
+            if (!done[j] && (regs[j]->get_many == regs[i]->get_many)) {
+                group[n] = regs[j];
+                gslot[n] = j;
+                done[j] = 1;
+                n++;
+            }
+        }
+        regs[i]->get_many(group,gvalues,n);
+        for (j=0;j<n;j++) {
+            values[gslot[j]] = gvalues[j];
+        }
+    }
+
+    return count;
+}
+
+#endif /* _AVMLIB_TXN_C_ */
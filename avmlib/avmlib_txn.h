@@ -0,0 +1,55 @@
+/**************************************************************************//**
+ * @file avmlib_txn.h
+ *
+ * @brief Batched register transactions.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * Between BEGIN and COMMIT, register writes are collected rather than
+ * sent to the register's setter.  On the outermost COMMIT, pending
+ * writes go out in the order they were last made: each run of
+ * consecutive writes to registers with the same set_many handler is
+ * one call, the rest fall back to their own setter.  Writes are never
+ * regrouped across a run boundary, since a backend may act on a write
+ * (device registers) and expect to see the program's order.
+ * Reads inside a transaction see the pending value for registers
+ * already written in it.
+ * */
+#ifndef _AVMLIB_TXN_H_
+#define _AVMLIB_TXN_H_
+
+#include "avmm_data.h"
+
+/**
+ * Initial size of the pending-write log; it doubles as needed.
+ */
+#define AVMLIB_TXN_INIT 64
+
+/**
+ * Most registers one avmlib_txn_get_many() call reads.
+ */
+#define AVMLIB_TXN_MAX 64
+
+/**
+ * Transaction state (one per executing process)
+ */
+typedef struct {
+    int depth; /* BEGIN nesting depth; 0 when no transaction is open */
+    int count; /* Pending writes */
+    int size; /* Slots allocated in regs[] and values[] */
+    class_register_t **regs; /* Pending write targets, in program order */
+    uint32_t *values; /* Pending write values */
+} avmlib_txn_t;
+
+/* Prototypes */
+void avmlib_txn_init(avmlib_txn_t *txn);
+void avmlib_txn_reset(avmlib_txn_t *txn);
+void avmlib_txn_free(avmlib_txn_t *txn);
+void avmlib_txn_begin(avmlib_txn_t *txn);
+int avmlib_txn_commit(avmlib_txn_t *txn);
+uint32_t avmlib_txn_get(avmlib_txn_t *txn, class_register_t *reg);
+int avmlib_txn_set(avmlib_txn_t *txn, class_register_t *reg, uint32_t value);
+int avmlib_txn_get_many(avmlib_txn_t *txn, class_register_t **regs, uint32_t *values, int count);
+
+#endif /* _AVMLIB_TXN_H_ */
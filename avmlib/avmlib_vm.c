@@ -0,0 +1,1429 @@
+/**************************************************************************//**
+ * @file avmlib_vm.c
+ *
+ * @brief Program instances and the executor
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMLIB_VM_C_
+#define _AVMLIB_VM_C_
+
+#include "avmlib.h"
+#include <errno.h>
+#include <inttypes.h>
+
+/**
+ * Bytes IN moves when no size is given
+ */
+#define AVMLIB_VM_IO_CHUNK 4096
+
+/**
+ * Most bytes OUT hands a port at once; a bigger source goes in pieces,
+ * so a full descriptor leaves the port holding at most one piece past
+ * its buffer
+ */
+#define AVMLIB_VM_OUT_CHUNK ((uint64_t)1 << 20)
+
+/**
+ * Most bytes IN reads from a port at once; a bigger IN reads piece
+ * after piece for as long as each comes back full
+ */
+#define AVMLIB_VM_IN_CHUNK ((uint64_t)1 << 20)
+
+/**
+ * While statistics are kept, a run adds its retired count to them at
+ * least this often (at a taken branch), not only when it returns
+ */
+#define AVMLIB_VM_STATS_EVERY ((uint64_t)1 << 20)
+
+/**
+ * A decoded operand
+ */
+typedef struct {
+    uint32_t e; /* Entity word */
+    uint32_t index; /* Table index (entities) */
+    int64_t imm; /* Value (immediates) */
+} avmlib_vm_arg_t;
+
+/**
+ * Report a failed instruction
+ */
+#define avmlib_vm_err(__vm, __format, __args...) \
+    avmlib_err("Segment %u, word %u: " __format, \
+               (__vm)->proc.segment ? (__vm)->proc.segment->id : 0,(__vm)->pc, ##__args)
+
+/**
+ * Is the instance being profiled?  (Never, unless built with AVM_PROFILE)
+ */
+#ifdef AVM_PROFILE
+#define AVMLIB_VM_PROFILING(__vm) (NULL != (__vm)->prof)
+#else
+#define AVMLIB_VM_PROFILING(__vm) 0
+#endif
+
+/**************************************************************************//**
+ * @brief Does an operand refer to its segment's tables?
+ *
+ * @details The compiler marks local ports and NUMBERs; strings,
+ * buffers, labels and unresolved names only ever live in the segment.
+ * */
+static inline int
+avmlib_vm_local(
+    uint32_t e
+)
+{
+    switch (avmlib_entity_class(e)) {
+        case AVM_CLASS_STRING:
+        case AVM_CLASS_BUFFER:
+        case AVM_CLASS_LABEL:
+        case AVM_CLASS_UNRESOLVED:
+            return 1;
+    }
+    return (e & OP_FLAG_LOCAL) ? 1 : 0;
+}
+
+/**************************************************************************//**
+ * @brief Decode an instruction's operands.
+ *
+ * @param code First operand word
+ * @param avail Code words left in the segment
+ * @param argc Operand count from the instruction word
+ * @param args Filled with the operands
+ *
+ * @returns Code words the operands occupy, or -1 if they run off the
+ * end of the code.
+ * */
+static int
+avmlib_vm_decode(
+    const entry_t *code,
+    uint32_t avail,
+    uint32_t argc,
+    avmlib_vm_arg_t *args
+)
+{
+    uint32_t n, words = 0, w;
+
+    for (n=0;n<argc;n++,words+=w) {
+        if (words >= avail) return -1;
+        w = avmlib_operand_words(code + words);
+        if (words + w > avail) return -1;
+        args[n].e = (uint32_t)code[words];
+        if (AVM_CLASS_IMMEDIATE == avmlib_entity_class(args[n].e)) {
+            avmlib_immediate_decode(code + words,&args[n].imm);
+        } else {
+            avmlib_entity_decode(code + words,&args[n].index);
+        }
+    }
+    return (int)words;
+}
+
+/**************************************************************************//**
+ * @brief The entity an operand refers to.
+ *
+ * @param vm The instance
+ * @param a The operand
+ * @param write Nonzero to get the instance's own, writable copy
+ *
+ * @returns The entity, or NULL if there isn't one.
+ * */
+static void *
+avmlib_vm_object(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *a,
+    int write
+)
+{
+    int class = avmlib_entity_class(a->e);
+    table_t *t;
+
+    if (class >= AVM_CLASS_MAX) return NULL;
+    if (avmlib_vm_local(a->e)) {
+        return write ? avmlib_machine_own_local(vm->avm,vm->proc.segment,class,a->index) :
+                       avmlib_machine_local(vm->avm,vm->proc.segment,class,a->index);
+    }
+    if (write) return avmlib_machine_own(vm->avm,class,a->index);
+    t = AVM_CLASS_TABLE(vm->avm,class);
+    return (a->index < t->size) ? (void *)t->entries[a->index] : NULL;
+}
+
+/**************************************************************************//**
+ * @brief Name of an operand's entity, for messages.
+ * */
+static const char *
+avmlib_vm_name(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *a
+)
+{
+    void *obj;
+
+    if (AVM_CLASS_IMMEDIATE == avmlib_entity_class(a->e)) return "(immediate)";
+    if (NULL == (obj = avmlib_vm_object(vm,a,0))) return "(none)";
+    return avmm_entity_name(obj);
+}
+
+/**************************************************************************//**
+ * @brief Read an operand as a number.
+ *
+ * @returns 0 on success, -1 if the operand has no numeric value.
+ * */
+static int
+avmlib_vm_get(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *a,
+    int64_t *val
+)
+{
+    avm_store_t *store;
+    class_register_t *reg;
+    class_string_t *str;
+
+    switch (avmlib_entity_class(a->e)) {
+        case AVM_CLASS_IMMEDIATE:
+            *val = a->imm;
+            return 0;
+        case AVM_CLASS_NUMBER:
+            store = avmlib_store_of(vm->avm,vm->proc.segment,a->e);
+            if (!store || (a->index >= store->number_count)) break;
+            *val = avmlib_store_number(store,a->index);
+            return 0;
+        case AVM_CLASS_REGISTER:
+            if ((NULL == (reg = avmlib_vm_object(vm,a,0))) || !(reg->mode & REGMODE_READ)) break;
+            *val = avmlib_txn_get(&vm->txn,reg);
+            return 0;
+        case AVM_CLASS_STRING:
+            if ((NULL == (str = avmlib_vm_object(vm,a,0))) || (0 >= avmlib_getnum(str->text,val))) break;
+            return 0;
+    }
+    avmlib_vm_err(vm,"\"%s\" has no numeric value.\n",avmlib_vm_name(vm,a));
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Fetch two numeric operands.
+ *
+ * @details Two readable registers are read with one
+ * avmlib_txn_get_many(), so a batched backend (avmlib_shmregs.h) gives
+ * a consistent pair.
+ *
+ * @returns 0 on success, -1 if an operand has no numeric value.
+ * */
+static int
+avmlib_vm_get2(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *args,
+    int64_t *a,
+    int64_t *b
+)
+{
+    class_register_t *regs[2];
+    uint32_t values[2];
+
+    if ((AVM_CLASS_REGISTER == avmlib_entity_class(args[0].e)) &&
+        (AVM_CLASS_REGISTER == avmlib_entity_class(args[1].e)) &&
+        (NULL != (regs[0] = avmlib_vm_object(vm,&args[0],0))) && (regs[0]->mode & REGMODE_READ) &&
+        (NULL != (regs[1] = avmlib_vm_object(vm,&args[1],0))) && (regs[1]->mode & REGMODE_READ) &&
+        (2 == avmlib_txn_get_many(&vm->txn,regs,values,2))) {
+        *a = values[0];
+        *b = values[1];
+        return 0;
+    }
+    if ((0 > avmlib_vm_get(vm,&args[0],a)) || (0 > avmlib_vm_get(vm,&args[1],b))) return -1;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Replace (or extend) a STRING's text.
+ *
+ * @returns 0 on success, -1 on alloc failure.
+ * */
+static int
+avmlib_vm_string_set(
+    class_string_t *str,
+    const void *data,
+    size_t len,
+    int append
+)
+{
+    size_t at = (append && str->text) ? strlen(str->text) : 0;
+    char *text;
+
+    if (!str->text || (at + len > str->capacity)) {
+        if (NULL == (text = realloc(str->text,at + len + 1))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            return -1;
+        }
+        str->text = text;
+        str->capacity = at + len;
+    }
+    memcpy(str->text + at,data,len);
+    str->text[at + len] = '\0';
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Store a number through an operand.
+ *
+ * @returns 0 on success, -1 if the operand can't hold a number.
+ * */
+static int
+avmlib_vm_put(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *a,
+    int64_t val
+)
+{
+    avm_store_t *store;
+    class_register_t *reg;
+    class_string_t *str;
+    char text[32];
+
+    switch (avmlib_entity_class(a->e)) {
+        case AVM_CLASS_NUMBER:
+            store = (a->e & OP_FLAG_LOCAL) ? avmlib_machine_local_store(vm->avm,vm->proc.segment) :
+                                             &vm->avm->store;
+            if (!store || (a->index >= store->number_count)) break;
+            return avmlib_store_number_set(store,a->index,val);
+        case AVM_CLASS_REGISTER:
+            if ((NULL == (reg = avmlib_vm_object(vm,a,1))) || !(reg->mode & REGMODE_WRITE)) break;
+            return avmlib_txn_set(&vm->txn,reg,(uint32_t)val);
+        case AVM_CLASS_STRING:
+            if (NULL == (str = avmlib_vm_object(vm,a,1))) break;
+            return avmlib_vm_string_set(str,text,snprintf(text,sizeof(text),"%" PRId64,val),0);
+    }
+    avmlib_vm_err(vm,"Can't store a number in \"%s\".\n",avmlib_vm_name(vm,a));
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief An operand's contents as bytes (OUT, STOR).
+ *
+ * @details Strings give their text and buffers everything they hold;
+ * numbers are formatted in decimal into scratch.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_vm_bytes(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *a,
+    const void **data,
+    uint64_t *len,
+    char *scratch,
+    size_t scratch_size
+)
+{
+    class_string_t *str;
+    class_buffer_t *buf;
+    int64_t val;
+
+    switch (avmlib_entity_class(a->e)) {
+        case AVM_CLASS_STRING:
+            if (NULL == (str = avmlib_vm_object(vm,a,0))) break;
+            *data = str->text ? str->text : "";
+            *len = strlen(*data);
+            return 0;
+        case AVM_CLASS_BUFFER:
+            if (NULL == (buf = avmlib_vm_object(vm,a,0))) break;
+            *data = buf->buf;
+            *len = buf->size;
+            return 0;
+        default:
+            if (0 > avmlib_vm_get(vm,a,&val)) return -1;
+            *data = scratch;
+            *len = (uint64_t)snprintf(scratch,scratch_size,"%" PRId64,val);
+            return 0;
+    }
+    avmlib_vm_err(vm,"No object for operand %08x.\n",a->e);
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Store bytes through an operand (IN).
+ *
+ * @details Strings are replaced, buffers appended to, and numbers parsed.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+avmlib_vm_store_bytes(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *a,
+    const void *data,
+    uint64_t len
+)
+{
+    class_buffer_t *buf;
+    class_string_t *str;
+    char text[64];
+    int64_t val;
+
+    switch (avmlib_entity_class(a->e)) {
+        case AVM_CLASS_STRING:
+            if (NULL == (str = avmlib_vm_object(vm,a,1))) return -1;
+            return avmlib_vm_string_set(str,data,(size_t)len,0);
+        case AVM_CLASS_BUFFER:
+            if (NULL == (buf = avmlib_vm_object(vm,a,1))) return -1;
+            if (0 > avmtype_buffer_write(buf,data,len)) {
+                avmlib_vm_err(vm,"Can't write buffer \"%s\" (%s).\n",
+                              avmm_entity_name(buf),strerror(errno));
+                return -1;
+            }
+            return 0;
+    }
+    if (len >= sizeof(text)) len = sizeof(text) - 1;
+    memcpy(text,data,(size_t)len);
+    text[len] = '\0';
+    if (0 >= avmlib_getnum(text,&val)) val = 0;
+    return avmlib_vm_put(vm,a,val);
+}
+
+/**************************************************************************//**
+ * @brief Flush one port, folding the result into the others'.
+ *
+ * @details The first port that would block is the one the instance
+ * waits on.
+ *
+ * @returns The worse of rc and this port's result: -1 over
+ * AVMLIB_IO_WOULDBLOCK over 0.
+ * */
+static int
+avmlib_vm_flush_port(
+    avmlib_vm_t *vm,
+    class_port_t *port,
+    int rc
+)
+{
+    switch (avmlib_port_flush(port)) {
+        case 0:
+            return rc;
+        case AVMLIB_IO_WOULDBLOCK:
+            if (rc) return rc;
+            vm->proc.wait_port = port;
+            vm->wait_write = 1;
+            return AVMLIB_IO_WOULDBLOCK;
+    }
+    avmlib_vm_err(vm,"Can't flush port \"%s\".\n",avmm_entity_name(port));
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Flush every port the instance has written through.
+ *
+ * @details Every port is tried even if an earlier one fails.
+ *
+ * @returns 0 on success, -1 if a port failed, or AVMLIB_IO_WOULDBLOCK
+ * if one is still holding output (vm->proc.wait_port).
+ * */
+static int
+avmlib_vm_flush(
+    avmlib_vm_t *vm
+)
+{
+    table_t *ports = AVM_CLASS_TABLE(vm->avm,AVM_CLASS_PORT);
+    avm_local_store_t *l;
+    uint32_t s, i;
+    int rc = 0;
+
+    for (i=0;i<avmlib_table_size(ports);i++) {
+        rc = avmlib_vm_flush_port(vm,(class_port_t *)ports->entries[i],rc);
+    }
+    for (s=0;s<vm->avm->nlocals;s++) {
+        l = &vm->avm->locals[s];
+        for (i=0;l->objects[AVM_CLASS_PORT] && (i<l->nobjects[AVM_CLASS_PORT]);i++) {
+            if (l->objects[AVM_CLASS_PORT][i]) {
+                rc = avmlib_vm_flush_port(vm,(class_port_t *)l->objects[AVM_CLASS_PORT][i],rc);
+            }
+        }
+    }
+    return rc;
+}
+
+/**************************************************************************//**
+ * @brief Resolve a jump target.
+ *
+ * @details Moves the instance into the label's segment if it's
+ * another one.
+ *
+ * @returns 0 with *next set to the target, or -1 on failure.
+ * */
+static int
+avmlib_vm_jump(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *a,
+    uint32_t *next
+)
+{
+    avm_store_t *store;
+    uint16_t id;
+
+    if (AVM_CLASS_LABEL != avmlib_entity_class(a->e)) {
+        avmlib_vm_err(vm,"Jump target \"%s\" is unresolved.\n",avmlib_vm_name(vm,a));
+        return -1;
+    }
+    store = avmlib_store_of(vm->avm,vm->proc.segment,a->e);
+    if (!store || (a->index >= store->label_count)) {
+        avmlib_vm_err(vm,"No label %u.\n",a->index);
+        return -1;
+    }
+    id = avmlib_store_label_segment(store,a->index);
+    if ((id != vm->proc.segment->id) &&
+        (NULL == avmlib_segment_enter(vm->avm,vm->thr,&vm->proc,id))) {
+        avmlib_vm_err(vm,"Can't enter segment %u.\n",id);
+        return -1;
+    }
+    *next = avmlib_store_label_offset(store,a->index);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief OUT port, source[, size]
+ *
+ * @details Ports are written AVMLIB_VM_OUT_CHUNK bytes at a time.  If
+ * one would block with more to go, vm->out_done keeps how far it got and
+ * the OUT runs again from there once the port drains (or, on a fileio
+ * port, once the piece is written).
+ *
+ * @returns 0 on success, -1 on failure, or AVMLIB_IO_WOULDBLOCK if the
+ * port took the bytes but is holding them until its descriptor drains.
+ * */
+static int
+avmlib_vm_out(
+    avmlib_vm_t *vm,
+    uint32_t argc,
+    const avmlib_vm_arg_t *args
+)
+{
+    const void *data;
+    uint64_t len, piece;
+    char scratch[32];
+    int64_t size;
+    ssize_t put;
+    void *dst;
+    int rc = 0;
+
+    if ((0 > avmlib_vm_bytes(vm,&args[1],&data,&len,scratch,sizeof(scratch))) ||
+        ((argc > 2) && (0 > avmlib_vm_get(vm,&args[2],&size)))) {
+        goto _avmlib_vm_out_fail;
+    }
+    if ((argc > 2) && (size >= 0) && ((uint64_t)size < len)) len = (uint64_t)size;
+    if (NULL == (dst = avmlib_vm_object(vm,&args[0],1))) goto _avmlib_vm_out_fail;
+
+    if (AVM_CLASS_BUFFER == avmlib_entity_class(args[0].e)) {
+        if (0 > avmtype_buffer_write((class_buffer_t *)dst,data,len)) goto _avmlib_vm_out_fail;
+        return 0;
+    }
+    if (AVM_CLASS_PORT != avmlib_entity_class(args[0].e)) {
+        avmlib_vm_err(vm,"OUT: \"%s\" is not a PORT.\n",avmlib_vm_name(vm,&args[0]));
+        goto _avmlib_vm_out_fail;
+    }
+
+    /* Pick up where a blocked try left off */
+    while ((AVMLIB_IO_WOULDBLOCK != rc) && (vm->out_done < len)) {
+        piece = len - vm->out_done;
+        if (piece > AVMLIB_VM_OUT_CHUNK) piece = AVMLIB_VM_OUT_CHUNK;
+        if (((class_port_t *)dst)->fileio) {
+            rc = avmlib_fileio_write(((class_port_t *)dst)->fileio,&vm->proc,(class_port_t *)dst,
+                                     (const char *)data + vm->out_done,(uint32_t)piece);
+            if (AVMLIB_IO_WOULDBLOCK == rc) {
+                vm->io_wait = 1;
+                vm->io_len = (uint32_t)piece;
+            }
+        } else {
+            put = avmlib_port_write((class_port_t *)dst,(const char *)data + vm->out_done,(size_t)piece);
+            rc = (put < 0) ? (int)put : 0;
+        }
+        if ((0 > rc) && (AVMLIB_IO_WOULDBLOCK != rc)) {
+            avmlib_vm_err(vm,"OUT: Can't write \"%s\".\n",avmlib_vm_name(vm,&args[0]));
+            goto _avmlib_vm_out_fail;
+        }
+        vm->out_done += piece; /* Taken, even if held */
+    }
+    if (vm->out_done >= len) vm->out_done = 0;
+    if (AVMLIB_IO_WOULDBLOCK == rc) {
+        vm->proc.wait_port = (class_port_t *)dst;
+        vm->wait_write = 1;
+        vm->again = (0 != vm->out_done);
+    }
+    return rc;
+
+_avmlib_vm_out_fail:
+    vm->out_done = 0;
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief IN through a port's file I/O backend.
+ *
+ * @details The first try queues a read of up to AVMLIB_VM_IN_CHUNK bytes
+ * and blocks.  Each retry collects a completed piece into vm->io_buf
+ * (vm->in_done bytes so far) and, if it came back full with more
+ * wanted, queues the next one.
+ *
+ * @param vm The instance
+ * @param port The port
+ * @param size Most bytes wanted
+ * @param got Set to the bytes read, in vm->io_buf (which the caller frees)
+ *
+ * @returns 0 when done, AVMLIB_IO_WOULDBLOCK if a piece is queued, or
+ * -1 on error.
+ * */
+static int
+avmlib_vm_in_fileio(
+    avmlib_vm_t *vm,
+    class_port_t *port,
+    uint64_t size,
+    uint64_t *got
+)
+{
+    uint64_t piece = size - vm->in_done;
+    char *grown;
+    int rc;
+
+    if (piece > AVMLIB_VM_IN_CHUNK) piece = AVMLIB_VM_IN_CHUNK;
+
+    /* Step 1: Retried after a piece completed */
+    if (vm->io_buf) {
+        if (0 > (rc = vm->proc.io_result)) {
+            errno = -rc;
+            goto _avmlib_vm_in_fileio_fail;
+        }
+        vm->in_done += (uint64_t)rc;
+        if (((uint64_t)rc < piece) || (vm->in_done >= size)) {
+            *got = vm->in_done;
+            vm->in_done = 0;
+            return 0;
+        }
+        piece = size - vm->in_done;
+        if (piece > AVMLIB_VM_IN_CHUNK) piece = AVMLIB_VM_IN_CHUNK;
+    }
+
+    /* Step 2: Queue the next piece */
+    if (NULL == (grown = realloc(vm->io_buf,vm->in_done + (piece ? piece : 1)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        goto _avmlib_vm_in_fileio_fail;
+    }
+    vm->io_buf = grown;
+    if (AVMLIB_IO_WOULDBLOCK != (rc = avmlib_fileio_read(port->fileio,&vm->proc,port,
+                                                        grown + vm->in_done,(uint32_t)piece))) {
+        goto _avmlib_vm_in_fileio_fail;
+    }
+    vm->io_wait = 1;
+    return rc;
+
+_avmlib_vm_in_fileio_fail:
+    free(vm->io_buf);
+    vm->io_buf = NULL;
+    vm->in_done = 0;
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief IN from a descriptor port, more than AVMLIB_VM_IO_CHUNK bytes.
+ *
+ * @details Reads AVMLIB_VM_IN_CHUNK bytes at a time for as long as each
+ * piece comes back full, so the memory taken follows what the port has
+ * rather than what was asked for.  Once some bytes are in, a piece that
+ * would block ends the IN.
+ *
+ * @param port The port
+ * @param size Most bytes wanted
+ * @param buf Set to the bytes read (the caller frees it)
+ * @param got Set to the number of bytes read
+ *
+ * @returns 0 on success, AVMLIB_IO_WOULDBLOCK if nothing was there yet,
+ * or -1 on error.
+ * */
+static int
+avmlib_vm_in_port(
+    class_port_t *port,
+    uint64_t size,
+    char **buf,
+    uint64_t *got
+)
+{
+    uint64_t piece, done = 0;
+    char *grown;
+    int rc;
+
+    *buf = NULL;
+    do {
+        piece = size - done;
+        if (piece > AVMLIB_VM_IN_CHUNK) piece = AVMLIB_VM_IN_CHUNK;
+        if (NULL == (grown = realloc(*buf,done + piece))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            rc = -1;
+            break;
+        }
+        *buf = grown;
+        rc = avmlib_port_read(port,grown + done,(uint32_t)piece);
+        if ((AVMLIB_IO_WOULDBLOCK == rc) && done) rc = 0;
+        if (0 >= rc) break;
+        done += (uint64_t)rc;
+    } while (((uint64_t)rc == piece) && (done < size));
+
+    if (0 > rc) {
+        free(*buf);
+        *buf = NULL;
+        return rc;
+    }
+    *got = done;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief IN source, storage[, size]
+ *
+ * @details Sizes are 64-bit.  A BUFFER source is consumed in place; a
+ * port is read in pieces (see avmlib_vm_in_port()).
+ *
+ * @returns 0 on success, -1 on failure, or AVMLIB_IO_WOULDBLOCK if the
+ * port has nothing yet (the IN hasn't happened).
+ * */
+static int
+avmlib_vm_in(
+    avmlib_vm_t *vm,
+    uint32_t argc,
+    const avmlib_vm_arg_t *args
+)
+{
+    char chunk[AVMLIB_VM_IO_CHUNK], *tmp = NULL;
+    const void *data = chunk;
+    int64_t size = AVMLIB_VM_IO_CHUNK;
+    uint64_t got = 0;
+    class_port_t *port;
+    void *src;
+    int rc;
+
+    if ((argc > 2) && (0 > avmlib_vm_get(vm,&args[2],&size))) return -1;
+    if (size < 0) {
+        avmlib_vm_err(vm,"IN: Bad size %" PRId64 ".\n",size);
+        errno = EINVAL;
+        return -1;
+    }
+    if (NULL == (src = avmlib_vm_object(vm,&args[0],1))) return -1;
+
+    /* Step 1: Get the bytes */
+    if (AVM_CLASS_BUFFER == avmlib_entity_class(args[0].e)) {
+        got = avmtype_buffer_view((class_buffer_t *)src,(uint64_t)size,&data);
+        rc = 0;
+    } else if (AVM_CLASS_PORT == avmlib_entity_class(args[0].e)) {
+        port = (class_port_t *)src;
+        if (port->fileio) {
+            rc = avmlib_vm_in_fileio(vm,port,(uint64_t)size,&got);
+            if (0 == rc) {
+                data = tmp = vm->io_buf;
+                vm->io_buf = NULL;
+            }
+        } else if (size <= AVMLIB_VM_IO_CHUNK) {
+            if (0 < (rc = avmlib_port_read(port,chunk,(uint32_t)size))) got = (uint64_t)rc;
+        } else if (0 == (rc = avmlib_vm_in_port(port,(uint64_t)size,&tmp,&got))) {
+            data = tmp;
+        }
+        if (AVMLIB_IO_WOULDBLOCK == rc) {
+            vm->proc.wait_port = port;
+            vm->wait_write = 0;
+            vm->again = 1;
+            return AVMLIB_IO_WOULDBLOCK; /* Retried on resume or completion */
+        }
+        if (0 > rc) {
+            avmlib_vm_err(vm,"IN: Can't read \"%s\".\n",avmlib_vm_name(vm,&args[0]));
+            return -1;
+        }
+    } else {
+        avmlib_vm_err(vm,"IN: \"%s\" is not a PORT or BUFFER.\n",avmlib_vm_name(vm,&args[0]));
+        return -1;
+    }
+
+    /* Step 2: Store them */
+    rc = avmlib_vm_store_bytes(vm,&args[1],data,got);
+    free(tmp);
+    return (0 > rc) ? -1 : 0;
+}
+
+/**************************************************************************//**
+ * @brief STOR target, source[, source...]
+ *
+ * @details A STRING or buffer target gets the sources concatenated; a
+ * numeric one gets the first source's value.
+ * */
+static int
+avmlib_vm_stor(
+    avmlib_vm_t *vm,
+    uint32_t argc,
+    const avmlib_vm_arg_t *args
+)
+{
+    int class = avmlib_entity_class(args[0].e);
+    char scratch[32], *text = NULL, *grown;
+    const void *data;
+    uint64_t used = 0, len;
+    class_buffer_t *buf;
+    uint32_t n;
+    int64_t val;
+    int rc = 0;
+
+    if ((AVM_CLASS_STRING != class) && (AVM_CLASS_BUFFER != class)) {
+        if (0 > avmlib_vm_get(vm,&args[1],&val)) return -1;
+        return avmlib_vm_put(vm,&args[0],val);
+    }
+
+    /* Step 1: Render the sources (one may be the target) */
+    for (n=1;n<argc;n++) {
+        if (0 > avmlib_vm_bytes(vm,&args[n],&data,&len,scratch,sizeof(scratch))) {
+            free(text);
+            return -1;
+        }
+        if (NULL == (grown = realloc(text,used + len + 1))) {
+            avmlib_err("%s: Alloc failure.\n",__func__);
+            free(text);
+            return -1;
+        }
+        text = grown;
+        memcpy(text + used,data,len);
+        used += len;
+    }
+
+    /* Step 2: Store */
+    if (AVM_CLASS_STRING == class) {
+        rc = avmlib_vm_store_bytes(vm,&args[0],text,used);
+    } else if (NULL == (buf = avmlib_vm_object(vm,&args[0],1))) {
+        rc = -1;
+    } else {
+        buf->size = buf->cursor = 0;
+        if (used && (0 > avmtype_buffer_write(buf,text,used))) rc = -1;
+    }
+    free(text);
+    return rc;
+}
+
+/**************************************************************************//**
+ * @brief FILE target, name
+ * */
+static int
+avmlib_vm_file(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *args
+)
+{
+    class_string_t *name;
+    void *target;
+    int rc;
+
+    if ((AVM_CLASS_STRING != avmlib_entity_class(args[1].e)) ||
+        (NULL == (name = avmlib_vm_object(vm,&args[1],0))) || !name->text) {
+        avmlib_vm_err(vm,"FILE: Name \"%s\" is not a STRING.\n",avmlib_vm_name(vm,&args[1]));
+        return -1;
+    }
+    if (NULL == (target = avmlib_vm_object(vm,&args[0],1))) return -1;
+    switch (avmlib_entity_class(args[0].e)) {
+        case AVM_CLASS_PORT:
+            rc = avmlib_port_open_file((class_port_t *)target,name->text);
+            if ((0 == rc) && vm->fileio) rc = avmlib_fileio_add_port(vm->fileio,(class_port_t *)target);
+            break;
+        case AVM_CLASS_BUFFER:
+            rc = avmtype_buffer_map((class_buffer_t *)target,name->text,BUFFER_MAP_COW);
+            break;
+        default:
+            rc = -1;
+            break;
+    }
+    if (0 > rc) avmlib_vm_err(vm,"FILE: Can't open \"%s\".\n",name->text);
+    return rc;
+}
+
+/**************************************************************************//**
+ * @brief SIZE source, storage
+ * */
+static int
+avmlib_vm_size(
+    avmlib_vm_t *vm,
+    const avmlib_vm_arg_t *args
+)
+{
+    class_string_t *str;
+    class_buffer_t *buf;
+    avm_store_t *store;
+    int64_t size = 0;
+
+    switch (avmlib_entity_class(args[0].e)) {
+        case AVM_CLASS_STRING:
+            if ((NULL != (str = avmlib_vm_object(vm,&args[0],0))) && str->text) size = strlen(str->text);
+            break;
+        case AVM_CLASS_BUFFER:
+            if (NULL != (buf = avmlib_vm_object(vm,&args[0],0))) size = (int64_t)buf->size;
+            break;
+        case AVM_CLASS_NUMBER:
+            store = avmlib_store_of(vm->avm,vm->proc.segment,args[0].e);
+            if (store && (args[0].index < store->number_count)) size = store->number_width[args[0].index] / 8;
+            break;
+        case AVM_CLASS_REGISTER:
+        case AVM_CLASS_IMMEDIATE:
+            size = sizeof(uint32_t);
+            break;
+    }
+    return avmlib_vm_put(vm,&args[1],size);
+}
+
+/**************************************************************************//**
+ * @brief Execute one decoded instruction.
+ *
+ * @param vm The instance
+ * @param op Opcode
+ * @param argc Operand count
+ * @param args Operands
+ * @param next Next code word; jumps change it
+ *
+ * @returns 0 on success, -1 on failure, or AVMLIB_IO_WOULDBLOCK if the
+ * instance must wait on vm->proc.wait_port.
+ * */
+static int
+avmlib_vm_exec(
+    avmlib_vm_t *vm,
+    uint32_t op,
+    uint32_t argc,
+    const avmlib_vm_arg_t *args,
+    uint32_t *next
+)
+{
+    int64_t a, b;
+    void *port;
+    int rc;
+
+    switch (op) {
+        case AVM_OP_NOP:
+            return 0;
+        case AVM_OP_STOR:
+            if (argc < 2) break;
+            return avmlib_vm_stor(vm,argc,args);
+        case AVM_OP_ADD:
+        case AVM_OP_SUB:
+            if ((argc < 1) || (argc > 3)) break;
+            b = 1;
+            if ((argc > 1) ? (0 > avmlib_vm_get2(vm,args,&a,&b)) : (0 > avmlib_vm_get(vm,&args[0],&a))) {
+                return -1;
+            }
+            return avmlib_vm_put(vm,&args[(argc > 2) ? 2 : 0],
+                                 (AVM_OP_ADD == op) ? (int64_t)((uint64_t)a + (uint64_t)b) :
+                                                      (int64_t)((uint64_t)a - (uint64_t)b));
+        case AVM_OP_GOTO:
+            if (argc != 1) break;
+            return avmlib_vm_jump(vm,&args[0],next);
+        case AVM_OP_JZ:
+        case AVM_OP_JNZ:
+            if (argc != 2) break;
+            if (0 > avmlib_vm_get(vm,&args[0],&a)) return -1;
+            if ((0 == a) != (AVM_OP_JZ == op)) return 0;
+            return avmlib_vm_jump(vm,&args[1],next);
+        case AVM_OP_FILE:
+            if (argc != 2) break;
+            return avmlib_vm_file(vm,args);
+        case AVM_OP_IN:
+            if ((argc < 2) || (argc > 3)) break;
+            return avmlib_vm_in(vm,argc,args);
+        case AVM_OP_OUT:
+            if ((argc < 2) || (argc > 3)) break;
+            return avmlib_vm_out(vm,argc,args);
+        case AVM_OP_FLUSH:
+            if (0 == argc) {
+                /* Runs again until no port is left holding output */
+                if (AVMLIB_IO_WOULDBLOCK == (rc = avmlib_vm_flush(vm))) vm->again = 1;
+                return rc;
+            }
+            if (NULL == (port = avmlib_vm_object(vm,&args[0],1))) return -1;
+            if (AVMLIB_IO_WOULDBLOCK == (rc = avmlib_port_flush((class_port_t *)port))) {
+                vm->proc.wait_port = (class_port_t *)port;
+                vm->wait_write = 1;
+            }
+            return rc;
+        case AVM_OP_BEGIN:
+            avmlib_txn_begin(&vm->txn);
+            return 0;
+        case AVM_OP_COMMIT:
+            if (0 > avmlib_txn_commit(&vm->txn)) {
+                avmlib_vm_err(vm,"COMMIT failed.\n");
+                return -1;
+            }
+            return 0;
+        case AVM_OP_SIZE:
+            if (argc != 2) break;
+            return avmlib_vm_size(vm,args);
+    }
+    avmlib_vm_err(vm,"Can't execute opcode 0x%02x with %u operands.\n",op,argc);
+    return -1;
+}
+
+/**
+ * What native code calls back into
+ */
+static const avmlib_vm_native_api_t avmlib_vm_native_api = {
+    .abi = AVMLIB_VM_NATIVE_ABI,
+    .step = avmlib_vm_step,
+    .own = avmlib_machine_own,
+    .local_store = avmlib_machine_local_store,
+    .store_own = avmlib_store_own,
+};
+
+/**************************************************************************//**
+ * @brief Load a program into a template machine.
+ *
+ * @details The compiled segment is registered and loaded now (so
+ * instances don't pay for it), and becomes where new instances start.
+ * Call once per segment, before making instances.
+ *
+ * @param tmpl The template machine
+ * @param path Compiled segment (.avmo)
+ *
+ * @returns The segment's ID, or -1 on failure.
+ * */
+int
+avmlib_vm_program(
+    avm_t *tmpl,
+    const char *path
+)
+{
+    int id;
+
+    if (tmpl->parent) {
+        avmlib_err("%s: Can't load a program into a clone.\n",__func__);
+        errno = EPERM;
+        return -1;
+    }
+    if ((0 > (id = avmlib_segment_register(tmpl,path))) ||
+        (NULL == avmlib_segment_get(tmpl,(uint16_t)id)) ||
+        (0 > avmlib_store_build(&tmpl->store,tmpl))) {
+        return -1;
+    }
+    tmpl->entrypoint = (entry_t)id;
+    avmlib_trace_symbols(tmpl);
+    avmlib_stats_env();
+    avmlib_stats_tables(tmpl);
+    return id;
+}
+
+/**************************************************************************//**
+ * @brief Make an instance of a loaded template.
+ *
+ * @details The instance starts at the template's entry segment, at its
+ * AVMLIB_VM_ENTRY_LABEL label if there is one and at its first word
+ * otherwise.
+ *
+ * @param tmpl The template machine
+ *
+ * @returns The instance, ready to run, or NULL on failure.
+ * */
+avmlib_vm_t *
+avmlib_vm_new(
+    avm_t *tmpl
+)
+{
+    avmlib_vm_t *vm;
+    class_segment_t *seg;
+    table_t *t;
+    uint32_t i;
+
+    if (NULL == (vm = calloc(1,sizeof(*vm)))) {
+        avmlib_err("%s: Alloc failure.\n",__func__);
+        return NULL;
+    }
+
+    /* Step 1: Our machine */
+    if ((NULL == (vm->avm = avmlib_machine_clone(tmpl))) ||
+        (NULL == (vm->thr = avmlib_epoch_register((avmlib_epoch_t *)vm->avm->epoch)))) {
+        avmlib_vm_free(vm);
+        return NULL;
+    }
+
+    /* Step 2: Entry point */
+    vm->entry_seg = (uint16_t)tmpl->entrypoint;
+    if (NULL == (seg = avmlib_segment_get(tmpl,vm->entry_seg))) {
+        avmlib_err("%s: No entry segment %u.\n",__func__,vm->entry_seg);
+        avmlib_vm_free(vm);
+        return NULL;
+    }
+    t = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    for (i=0;i<t->size;i++) {
+        class_label_t *lbl = (class_label_t *)t->entries[i];
+        if (!strcmp(avmm_entity_name(lbl),AVMLIB_VM_ENTRY_LABEL)) {
+            vm->entry_pc = lbl->offset;
+            break;
+        }
+    }
+
+    if (0 > avmlib_vm_reset(vm)) {
+        avmlib_vm_free(vm);
+        return NULL;
+    }
+    if (avmlib_stats) {
+        avmlib_stats_add(instances,1);
+        vm->counted = 1;
+    }
+    return vm;
+}
+
+/**************************************************************************//**
+ * @brief Put an instance back to the state it was made in.
+ *
+ * @details Everything the last run wrote is dropped (see
+ * avmlib_machine_clone_reset()), open transactions are abandoned, and
+ * execution goes back to the entry point.  Ports keep their
+ * descriptors, so a port the program opened with FILE stays open.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+int
+avmlib_vm_reset(
+    avmlib_vm_t *vm
+)
+{
+    avmlib_segment_leave(&vm->proc);
+    avmlib_machine_clone_reset(vm->avm);
+    avmlib_txn_reset(&vm->txn);
+    free(vm->io_buf);
+    vm->io_buf = NULL;
+    vm->io_wait = 0;
+    vm->retired = 0;
+    vm->pc = vm->entry_pc;
+    vm->proc.wait_port = NULL;
+    vm->proc.state = PROC_STATE_RUNNABLE;
+    vm->wait_write = 0;
+    vm->again = 0;
+    vm->out_done = 0;
+    vm->in_done = 0;
+    if (NULL == avmlib_segment_enter(vm->avm,vm->thr,&vm->proc,vm->entry_seg)) {
+        vm->status = AVMLIB_VM_ERROR;
+        return -1;
+    }
+    vm->status = AVMLIB_VM_READY;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Pick a blocked instance up where it stopped.
+ *
+ * @returns Nonzero if it can run now.
+ * */
+static int
+avmlib_vm_unblock(
+    avmlib_vm_t *vm
+)
+{
+    int rc;
+
+    /* A backend request; see that it's done (and, for OUT, took it all) */
+    if (vm->io_wait) {
+        if (PROC_STATE_RUNNABLE != vm->proc.state) return 0;
+        vm->io_wait = 0;
+        vm->proc.wait_port = NULL;
+        if (vm->wait_write && (vm->proc.io_result != (int32_t)vm->io_len)) {
+            avmlib_vm_err(vm,"OUT: File write failed (%d of %u bytes).\n",vm->proc.io_result,vm->io_len);
+            vm->status = AVMLIB_VM_ERROR;
+            return 0;
+        }
+    }
+
+    /* An OUT or FLUSH completed, but its port is still draining (an
+     * event loop drains it before waking us, and clears wait_port) */
+    if (vm->wait_write && vm->proc.wait_port) {
+        rc = avmlib_port_flush(vm->proc.wait_port);
+        if (AVMLIB_IO_WOULDBLOCK == rc) return 0;
+        if (0 > rc) {
+            avmlib_vm_err(vm,"Can't drain port \"%s\".\n",avmm_entity_name(vm->proc.wait_port));
+            vm->status = AVMLIB_VM_ERROR;
+            return 0;
+        }
+    }
+
+    /* An IN is just tried again */
+    vm->proc.wait_port = NULL;
+    vm->proc.state = PROC_STATE_RUNNABLE;
+    vm->status = AVMLIB_VM_READY;
+    return 1;
+}
+
+/**************************************************************************//**
+ * @brief Execute the instruction at the instance's pc.
+ *
+ * @details This is the interpreter; native code (avmlib_aot.h) calls
+ * it for anything it doesn't compile itself.  The pc and retired count
+ * move past the instruction, and a jump may move the instance into
+ * another segment.  The budget is the caller's business.
+ *
+ * @returns 0 if execution falls through to the next instruction, 1 if
+ * it branched, or -1 if the instance stopped (vm->status says why; a
+ * pc at the end of the code halts).
+ * */
+int
+avmlib_vm_step(
+    avmlib_vm_t *vm
+)
+{
+    avmlib_vm_arg_t args[AVMLIB_VM_ARGS];
+    const table_t *code;
+    uint32_t word, op, argc, next, fall;
+    int words, rc;
+
+    /* Step 1: Fetch */
+    code = AVM_CLASS_TABLE(vm->proc.segment,AVM_CLASS_INSTRUCTION);
+    if (vm->pc >= code->size) {
+        vm->status = AVMLIB_VM_HALTED;
+        return -1;
+    }
+    word = (uint32_t)code->entries[vm->pc];
+    op = (word >> 16) & 0xFF;
+    argc = word & 0xFF;
+    if ((AVM_CLASS_INSTRUCTION != avmlib_entity_class(word)) || (argc > AVMLIB_VM_ARGS)) {
+        avmlib_vm_err(vm,"Not an instruction (%08x).\n",word);
+        vm->status = AVMLIB_VM_ERROR;
+        return -1;
+    }
+    if (avmlib_trace_on) {
+        avmlib_trace_record(vm,op,argc,(vm->pc + 1 < code->size) ? (uint32_t)code->entries[vm->pc + 1] : 0,
+                            (vm->pc + 2 < code->size) ? (uint32_t)code->entries[vm->pc + 2] : 0);
+    }
+
+    /* Step 2: Decode */
+    if (0 > (words = avmlib_vm_decode(&code->entries[vm->pc + 1],code->size - vm->pc - 1,argc,args))) {
+        avmlib_vm_err(vm,"Operands run past the end of the code.\n");
+        vm->status = AVMLIB_VM_ERROR;
+        return -1;
+    }
+    next = fall = vm->pc + 1 + (uint32_t)words;
+
+    /* Step 3: Execute */
+    vm->again = 0;
+    if (0 > (rc = avmlib_vm_exec(vm,op,argc,args,&next))) {
+        if (AVMLIB_IO_WOULDBLOCK != rc) {
+            vm->status = AVMLIB_VM_ERROR;
+            return -1;
+        }
+        vm->status = AVMLIB_VM_BLOCKED;
+        vm->proc.state = PROC_STATE_WAITING;
+        if (vm->again) return -1; /* An IN, or the rest of an OUT or FLUSH, runs again */
+        vm->pc = next;
+        vm->retired++;
+        return -1;
+    }
+    vm->pc = next;
+    vm->retired++;
+    return (next != fall) ? 1 : 0;
+}
+
+#ifdef AVM_PROFILE
+/**************************************************************************//**
+ * @brief avmlib_vm_step(), timed and charged to vm->prof.
+ * */
+static int
+avmlib_vm_step_profiled(
+    avmlib_vm_t *vm
+)
+{
+    const class_segment_t *seg = vm->proc.segment;
+    const table_t *code = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    avmlib_vm_arg_t port;
+    uint32_t pc = vm->pc, word, op;
+    uint64_t ticks;
+    int rc;
+
+    if (pc >= code->size) return avmlib_vm_step(vm);
+    word = (uint32_t)code->entries[pc];
+    op = (word >> 16) & 0xFF;
+    ticks = avmlib_prof_clock();
+    rc = avmlib_vm_step(vm);
+    ticks = avmlib_prof_clock() - ticks;
+    avmlib_prof_insn(vm->prof,seg,pc,op,ticks);
+    if (((AVM_OP_IN == op) || (AVM_OP_OUT == op) || (AVM_OP_FLUSH == op) || (AVM_OP_FILE == op)) &&
+        (word & 0xFF) && (0 < avmlib_vm_decode(&code->entries[pc + 1],code->size - pc - 1,1,&port)) &&
+        (AVM_CLASS_PORT == avmlib_entity_class(port.e))) {
+        avmlib_prof_port(vm->prof,avmlib_vm_name(vm,&port),op,ticks);
+    }
+    return rc;
+}
+#endif /* AVM_PROFILE */
+
+/**************************************************************************//**
+ * @brief Where the next taken-branch check should stop a run: at the
+ * budget, or sooner while statistics are kept (AVMLIB_VM_STATS_EVERY).
+ * */
+static inline uint64_t
+avmlib_vm_next_limit(
+    avmlib_vm_t *vm,
+    uint64_t budget
+)
+{
+    if (!avmlib_stats || (budget - vm->retired <= AVMLIB_VM_STATS_EVERY)) return budget;
+    return vm->retired + AVMLIB_VM_STATS_EVERY;
+}
+
+/**************************************************************************//**
+ * @brief Publish the retired count at a stop short of the budget.
+ *
+ * @returns Nonzero if the budget is spent (the run should yield).
+ * */
+static inline int
+avmlib_vm_checkpoint(
+    avmlib_vm_t *vm,
+    uint64_t budget,
+    uint64_t *start
+)
+{
+    avmlib_stats_add(retired,vm->retired - *start);
+    *start = vm->retired;
+    if (vm->retired >= budget) return 1;
+    vm->limit = avmlib_vm_next_limit(vm,budget);
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Run an instance for a while.
+ *
+ * @details Runs until the program halts or fails, the budget is spent,
+ * or a port would block; the last two can be resumed by calling this
+ * again.  Running off the end of the code halts; output held in the
+ * instance's ports is flushed then.
+ *
+ * A segment with native code attached (avmlib_aot_load(), or the JIT
+ * once the segment is hot; see avmlib_jit.h) runs that instead of
+ * being interpreted, for as long as the instance stays in it.  If the
+ * native code declines (see AVMLIB_VM_NATIVE_DECLINE) the segment is
+ * interpreted until the instance leaves it.  A profiled instance
+ * (avmlib_prof.h) is always interpreted, as is every instance while
+ * tracing with AVMLIB_TRACE_INTERPRET (avmlib_trace.h).
+ *
+ * @param vm The instance
+ * @param max_instructions Budget, or AVMLIB_VM_UNLIMITED.  It's checked
+ * at taken branches only, so the run can go over by one straight-line
+ * stretch of code.  While statistics are kept the run also stops
+ * briefly every AVMLIB_VM_STATS_EVERY instructions to add what it has
+ * retired, so an unlimited run shows up as it goes.
+ *
+ * @returns The instance's status.
+ * */
+avmlib_vm_status_t
+avmlib_vm_run(
+    avmlib_vm_t *vm,
+    uint64_t max_instructions
+)
+{
+    class_segment_t *declined = NULL;
+    avmlib_vm_native_fn native;
+    uint64_t start = vm->retired, budget;
+    int rc;
+
+    /* Step 1: Resume */
+    avmlib_stats_add(runs,1);
+    if ((AVMLIB_VM_BLOCKED == vm->status) && !avmlib_vm_unblock(vm)) return vm->status;
+    if (AVMLIB_VM_YIELDED == vm->status) vm->status = AVMLIB_VM_READY;
+    if (AVMLIB_VM_READY != vm->status) return vm->status;
+    budget = (AVMLIB_VM_UNLIMITED == max_instructions) ? UINT64_MAX : vm->retired + max_instructions;
+    vm->limit = avmlib_vm_next_limit(vm,budget);
+
+    for (;;) {
+        /* Step 2: Native code, if the segment has it */
+        if (!AVMLIB_VM_PROFILING(vm) &&
+            (NULL != (native = (avmlib_vm_native_fn)__atomic_load_n(&vm->proc.segment->native,
+                                                                    __ATOMIC_ACQUIRE))) &&
+            (vm->proc.segment != declined) && !avmlib_trace_all) {
+            if (avmlib_trace_on) {
+                avmlib_trace_record(vm,AVMLIB_TRACE_NATIVE_IN,0,(uint32_t)vm->retired,(uint32_t)(vm->retired >> 32));
+            }
+            rc = native(vm,&avmlib_vm_native_api);
+            if (avmlib_trace_on) {
+                avmlib_trace_record(vm,AVMLIB_TRACE_NATIVE_OUT,0,(uint32_t)vm->retired,(uint32_t)(vm->retired >> 32));
+            }
+            if (AVMLIB_VM_NATIVE_DECLINE == rc) {
+                declined = vm->proc.segment;
+                continue;
+            }
+            if (AVMLIB_VM_READY == vm->status) continue; /* Left the segment */
+            if ((AVMLIB_VM_YIELDED == vm->status) && !avmlib_vm_checkpoint(vm,budget,&start)) {
+                vm->status = AVMLIB_VM_READY;
+                continue;
+            }
+            if ((AVMLIB_VM_HALTED != vm->status) && (AVMLIB_VM_ERROR != vm->status)) goto _avmlib_vm_run_out;
+            break;
+        }
+
+        /* Step 3: Interpret */
+#ifdef AVM_PROFILE
+        rc = vm->prof ? avmlib_vm_step_profiled(vm) : avmlib_vm_step(vm);
+#else
+        rc = avmlib_vm_step(vm);
+#endif
+        if (0 > rc) {
+            if ((AVMLIB_VM_HALTED != vm->status) && (AVMLIB_VM_ERROR != vm->status)) goto _avmlib_vm_run_out;
+            break;
+        }
+
+        /* Step 4: Heat and budget, at taken branches only */
+        if (!rc) continue;
+        if (vm->proc.segment != vm->hot) {
+            vm->hot = vm->proc.segment;
+            vm->heat = 0;
+        } else if (AVMLIB_JIT_HOT == ++vm->heat) {
+            avmlib_jit_compile(vm->proc.segment);
+        }
+        if ((vm->retired >= vm->limit) && avmlib_vm_checkpoint(vm,budget,&start)) {
+            vm->status = AVMLIB_VM_YIELDED;
+            goto _avmlib_vm_run_out;
+        }
+    }
+
+    /* Step 5: Output held by a full port keeps us from halting till it drains */
+    vm->proc.state = PROC_STATE_HALTED;
+    rc = avmlib_vm_flush(vm);
+    if ((AVMLIB_VM_HALTED == vm->status) && (AVMLIB_IO_WOULDBLOCK == rc)) {
+        vm->status = AVMLIB_VM_BLOCKED;
+        vm->proc.state = PROC_STATE_WAITING;
+    } else if (0 > rc) {
+        vm->status = AVMLIB_VM_ERROR;
+    }
+
+_avmlib_vm_run_out:
+    avmlib_stats_add(retired,vm->retired - start);
+    return vm->status;
+}
+
+/**************************************************************************//**
+ * @brief What a blocked instance is waiting for.
+ *
+ * @param vm The instance
+ * @param for_write Set nonzero if it's waiting to write, zero to read
+ *
+ * @returns Descriptor to poll, or -1 if the instance isn't blocked (or
+ * its port has no descriptor).
+ * */
+int
+avmlib_vm_wait_fd(
+    avmlib_vm_t *vm,
+    int *for_write
+)
+{
+    if ((AVMLIB_VM_BLOCKED != vm->status) || !vm->proc.wait_port) return -1;
+    if (for_write) *for_write = vm->wait_write;
+    return vm->proc.wait_port->fd;
+}
+
+/**************************************************************************//**
+ * @brief Release an instance.
+ *
+ * @details The template is untouched.
+ * */
+void
+avmlib_vm_free(
+    avmlib_vm_t *vm
+)
+{
+    if (!vm) return;
+    if (vm->counted) avmlib_stats_add(frees,1);
+    avmlib_segment_leave(&vm->proc);
+    if (vm->avm) avmlib_vm_flush(vm);
+    if (vm->thr) avmlib_epoch_unregister(vm->thr);
+    avmlib_txn_free(&vm->txn);
+    free(vm->io_buf);
+    avmlib_machine_clone_free(vm->avm);
+    free(vm);
+}
+
+#endif /* _AVMLIB_VM_C_ */
@@ -0,0 +1,148 @@
+/**************************************************************************//**
+ * @file avmlib_vm.h
+ *
+ * @brief Embedding API: program instances and the executor.
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * A host loads a program once into a template machine
+ * (avmlib_vm_program()), then makes as many instances of it as it
+ * likes with avmlib_vm_new().  Each instance is a clone of the template
+ * (avmlib_machine_clone()) plus its own execution state, so instances
+ * share code and read-only data, never see each other's writes, and
+ * can run on different threads at once with no locking.  One instance
+ * is run by one thread at a time.
+ *
+ * The template must be fully loaded before the first instance is made,
+ * and left alone while instances exist.
+ *
+ * avmlib_vm_run() takes an instruction budget, so a host can interleave
+ * instances with its own work.  A run returns, resumable, when the
+ * budget is spent (YIELDED) or a non-blocking port can't make progress
+ * (BLOCKED; poll avmlib_vm_wait_fd(), or park vm->proc on an event
+ * loop (avmlib_evloop.h), before running it again), and for
+ * good when the program halts or fails.  The budget is only checked at
+ * taken branches, so straight-line code never pays for it and a run
+ * may overshoot by the length of one branch-free stretch of code.
+ *
+ * IN and OUT on a port attached to a file I/O backend (avmlib_fileio.h;
+ * FILE attaches the ports it opens to vm->fileio) queue a request and
+ * block; the instance stays BLOCKED until avmlib_fileio_poll() has
+ * completed it.  Don't reset or free an instance with a request out.
+ * */
+#ifndef _AVMLIB_VM_H_
+#define _AVMLIB_VM_H_
+
+#include <stddef.h>
+#include "avmm_data.h"
+#include "avmlib_epoch.h"
+#include "avmlib_txn.h"
+
+/**
+ * Most operands an instruction can carry
+ */
+#define AVMLIB_VM_ARGS 16
+
+/**
+ * Label an instance starts at, if its entry segment has one
+ */
+#define AVMLIB_VM_ENTRY_LABEL "main"
+
+/**
+ * Instance status
+ */
+typedef enum avmlib_vm_status_e {
+    AVMLIB_VM_READY = 0, /* Can run (not started, or stopped between instructions) */
+    AVMLIB_VM_HALTED = 1, /* Ran off the end of its code */
+    AVMLIB_VM_ERROR = 2, /* Stopped on a bad instruction or failed operation */
+    AVMLIB_VM_YIELDED = 3, /* Used up its instruction budget; run it again to resume */
+    AVMLIB_VM_BLOCKED = 4, /* Waiting on a port (avmlib_vm_wait_fd()); run it again to resume */
+} avmlib_vm_status_t;
+
+/**
+ * No instruction budget
+ */
+#define AVMLIB_VM_UNLIMITED ((uint64_t)0)
+
+/**
+ * A program instance
+ */
+typedef struct {
+    avm_t *avm; /* Our clone of the template */
+    class_process_t proc; /* Execution state; proc.segment is the segment running */
+    avmlib_epoch_thread_t *thr; /* Our record in the machine's epoch domain */
+    avmlib_txn_t txn; /* Register transaction */
+    uint16_t entry_seg; /* Where a reset starts */
+    uint32_t entry_pc;
+    uint32_t pc; /* Next code word in proc.segment */
+    avmlib_vm_status_t status;
+    uint64_t retired; /* Instructions executed since the last reset */
+    uint64_t limit; /* Stop at a taken branch once retired reaches this (the budget, or a statistics checkpoint) */
+    int wait_write; /* BLOCKED on output draining (else on input) */
+    int again; /* The instruction that BLOCKED runs again once unblocked (else pc is past it) */
+    uint64_t out_done; /* Bytes of the OUT at pc already written; it runs again for the rest */
+    class_segment_t *hot; /* Segment the last taken branch was in */
+    uint32_t heat; /* Taken branches in it since (see AVMLIB_JIT_HOT) */
+    struct avmlib_prof_s *prof; /* Profile being collected (AVM_PROFILE builds; see avmlib_prof.h) */
+    uint32_t counted; /* Counted in the statistics block as made (avmlib_stats.h) */
+    void *host; /* Host's own pointer (avmlib_pool.c keeps the job here); untouched by reset */
+    void *fileio; /* Backend FILE attaches ports to (avmlib_fileio_t), or NULL */
+    int io_wait; /* A backend request is out; BLOCKED until proc.state is RUNNABLE again */
+    void *io_buf; /* Backend read so far, for the retried IN */
+    uint64_t in_done; /* Bytes of the IN at pc in io_buf; it runs again for the rest */
+    uint32_t io_len; /* Bytes the outstanding backend write should take (one OUT piece) */
+} avmlib_vm_t;
+
+/**
+ * The instance a process belongs to, e.g. one taken off an event
+ * loop's run queue (avmlib_evloop_next())
+ */
+#define AVMLIB_VM_OF(__proc) \
+    ((avmlib_vm_t *)((char *)(__proc) - offsetof(avmlib_vm_t,proc)))
+
+/**
+ * Returned by native code that can't run the instance as it stands
+ * (a register with a getter, an open transaction...); the interpreter
+ * runs the segment instead
+ */
+#define AVMLIB_VM_NATIVE_DECLINE (-1)
+
+/**
+ * Version of the native code interface below and of the avmlib_vm_t
+ * fields native code touches (pc, status, retired, limit, proc.segment,
+ * avm, txn)
+ */
+#define AVMLIB_VM_NATIVE_ABI 1
+
+/**
+ * What native code calls back into.  It's passed in rather than linked
+ * against, so a compiled segment needs nothing exported by the host.
+ */
+typedef struct {
+    uint32_t abi; /* AVMLIB_VM_NATIVE_ABI */
+    int (*step)(avmlib_vm_t *vm); /* avmlib_vm_step() */
+    void *(*own)(avm_t *avm, int class, uint32_t index); /* avmlib_machine_own() */
+    avm_store_t *(*local_store)(avm_t *avm, class_segment_t *seg); /* avmlib_machine_local_store() */
+    int (*store_own)(avm_store_t *store); /* avmlib_store_own() */
+} avmlib_vm_native_api_t;
+
+/**
+ * Native code for a segment (class_segment_t.native).  Runs the
+ * instance from vm->pc until it stops, leaves the segment (returning
+ * with vm->status AVMLIB_VM_READY) or spends its budget, exactly as
+ * the interpreter would, and returns vm->status; or returns
+ * AVMLIB_VM_NATIVE_DECLINE having changed nothing.
+ */
+typedef int (*avmlib_vm_native_fn)(avmlib_vm_t *vm, const avmlib_vm_native_api_t *api);
+
+/* Prototypes */
+int avmlib_vm_program(avm_t *tmpl, const char *path);
+avmlib_vm_t *avmlib_vm_new(avm_t *tmpl);
+avmlib_vm_status_t avmlib_vm_run(avmlib_vm_t *vm, uint64_t max_instructions);
+int avmlib_vm_step(avmlib_vm_t *vm);
+int avmlib_vm_wait_fd(avmlib_vm_t *vm, int *for_write);
+int avmlib_vm_reset(avmlib_vm_t *vm);
+void avmlib_vm_free(avmlib_vm_t *vm);
+
+#endif /* _AVMLIB_VM_H_ */
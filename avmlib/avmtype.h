@@ -9,6 +9,32 @@
 #ifndef _AVMTYPE_H_
 #define _AVMTYPE_H_
 
+/*
+ * Buffers are heap memory or a private mapping of a file
+ * (avmtype_buffer_map()).  FILE always maps BUFFER_MAP_COW, where the
+ * mapping is exactly the file (size == capacity), so OUT past its end
+ * moves the contents to the heap (see avmtype_buffer_write()).
+ * BUFFER_MAP_READONLY, which refuses writes with EROFS, is only
+ * reachable through this API, not from AVM code.
+ */
+
+/**
+ * Readahead window requested ahead of a mapped buffer's cursor
+ */
+#define AVMTYPE_BUFFER_READAHEAD (4 * 1024 * 1024)
+
 class_string_t *avmtype_string_new(char *name, char *value);
+void avmtype_string_destroy(table_t *this, entry_t entry);
+
+int64_t avmtype_string_serialize(table_t *tbl, entry_t entry, void *binbuf, int64_t binsize);
+
+class_buffer_t *avmtype_buffer_new(char *name, uint64_t capacity);
+void avmtype_buffer_release(class_buffer_t *buffer);
+void avmtype_buffer_destroy(table_t *this, entry_t entry);
+int avmtype_buffer_map(class_buffer_t *buffer, const char *path, buffer_map_t mode);
+uint64_t avmtype_buffer_view(class_buffer_t *buffer, uint64_t len, const void **data);
+uint64_t avmtype_buffer_read(class_buffer_t *buffer, void *dst, uint64_t len);
+int64_t avmtype_buffer_write(class_buffer_t *buffer, const void *data, uint64_t len);
+int64_t avmtype_buffer_serialize(table_t *tbl, entry_t entry, void *binbuf, int64_t binsize);
 
 #endif /* _AVMTYPE_H_ */
@@ -0,0 +1,322 @@
+/**************************************************************************//**
+ * @file avmtype_buffer.c
+ *
+ * @brief Handle buffer-related operations
+ *
+ * @details
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ *
+ * A buffer is either heap memory or a mapping of a file (the FILE
+ * instruction).  Mapped buffers are never read() into memory; IN
+ * consumes straight from the page cache, and readahead is requested a
+ * window at a time as the cursor advances.
+ * */
+#ifndef _AVMTYPE_BUFFER_C_
+#define _AVMTYPE_BUFFER_C_
+
+#include "avmlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**************************************************************************//**
+ * @brief Create a buffer object
+ *
+ * @param name Symbolic name (may be NULL)
+ * @param capacity Bytes of heap storage to allocate (may be 0)
+ *
+ * @returns New buffer object on success, NULL on failure.
+ * */
+class_buffer_t *
+avmtype_buffer_new(
+    char *name,
+    uint64_t capacity
+)
+{
+    class_buffer_t *obj = calloc(1,sizeof(*obj));
+
+    if (NULL == obj) return NULL;
+    if (capacity && ((capacity > SIZE_MAX) ||
+                     (NULL == (obj->buf = calloc(1,(size_t)capacity))))) {
+        free(obj);
+        return NULL;
+    }
+
+    avmm_entity_name_set(obj,name);
+    obj->capacity = capacity;
+    obj->map = BUFFER_MAP_NONE;
+    return obj;
+}
+
+/**************************************************************************//**
+ * @brief Release a buffer's storage, leaving it empty.
+ * */
+void
+avmtype_buffer_release(
+    class_buffer_t *buffer
+)
+{
+    if (buffer->buf) {
+        if (BUFFER_MAP_NONE == buffer->map) {
+            free(buffer->buf);
+        } else if (BUFFER_MAP_IMAGE != buffer->map) {
+            munmap(buffer->buf,buffer->capacity);
+        }
+    }
+    buffer->buf = NULL;
+    buffer->capacity = buffer->size = buffer->cursor = 0;
+    buffer->advised = 0;
+    buffer->map = BUFFER_MAP_NONE;
+}
+
+/**************************************************************************//**
+ * @brief Table handler for destroying a buffer.
+ * */
+void
+avmtype_buffer_destroy(
+    table_t *this,
+    entry_t entry
+)
+{
+    class_buffer_t *buffer = (class_buffer_t *)entry;
+
+    avmtype_buffer_release(buffer);
+    free(buffer);
+}
+
+/**************************************************************************//**
+ * @brief Map a file into a buffer (the FILE instruction).
+ *
+ * @details The whole file is mapped; pages are faulted in from the page
+ * cache as IN consumes them.  Whatever the buffer held before is
+ * released, and the cursor returns to the start.
+ *
+ * @param buffer The buffer to (re)fill
+ * @param path File to map
+ * @param mode BUFFER_MAP_READONLY or BUFFER_MAP_COW
+ *
+ * @returns 0 on success, -1 on failure (errno set; EFBIG if the file
+ * doesn't fit the address space).
+ * */
+int
+avmtype_buffer_map(
+    class_buffer_t *buffer,
+    const char *path,
+    buffer_map_t mode
+)
+{
+    struct stat st;
+    void *m = NULL;
+    int prot = PROT_READ;
+    int fd, err;
+
+    if ((BUFFER_MAP_READONLY != mode) && (BUFFER_MAP_COW != mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Step 1: Open and size */
+    if (0 > (fd = open(path,O_RDONLY|O_CLOEXEC))) {
+        avmlib_err("%s: Can't open \"%s\" (%s).\n",__func__,path,strerror(errno));
+        return -1;
+    }
+    if (0 > fstat(fd,&st)) goto _avmtype_buffer_map_fail;
+    if ((uint64_t)st.st_size > SIZE_MAX) {
+        errno = EFBIG;
+        goto _avmtype_buffer_map_fail;
+    }
+
+    /* Step 2: Map (an empty file maps to nothing) */
+    if (st.st_size) {
+        if (BUFFER_MAP_COW == mode) prot |= PROT_WRITE;
+        m = mmap(NULL,st.st_size,prot,MAP_PRIVATE,fd,0);
+        if (MAP_FAILED == m) goto _avmtype_buffer_map_fail;
+        madvise(m,st.st_size,MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    /* Step 3: Install */
+    avmtype_buffer_release(buffer);
+    buffer->buf = m;
+    buffer->capacity = buffer->size = (uint64_t)st.st_size;
+    buffer->cursor = 0;
+    buffer->advised = 0;
+    buffer->map = mode;
+    return 0;
+
+_avmtype_buffer_map_fail:
+    err = errno;
+    avmlib_err("%s: Can't map \"%s\" (%s).\n",__func__,path,strerror(err));
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+/**************************************************************************//**
+ * @brief Request readahead for the window ahead of the cursor.
+ *
+ * @remarks Only mapped buffers; issued at most once per window.
+ * */
+static void
+avmtype_buffer_advise(
+    class_buffer_t *buffer,
+    uint64_t upto
+)
+{
+    uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start;
+    uint64_t end;
+
+    if ((BUFFER_MAP_NONE == buffer->map) || (upto <= buffer->advised)) return;
+
+    end = upto + AVMTYPE_BUFFER_READAHEAD;
+    if ((end < upto) || (end > buffer->size)) end = buffer->size;
+    start = ((uintptr_t)buffer->buf + buffer->advised) & ~(pg - 1);
+    madvise((void *)start,((uintptr_t)buffer->buf + end) - start,MADV_WILLNEED);
+    buffer->advised = end;
+}
+
+/**************************************************************************//**
+ * @brief Consume bytes at the cursor without copying.
+ *
+ * @param buffer The buffer
+ * @param len Most bytes wanted
+ * @param data Set to the bytes at the cursor
+ *
+ * @returns Bytes available at *data (0 at end of buffer); the cursor
+ * moves past them.
+ * */
+uint64_t
+avmtype_buffer_view(
+    class_buffer_t *buffer,
+    uint64_t len,
+    const void **data
+)
+{
+    uint64_t avail = buffer->size - buffer->cursor;
+
+    if (len > avail) len = avail;
+    *data = (char *)buffer->buf + buffer->cursor;
+    avmtype_buffer_advise(buffer,buffer->cursor + len);
+    buffer->cursor += len;
+    return len;
+}
+
+/**************************************************************************//**
+ * @brief Consume bytes at the cursor into other storage (IN).
+ *
+ * @returns Bytes copied (0 at end of buffer).
+ * */
+uint64_t
+avmtype_buffer_read(
+    class_buffer_t *buffer,
+    void *dst,
+    uint64_t len
+)
+{
+    const void *src;
+
+    len = avmtype_buffer_view(buffer,len,&src);
+    if (len) memcpy(dst,src,len);
+    return len;
+}
+
+/**************************************************************************//**
+ * @brief Append bytes to a buffer (OUT).
+ *
+ * @details Heap buffers grow as needed.  A copy-on-write mapping (what
+ * FILE makes) is copied to the heap the first time it has to grow, so
+ * appending to a mapped file costs one copy of it; read-only ones
+ * refuse writes.
+ *
+ * @returns Bytes stored, or -1 on failure (errno set).
+ * */
+int64_t
+avmtype_buffer_write(
+    class_buffer_t *buffer,
+    const void *data,
+    uint64_t len
+)
+{
+    uint64_t need = buffer->size + len;
+    uint64_t cap;
+    void *nbuf;
+
+    if (BUFFER_MAP_READONLY == buffer->map) {
+        errno = EROFS;
+        return -1;
+    }
+    if ((need < buffer->size) || (need > SIZE_MAX) || (len > INT64_MAX)) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (need > buffer->capacity) {
+        for (cap = buffer->capacity ? buffer->capacity : 64; cap < need; cap <<= 1) {
+            if (cap & 0x8000000000000000ULL) {
+                cap = need;
+                break;
+            }
+        }
+        if (cap > SIZE_MAX) cap = need;
+        if (BUFFER_MAP_NONE != buffer->map) {
+            /* Image pages and file mappings can't be realloc'd (nor a
+             * private mapping extended past the file); move to the heap */
+            if (NULL == (nbuf = malloc((size_t)cap))) return -1;
+            if (buffer->size) memcpy(nbuf,buffer->buf,(size_t)buffer->size);
+            if ((BUFFER_MAP_COW == buffer->map) && buffer->buf) munmap(buffer->buf,buffer->capacity);
+            buffer->map = BUFFER_MAP_NONE;
+            buffer->advised = 0;
+        } else if (NULL == (nbuf = realloc(buffer->buf,(size_t)cap))) {
+            return -1;
+        }
+        avmlib_stats_add(allocs,1);
+        avmlib_stats_add(alloc_bytes,cap - buffer->capacity);
+        buffer->buf = nbuf;
+        buffer->capacity = cap;
+    }
+
+    memcpy((char *)buffer->buf + buffer->size,data,len);
+    buffer->size = need;
+    return (int64_t)len;
+}
+
+/**************************************************************************//**
+ * @brief serialize a buffer object into a buffer
+ *
+ * @details Layout is the NUL-terminated name, the 64-bit size (host
+ * order), then the contents.  The cursor and backing aren't kept; a
+ * deserialized buffer is always heap memory.
+ *
+ * @returns Number of bytes serialized into binbuf, or -1 on error.
+ * */
+int64_t
+avmtype_buffer_serialize(
+    table_t *tbl,
+    entry_t entry,
+    void *binbuf,
+    int64_t binsize
+)
+{
+    class_buffer_t *b = (class_buffer_t *)entry;
+    const char *n = avmm_entity_name(b);
+    char *p = binbuf;
+    uint64_t nlen = (n ? strlen(n) : 0) + 1;
+    uint64_t need = nlen + sizeof(uint64_t) + b->size;
+
+    if ((binsize < 0) || (need > (uint64_t)binsize) || (need > INT64_MAX)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    memcpy(p,n ? n : "",nlen);
+    p += nlen;
+    memcpy(p,&b->size,sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    if (b->size) memcpy(p,b->buf,b->size);
+    return (int64_t)need;
+}
+
+#endif /* _AVMTYPE_BUFFER_C_ */
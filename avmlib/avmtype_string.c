@@ -40,12 +40,27 @@ avmtype_string_new(
     }
 
     /* Save name */
-    if (name) strncpy(obj->header.symname, name, sizeof(obj->header.symname));
+    avmm_entity_name_set(obj,name);
     obj->text = val;
     obj->capacity = strlen(val);
     return obj;
 }
 
+/**************************************************************************//**
+ * @brief Table handler for destroying a string.
+ * */
+void
+avmtype_string_destroy(
+    table_t *this,
+    entry_t entry
+)
+{
+    class_string_t *s = (class_string_t *)entry;
+
+    free(s->text);
+    free(s);
+}
+
 /**************************************************************************//**
  * @brief serialize a string object into a buffer
  *
@@ -60,18 +75,18 @@ avmtype_string_new(
  *
  * @remarks This assumes NULL-terminated strings.
  * */
-int
+int64_t
 avmtype_string_serialize(
     table_t *tbl,
     entry_t entry,
     void *binbuf,
-    int binsize
+    int64_t binsize
 )
 {
     char *p = binbuf;
     class_string_t *s = (class_string_t *)entry;
-    int need = 2; 
-    char *n = avmm_entity_name(s);
+    int64_t need = 2; 
+    const char *n = avmm_entity_name(s);
 
     /* Step 1: Size needed? */
     if (n && *n) {
@@ -91,6 +106,7 @@ avmtype_string_serialize(
         strcpy(p,n);
         p+=strlen(n);
     }
+    p++; /* Keep the name's NUL */
     if (s->text && *(s->text)) {
         strcpy(p,s->text);
     }
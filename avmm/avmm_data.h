@@ -36,7 +36,7 @@ typedef enum {
     AVM_CLASS_LABEL = 0x07, /* A named code location (for jumps, gotos, etc.) */
     AVM_CLASS_PROCESS = 0x08, /* A thread ID */
     AVM_CLASS_NUMBER = 0x09, /* A numeric reference (basically an 'int' variable) */
-    AVM_CLASS_IMMEDIATE = 0x0A, /* Lower 16 bits are an immediate value. */
+    AVM_CLASS_IMMEDIATE = 0x0A, /* Lower 21 bits (or following words) are an immediate value. */
     AVM_CLASS_SEGMENT = 0x0B, /* A program segment */
     AVM_CLASS_UNRESOLVED = 0x0C, /* Unresolved marker */
     AVM_CLASS_MAX
@@ -84,6 +84,10 @@ typedef enum {
     AVM_OP_IN = 0x17,
     AVM_OP_OUT = 0x18,
 
+    AVM_OP_BEGIN = 0x19,
+    AVM_OP_COMMIT = 0x1A,
+    AVM_OP_FLUSH = 0x1B,
+
     /* Compiler or linker instructions */
     AVM_OP_DEF = 0xA0,
     AVM_OP_SIZE = 0xA1,
@@ -95,7 +99,7 @@ typedef enum {
  * Common struct for all entity stores
  */
 typedef struct {
-    char symname[64]; /* Name of this entity */
+    uint32_t name; /* Offset of our name in the name table; 0 if anonymous */
 } class_header_t;
 
     
@@ -142,8 +146,24 @@ typedef struct _class_register_s {
     uint32_t (*get)(struct _class_register_s *reg);
     /* If a register can be written, assign a setter */
     uint32_t (*set)(struct _class_register_s *reg, uint32_t value);
+    /* Optional batched getter; fills values[] for count registers */
+    int (*get_many)(struct _class_register_s **regs, uint32_t *values, int count);
+    /* Optional batched setter; applies values[] to count registers */
+    int (*set_many)(struct _class_register_s **regs, uint32_t *values, int count);
+    /* Value of a register with no getter/setter */
+    uint32_t value;
 } class_register_t;
 
+/**
+ * How a buffer's storage is backed
+ */
+typedef enum buffer_map_e {
+    BUFFER_MAP_NONE = 0, /* Heap memory (or nothing yet) */
+    BUFFER_MAP_READONLY = 1, /* File mapping; writes are refused (API only; FILE maps COW) */
+    BUFFER_MAP_COW = 2, /* Private file mapping; writes stay in memory; moved to the heap to grow */
+    BUFFER_MAP_IMAGE = 3, /* Inside a restored machine image; moved to the heap to grow */
+} buffer_map_t;
+
 /**
  * Storage for a buffer entity
  *
@@ -151,11 +171,25 @@ typedef struct _class_register_s {
 typedef struct {
     class_header_t header; /* Generic common header */
     void *buf; /* The actual buffer */
-    uint32_t capacity; /* Bytes available in buf */
-    uint32_t size; /* How many bytes actually stored */
-    uint32_t cursor; /* Position within buffer of cursor */
+    uint64_t capacity; /* Bytes available in buf */
+    uint64_t size; /* How many bytes actually stored */
+    uint64_t cursor; /* Position within buffer of cursor */
+    buffer_map_t map; /* Backing of buf */
+    uint64_t advised; /* Mapped buffers: readahead requested up to here */
 } class_buffer_t;
 
+/**
+ * Port output buffering policy
+ */
+typedef enum port_bufmode_e {
+    PORT_BUFMODE_NONE = 0, /* Every OUT goes straight to the port */
+    PORT_BUFMODE_LINE = 1, /* Hold output until a newline is written */
+    PORT_BUFMODE_FULL = 2, /* Hold output until the buffer fills */
+} port_bufmode_t;
+
+struct _class_process_s;
+struct _class_segment_s;
+
 /**
  * Storage for a port entity 
  *
@@ -173,6 +207,24 @@ typedef struct _class_port_s {
     int (*read)(struct _class_port_s *port, void *buffer, int size);
     /* If a port can be written, assign a setter */
     int (*write)(struct _class_port_s *port, void *buffer, int size);
+    /* Output buffering (fd ports only) */
+    port_bufmode_t bufmode; /* Buffering policy */
+    char *obuf; /* Pending output */
+    uint32_t obuf_size; /* Bytes available in obuf */
+    uint32_t obuf_len; /* Bytes pending in obuf */
+    /* Statistics */
+    uint64_t stat_bytes_in; /* Bytes read from the OS */
+    uint64_t stat_bytes_out; /* Bytes handed to the OS */
+    uint64_t stat_syscalls; /* read()/write()/writev() calls made */
+    uint32_t stat_index; /* Its index in the stats block + 1, or 0 (avmlib_stats.h) */
+    /* File ports */
+    int seekable; /* Nonzero if reads use rd_offset (regular files) */
+    uint64_t rd_offset; /* Next read position */
+    void *fileio; /* Batched file I/O backend, if attached */
+    /* Event loop bookkeeping (fd ports only) */
+    void *evloop; /* Event loop this port is registered with */
+    struct _class_process_s *rd_waiter; /* Process parked on input */
+    struct _class_process_s *wr_waiter; /* Process parked on output */
 } class_port_t;
 
 /**
@@ -181,7 +233,7 @@ typedef struct _class_port_s {
 typedef struct {
     class_header_t header; /* Generic common header */
     char *text;
-    uint32_t capacity;
+    uint64_t capacity;
 } class_string_t;
 
 /**
@@ -196,17 +248,31 @@ typedef struct {
  */
 typedef struct {
     class_header_t header; /* Generic common header */
-    uint8_t segment; /* Which segment this label references */
+    uint16_t segment; /* Which segment this label references */
     uint32_t offset; /* Instruction offset into reference segment's code */
 } class_label_t;
 
+/**
+ * Scheduling state of a process
+ */
+typedef enum process_state_e {
+    PROC_STATE_RUNNABLE = 0, /* Ready to execute */
+    PROC_STATE_WAITING = 1, /* Parked on port I/O */
+    PROC_STATE_HALTED = 2, /* Finished or killed */
+} process_state_t;
+
 /**
  * Storage for a process/thread/core entity
  */
-typedef struct {
+typedef struct _class_process_s {
     class_header_t header; /* Generic common header */
     table_t registers; /* Table of per-core registers */
     table_t stack;     /* Entity stack */
+    process_state_t state; /* Scheduling state */
+    struct _class_port_s *wait_port; /* Port we're parked on, if WAITING */
+    struct _class_process_s *next_ready; /* Run queue link */
+    int32_t io_result; /* Result of the last completed asynchronous I/O */
+    struct _class_segment_s *segment; /* Segment version executing (referenced) */
 } class_process_t;
 
 /**
@@ -218,13 +284,41 @@ typedef struct {
     int64_t value;
 } class_number_t;
 
+/**
+ * Non-instruction entity encoding
+ *
+ * Bits
+ * 24-31 - Entity class
+ * 23    - OP_FLAG_CONSTANT
+ * 22    - OP_FLAG_WIDE
+ * 21    - OP_FLAG_LOCAL
+ * 00-20 - Table index (compact form)
+ *
+ * An index too big for the compact form is carried whole in the next
+ * code word, and the entity itself has OP_FLAG_WIDE set.
+ */
+#define AVM_ENTITY_INDEX_MASK ((uint32_t)0x001FFFFF)
+
 /**
  * Supported entity flags
  *
  * These should all be 32-bit values suitable for ORing into
  * an exiting entity.
  */
-#define OP_FLAG_CONSTANT ((uint32_t)0x00C00000)
+#define OP_FLAG_CONSTANT ((uint32_t)0x00800000) /* Read-only */
+#define OP_FLAG_WIDE ((uint32_t)0x00400000) /* Index is in the next code word */
+#define OP_FLAG_LOCAL ((uint32_t)0x00200000) /* In the segment's table, not the machine's */
+
+/**
+ * Immediate encoding
+ *
+ * Compact: bit 20 is the sign and bits 00-19 the magnitude.
+ * Wide (OP_FLAG_WIDE): the literal follows in the code stream, as one
+ * sign-extended 32-bit word, or as two words (high, low) if
+ * AVM_IMMEDIATE_WIDE64 is also set.
+ */
+#define AVM_IMMEDIATE_MAX ((int64_t)0xFFFFF)
+#define AVM_IMMEDIATE_WIDE64 ((uint32_t)0x00000001)
 
 /**
  * Storage for an unresolved reference.
@@ -234,35 +328,112 @@ typedef struct {
 } class_unresolved_t;
 
 /**
- * Storage for a virtual machine
+ * Runtime entity store
+ *
+ * The hot fields of value-like classes, in contiguous arrays indexed by
+ * entity index, so an operand fetch is one indexed load instead of a
+ * walk through the table of tables to a separately allocated object.
+ * Built from the tables by avmlib_store_build(); see avmlib_store.h.
  */
 typedef struct {
+    uint32_t number_count;
+    int64_t *number_values; /* NUMBER values */
+    uint32_t *number_width; /* NUMBER bit widths */
+    uint32_t label_count;
+    uint32_t *label_offset; /* LABEL instruction offsets */
+    uint16_t *label_segment; /* LABEL segment IDs */
+    uint32_t mapped; /* Arrays live in a restored machine image */
+    uint32_t shared; /* AVMM_STORE_SHARED_*: arrays a clone borrows from its parent */
+} avm_store_t;
+
+/**
+ * Store arrays borrowed from a parent machine
+ */
+#define AVMM_STORE_SHARED_VALUES 0x1 /* number_values; copied on first write */
+#define AVMM_STORE_SHARED_CONST 0x2 /* Widths and labels; never written */
+
+/**
+ * A clone's private copy of a segment's local store
+ */
+typedef struct {
+    const struct _class_segment_s *seg; /* Segment it was made for... */
+    uint32_t version; /* ...and its version, in case the address is reused */
+    avm_store_t store;
+    entry_t *objects[AVM_CLASS_MAX]; /* Copied local entities, by class and index */
+    uint32_t nobjects[AVM_CLASS_MAX]; /* Length of each objects[] array */
+} avm_local_store_t;
+
+/**
+ * Storage for a virtual machine
+ */
+typedef struct _avm_s {
     class_header_t header; /* Generic common header */
     table_t tables; /* Table of tables */
     entity_t entrypoint; /* Segment entrypoint */
+    avm_store_t store; /* Runtime store for global entities */
+    void *epoch; /* Reclamation domain for swapped-out segments */
+    /* Clones only (see avmlib_machine_clone()) */
+    struct _avm_s *parent; /* Machine we share with; NULL if not a clone */
+    uint32_t shared; /* Bit per class whose table is still the parent's */
+    uint32_t nlocals;
+    avm_local_store_t *locals; /* Private local stores, by segment ID */
 } avm_t;
 
 /**
  * Storage for a program segment
  */
-typedef struct {
+typedef struct _class_segment_s {
     class_header_t header; /* Generic common header */
     table_t tables; /* Table of tables */
-    uint8_t id; /* Segment number */
+    uint16_t id; /* Segment number */
     avm_t *avm; /* Machine we're building for */
+    char *image; /* Image to load on first touch (NULL if built in memory) */
+    uint32_t state; /* AVMM_SEGMENT_{COLD,LOADING,RESIDENT} */
+    uint32_t refs; /* Processes executing in this version, | AVMM_SEGMENT_RETIRED */
+    uint32_t version; /* Bumped each time the segment's slot is swapped */
+    avm_store_t store; /* Runtime store for local entities */
+    uint32_t mapped; /* Lives in a restored machine image; never freed */
+    void *native; /* Compiled code for this version (avmlib_vm_native_fn), or NULL */
+    void *native_handle; /* What the code came from, for native_release() */
+    void (*native_release)(void *handle);
+    uint32_t jit_tried; /* The JIT has had its go at this version */
 } class_segment_t;
 
 /**
  * @brief Segment ID of the machine itself (globals)
  */
-#define AVMM_SEGMENT_GLOBAL ((uint8_t)(0))
+#define AVMM_SEGMENT_GLOBAL ((uint16_t)(0))
 /**
  * @brief Segment ID of the local segment.
  */
-#define AVMM_SEGMENT_UNLINKED ((uint8_t)(0xFF))
+#define AVMM_SEGMENT_UNLINKED ((uint16_t)(0xFFFF))
+/**
+ * @brief Largest usable segment ID
+ */
+#define AVMM_SEGMENT_MAX ((uint16_t)(0xFFFE))
+
+/**
+ * Segment residency
+ */
+#define AVMM_SEGMENT_COLD 0 /* Registered; tables not built */
+#define AVMM_SEGMENT_LOADING 1 /* Being loaded by some thread */
+#define AVMM_SEGMENT_RESIDENT 2 /* Tables built and usable */
 
+/**
+ * Set in a segment's refs once it's been swapped out and no thread
+ * can still find it; the last process to leave frees it.
+ */
+#define AVMM_SEGMENT_RETIRED ((uint32_t)0x80000000)
+
+/**
+ * Entity names live in avmlib's interned name table (avmlib_names.h);
+ * the header only holds an offset into it.
+ */
 #define avmm_entity_name(__entity) \
-    ((class_header_t *)__entity)->symname
+    avmlib_name(((class_header_t *)__entity)->name)
+
+#define avmm_entity_name_set(__entity,__name) \
+    (((class_header_t *)__entity)->name = avmlib_name_intern(__name))
 
 #define AVMM_DEFAULT_ENTRYPOINT ((entry_t)(0))
 
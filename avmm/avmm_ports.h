@@ -21,17 +21,24 @@ void avmm_ports_init(avm_t *avm);
 /**
  * Definitions table
  *
+ * Names aren't stored in entities, so each definition carries the name
+ * to intern for it.
  */
+typedef struct {
+    const char *name; /* Interned into port at init */
+    class_port_t port;
+} avmm_port_def_t;
+
 #ifdef _AVMLIB_PORTS_C_ 
-class_port_t avm_global_ports[] = {
-    //{{"@stdin"},NULL,0,NULL,NULL,NULL,NULL},
-    //{{"@stdout"},NULL,1,NULL,NULL,NULL,NULL},
-    //{{"@stderr"},NULL,2,NULL,NULL,NULL,NULL},
+avmm_port_def_t avm_global_ports[] = {
+    //{"@stdin",{{0},NULL,0,NULL,NULL,NULL,NULL}},
+    //{"@stdout",{{0},NULL,1,NULL,NULL,NULL,NULL}},
+    //{"@stderr",{{0},NULL,2,NULL,NULL,NULL,NULL}},
         // stdin/stdout/stderr are handled directly in init() 
-    {{"\0"},NULL,-1,NULL,NULL,NULL,NULL},
+    {NULL,{{0},NULL,-1,NULL,NULL,NULL,NULL}},
 };
 #else
-extern class_port_t avm_global_ports[];
+extern avmm_port_def_t avm_global_ports[];
 #endif
 
 /**
@@ -42,9 +49,14 @@ extern class_port_t avm_global_ports[];
  * 2. either a nonnegative file descriptor or a non-NULL file pointer
  */
 #define AVM_PORT_VALID(__port) \
-    ((((class_port_t *)__port)->header.symname[0]) && \
+    ((((class_port_t *)__port)->header.name) && \
      ((((class_port_t *)__port)->fd >= 0) || \
       (((class_port_t *)__port)->file)))
+
+#define AVM_PORT_DEF_VALID(__def) \
+    ((((avmm_port_def_t *)__def)->name) && \
+     ((((avmm_port_def_t *)__def)->port.fd >= 0) || \
+      (((avmm_port_def_t *)__def)->port.file)))
           
 
 
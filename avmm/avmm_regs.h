@@ -24,24 +24,30 @@ uint32_t avmm_regs_default_set(class_register_t *reg, uint32_t value);
 /**
  * Definitions tables
  *
- * NULL handlers will resolve to default handlers.
+ * NULL handlers will resolve to default handlers.  Names aren't stored
+ * in entities, so each definition carries the name to intern for it.
  */
+typedef struct {
+    const char *name; /* Interned into reg at init */
+    class_register_t reg;
+} avmm_reg_def_t;
+
 #ifdef _AVMLIB_REGS_C_ 
-class_register_t avm_global_regs[] = {
-    { {"CLK"},REGMODE_READ,0,NULL,NULL,NULL},
-    { {"VER"},REGMODE_READ,0,NULL,NULL,NULL},
-    { {"GR0"},REGMODE_RW,0,NULL,NULL,NULL},
-    { {"GR1"},REGMODE_RW,0,NULL,NULL,NULL},
-    { {"GR2"},REGMODE_RW,0,NULL,NULL,NULL},
-    { {"GR3"},REGMODE_RW,0,NULL,NULL,NULL},
-    { {"GR4"},REGMODE_RW,0,NULL,NULL,NULL},
-    { {"GR5"},REGMODE_RW,0,NULL,NULL,NULL},
-    { {"GR6"},REGMODE_RW,0,NULL,NULL,NULL},
-    { {"GR7"},REGMODE_RW,0,NULL,NULL,NULL},
-    {{"\0"},REGMODE_INVALID}
+avmm_reg_def_t avm_global_regs[] = {
+    { "CLK",{ {0},REGMODE_READ,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "VER",{ {0},REGMODE_READ,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "GR0",{ {0},REGMODE_RW,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "GR1",{ {0},REGMODE_RW,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "GR2",{ {0},REGMODE_RW,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "GR3",{ {0},REGMODE_RW,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "GR4",{ {0},REGMODE_RW,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "GR5",{ {0},REGMODE_RW,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "GR6",{ {0},REGMODE_RW,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { "GR7",{ {0},REGMODE_RW,0,NULL,NULL,NULL,NULL,NULL,0} },
+    { NULL,{ {0},REGMODE_INVALID,0,NULL,NULL,NULL,NULL,NULL,0} }
 };
 #else
-extern class_register_t avm_global_regs[];
+extern avmm_reg_def_t avm_global_regs[];
 #endif
 
 /**
@@ -52,8 +58,12 @@ extern class_register_t avm_global_regs[];
  * 2. At least one setter or getter
  */
 #define AVM_REG_VALID(__reg) \
-    ((((class_register_t *)__reg)->header.symname[0]) && \
+    ((((class_register_t *)__reg)->header.name) && \
           (((class_register_t *)__reg)->mode != REGMODE_INVALID))
 
+#define AVM_REG_DEF_VALID(__def) \
+    ((((avmm_reg_def_t *)__def)->name) && \
+          (((avmm_reg_def_t *)__def)->reg.mode != REGMODE_INVALID))
+
 
 #endif /* _AVMM_REGS_H_ */
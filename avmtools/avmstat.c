@@ -0,0 +1,182 @@
+/**************************************************************************//**
+ * @file avmstat.c
+ *
+ * @brief Sample a running VM's statistics block.
+ *
+ * @details Maps the block a process keeps with avmlib_stats_open() (or
+ * AVM_STATS) read-only and prints it, summed over threads.  With an
+ * interval it keeps sampling and adds each counter's rate since the
+ * last sample.  The VM isn't stopped, signalled or otherwise touched.
+ *
+ *     avmstat [-i seconds] [-c count] name
+ *
+ * name is the shm name ("/avm-stats"), or /proc/<pid>/fd/<n> for a
+ * memfd.
+ *
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMSTAT_C_
+#define _AVMSTAT_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avmlib.h"
+
+/**
+ * Class names, for table sizes
+ */
+static const char *avmstat_classes[AVM_CLASS_MAX] = {
+    [AVM_CLASS_INSTRUCTION] = "INSTRUCTION", [AVM_CLASS_ERROR] = "ERROR",
+    [AVM_CLASS_GROUP] = "GROUP", [AVM_CLASS_REGISTER] = "REGISTER",
+    [AVM_CLASS_BUFFER] = "BUFFER", [AVM_CLASS_PORT] = "PORT",
+    [AVM_CLASS_STRING] = "STRING", [AVM_CLASS_LABEL] = "LABEL",
+    [AVM_CLASS_PROCESS] = "PROCESS", [AVM_CLASS_NUMBER] = "NUMBER",
+    [AVM_CLASS_IMMEDIATE] = "IMMEDIATE", [AVM_CLASS_SEGMENT] = "SEGMENT",
+    [AVM_CLASS_UNRESOLVED] = "UNRESOLVED",
+};
+
+/**
+ * One sample, summed over slots
+ */
+typedef struct {
+    double when; /* CLOCK_MONOTONIC, seconds */
+    uint32_t threads;
+    avmlib_stats_slot_t sum;
+} avmstat_sample_t;
+
+/**************************************************************************//**
+ * @brief Take a sample.
+ * */
+static void
+avmstat_sample(
+    const avmlib_stats_block_t *b,
+    avmstat_sample_t *s
+)
+{
+    const avmlib_stats_slot_t *slot;
+    struct timespec ts;
+    uint32_t i, p;
+
+    memset(s,0,sizeof(*s));
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    s->when = ts.tv_sec + ts.tv_nsec / 1e9;
+    for (i=0;i<b->nslots;i++) {
+        slot = &b->slot[i];
+        if (__atomic_load_n(&slot->tid,__ATOMIC_RELAXED)) s->threads++;
+        s->sum.retired += __atomic_load_n(&slot->retired,__ATOMIC_RELAXED);
+        s->sum.runs += __atomic_load_n(&slot->runs,__ATOMIC_RELAXED);
+        s->sum.instances += __atomic_load_n(&slot->instances,__ATOMIC_RELAXED);
+        s->sum.frees += __atomic_load_n(&slot->frees,__ATOMIC_RELAXED);
+        s->sum.allocs += __atomic_load_n(&slot->allocs,__ATOMIC_RELAXED);
+        s->sum.alloc_bytes += __atomic_load_n(&slot->alloc_bytes,__ATOMIC_RELAXED);
+        for (p=0;p<AVMLIB_STATS_PORTS;p++) {
+            s->sum.bytes_in[p] += __atomic_load_n(&slot->bytes_in[p],__ATOMIC_RELAXED);
+            s->sum.bytes_out[p] += __atomic_load_n(&slot->bytes_out[p],__ATOMIC_RELAXED);
+            s->sum.syscalls[p] += __atomic_load_n(&slot->syscalls[p],__ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**************************************************************************//**
+ * @brief Print a counter, with its rate if there's an earlier sample.
+ * */
+static void
+avmstat_counter(
+    const char *what,
+    uint64_t now,
+    uint64_t then,
+    double secs
+)
+{
+    printf("  %-22s %16" PRIu64,what,now);
+    if (secs > 0) printf("  %14.1f/s",(now - then) / secs);
+    printf("\n");
+}
+
+/**************************************************************************//**
+ * @brief Print a sample.
+ * */
+static void
+avmstat_print(
+    const avmlib_stats_block_t *b,
+    const avmstat_sample_t *s,
+    const avmstat_sample_t *last
+)
+{
+    double secs = last ? s->when - last->when : 0;
+    uint32_t nports = __atomic_load_n(&b->nports,__ATOMIC_ACQUIRE), c, p;
+
+    printf("pid %u, %u thread%s counting\n",b->pid,s->threads,(1 == s->threads) ? "" : "s");
+    avmstat_counter("instructions retired",s->sum.retired,last ? last->sum.retired : 0,secs);
+    avmstat_counter("runs",s->sum.runs,last ? last->sum.runs : 0,secs);
+    avmstat_counter("instances made",s->sum.instances,last ? last->sum.instances : 0,secs);
+    avmstat_counter("instances freed",s->sum.frees,last ? last->sum.frees : 0,secs);
+    avmstat_counter("allocations",s->sum.allocs,last ? last->sum.allocs : 0,secs);
+    avmstat_counter("allocated bytes",s->sum.alloc_bytes,last ? last->sum.alloc_bytes : 0,secs);
+    printf("  queues: ready %" PRId64 ", parked %" PRId64 ", pool pending %" PRId64 "\n",
+           __atomic_load_n(&b->ready,__ATOMIC_RELAXED),__atomic_load_n(&b->parked,__ATOMIC_RELAXED),
+           __atomic_load_n(&b->pending,__ATOMIC_RELAXED));
+    printf("  tables:");
+    for (c=0;(c<b->nclasses) && (c<AVM_CLASS_MAX);c++) {
+        if (b->tables[c]) printf(" %s %" PRIu64,avmstat_classes[c] ? avmstat_classes[c] : "?",b->tables[c]);
+    }
+    printf("\n");
+    if (nports) printf("  %-24s %14s %14s %12s\n","port","bytes in","bytes out","syscalls");
+    for (p=0;(p<nports) && (p<AVMLIB_STATS_PORTS);p++) {
+        printf("  %-24.24s %14" PRIu64 " %14" PRIu64 " %12" PRIu64 "\n",b->port[p],
+               s->sum.bytes_in[p],s->sum.bytes_out[p],s->sum.syscalls[p]);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    avmstat_sample_t sample[2];
+    avmlib_stats_t *stats;
+    double interval = 0;
+    long count = -1, n;
+    int c;
+
+    while (-1 != (c = getopt(argc,argv,"i:c:"))) {
+        switch (c) {
+            case 'i':
+                interval = strtod(optarg,NULL);
+                break;
+            case 'c':
+                count = strtol(optarg,NULL,0);
+                break;
+            default:
+                fprintf(stderr,"Usage: %s [-i seconds] [-c count] name\n",argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr,"Usage: %s [-i seconds] [-c count] name\n",argv[0]);
+        return 2;
+    }
+    if (NULL == (stats = avmlib_stats_attach(argv[optind]))) return 1;
+    if (interval <= 0) count = 1;
+
+    for (n=0;(count < 0) || (n < count);n++) {
+        if (n) usleep((useconds_t)(interval * 1e6));
+        avmstat_sample(stats->block,&sample[n & 1]);
+        avmstat_print(stats->block,&sample[n & 1],n ? &sample[(n - 1) & 1] : NULL);
+        fflush(stdout);
+    }
+    avmlib_stats_close(stats);
+    return 0;
+}
+
+#endif /* _AVMSTAT_C_ */
@@ -0,0 +1,294 @@
+/**************************************************************************//**
+ * @file avmtrace.c
+ *
+ * @brief Decode an execution trace dump.
+ *
+ * @details Reads a file written by avmlib_trace_dump() (or by the
+ * trace's signal and crash handlers) and prints its records oldest
+ * first, merging the threads' rings by their ticks, and placing each
+ * record by segment and label from the symbols the dump carries.
+ *
+ *     avmtrace [-n count] dump
+ *
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _AVMTRACE_C_
+#define _AVMTRACE_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "avmlib.h"
+
+/**
+ * A segment from the dump's symbols
+ */
+typedef struct {
+    const avmlib_trace_sym_t *sym; /* The segment; its labels follow */
+} avmtrace_seg_t;
+
+/**
+ * Class names, for operands
+ */
+static const char *avmtrace_classes[AVM_CLASS_MAX] = {
+    [AVM_CLASS_INSTRUCTION] = "INSTRUCTION", [AVM_CLASS_ERROR] = "ERROR",
+    [AVM_CLASS_GROUP] = "GROUP", [AVM_CLASS_REGISTER] = "REGISTER",
+    [AVM_CLASS_BUFFER] = "BUFFER", [AVM_CLASS_PORT] = "PORT",
+    [AVM_CLASS_STRING] = "STRING", [AVM_CLASS_LABEL] = "LABEL",
+    [AVM_CLASS_PROCESS] = "PROCESS", [AVM_CLASS_NUMBER] = "NUMBER",
+    [AVM_CLASS_IMMEDIATE] = "IMMEDIATE", [AVM_CLASS_SEGMENT] = "SEGMENT",
+    [AVM_CLASS_UNRESOLVED] = "UNRESOLVED",
+};
+
+/**
+ * A record to print, and the ring, thread and sequence number it had
+ */
+typedef struct {
+    const avmlib_trace_rec_t *rec;
+    uint64_t seq;
+    uint32_t ring; /* Its ring's place in the dump */
+    uint32_t tid;
+} avmtrace_ent_t;
+
+static avmtrace_seg_t *avmtrace_segs;
+static uint32_t avmtrace_nsegs;
+
+/**************************************************************************//**
+ * @brief Order records by ticks, then by ring and sequence.
+ * */
+static int
+avmtrace_older(
+    const void *a,
+    const void *b
+)
+{
+    const avmtrace_ent_t *x = a, *y = b;
+
+    if (x->rec->ticks != y->rec->ticks) return (x->rec->ticks < y->rec->ticks) ? -1 : 1;
+    if (x->ring != y->ring) return (x->ring < y->ring) ? -1 : 1;
+    return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+/**************************************************************************//**
+ * @brief A segment's symbols (the last registered for its ID).
+ * */
+static const avmlib_trace_sym_t *
+avmtrace_seg(
+    uint32_t id
+)
+{
+    uint32_t i;
+
+    for (i=avmtrace_nsegs;i--;) {
+        if (avmtrace_segs[i].sym->id == id) return avmtrace_segs[i].sym;
+    }
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Print where a code word is: segment:label+offset.
+ * */
+static void
+avmtrace_where(
+    uint32_t id,
+    uint32_t pc
+)
+{
+    const avmlib_trace_sym_t *seg = avmtrace_seg(id), *best = NULL;
+    char where[2 * AVMLIB_NAME_MAX + 32];
+    uint32_t i;
+
+    if (!seg) {
+        snprintf(where,sizeof(where),"#%u+%u",id,pc);
+    } else {
+        for (i=1;i<=seg->count;i++) {
+            if ((UINT32_MAX != seg[i].id) && (seg[i].id <= pc) && (!best || (seg[i].id > best->id))) {
+                best = &seg[i];
+            }
+        }
+        if (!best) {
+            snprintf(where,sizeof(where),"%s+%u",seg->name,pc);
+        } else if (best->id == pc) {
+            snprintf(where,sizeof(where),"%s:%s",seg->name,best->name);
+        } else {
+            snprintf(where,sizeof(where),"%s:%s+%u",seg->name,best->name,pc - best->id);
+        }
+    }
+    printf(" %-28s",where);
+}
+
+/**************************************************************************//**
+ * @brief Print one operand.
+ *
+ * @returns Code words it takes, as far as the record shows.
+ * */
+static int
+avmtrace_operand(
+    uint32_t id,
+    const entry_t *words,
+    uint32_t have
+)
+{
+    const avmlib_trace_sym_t *seg;
+    uint32_t e = (uint32_t)words[0], class = avmlib_entity_class(e), index;
+    int64_t imm;
+    int n = avmlib_operand_words(words);
+
+    if ((uint32_t)n > have) {
+        printf(" %08x...",e);
+        return n;
+    }
+    if (AVM_CLASS_IMMEDIATE == class) {
+        avmlib_immediate_decode(words,&imm);
+        printf(" #%" PRId64,imm);
+        return n;
+    }
+    avmlib_entity_decode(words,&index);
+    if ((AVM_CLASS_LABEL == class) && (e & OP_FLAG_LOCAL) && (NULL != (seg = avmtrace_seg(id))) &&
+        (index < seg->count) && seg[1 + index].name[0]) {
+        printf(" %s",seg[1 + index].name);
+        return n;
+    }
+    printf(" %s%s[%u]",(e & OP_FLAG_LOCAL) ? "local " : "",
+           ((class < AVM_CLASS_MAX) && avmtrace_classes[class]) ? avmtrace_classes[class] : "?",index);
+    return n;
+}
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    const avmlib_trace_header_t *hdr;
+    const avmlib_trace_part_t *part;
+    const avmlib_trace_rec_t *ring, *r;
+    const uint8_t *p, *end;
+    uint64_t count = UINT64_MAX, seq, first, last = 0, lost = 0, total = 0, nents = 0, i, k;
+    avmtrace_ent_t *ents;
+    entry_t words[2];
+    uint8_t *buf;
+    long size;
+    FILE *f;
+    int c, n;
+
+    while (-1 != (c = getopt(argc,argv,"n:"))) {
+        switch (c) {
+            case 'n':
+                count = strtoull(optarg,NULL,0);
+                break;
+            default:
+                fprintf(stderr,"Usage: %s [-n count] dump\n",argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr,"Usage: %s [-n count] dump\n",argv[0]);
+        return 2;
+    }
+
+    /* Step 1: The dump */
+    if ((NULL == (f = fopen(argv[optind],"rb"))) || fseek(f,0,SEEK_END) || (0 > (size = ftell(f))) ||
+        fseek(f,0,SEEK_SET) || (NULL == (buf = malloc((size_t)size + 1))) ||
+        (1 != fread(buf,(size_t)size,1,f))) {
+        fprintf(stderr,"%s: Can't read \"%s\".\n",argv[0],argv[optind]);
+        return 1;
+    }
+    fclose(f);
+    hdr = (const avmlib_trace_header_t *)buf;
+    if (((size_t)size < sizeof(*hdr)) || memcmp(hdr->magic,AVMLIB_TRACE_MAGIC,sizeof(hdr->magic)) ||
+        (AVMLIB_TRACE_VERSION != hdr->version) || (sizeof(avmlib_trace_rec_t) != hdr->rec_size) ||
+        (!hdr->records || (hdr->records & (hdr->records - 1)) || (hdr->records > ((uint64_t)1 << 32))) ||
+        (hdr->rings > (uint64_t)size / (sizeof(*part) + hdr->records * hdr->rec_size)) ||
+        ((uint64_t)size != sizeof(*hdr) + hdr->rings * (sizeof(*part) + hdr->records * hdr->rec_size) +
+                           hdr->sym_size)) {
+        fprintf(stderr,"%s: \"%s\" isn't a trace dump this build can read.\n",argv[0],argv[optind]);
+        return 1;
+    }
+
+    /* Step 2: Its symbols */
+    p = buf + sizeof(*hdr) + hdr->rings * (sizeof(*part) + hdr->records * hdr->rec_size);
+    end = p + hdr->sym_size;
+    while (p + sizeof(avmlib_trace_sym_t) <= end) {
+        const avmlib_trace_sym_t *sym = (const avmlib_trace_sym_t *)p;
+
+        if (p + sizeof(*sym) * (1 + (uint64_t)sym->count) > end) break;
+        if (NULL == (avmtrace_segs = realloc(avmtrace_segs,sizeof(*avmtrace_segs) * (avmtrace_nsegs + 1)))) {
+            fprintf(stderr,"%s: Alloc failure.\n",argv[0]);
+            return 1;
+        }
+        avmtrace_segs[avmtrace_nsegs++].sym = sym;
+        p += sizeof(*sym) * (1 + sym->count);
+    }
+
+    /* Step 3: Every ring's complete records, merged oldest first */
+    if (NULL == (ents = malloc(sizeof(*ents) * (hdr->rings * hdr->records + 1)))) {
+        fprintf(stderr,"%s: Alloc failure.\n",argv[0]);
+        return 1;
+    }
+    p = buf + sizeof(*hdr);
+    for (k=0;k<hdr->rings;k++) {
+        part = (const avmlib_trace_part_t *)p;
+        ring = (const avmlib_trace_rec_t *)(part + 1);
+        total += part->head;
+        for (seq=(part->head > hdr->records) ? part->head - hdr->records : 0;seq<part->head;seq++) {
+            r = &ring[seq & (hdr->records - 1)];
+            if (r->seq != (uint32_t)seq) {
+                lost++;
+                continue;
+            }
+            ents[nents].rec = r;
+            ents[nents].seq = seq;
+            ents[nents].ring = (uint32_t)k;
+            ents[nents++].tid = part->tid;
+        }
+        p = (const uint8_t *)(ring + hdr->records);
+    }
+    qsort(ents,(size_t)nents,sizeof(*ents),avmtrace_older);
+    first = (nents > count) ? nents - count : 0;
+
+    /* Step 4: Print them */
+    printf("pid %u: %" PRIu64 " records from %" PRIu64 " threads, showing %" PRIu64 " (ticks are %s)\n",
+           hdr->pid,total,hdr->rings,nents - first,hdr->ns ? "ns" : "TSC cycles");
+    for (i=first;i<nents;i++) {
+        r = ents[i].rec;
+        printf("%7u %10" PRIu64 " %+12" PRId64 " vm %08x",ents[i].tid,ents[i].seq,
+               last ? (int64_t)(r->ticks - last) : 0,r->vm);
+        last = r->ticks;
+        avmtrace_where(r->seg,r->pc);
+        if ((AVMLIB_TRACE_NATIVE_IN == r->op) || (AVMLIB_TRACE_NATIVE_OUT == r->op)) {
+            printf(" (native %s; %" PRIu64 " retired)\n",(AVMLIB_TRACE_NATIVE_IN == r->op) ? "in" : "out",
+                   ((uint64_t)r->arg[1] << 32) | r->arg[0]);
+            continue;
+        }
+        if (avmlib_op_name(r->op)) {
+            printf(" %-6s",avmlib_op_name(r->op));
+        } else {
+            printf(" op%02x  ",r->op);
+        }
+        words[0] = r->arg[0];
+        words[1] = r->arg[1];
+        if (r->argc > 0) {
+            n = avmtrace_operand(r->seg,words,2);
+            if ((r->argc > 1) && (1 == n)) {
+                printf(",");
+                avmtrace_operand(r->seg,&words[1],1);
+            }
+            if (r->argc > 2) printf(", ...");
+        }
+        printf("\n");
+    }
+    if (lost) printf("(%" PRIu64 " records overwritten or unfinished at the dump)\n",lost);
+    free(ents);
+    free(avmtrace_segs);
+    free(buf);
+    return 0;
+}
+
+#endif /* _AVMTRACE_C_ */
@@ -0,0 +1,31 @@
+#!/bin/sh
+# gen_large.sh -- Write a large, straight-line AVM source to stdout.
+#
+# Usage: gen_large.sh [blocks]
+#
+# Each block is a labelled run of register arithmetic and string
+# building, ending in a conditional jump to the next block, so the
+# compiler sees every kind of line the other benchmarks use.
+
+blocks=${1:-2000}
+
+awk -v blocks="$blocks" 'BEGIN {
+    print "; large.avma -- Generated by gen_large.sh; do not edit."
+    print ""
+    print "\tDEF STRING, text"
+    print ""
+    print "\tLABEL main"
+    print "\tSTOR GR0, 1"
+    for (b = 0; b < blocks; b++) {
+        print ""
+        printf "\tLABEL block%d\n", b
+        printf "\tADD GR1,%d,GR1\n", b % 97 + 1
+        printf "\tSUB GR1,%d,GR2\n", b % 13
+        printf "\tADD GR2,GR1,GR3\n"
+        printf "\tSTOR text,\"block \",GR3,\" of %d\"\n", blocks
+        printf "\tJNZ GR0,block%d\n", b + 1
+    }
+    print ""
+    printf "\tLABEL block%d\n", blocks
+    print "\tOUT @stdout,text"
+}'
@@ -0,0 +1,80 @@
+/**************************************************************************//**
+ * @file bench.h
+ *
+ * @brief Scaffolding shared by the benchmarks.
+ *
+ * @details Timing, and the counting loop the VM benchmarks run
+ * (bench_program()).
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "avmlib.h"
+
+/* Machine registers the counting loop uses */
+#define BENCH_GR1 3
+#define BENCH_GR2 4
+
+/**************************************************************************//**
+ * @brief Nanoseconds between two timestamps.
+ * */
+static inline double
+bench_ns(
+    struct timespec *t0,
+    struct timespec *t1
+)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/**************************************************************************//**
+ * @brief Write the program: GR2 = sum of GR1..1, counting GR1 down.
+ *
+ * @param path Where to save the segment
+ * @param name Segment name
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static inline int
+bench_program(
+    const char *path,
+    const char *name
+)
+{
+    class_segment_t seg;
+    table_t *code;
+    entity_t gr1 = avmlib_entity_new(AVM_CLASS_REGISTER,BENCH_GR1);
+    entity_t gr2 = avmlib_entity_new(AVM_CLASS_REGISTER,BENCH_GR2);
+    int i;
+
+    memset(&seg,0,sizeof(seg));
+    seg.id = AVMM_SEGMENT_UNLINKED;
+    seg.state = AVMM_SEGMENT_RESIDENT;
+    avmlib_table_init(&seg.tables,AVM_CLASS_MAX);
+    for (i=0;i<AVM_CLASS_MAX;i++) avmlib_table_add(&seg.tables,avmlib_table_new(16));
+    avmm_entity_name_set(&seg,name);
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+
+    /* loop: ADD GR2,GR1,GR2 / DEC GR1 / JNZ GR1,loop */
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_LABEL),
+                     avmlib_new_label("loop",AVMM_SEGMENT_UNLINKED,code->size));
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_UNRESOLVED),avmlib_unresolved_new("loop"));
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_ADD,0,3));
+    avmlib_entity_emit(code,gr2,0);
+    avmlib_entity_emit(code,gr1,0);
+    avmlib_entity_emit(code,gr2,0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_SUB,0,1));
+    avmlib_entity_emit(code,gr1,0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_JNZ,0,2));
+    avmlib_entity_emit(code,gr1,0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_UNRESOLVED,0),0);
+
+    return avmlib_segment_save(&seg,path,0);
+}
+
+#endif /* _BENCH_H_ */
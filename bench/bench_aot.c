@@ -0,0 +1,142 @@
+/**************************************************************************//**
+ * @file bench_aot.c
+ *
+ * @brief Interpreted, JIT-compiled and ahead-of-time compiled execution.
+ *
+ * @details Builds a counting loop and runs it interpreted (JIT off),
+ * then with the JIT on, then translated to C (avmlib_aot_translate()),
+ * built with the host compiler ($CC, else cc) and attached, reporting
+ * ns per instruction for each.  Run from the bench directory.  Exits
+ * nonzero if any run computes the wrong sum; skips the native run if
+ * the compiler can't be run.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_AOT_C_
+#define _BENCH_AOT_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define BENCH_LOOPS 10000000
+#define BENCH_RUNS 3
+
+/**************************************************************************//**
+ * @brief Best of BENCH_RUNS runs, in ns per instruction.
+ *
+ * @returns The time, or a negative number if a run went wrong.
+ * */
+static double
+bench_run(
+    avm_t *tmpl
+)
+{
+    struct timespec t0, t1;
+    avmlib_vm_t *vm;
+    class_register_t *gr1, *gr2;
+    double ns, best = -1;
+    int r;
+
+    if (NULL == (vm = avmlib_vm_new(tmpl))) return -1;
+    for (r=0;r<BENCH_RUNS;r++) {
+        if ((0 > avmlib_vm_reset(vm)) ||
+            (NULL == (gr1 = avmlib_machine_own(vm->avm,AVM_CLASS_REGISTER,BENCH_GR1)))) {
+            best = -1;
+            break;
+        }
+        gr1->value = BENCH_LOOPS;
+        clock_gettime(CLOCK_MONOTONIC,&t0);
+        if (AVMLIB_VM_HALTED != avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED)) {
+            best = -1;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC,&t1);
+        gr2 = (class_register_t *)AVM_CLASS_TABLE(vm->avm,AVM_CLASS_REGISTER)->entries[BENCH_GR2];
+        if (gr2->value != (uint32_t)((uint64_t)BENCH_LOOPS * (BENCH_LOOPS + 1) / 2)) {
+            best = -1;
+            break;
+        }
+        ns = bench_ns(&t0,&t1) / vm->retired;
+        if ((best < 0) || (ns < best)) best = ns;
+    }
+    avmlib_vm_free(vm);
+    return best;
+}
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char path[] = "/tmp/avm_bench_aotXXXXXX", csrc[64], so[64], cmd[512];
+    const char *cc = getenv("CC") ? getenv("CC") : "cc";
+    double interp, jit, native;
+    avm_t *tmpl[3];
+    int fd, id = -1, i;
+
+    /* Step 1: Program, and a template for each way of running it */
+    if (0 > (fd = mkstemp(path))) return 1;
+    close(fd);
+    if (0 > bench_program(path,"bench_aot")) {
+        unlink(path);
+        return 1;
+    }
+    for (i=0;i<3;i++) {
+        if ((NULL == (tmpl[i] = avmlib_machine_new())) || (0 > (id = avmlib_vm_program(tmpl[i],path)))) {
+            unlink(path);
+            return 1;
+        }
+    }
+    unlink(path);
+    printf("bench_aot: %d loops, best of %d\n",BENCH_LOOPS,BENCH_RUNS);
+
+    /* Step 2: Interpreted */
+    avmlib_jit_enable(0);
+    if (0 > (interp = bench_run(tmpl[0]))) {
+        printf("  interpreted: BAD RUN\n");
+        return 1;
+    }
+    printf("  interpreted: %7.3f ns/instruction\n",interp);
+
+    /* Step 3: JIT (it compiles the loop during the first run) */
+    avmlib_jit_enable(1);
+    if (0 > (jit = bench_run(tmpl[1]))) {
+        printf("  JIT: BAD RUN\n");
+        return 1;
+    }
+    printf("  JIT:         %7.3f ns/instruction  x%.1f%s\n",jit,interp / jit,
+           avmlib_segment_get(tmpl[1],(uint16_t)id)->native ? "" : " (not compiled)");
+    avmlib_jit_enable(0);
+
+    /* Step 4: Ahead of time */
+    snprintf(csrc,sizeof(csrc),"%s.c",path);
+    snprintf(so,sizeof(so),"%s.so",path);
+    snprintf(cmd,sizeof(cmd),"%s -O2 -fPIC -shared -I../avmm -I../avmlib -I../avmc -o %s %s 2>/dev/null",
+             cc,so,csrc);
+    if ((0 > avmlib_aot_translate(avmlib_segment_get(tmpl[2],(uint16_t)id),csrc)) || system(cmd)) {
+        printf("  native: can't build (%s)\n",cc);
+        unlink(csrc);
+        return 0;
+    }
+    unlink(csrc);
+    if (0 > avmlib_aot_load(tmpl[2],(uint16_t)id,so)) {
+        unlink(so);
+        return 1;
+    }
+    unlink(so);
+    if (0 > (native = bench_run(tmpl[2]))) {
+        printf("  native: BAD RUN\n");
+        return 1;
+    }
+    printf("  native:      %7.3f ns/instruction  x%.1f\n",native,interp / native);
+    return 0;
+}
+
+#endif /* _BENCH_AOT_C_ */
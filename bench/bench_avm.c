@@ -0,0 +1,486 @@
+/**************************************************************************//**
+ * @file bench_avm.c
+ *
+ * @brief Compile and run a directory of AVM programs, end to end.
+ *
+ * @details For each x.avma in the directory, runs the compiler on it
+ * (avmc -q -o x.avmo x.avma, best of the runs), then loads x.avmo and
+ * runs it to completion, reporting per program: compile time, source
+ * lines per second and the compiler's peak RSS; instructions, ns per
+ * instruction (best and median of the runs), the runner's peak RSS,
+ * and the port syscalls and bytes written per run, as counted by the
+ * statistics block (avmlib_stats.h).  Programs named fanout* are run as
+ * BENCH_FANOUT instances at once on a pool, one worker per CPU.
+ *
+ *     bench_avm [-n runs] [-c avmc] [-o out.json] dir
+ *
+ * Each program runs in a child of its own, with stdout on /dev/null, so
+ * peak RSS is its own and output costs only the syscalls.  If the
+ * compiler can't be run but x.avmo exists, that's run and the compile
+ * figures are left out (null in the JSON).  Exits nonzero if any
+ * program fails to compile or run.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_AVM_C_
+#define _BENCH_AVM_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define BENCH_RUNS 5
+#define BENCH_MAX_RUNS 64
+#define BENCH_FANOUT 2000
+#define BENCH_FANOUT_PREFIX "fanout"
+
+/**
+ * What a run child sends back
+ */
+typedef struct {
+    int ok;
+    uint32_t runs;
+    uint64_t instances; /* Per run */
+    uint64_t instructions; /* Per run */
+    uint64_t syscalls; /* Port syscalls, per run */
+    uint64_t bytes_out; /* Port bytes written, per run */
+    double ns[BENCH_MAX_RUNS]; /* Per instruction, each run */
+} bench_result_t;
+
+/**
+ * One program's figures
+ */
+typedef struct {
+    char name[64];
+    uint64_t lines;
+    int compiled; /* Zero if the compile figures are missing */
+    double compile_ns;
+    long compile_rss; /* KB */
+    long run_rss; /* KB */
+    double ns_min, ns_median;
+    bench_result_t r;
+} bench_prog_t;
+
+static uint64_t bench_retired;
+static uint64_t bench_bad;
+
+/**************************************************************************//**
+ * @brief For qsort(): doubles, ascending.
+ * */
+static int
+bench_cmp_double(
+    const void *a,
+    const void *b
+)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/**************************************************************************//**
+ * @brief For qsort(): strings.
+ * */
+static int
+bench_cmp_name(
+    const void *a,
+    const void *b
+)
+{
+    return strcmp(*(char * const *)a,*(char * const *)b);
+}
+
+/**************************************************************************//**
+ * @brief Lines in a file.
+ * */
+static uint64_t
+bench_lines(
+    const char *path
+)
+{
+    uint64_t n = 0;
+    FILE *f;
+    int c;
+
+    if (NULL == (f = fopen(path,"r"))) return 0;
+    while (EOF != (c = getc(f))) {
+        if ('\n' == c) n++;
+    }
+    fclose(f);
+    return n;
+}
+
+/**************************************************************************//**
+ * @brief Point stdout (and stderr, if asked) at /dev/null.
+ * */
+static void
+bench_quiet(
+    int stderr_too
+)
+{
+    int fd;
+
+    if (0 > (fd = open("/dev/null",O_WRONLY))) return;
+    dup2(fd,STDOUT_FILENO);
+    if (stderr_too) dup2(fd,STDERR_FILENO);
+    close(fd);
+}
+
+/**************************************************************************//**
+ * @brief Run the compiler once.
+ *
+ * @returns 0 on success, 1 if it can't be run, -1 if it failed.
+ * */
+static int
+bench_compile_once(
+    const char *avmc,
+    const char *src,
+    const char *obj,
+    double *ns,
+    long *rss
+)
+{
+    struct timespec t0, t1;
+    struct rusage ru;
+    pid_t pid;
+    int status;
+
+    fflush(stdout); /* Or the child writes it again */
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    if (0 > (pid = fork())) return -1;
+    if (!pid) {
+        bench_quiet(1);
+        execl(avmc,avmc,"-q","-o",obj,src,(char *)NULL);
+        _exit(127);
+    }
+    if (0 > wait4(pid,&status,0,&ru)) return -1;
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    if (!WIFEXITED(status)) return -1;
+    if (127 == WEXITSTATUS(status)) return 1;
+    if (WEXITSTATUS(status)) return -1;
+    *ns = bench_ns(&t0,&t1);
+    *rss = ru.ru_maxrss;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Fan-out job completion: count what it ran.
+ * */
+static void
+bench_done(
+    avmlib_vm_t *vm,
+    avmlib_vm_status_t status,
+    void *arg
+)
+{
+    __atomic_add_fetch(&bench_retired,vm->retired,__ATOMIC_RELAXED);
+    if (AVMLIB_VM_HALTED != status) __atomic_add_fetch(&bench_bad,1,__ATOMIC_RELAXED);
+}
+
+/**************************************************************************//**
+ * @brief Run a program (in the run child).
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+bench_run(
+    const char *name,
+    const char *obj,
+    uint32_t runs,
+    bench_result_t *r
+)
+{
+    const avmlib_stats_slot_t *slot;
+    struct timespec t0, t1;
+    avmlib_stats_t *stats;
+    avmlib_pool_t *pool = NULL;
+    avmlib_vm_t *vm = NULL;
+    avm_t *tmpl;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t i, s, p;
+
+    /* Step 1: Count from the start, then load */
+    if ((NULL == (stats = avmlib_stats_open(NULL))) ||
+        (NULL == (tmpl = avmlib_machine_new())) ||
+        (0 > avmlib_vm_program(tmpl,obj))) {
+        return -1;
+    }
+    r->runs = runs;
+    r->instances = strncmp(name,BENCH_FANOUT_PREFIX,strlen(BENCH_FANOUT_PREFIX)) ? 1 : BENCH_FANOUT;
+    if (1 == r->instances) {
+        if (NULL == (vm = avmlib_vm_new(tmpl))) return -1;
+    } else if (NULL == (pool = avmlib_pool_new(tmpl,(ncpu > 0) ? (int)ncpu : 1))) {
+        return -1;
+    }
+
+    /* Step 2: The runs */
+    for (i=0;i<runs;i++) {
+        if (vm) {
+            if (0 > avmlib_vm_reset(vm)) return -1;
+            clock_gettime(CLOCK_MONOTONIC,&t0);
+            if (AVMLIB_VM_HALTED != avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED)) return -1;
+            clock_gettime(CLOCK_MONOTONIC,&t1);
+            r->instructions = vm->retired;
+        } else {
+            bench_retired = 0;
+            clock_gettime(CLOCK_MONOTONIC,&t0);
+            for (s=0;s<BENCH_FANOUT;s++) {
+                if (0 > avmlib_pool_run(pool,NULL,bench_done,NULL)) return -1;
+            }
+            avmlib_pool_wait(pool);
+            clock_gettime(CLOCK_MONOTONIC,&t1);
+            if (bench_bad) return -1;
+            r->instructions = bench_retired;
+        }
+        if (!r->instructions) return -1;
+        r->ns[i] = bench_ns(&t0,&t1) / r->instructions;
+    }
+
+    /* Step 3: Port traffic, per run */
+    for (s=0;s<stats->block->nslots;s++) {
+        slot = &stats->block->slot[s];
+        if (!__atomic_load_n(&slot->tid,__ATOMIC_RELAXED)) continue;
+        for (p=0;p<AVMLIB_STATS_PORTS;p++) {
+            r->syscalls += __atomic_load_n(&slot->syscalls[p],__ATOMIC_RELAXED);
+            r->bytes_out += __atomic_load_n(&slot->bytes_out[p],__ATOMIC_RELAXED);
+        }
+    }
+    r->syscalls /= runs;
+    r->bytes_out /= runs;
+    r->ok = 1;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Run a program in a child of its own.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+bench_run_child(
+    bench_prog_t *prog,
+    const char *obj,
+    uint32_t runs
+)
+{
+    struct rusage ru;
+    ssize_t n;
+    pid_t pid;
+    int fds[2], status;
+
+    /* Step 1: The child; it answers on a pipe */
+    if (0 > pipe(fds)) return -1;
+    fflush(stdout);
+    if (0 > (pid = fork())) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (!pid) {
+        bench_result_t r;
+
+        close(fds[0]);
+        bench_quiet(0);
+        memset(&r,0,sizeof(r));
+        bench_run(prog->name,obj,runs,&r);
+        n = write(fds[1],&r,sizeof(r));
+        _exit((sizeof(r) == (size_t)n) ? 0 : 1);
+    }
+
+    /* Step 2: Its answer, and its footprint */
+    close(fds[1]);
+    memset(&prog->r,0,sizeof(prog->r));
+    while ((0 > (n = read(fds[0],&prog->r,sizeof(prog->r)))) && (EINTR == errno));
+    close(fds[0]);
+    if ((0 > wait4(pid,&status,0,&ru)) || !WIFEXITED(status) || WEXITSTATUS(status) ||
+        (sizeof(prog->r) != (size_t)n) || !prog->r.ok) {
+        return -1;
+    }
+    prog->run_rss = ru.ru_maxrss;
+
+    /* Step 3: Best and median */
+    qsort(prog->r.ns,runs,sizeof(prog->r.ns[0]),bench_cmp_double);
+    prog->ns_min = prog->r.ns[0];
+    prog->ns_median = (runs & 1) ? prog->r.ns[runs / 2] : (prog->r.ns[runs / 2 - 1] + prog->r.ns[runs / 2]) / 2;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Write the results as JSON.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+bench_json(
+    const char *path,
+    const bench_prog_t *progs,
+    uint32_t nprogs
+)
+{
+    const bench_prog_t *p;
+    char when[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    uint32_t i;
+    FILE *f;
+
+    if (NULL == (f = fopen(path,"w"))) {
+        fprintf(stderr,"bench_avm: Can't write \"%s\" (%s).\n",path,strerror(errno));
+        return -1;
+    }
+    gmtime_r(&now,&tm);
+    strftime(when,sizeof(when),"%Y-%m-%dT%H:%M:%SZ",&tm);
+    fprintf(f,"{\n  \"schema\": 1,\n  \"timestamp\": \"%s\",\n  \"benchmarks\": [\n",when);
+    for (i=0;i<nprogs;i++) {
+        p = &progs[i];
+        fprintf(f,"    {\n      \"name\": \"%s\",\n      \"source_lines\": %llu,\n",p->name,
+                (unsigned long long)p->lines);
+        if (p->compiled) {
+            fprintf(f,"      \"compile\": { \"ns\": %.0f, \"lines_per_sec\": %.0f, \"peak_rss_kb\": %ld },\n",
+                    p->compile_ns,p->lines / (p->compile_ns / 1e9),p->compile_rss);
+        } else {
+            fprintf(f,"      \"compile\": null,\n");
+        }
+        if (!p->r.ok) {
+            fprintf(f,"      \"run\": null\n    }%s\n",(i + 1 < nprogs) ? "," : "");
+            continue;
+        }
+        fprintf(f,"      \"run\": { \"runs\": %u, \"instances\": %llu, \"instructions\": %llu, "
+                "\"ns_per_instruction\": { \"min\": %.3f, \"median\": %.3f }, \"peak_rss_kb\": %ld, "
+                "\"syscalls_per_run\": %llu, \"bytes_out_per_run\": %llu }\n    }%s\n",
+                p->r.runs,(unsigned long long)p->r.instances,(unsigned long long)p->r.instructions,
+                p->ns_min,p->ns_median,p->run_rss,(unsigned long long)p->r.syscalls,
+                (unsigned long long)p->r.bytes_out,(i + 1 < nprogs) ? "," : "");
+    }
+    fprintf(f,"  ]\n}\n");
+    if (fclose(f)) return -1;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    const char *avmc = "../avmc/avmc", *json = NULL, *dir;
+    char src[512], obj[512], **names = NULL;
+    bench_prog_t *progs = NULL, *p;
+    struct dirent *de;
+    struct stat st;
+    uint32_t runs = BENCH_RUNS, nnames = 0, i, r;
+    size_t len;
+    double ns;
+    long rss;
+    int c, rc, bad = 0;
+    DIR *d;
+
+    while (-1 != (c = getopt(argc,argv,"n:c:o:"))) {
+        switch (c) {
+            case 'n':
+                runs = (uint32_t)strtoul(optarg,NULL,0);
+                break;
+            case 'c':
+                avmc = optarg;
+                break;
+            case 'o':
+                json = optarg;
+                break;
+            default:
+                fprintf(stderr,"Usage: %s [-n runs] [-c avmc] [-o out.json] dir\n",argv[0]);
+                return 2;
+        }
+    }
+    if ((optind != argc - 1) || !runs || (runs > BENCH_MAX_RUNS)) {
+        fprintf(stderr,"Usage: %s [-n runs] [-c avmc] [-o out.json] dir\n",argv[0]);
+        return 2;
+    }
+    dir = argv[optind];
+
+    /* Step 1: The programs, in name order */
+    if (NULL == (d = opendir(dir))) {
+        fprintf(stderr,"%s: Can't open \"%s\" (%s).\n",argv[0],dir,strerror(errno));
+        return 1;
+    }
+    while (NULL != (de = readdir(d))) {
+        len = strlen(de->d_name);
+        if ((len <= 5) || (len - 5 >= sizeof(p->name)) || strcmp(de->d_name + len - 5,".avma")) continue;
+        if ((NULL == (names = realloc(names,sizeof(*names) * (nnames + 1)))) ||
+            (NULL == (names[nnames++] = strndup(de->d_name,len - 5)))) {
+            fprintf(stderr,"%s: Alloc failure.\n",argv[0]);
+            return 1;
+        }
+    }
+    closedir(d);
+    if (!nnames) {
+        fprintf(stderr,"%s: No programs in \"%s\".\n",argv[0],dir);
+        return 1;
+    }
+    qsort(names,nnames,sizeof(*names),bench_cmp_name);
+    if (NULL == (progs = calloc(nnames,sizeof(*progs)))) {
+        fprintf(stderr,"%s: Alloc failure.\n",argv[0]);
+        return 1;
+    }
+
+    printf("bench_avm: %u programs, %u runs each\n",nnames,runs);
+    printf("  %-16s %8s %10s %10s %8s %12s %8s %8s %8s %10s\n","program","lines","compile ms","lines/s",
+           "cc RSS K","instructions","ns min","ns med","RSS K","syscalls");
+    for (i=0;i<nnames;i++) {
+        p = &progs[i];
+        snprintf(p->name,sizeof(p->name),"%s",names[i]);
+        snprintf(src,sizeof(src),"%s/%s.avma",dir,names[i]);
+        snprintf(obj,sizeof(obj),"%s/%s.avmo",dir,names[i]);
+        p->lines = bench_lines(src);
+
+        /* Step 2: Compile, best of the runs */
+        for (r=0;r<runs;r++) {
+            if (0 != (rc = bench_compile_once(avmc,src,obj,&ns,&rss))) break;
+            if (!p->compiled || (ns < p->compile_ns)) p->compile_ns = ns;
+            if (rss > p->compile_rss) p->compile_rss = rss;
+            p->compiled = 1;
+        }
+        if ((rc < 0) || ((rc > 0) && stat(obj,&st))) {
+            printf("  %-16s COMPILE FAILED\n",p->name);
+            p->compiled = 0;
+            bad++;
+            continue;
+        }
+
+        /* Step 3: Run */
+        if (0 > bench_run_child(p,obj,runs)) {
+            printf("  %-16s BAD RUN\n",p->name);
+            bad++;
+            continue;
+        }
+        if (p->compiled) {
+            printf("  %-16s %8llu %10.3f %10.0f %8ld",p->name,(unsigned long long)p->lines,p->compile_ns / 1e6,
+                   p->lines / (p->compile_ns / 1e9),p->compile_rss);
+        } else {
+            printf("  %-16s %8llu %10s %10s %8s",p->name,(unsigned long long)p->lines,"-","-","-");
+        }
+        printf(" %12llu %8.3f %8.3f %8ld %10llu\n",(unsigned long long)p->r.instructions,p->ns_min,
+               p->ns_median,p->run_rss,(unsigned long long)p->r.syscalls);
+    }
+
+    /* Step 4: The record */
+    if (json && (0 > bench_json(json,progs,nnames))) bad++;
+    for (i=0;i<nnames;i++) free(names[i]);
+    free(names);
+    free(progs);
+    return bad ? 1 : 0;
+}
+
+#endif /* _BENCH_AVM_C_ */
@@ -0,0 +1,77 @@
+/**************************************************************************//**
+ * @file bench_buffer_map.c
+ *
+ * @brief Consume a >4 GiB file through a mapped BUFFER.
+ *
+ * @details Creates a sparse BENCH_FILE_GIB GiB file, maps it with
+ * avmtype_buffer_map(), and consumes it front to back in IN-sized views,
+ * reporting throughput.  A sparse file reads as zero pages, so this
+ * measures the buffer path (cursor, readahead advice, page faults)
+ * rather than the disk.  Exits nonzero if the cursor doesn't reach the
+ * end, i.e. if any size or cursor arithmetic wrapped at 4 GiB.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_BUFFER_MAP_C_
+#define _BENCH_BUFFER_MAP_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avmlib.h"
+
+#define BENCH_FILE_GIB 5
+#define BENCH_VIEW (1024 * 1024)
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char path[] = "/tmp/avm_bench_bufmapXXXXXX";
+    uint64_t want = (uint64_t)BENCH_FILE_GIB << 30;
+    uint64_t total = 0, got;
+    struct timespec t0, t1;
+    class_buffer_t *b;
+    const void *v;
+    uint64_t sum = 0;
+    double ns;
+    int fd;
+
+    /* Step 1: Sparse file */
+    if ((0 > (fd = mkstemp(path))) || (0 > ftruncate(fd,(off_t)want))) {
+        perror("bench_buffer_map");
+        return 1;
+    }
+    close(fd);
+
+    /* Step 2: Map and consume */
+    b = avmtype_buffer_new("bench",0);
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    if (0 > avmtype_buffer_map(b,path,BUFFER_MAP_READONLY)) {
+        unlink(path);
+        return 1;
+    }
+    while (0 < (got = avmtype_buffer_view(b,BENCH_VIEW,&v))) {
+        sum += ((const uint8_t *)v)[got - 1]; /* Touch the last page */
+        total += got;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("buffer_map size=%" PRIu64 " consumed=%" PRIu64 " cursor=%" PRIu64
+           " GiB_per_s=%.2f checksum=%" PRIu64 "\n",
+           b->size,total,b->cursor,(total / (double)(1 << 30)) / (ns / 1e9),sum);
+
+    avmtype_buffer_destroy(NULL,(entry_t)b);
+    unlink(path);
+    return (total == want) ? 0 : 1;
+}
+
+#endif /* _BENCH_BUFFER_MAP_C_ */
@@ -0,0 +1,140 @@
+/**************************************************************************//**
+ * @file bench_fileio.c
+ *
+ * @brief Compare file port backends on many small files.
+ *
+ * @details Creates BENCH_FILES small files, then appends a block to each
+ * and reads each back, once with plain (synchronous) port I/O and once
+ * through each fileio backend.  Backend runs queue one request per port
+ * and let avmlib_fileio_poll() submit them in batches (a full ring is
+ * also polled from the submit path, so drain on inflight, not on counts).
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_FILEIO_C_
+#define _BENCH_FILEIO_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avmlib.h"
+
+#define BENCH_FILES 2000
+#define BENCH_BLOCK 4096
+#define BENCH_ROUNDS 4
+
+static char bench_dir[] = "/tmp/avm_bench_fileioXXXXXX";
+static class_port_t *bench_ports[BENCH_FILES];
+static class_process_t bench_procs[BENCH_FILES];
+static char bench_buf[BENCH_FILES][BENCH_BLOCK];
+
+/**************************************************************************//**
+ * @brief (Re)open every file port.
+ * */
+static void
+bench_fileio_open(void)
+{
+    char path[256];
+    int i;
+
+    for (i=0;i<BENCH_FILES;i++) {
+        if (!bench_ports[i]) bench_ports[i] = avmlib_port_new("@bench",-1,NULL);
+        snprintf(path,sizeof(path),"%s/f%05d",bench_dir,i);
+        if (0 > avmlib_port_open_file(bench_ports[i],path)) exit(1);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Run one backend and print its line of results.
+ *
+ * @param io Backend, or NULL for synchronous port I/O
+ * */
+static void
+bench_fileio_run(
+    avmlib_fileio_t *io,
+    const char *name
+)
+{
+    struct timespec t0, t1;
+    uint64_t syscalls = 0;
+    double ns;
+    int r, i;
+
+    bench_fileio_open();
+    for (i=0;i<BENCH_FILES;i++) {
+        bench_ports[i]->stat_syscalls = 0;
+        if (io) avmlib_fileio_add_port(io,bench_ports[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    for (r=0;r<BENCH_ROUNDS;r++) {
+        /* Append a block to every file, then read one back from each */
+        if (!io) {
+            for (i=0;i<BENCH_FILES;i++) {
+                avmlib_port_write(bench_ports[i],bench_buf[i],BENCH_BLOCK);
+            }
+            for (i=0;i<BENCH_FILES;i++) {
+                avmlib_port_read(bench_ports[i],bench_buf[i],BENCH_BLOCK);
+            }
+            continue;
+        }
+        for (i=0;i<BENCH_FILES;i++) {
+            avmlib_fileio_write(io,&bench_procs[i],bench_ports[i],bench_buf[i],BENCH_BLOCK);
+        }
+        while (io->inflight) avmlib_fileio_poll(io,1);
+        for (i=0;i<BENCH_FILES;i++) {
+            avmlib_fileio_read(io,&bench_procs[i],bench_ports[i],bench_buf[i],BENCH_BLOCK);
+        }
+        while (io->inflight) avmlib_fileio_poll(io,1);
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+
+    for (i=0;i<BENCH_FILES;i++) {
+        syscalls += bench_ports[i]->stat_syscalls;
+    }
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("backend=%-8s files=%d ops=%d port_syscalls=%" PRIu64 " batches=%" PRIu64 " ns_per_op=%.1f\n",
+           name,BENCH_FILES,BENCH_FILES * BENCH_ROUNDS * 2,syscalls,
+           io ? io->stat_batches : 0,
+           ns / (BENCH_FILES * BENCH_ROUNDS * 2));
+}
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    avmlib_fileio_t *io;
+    char cmd[300];
+    int i;
+
+    if (!mkdtemp(bench_dir)) return 1;
+    for (i=0;i<BENCH_FILES;i++) {
+        memset(bench_buf[i],'a' + (i % 26),BENCH_BLOCK);
+    }
+
+    bench_fileio_run(NULL,"sync");
+    if (NULL != (io = avmlib_fileio_new(NULL,FILEIO_BACKEND_URING,0))) {
+        bench_fileio_run(io,"io_uring");
+        avmlib_fileio_destroy(io);
+    } else {
+        printf("backend=io_uring unavailable\n");
+    }
+    if (NULL != (io = avmlib_fileio_new(NULL,FILEIO_BACKEND_THREADS,0))) {
+        bench_fileio_run(io,"threads");
+        avmlib_fileio_destroy(io);
+    }
+
+    for (i=0;i<BENCH_FILES;i++) {
+        close(bench_ports[i]->fd);
+    }
+    snprintf(cmd,sizeof(cmd),"rm -rf %s",bench_dir);
+    return system(cmd) ? 1 : 0;
+}
+
+#endif /* _BENCH_FILEIO_C_ */
@@ -0,0 +1,137 @@
+/**************************************************************************//**
+ * @file bench_pool.c
+ *
+ * @brief Many small program runs through a machine pool.
+ *
+ * @details Builds a small counting loop, loads it into a template
+ * machine, and runs BENCH_JOBS instances of it through pools of 1, 2,
+ * 4... workers up to the number of online CPUs, reporting jobs per
+ * second and the speedup over one worker.  The largest pool then runs
+ * the jobs again while the segment is replaced BENCH_SWAPS times from
+ * the image, reporting the cost of a swap and any retired versions
+ * left unreclaimed.  Exits nonzero if any run computes the wrong sum or
+ * a version is never reclaimed.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_POOL_C_
+#define _BENCH_POOL_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define BENCH_JOBS 20000
+#define BENCH_LOOPS 100
+#define BENCH_SWAPS 100
+
+static uint64_t bench_bad;
+
+/**************************************************************************//**
+ * @brief Job setup: count from BENCH_LOOPS.
+ * */
+static int
+bench_setup(
+    avmlib_vm_t *vm,
+    void *arg
+)
+{
+    class_register_t *gr1 = avmlib_machine_own(vm->avm,AVM_CLASS_REGISTER,BENCH_GR1);
+
+    if (!gr1) return -1;
+    gr1->value = BENCH_LOOPS;
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Job completion: check the sum.
+ * */
+static void
+bench_done(
+    avmlib_vm_t *vm,
+    avmlib_vm_status_t status,
+    void *arg
+)
+{
+    class_register_t *gr2 =
+        (class_register_t *)AVM_CLASS_TABLE(vm->avm,AVM_CLASS_REGISTER)->entries[BENCH_GR2];
+
+    if ((AVMLIB_VM_HALTED != status) || (gr2->value != BENCH_LOOPS * (BENCH_LOOPS + 1) / 2)) {
+        __atomic_add_fetch(&bench_bad,1,__ATOMIC_RELAXED);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char path[] = "/tmp/avm_bench_poolXXXXXX";
+    struct timespec t0, t1, s0, s1;
+    avmlib_pool_t *pool;
+    avm_t *tmpl;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    double ns, swap_ns, base = 0;
+    int fd, n, i, pending;
+
+    /* Step 1: Program and template */
+    if (0 > (fd = mkstemp(path))) return 1;
+    close(fd);
+    if ((0 > bench_program(path,"bench_pool")) ||
+        (NULL == (tmpl = avmlib_machine_new())) ||
+        (0 > avmlib_vm_program(tmpl,path))) {
+        unlink(path);
+        return 1;
+    }
+
+    printf("bench_pool: %d jobs of %d loops, %ld CPUs\n",BENCH_JOBS,BENCH_LOOPS,ncpu);
+
+    /* Step 2: Pools of increasing size */
+    for (n=1;n<=ncpu;n=(n * 2 > ncpu && n < ncpu) ? (int)ncpu : n * 2) {
+        if (NULL == (pool = avmlib_pool_new(tmpl,n))) return 1;
+        clock_gettime(CLOCK_MONOTONIC,&t0);
+        for (i=0;i<BENCH_JOBS;i++) avmlib_pool_run(pool,bench_setup,bench_done,NULL);
+        avmlib_pool_wait(pool);
+        clock_gettime(CLOCK_MONOTONIC,&t1);
+        avmlib_pool_free(pool);
+
+        ns = bench_ns(&t0,&t1);
+        if (1 == n) base = ns;
+        printf("  %3d workers: %10.0f jobs/s  %6.3f us/job  x%.2f\n",n,
+               BENCH_JOBS / (ns / 1e9),ns / 1e3 / BENCH_JOBS,base / ns);
+    }
+
+    /* Step 3: The largest pool again, swapping the segment under it */
+    if (NULL == (pool = avmlib_pool_new(tmpl,(int)ncpu))) return 1;
+    swap_ns = 0;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    for (i=0;i<BENCH_JOBS;i++) {
+        avmlib_pool_run(pool,bench_setup,bench_done,NULL);
+        if (0 == (i % (BENCH_JOBS / BENCH_SWAPS))) {
+            clock_gettime(CLOCK_MONOTONIC,&s0);
+            if (0 > avmlib_segment_replace(tmpl,(uint16_t)tmpl->entrypoint,path)) bench_bad++;
+            clock_gettime(CLOCK_MONOTONIC,&s1);
+            swap_ns += bench_ns(&s0,&s1);
+        }
+    }
+    avmlib_pool_wait(pool);
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    pending = avmlib_epoch_reclaim((avmlib_epoch_t *)tmpl->epoch);
+    avmlib_pool_free(pool);
+    unlink(path);
+
+    ns = bench_ns(&t0,&t1);
+    printf("  %3ld workers, %d swaps: %10.0f jobs/s  %8.1f us/swap  %d unreclaimed\n",ncpu,BENCH_SWAPS,
+           BENCH_JOBS / (ns / 1e9),swap_ns / 1e3 / BENCH_SWAPS,pending);
+
+    if (bench_bad) printf("  %llu BAD RUNS\n",(unsigned long long)bench_bad);
+    return (bench_bad || pending) ? 1 : 0;
+}
+
+#endif /* _BENCH_POOL_C_ */
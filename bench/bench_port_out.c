@@ -0,0 +1,75 @@
+/**************************************************************************//**
+ * @file bench_port_out.c
+ *
+ * @brief Measure port output cost under each buffering policy.
+ *
+ * @details Issues 1M OUT-sized writes to a port on /dev/null and reports
+ * how many syscalls each buffering policy needed.  PORT_BUFMODE_NONE is
+ * the historical (one write per OUT) behavior.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_PORT_OUT_C_
+#define _BENCH_PORT_OUT_C_
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avmlib.h"
+
+#define BENCH_OUTS 1000000
+
+/**************************************************************************//**
+ * @brief Run one policy and print its line of results.
+ * */
+static void
+bench_port_out_run(
+    port_bufmode_t mode,
+    const char *mode_name
+)
+{
+    static const char msg[] = "count: 0x10 ";
+    struct timespec t0, t1;
+    class_port_t *port;
+    double ns;
+    int i;
+
+    port = avmlib_port_new("@bench",open("/dev/null",O_WRONLY),NULL);
+    avmlib_port_set_buffering(port,mode,0);
+
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    for (i=0;i<BENCH_OUTS;i++) {
+        /* Every 8th OUT ends a line */
+        avmlib_port_write(port,(i & 7) == 7 ? "\n" : msg,
+                          (i & 7) == 7 ? 1 : sizeof(msg) - 1);
+    }
+    avmlib_port_flush(port);
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("mode=%-4s outs=%d syscalls=%" PRIu64 " bytes=%" PRIu64 " ns_per_out=%.1f\n",
+           mode_name,BENCH_OUTS,port->stat_syscalls,port->stat_bytes_out,
+           ns / BENCH_OUTS);
+
+    close(port->fd);
+    free(port->obuf);
+    free(port);
+}
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    bench_port_out_run(PORT_BUFMODE_NONE,"none");
+    bench_port_out_run(PORT_BUFMODE_LINE,"line");
+    bench_port_out_run(PORT_BUFMODE_FULL,"full");
+    return 0;
+}
+
+#endif /* _BENCH_PORT_OUT_C_ */
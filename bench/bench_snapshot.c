@@ -0,0 +1,112 @@
+/**************************************************************************//**
+ * @file bench_snapshot.c
+ *
+ * @brief Machine startup: building entities vs. restoring a snapshot.
+ *
+ * @details Builds a machine with BENCH_ENTITIES named NUMBERs and as
+ * many named STRINGs, timing it, and saves a snapshot.  Then re-runs
+ * itself (so the name table starts empty, as in a real startup) to time
+ * avmlib_snapshot_restore() and the first touch of a few entities.
+ * Exits nonzero if the restored values are wrong.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_SNAPSHOT_C_
+#define _BENCH_SNAPSHOT_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define BENCH_ENTITIES (1 << 18)
+
+/**************************************************************************//**
+ * @brief Child half: restore and spot-check.
+ * */
+static int
+bench_restore(
+    const char *path
+)
+{
+    struct timespec t0, t1;
+    avm_t *avm;
+    table_t *t;
+    uint32_t i;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    if (NULL == (avm = avmlib_snapshot_restore(path))) return 1;
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    ns = bench_ns(&t0,&t1);
+    printf("  restore: %10.3f ms\n",ns / 1e6);
+
+    t = AVM_CLASS_TABLE(avm,AVM_CLASS_NUMBER);
+    for (i=0;i<BENCH_ENTITIES;i+=BENCH_ENTITIES / 8) {
+        class_number_t *n = (class_number_t *)t->entries[i];
+        char name[32];
+        snprintf(name,sizeof(name),"n%u",i);
+        if ((n->value != (int64_t)i * 3) || strcmp(avmm_entity_name(n),name)) {
+            printf("  MISMATCH at %u\n",i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char path[] = "/tmp/avm_bench_snapshotXXXXXX";
+    char name[32], cmd[4096];
+    struct timespec t0, t1;
+    avm_t *avm;
+    uint32_t i;
+    int fd, rc;
+
+    if ((3 == argc) && !strcmp(argv[1],"-r")) return bench_restore(argv[2]);
+
+    /* Step 1: Build */
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    avm = avmlib_machine_new();
+    for (i=0;i<BENCH_ENTITIES;i++) {
+        snprintf(name,sizeof(name),"n%u",i);
+        avmlib_table_add(AVM_CLASS_TABLE(avm,AVM_CLASS_NUMBER),
+                         avmlib_number_new(name,64,(int64_t)i * 3));
+        snprintf(name,sizeof(name),"s%u",i);
+        avmlib_table_add(AVM_CLASS_TABLE(avm,AVM_CLASS_STRING),
+                         avmtype_string_new(name,name));
+    }
+    avmlib_store_build(&avm->store,avm);
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+
+    printf("bench_snapshot: %u numbers, %u strings\n",BENCH_ENTITIES,BENCH_ENTITIES);
+    printf("  build:   %10.3f ms\n",bench_ns(&t0,&t1) / 1e6);
+
+    /* Step 2: Save */
+    if (0 > (fd = mkstemp(path))) return 1;
+    close(fd);
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    if (0 > avmlib_snapshot_save(avm,path)) {
+        unlink(path);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    printf("  save:    %10.3f ms\n",bench_ns(&t0,&t1) / 1e6);
+    fflush(stdout);
+
+    /* Step 3: Restore in a fresh process */
+    snprintf(cmd,sizeof(cmd),"%s -r %s",argv[0],path);
+    rc = system(cmd);
+    unlink(path);
+    return rc ? 1 : 0;
+}
+
+#endif /* _BENCH_SNAPSHOT_C_ */
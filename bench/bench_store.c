@@ -0,0 +1,81 @@
+/**************************************************************************//**
+ * @file bench_store.c
+ *
+ * @brief NUMBER operand fetch: table-of-tables chase vs. runtime store.
+ *
+ * @details Defines BENCH_NUMBERS numbers in a machine, builds its
+ * store, then sums BENCH_FETCHES of them at pseudo-random indices, once
+ * through AVM_CLASS_TABLE (table of tables, entry pointer, object) and
+ * once through avmlib_store_number().  Exits nonzero if the sums differ.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _BENCH_STORE_C_
+#define _BENCH_STORE_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench.h"
+
+#define BENCH_NUMBERS (1 << 20)
+#define BENCH_FETCHES (1 << 24)
+
+/**************************************************************************//**
+ * @brief Main.
+ * */
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    avm_t *avm = avmlib_machine_new();
+    avm_store_t *store;
+    struct timespec t0, t1;
+    uint32_t *idx, i, x = 1;
+    int64_t sum_table = 0, sum_store = 0;
+    double ns_table, ns_store;
+
+    /* Step 1: Numbers, and a fixed random access pattern */
+    for (i=0;i<BENCH_NUMBERS;i++) {
+        avmlib_table_add(AVM_CLASS_TABLE(avm,AVM_CLASS_NUMBER),
+                         avmlib_number_new(NULL,64,(int64_t)i * 3));
+    }
+    if ((0 > avmlib_store_build(&avm->store,avm)) ||
+        (NULL == (idx = malloc(BENCH_FETCHES * sizeof(*idx))))) {
+        return 1;
+    }
+    for (i=0;i<BENCH_FETCHES;i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        idx[i] = x & (BENCH_NUMBERS - 1);
+    }
+
+    /* Step 2: Through the tables */
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    for (i=0;i<BENCH_FETCHES;i++) {
+        sum_table += ((class_number_t *)AVM_CLASS_TABLE(avm,AVM_CLASS_NUMBER)->entries[idx[i]])->value;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    ns_table = bench_ns(&t0,&t1);
+
+    /* Step 3: Through the store */
+    store = &avm->store;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    for (i=0;i<BENCH_FETCHES;i++) {
+        sum_store += avmlib_store_number(store,idx[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    ns_store = bench_ns(&t0,&t1);
+
+    printf("bench_store: %u numbers, %u fetches\n",BENCH_NUMBERS,BENCH_FETCHES);
+    printf("  tables: %6.2f ns/fetch\n",ns_table / BENCH_FETCHES);
+    printf("  store:  %6.2f ns/fetch\n",ns_store / BENCH_FETCHES);
+    if (sum_table != sum_store) {
+        printf("  MISMATCH: %lld != %lld\n",(long long)sum_table,(long long)sum_store);
+        return 1;
+    }
+    return 0;
+}
+
+#endif /* _BENCH_STORE_C_ */
@@ -0,0 +1,113 @@
+/**************************************************************************//**
+ * @file test.h
+ *
+ * @brief Scaffolding shared by the tests.
+ *
+ * @details Each test is one program that includes this, checks with
+ * TEST_CHECK() (which reports and carries on), and exits with
+ * test_failed.  Programs are built in memory as unlinked segments
+ * (test_segment_init()), then saved and loaded into a template machine
+ * (test_template()), the same way avmc output is.  test_loop() is a
+ * counting loop for tests that need a program to run for a while.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "avmlib.h"
+
+/* The machine's @stdin and @stdout */
+#define TEST_PORT_IN 0
+#define TEST_PORT_OUT 1
+
+/* The machine's GR1 and GR2 */
+#define TEST_GR1 3
+#define TEST_GR2 4
+
+static int test_failed;
+
+#define TEST_CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+        test_failed = 1; \
+    } \
+} while (0)
+
+/**************************************************************************//**
+ * @brief Start an empty, unlinked segment with a table for every class.
+ * */
+static inline void
+test_segment_init(
+    class_segment_t *seg,
+    const char *name
+)
+{
+    int i;
+
+    memset(seg,0,sizeof(*seg));
+    seg->id = AVMM_SEGMENT_UNLINKED;
+    seg->state = AVMM_SEGMENT_RESIDENT;
+    avmlib_table_init(&seg->tables,AVM_CLASS_MAX);
+    for (i=0;i<AVM_CLASS_MAX;i++) avmlib_table_add(&seg->tables,avmlib_table_new(16));
+    avmm_entity_name_set(seg,name);
+}
+
+/**************************************************************************//**
+ * @brief Save a segment and load it as a new template machine's program.
+ *
+ * @returns The template, or NULL on failure.
+ * */
+static inline avm_t *
+test_template(
+    class_segment_t *seg
+)
+{
+    char path[] = "/tmp/avm_testXXXXXX";
+    avm_t *tmpl = NULL;
+    int fd;
+
+    if ((0 > (fd = mkstemp(path))) || (0 > close(fd)) ||
+        (0 > avmlib_segment_save(seg,path,0)) ||
+        (NULL == (tmpl = avmlib_machine_new())) ||
+        (0 > avmlib_vm_program(tmpl,path))) {
+        tmpl = NULL;
+    }
+    if (0 <= fd) unlink(path);
+    return tmpl;
+}
+
+/**************************************************************************//**
+ * @brief Add the counting loop to a segment:
+ * loop: ADD GR2,GR1,GR2 / DEC GR1 / JNZ GR1,loop.
+ *
+ * @details Run with GR1 = n, it retires 3n instructions and leaves
+ * GR2 = n(n+1)/2 (mod 2^32) if GR2 started at 0.
+ * */
+static inline void
+test_loop(
+    class_segment_t *seg
+)
+{
+    table_t *code = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    entity_t gr1 = avmlib_entity_new(AVM_CLASS_REGISTER,TEST_GR1);
+    entity_t gr2 = avmlib_entity_new(AVM_CLASS_REGISTER,TEST_GR2);
+
+    avmlib_table_add(AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL),
+                     avmlib_new_label("loop",AVMM_SEGMENT_UNLINKED,code->size));
+    avmlib_table_add(AVM_CLASS_TABLE(seg,AVM_CLASS_UNRESOLVED),avmlib_unresolved_new("loop"));
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_ADD,0,3));
+    avmlib_entity_emit(code,gr2,0);
+    avmlib_entity_emit(code,gr1,0);
+    avmlib_entity_emit(code,gr2,0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_SUB,0,1));
+    avmlib_entity_emit(code,gr1,0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_JNZ,0,2));
+    avmlib_entity_emit(code,gr1,0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_UNRESOLVED,0),0);
+}
+
+#endif /* _TEST_H_ */
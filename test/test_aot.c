@@ -0,0 +1,149 @@
+/**************************************************************************//**
+ * @file test_aot.c
+ *
+ * @brief Ahead-of-time translation and loading.
+ *
+ * @details Translates the counting loop to C, builds it with the host
+ * compiler ($CC, else cc) and attaches it.  Instances must then run
+ * native code to the same result and retired count as the interpreter,
+ * yielding and resuming on a budget.  The object must be refused with
+ * ENOEXEC by a segment whose code differs in one word (the hash
+ * check), which keeps interpreting, and a second load onto the same
+ * segment fails with EBUSY.  Run from the test directory; skipped if
+ * the compiler can't be run.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_AOT_C_
+#define _TEST_AOT_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_LOOPS 100000
+#define TEST_BUDGET 1000
+#define TEST_SUM ((uint32_t)((uint64_t)TEST_LOOPS * (TEST_LOOPS + 1) / 2))
+
+/* Code word of the loop's JNZ (see test_loop()) */
+#define TEST_JNZ_WORD 6
+
+/**************************************************************************//**
+ * @brief A template running the loop, and its segment.
+ *
+ * @param jz Nonzero to make the loop's branch a JZ instead
+ * */
+static avm_t *
+test_program(
+    int jz,
+    class_segment_t **seg
+)
+{
+    class_segment_t img;
+    table_t *segs;
+    avm_t *tmpl;
+
+    test_segment_init(&img,"test_aot");
+    test_loop(&img);
+    if (jz) {
+        AVM_CLASS_TABLE(&img,AVM_CLASS_INSTRUCTION)->entries[TEST_JNZ_WORD] =
+            avmlib_instruction_new(AVM_OP_JZ,0,2);
+    }
+    if (NULL == (tmpl = test_template(&img))) return NULL;
+    segs = AVM_CLASS_TABLE(tmpl,AVM_CLASS_SEGMENT);
+    *seg = avmlib_segment_get(tmpl,(uint16_t)(segs->size - 1));
+    return *seg ? tmpl : NULL;
+}
+
+/**************************************************************************//**
+ * @brief Run an instance of the loop on a budget.
+ *
+ * @returns GR2 at the end, with the instance's retired count.
+ * */
+static uint32_t
+test_run(
+    avm_t *tmpl,
+    uint64_t budget,
+    uint64_t *retired
+)
+{
+    avmlib_vm_status_t status;
+    class_register_t *gr1;
+    avmlib_vm_t *vm;
+    uint32_t sum;
+
+    if ((NULL == (vm = avmlib_vm_new(tmpl))) ||
+        (NULL == (gr1 = avmlib_machine_own(vm->avm,AVM_CLASS_REGISTER,TEST_GR1)))) {
+        TEST_CHECK(!"instance");
+        return 0;
+    }
+    gr1->value = TEST_LOOPS;
+    while (AVMLIB_VM_YIELDED == (status = avmlib_vm_run(vm,budget)));
+    TEST_CHECK(AVMLIB_VM_HALTED == status);
+    sum = ((class_register_t *)AVM_CLASS_TABLE(vm->avm,AVM_CLASS_REGISTER)->entries[TEST_GR2])->value;
+    *retired = vm->retired;
+    avmlib_vm_free(vm);
+    return sum;
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char base[] = "/tmp/avm_test_aotXXXXXX", csrc[64], so[64], cmd[512];
+    const char *cc = getenv("CC") ? getenv("CC") : "cc";
+    class_segment_t *seg, *other;
+    avm_t *tmpl, *tmpl_jz;
+    uint64_t retired;
+    int fd;
+
+    /* Step 1: Translated and built */
+    avmlib_jit_enable(0);
+    if ((NULL == (tmpl = test_program(0,&seg))) || (NULL == (tmpl_jz = test_program(1,&other))) ||
+        (0 > (fd = mkstemp(base))) || (0 > close(fd))) {
+        fprintf(stderr,"test_aot: setup failed\n");
+        return 1;
+    }
+    snprintf(csrc,sizeof(csrc),"%s.c",base);
+    snprintf(so,sizeof(so),"%s.so",base);
+    snprintf(cmd,sizeof(cmd),"%s -O1 -fPIC -shared -I../avmm -I../avmlib -I../avmc -o %s %s",
+             cc,so,csrc);
+    TEST_CHECK(0 == avmlib_aot_translate(seg,csrc));
+    if (system(cmd)) {
+        printf("test_aot: skipped (%s can't build %s)\n",cc,csrc);
+        unlink(csrc);
+        unlink(base);
+        return test_failed;
+    }
+    unlink(csrc);
+
+    /* Step 2: Refused for other code, which still interprets */
+    errno = 0;
+    TEST_CHECK((0 > avmlib_aot_load(tmpl_jz,other->id,so)) && (ENOEXEC == errno));
+    TEST_CHECK(NULL == other->native);
+    TEST_CHECK(TEST_LOOPS == test_run(tmpl_jz,AVMLIB_VM_UNLIMITED,&retired));
+    TEST_CHECK(3 == retired);
+
+    /* Step 3: Attached, once */
+    TEST_CHECK(0 == avmlib_aot_load(tmpl,seg->id,so));
+    TEST_CHECK(NULL != seg->native);
+    errno = 0;
+    TEST_CHECK((0 > avmlib_aot_load(tmpl,seg->id,so)) && (EBUSY == errno));
+    unlink(so);
+    unlink(base);
+
+    /* Step 4: Native runs match the interpreter, whole or in slices */
+    TEST_CHECK(TEST_SUM == test_run(tmpl,AVMLIB_VM_UNLIMITED,&retired));
+    TEST_CHECK((uint64_t)TEST_LOOPS * 3 == retired);
+    TEST_CHECK(TEST_SUM == test_run(tmpl,TEST_BUDGET,&retired));
+    TEST_CHECK((uint64_t)TEST_LOOPS * 3 == retired);
+
+    printf("test_aot: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_AOT_C_ */
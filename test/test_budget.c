@@ -0,0 +1,186 @@
+/**************************************************************************//**
+ * @file test_budget.c
+ *
+ * @brief Instruction budgets: yield and resume.
+ *
+ * @details Runs the counting loop in slices of several budgets, first
+ * interpreted and then with the JIT on.  Every slice but the last must
+ * yield having retired at least its budget, and, since the budget is
+ * only checked at taken branches, at most one loop body (the longest
+ * branch-free stretch) past it; a budget of 1000 may well stop at 1002.
+ * The resumed run must end exactly where an unlimited one does.  A
+ * program with no branches runs to the end whatever its budget, and a
+ * halted instance stays halted.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_BUDGET_C_
+#define _TEST_BUDGET_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+#define TEST_LOOPS 100000
+#define TEST_BODY 3 /* Instructions in the loop, and so the most a slice overshoots */
+
+/**************************************************************************//**
+ * @brief An instance of a template, its GR1 set to a count.
+ * */
+static avmlib_vm_t *
+test_instance(
+    avm_t *tmpl,
+    uint32_t count
+)
+{
+    class_register_t *gr1;
+    avmlib_vm_t *vm;
+
+    if ((NULL == (vm = avmlib_vm_new(tmpl))) ||
+        (NULL == (gr1 = avmlib_machine_own(vm->avm,AVM_CLASS_REGISTER,TEST_GR1)))) {
+        avmlib_vm_free(vm);
+        return NULL;
+    }
+    gr1->value = count;
+    return vm;
+}
+
+/**************************************************************************//**
+ * @brief GR2 of an instance.
+ * */
+static uint32_t
+test_gr2(
+    avmlib_vm_t *vm
+)
+{
+    return ((class_register_t *)AVM_CLASS_TABLE(vm->avm,AVM_CLASS_REGISTER)->entries[TEST_GR2])->value;
+}
+
+/**************************************************************************//**
+ * @brief The loop in slices of one budget.
+ * */
+static void
+test_slices(
+    avm_t *tmpl,
+    uint64_t budget,
+    uint32_t expect
+)
+{
+    avmlib_vm_status_t status;
+    uint64_t before, slices = 0;
+    avmlib_vm_t *vm;
+    int over = 0;
+
+    if (NULL == (vm = test_instance(tmpl,TEST_LOOPS))) {
+        TEST_CHECK(!"instance");
+        return;
+    }
+    for (;;) {
+        before = vm->retired;
+        status = avmlib_vm_run(vm,budget);
+        if (AVMLIB_VM_YIELDED != status) break;
+        slices++;
+        if ((vm->retired - before < budget) || (vm->retired - before >= budget + TEST_BODY)) {
+            if (!over++) {
+                fprintf(stderr,"test_budget: budget %llu, slice of %llu\n",
+                        (unsigned long long)budget,(unsigned long long)(vm->retired - before));
+            }
+        }
+    }
+    TEST_CHECK(!over);
+    TEST_CHECK(AVMLIB_VM_HALTED == status);
+    TEST_CHECK((uint64_t)TEST_LOOPS * TEST_BODY == vm->retired);
+    TEST_CHECK(expect == test_gr2(vm));
+    TEST_CHECK(slices >= vm->retired / (budget + TEST_BODY));
+
+    /* Halted is for good */
+    before = vm->retired;
+    TEST_CHECK(AVMLIB_VM_HALTED == avmlib_vm_run(vm,budget));
+    TEST_CHECK(before == vm->retired);
+    avmlib_vm_free(vm);
+}
+
+/**************************************************************************//**
+ * @brief Every budget, against an unlimited run.
+ * */
+static void
+test_budgets(
+    avm_t *tmpl
+)
+{
+    static const uint64_t budgets[] = { 1, 2, 7, 1000, 65536 };
+    avmlib_vm_t *vm;
+    uint32_t expect;
+    int i;
+
+    if (NULL == (vm = test_instance(tmpl,TEST_LOOPS))) {
+        TEST_CHECK(!"instance");
+        return;
+    }
+    TEST_CHECK(AVMLIB_VM_HALTED == avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED));
+    expect = test_gr2(vm);
+    TEST_CHECK((uint32_t)((uint64_t)TEST_LOOPS * (TEST_LOOPS + 1) / 2) == expect);
+    avmlib_vm_free(vm);
+
+    for (i=0;i<sizeof(budgets)/sizeof(budgets[0]);i++) test_slices(tmpl,budgets[i],expect);
+}
+
+/**************************************************************************//**
+ * @brief Straight-line code isn't checked.
+ * */
+static void
+test_straight(void)
+{
+    class_segment_t seg;
+    avmlib_vm_t *vm;
+    table_t *code;
+    avm_t *tmpl;
+    int i;
+
+    test_segment_init(&seg,"test_budget_straight");
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+    for (i=0;i<10;i++) {
+        avmlib_table_add(code,avmlib_instruction_new(AVM_OP_SUB,0,1));
+        avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_REGISTER,TEST_GR1),0);
+    }
+    if ((NULL == (tmpl = test_template(&seg))) || (NULL == (vm = test_instance(tmpl,10)))) {
+        TEST_CHECK(!"program");
+        return;
+    }
+    TEST_CHECK(AVMLIB_VM_HALTED == avmlib_vm_run(vm,1));
+    TEST_CHECK(10 == vm->retired);
+    avmlib_vm_free(vm);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    class_segment_t seg;
+    avm_t *tmpl;
+
+    test_segment_init(&seg,"test_budget");
+    test_loop(&seg);
+    if (NULL == (tmpl = test_template(&seg))) {
+        fprintf(stderr,"test_budget: no template\n");
+        return 1;
+    }
+
+    /* Step 1: Interpreted */
+    avmlib_jit_enable(0);
+    test_budgets(tmpl);
+
+    /* Step 2: Compiled once hot, where the JIT builds */
+    avmlib_jit_enable(1);
+    test_budgets(tmpl);
+
+    /* Step 3: No branches */
+    test_straight();
+
+    printf("test_budget: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_BUDGET_C_ */
@@ -0,0 +1,89 @@
+/**************************************************************************//**
+ * @file test_buffer.c
+ *
+ * @brief Appending to mapped BUFFER entities.
+ *
+ * @details A copy-on-write mapping (what FILE makes) is exactly the
+ * file, so an append must move it to the heap: the contents are the
+ * file's followed by what was appended, and the file itself is left
+ * alone.  The same must hold for an empty file, which maps to nothing.
+ * A read-only mapping must refuse the append with EROFS and keep its
+ * contents.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_BUFFER_C_
+#define _TEST_BUFFER_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "test.h"
+
+#define TEST_TEXT "mapped text"
+#define TEST_MORE " and more"
+
+/**************************************************************************//**
+ * @brief Map a file and append to it.
+ * */
+static void
+test_append(
+    const char *path,
+    const char *text,
+    buffer_map_t mode
+)
+{
+    class_buffer_t *b = avmtype_buffer_new("test",0);
+    char expect[64], got[64];
+    size_t len = strlen(text);
+    FILE *f;
+
+    if (!b || (NULL == (f = fopen(path,"w"))) || (len != fwrite(text,1,len,f)) || fclose(f)) {
+        TEST_CHECK(!"setup");
+        return;
+    }
+    TEST_CHECK(0 == avmtype_buffer_map(b,path,mode));
+    TEST_CHECK((mode == b->map) && (len == b->size) && (len == b->capacity));
+
+    errno = 0;
+    if (BUFFER_MAP_READONLY == mode) {
+        TEST_CHECK((-1 == avmtype_buffer_write(b,TEST_MORE,strlen(TEST_MORE))) && (EROFS == errno));
+        snprintf(expect,sizeof(expect),"%s",text);
+    } else {
+        TEST_CHECK((int64_t)strlen(TEST_MORE) == avmtype_buffer_write(b,TEST_MORE,strlen(TEST_MORE)));
+        TEST_CHECK(BUFFER_MAP_NONE == b->map);
+        snprintf(expect,sizeof(expect),"%s%s",text,TEST_MORE);
+    }
+    TEST_CHECK((strlen(expect) == b->size) && !memcmp(expect,b->buf,b->size));
+    TEST_CHECK(strlen(expect) == avmtype_buffer_read(b,got,sizeof(got)));
+    TEST_CHECK(!memcmp(expect,got,strlen(expect)));
+
+    /* The file never changes */
+    memset(got,0,sizeof(got));
+    if (NULL != (f = fopen(path,"r"))) {
+        TEST_CHECK((len == fread(got,1,sizeof(got),f)) && !memcmp(text,got,len));
+        fclose(f);
+    }
+    avmtype_buffer_destroy(NULL,(entry_t)b);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char path[] = "/tmp/avm_test_bufferXXXXXX";
+    int fd;
+
+    if ((0 > (fd = mkstemp(path))) || (0 > close(fd))) return 1;
+    test_append(path,TEST_TEXT,BUFFER_MAP_COW);
+    test_append(path,"",BUFFER_MAP_COW);
+    test_append(path,TEST_TEXT,BUFFER_MAP_READONLY);
+    unlink(path);
+
+    printf("test_buffer: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_BUFFER_C_ */
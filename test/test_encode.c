@@ -0,0 +1,145 @@
+/**************************************************************************//**
+ * @file test_encode.c
+ *
+ * @brief Operand encoding: entity indexes and immediates.
+ *
+ * @details Emits entities at and around the edge of the compact index
+ * (AVM_ENTITY_INDEX_MASK) and checks that avmlib_entity_decode() and
+ * avmlib_operand_words() read back the same index and word count,
+ * with the class and flags left intact.  Then the same for immediates
+ * either side of AVM_IMMEDIATE_MAX, int32 and int64, and a program
+ * that adds wide immediates must get the right sums.  Exits nonzero on
+ * failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_ENCODE_C_
+#define _TEST_ENCODE_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+/**************************************************************************//**
+ * @brief Emit an entity index and read it back.
+ * */
+static void
+test_index(
+    avm_class_e class,
+    uint32_t index,
+    uint32_t flags
+)
+{
+    table_t *code = avmlib_table_new(4);
+    entity_t e = avmlib_entity_new(class,index) | flags;
+    int words = (index > AVM_ENTITY_INDEX_MASK) ? 2 : 1;
+    uint32_t got = ~index;
+
+    TEST_CHECK(words == avmlib_entity_emit(code,e,index));
+    TEST_CHECK(words == code->size);
+    TEST_CHECK(words == avmlib_operand_words(code->entries));
+    TEST_CHECK(words == avmlib_entity_decode(code->entries,&got));
+    TEST_CHECK(index == got);
+    TEST_CHECK(class == avmlib_entity_class(code->entries[0]));
+    TEST_CHECK(flags == (code->entries[0] & flags));
+    avmlib_table_destroy(code);
+}
+
+/**************************************************************************//**
+ * @brief Emit an immediate and read it back.
+ * */
+static void
+test_immediate(
+    int64_t val,
+    int words
+)
+{
+    table_t *code = avmlib_table_new(4);
+    int64_t got = ~val;
+
+    TEST_CHECK(words == avmlib_entity_emit(code,avmlib_immediate_new(val),(uint64_t)val));
+    TEST_CHECK(words == code->size);
+    TEST_CHECK(words == avmlib_operand_words(code->entries));
+    TEST_CHECK(words == avmlib_immediate_decode(code->entries,&got));
+    TEST_CHECK(val == got);
+    TEST_CHECK(AVM_CLASS_IMMEDIATE == avmlib_entity_class(code->entries[0]));
+    avmlib_table_destroy(code);
+}
+
+/**************************************************************************//**
+ * @brief Append ADD a,b,reg with immediate operands.
+ * */
+static void
+test_add(
+    table_t *code,
+    int64_t a,
+    int64_t b,
+    int reg
+)
+{
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_ADD,0,3));
+    avmlib_entity_emit(code,avmlib_immediate_new(a),(uint64_t)a);
+    avmlib_entity_emit(code,avmlib_immediate_new(b),(uint64_t)b);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_REGISTER,reg),0);
+}
+
+/**************************************************************************//**
+ * @brief The interpreter reads wide immediates from the code stream.
+ * */
+static void
+test_run(void)
+{
+    class_segment_t seg;
+    avmlib_vm_t *vm;
+    table_t *regs;
+    avm_t *tmpl;
+
+    test_segment_init(&seg,"test_encode");
+    test_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION),1 << 20,-(1 << 20) - 5,TEST_GR1);
+    test_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION),INT64_MIN,INT64_MAX - 0x1FFFFF,TEST_GR2);
+    if ((NULL == (tmpl = test_template(&seg))) || (NULL == (vm = avmlib_vm_new(tmpl)))) {
+        TEST_CHECK(!"program");
+        return;
+    }
+    TEST_CHECK(AVMLIB_VM_HALTED == avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED));
+    regs = AVM_CLASS_TABLE(vm->avm,AVM_CLASS_REGISTER);
+    TEST_CHECK((uint32_t)-5 == ((class_register_t *)regs->entries[TEST_GR1])->value);
+    TEST_CHECK((uint32_t)-0x200000 == ((class_register_t *)regs->entries[TEST_GR2])->value);
+    avmlib_vm_free(vm);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    test_index(AVM_CLASS_STRING,0,0);
+    test_index(AVM_CLASS_STRING,0xFFFF,0);
+    test_index(AVM_CLASS_STRING,0x10000,0);
+    test_index(AVM_CLASS_STRING,AVM_ENTITY_INDEX_MASK,0);
+    test_index(AVM_CLASS_STRING,AVM_ENTITY_INDEX_MASK + 1,0);
+    test_index(AVM_CLASS_LABEL,AVM_ENTITY_INDEX_MASK,OP_FLAG_LOCAL);
+    test_index(AVM_CLASS_LABEL,AVM_ENTITY_INDEX_MASK + 1,OP_FLAG_LOCAL);
+    test_index(AVM_CLASS_PORT,AVM_ENTITY_INDEX_MASK + 1,OP_FLAG_CONSTANT);
+    test_index(AVM_CLASS_REGISTER,0x7FFFFFFF,0);
+
+    test_immediate(0,1);
+    test_immediate(AVM_IMMEDIATE_MAX,1);
+    test_immediate(-AVM_IMMEDIATE_MAX,1);
+    test_immediate(1 << 20,2);
+    test_immediate(-(1 << 20),2);
+    test_immediate(0x1FFFFF,2);
+    test_immediate(INT32_MAX,2);
+    test_immediate(INT32_MIN,2);
+    test_immediate((int64_t)INT32_MAX + 1,3);
+    test_immediate((int64_t)INT32_MIN - 1,3);
+    test_immediate(INT64_MAX,3);
+    test_immediate(INT64_MIN,3);
+    test_run();
+
+    printf("test_encode: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_ENCODE_C_ */
@@ -0,0 +1,277 @@
+/**************************************************************************//**
+ * @file test_fileio.c
+ *
+ * @brief File ports through a fileio backend, directly and from a pool.
+ *
+ * @details First, on each backend (io_uring is skipped if the kernel
+ * won't give us a ring), reads queued back to back on one port must get
+ * consecutive offsets (not all the port's offset at submit time), and
+ * a short read at the end must leave the offset at end of file; writes
+ * queued back to back must all land, in order, after what the file
+ * already held; and a writable port not open O_APPEND is refused.  Then
+ * a pool started with AVM_FILEIO=threads runs jobs that FILE a port
+ * onto an input file, IN a line from it, FILE another onto an output
+ * file and OUT the line; every job must halt and every line must land
+ * in the output.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_FILEIO_C_
+#define _TEST_FILEIO_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_JOBS 16
+#define TEST_WORKERS 2
+#define TEST_LINE "hello\n"
+
+static char test_in[] = "/tmp/avm_test_fileio_inXXXXXX";
+static char test_out[] = "/tmp/avm_test_fileio_outXXXXXX";
+static avmlib_vm_status_t test_status[TEST_JOBS];
+
+/**************************************************************************//**
+ * @brief Queue three reads on one port before any of them complete.
+ * */
+static void
+test_offsets(
+    fileio_backend_t backend
+)
+{
+    unsigned char data[64], got[3][64];
+    class_process_t procs[3];
+    avmlib_fileio_t *io;
+    class_port_t *port;
+    int fd, i;
+
+    for (i=0;i<(int)sizeof(data);i++) data[i] = (unsigned char)i;
+    if ((0 > (fd = open(test_in,O_WRONLY|O_TRUNC))) || (sizeof(data) != write(fd,data,sizeof(data)))) {
+        TEST_CHECK(0);
+        return;
+    }
+    close(fd);
+
+    memset(procs,0,sizeof(procs));
+    port = avmlib_port_new("@test",-1,NULL);
+    io = avmlib_fileio_new(NULL,backend,0);
+    TEST_CHECK(port && io);
+    if (!port || !io) return;
+    TEST_CHECK(0 == avmlib_port_open_file(port,test_in));
+    TEST_CHECK(0 == avmlib_fileio_add_port(io,port));
+
+    TEST_CHECK(AVMLIB_IO_WOULDBLOCK == avmlib_fileio_read(io,&procs[0],port,got[0],16));
+    TEST_CHECK(AVMLIB_IO_WOULDBLOCK == avmlib_fileio_read(io,&procs[1],port,got[1],16));
+    TEST_CHECK(AVMLIB_IO_WOULDBLOCK == avmlib_fileio_read(io,&procs[2],port,got[2],64));
+    while (io->inflight && (0 <= avmlib_fileio_poll(io,1)));
+
+    TEST_CHECK((16 == procs[0].io_result) && !memcmp(got[0],data,16));
+    TEST_CHECK((16 == procs[1].io_result) && !memcmp(got[1],data + 16,16));
+    TEST_CHECK((32 == procs[2].io_result) && !memcmp(got[2],data + 32,32));
+    TEST_CHECK(64 == port->rd_offset);
+
+    avmlib_fileio_destroy(io);
+    avmlib_port_destroy(NULL,(entry_t)port);
+}
+
+/**************************************************************************//**
+ * @brief Queue two writes on one port; refuse a port without O_APPEND.
+ * */
+static void
+test_append(
+    fileio_backend_t backend
+)
+{
+    class_process_t procs[2];
+    avmlib_fileio_t *io;
+    class_port_t *port;
+    char got[16];
+    ssize_t n;
+    int fd;
+
+    if ((0 > (fd = open(test_out,O_WRONLY|O_TRUNC))) || (4 != write(fd,"head",4))) {
+        TEST_CHECK(0);
+        return;
+    }
+    close(fd);
+
+    /* Step 1: Both land after what was there */
+    memset(procs,0,sizeof(procs));
+    port = avmlib_port_new("@test",-1,NULL);
+    io = avmlib_fileio_new(NULL,backend,0);
+    TEST_CHECK(port && io);
+    if (!port || !io) return;
+    TEST_CHECK(0 == avmlib_port_open_file(port,test_out));
+    TEST_CHECK(0 == avmlib_fileio_add_port(io,port));
+    TEST_CHECK(AVMLIB_IO_WOULDBLOCK == avmlib_fileio_write(io,&procs[0],port,"AAAA",4));
+    TEST_CHECK(AVMLIB_IO_WOULDBLOCK == avmlib_fileio_write(io,&procs[1],port,"BBBB",4));
+    while (io->inflight && (0 <= avmlib_fileio_poll(io,1)));
+    TEST_CHECK((4 == procs[0].io_result) && (4 == procs[1].io_result));
+    if (0 > (fd = open(test_out,O_RDONLY))) {
+        TEST_CHECK(0);
+    } else {
+        n = read(fd,got,sizeof(got));
+        close(fd);
+        TEST_CHECK((12 == n) && !memcmp(got,"headAAAABBBB",12));
+    }
+
+    /* Step 2: Writable, but not O_APPEND */
+    if (0 > (fd = open(test_out,O_WRONLY))) {
+        TEST_CHECK(0);
+    } else {
+        TEST_CHECK(0 == avmlib_port_set_fd(port,fd,0));
+        TEST_CHECK((0 > avmlib_fileio_add_port(io,port)) && (EINVAL == errno));
+        TEST_CHECK(NULL == port->fileio);
+    }
+
+    avmlib_fileio_destroy(io);
+    avmlib_port_destroy(NULL,(entry_t)port);
+}
+
+/**************************************************************************//**
+ * @brief Direct requests on one backend.
+ * */
+static void
+test_backend(
+    fileio_backend_t backend
+)
+{
+    avmlib_fileio_t *io;
+
+    if (NULL == (io = avmlib_fileio_new(NULL,backend,0))) {
+        printf("test_fileio: no io_uring; skipped\n");
+        return;
+    }
+    avmlib_fileio_destroy(io);
+    test_offsets(backend);
+    test_append(backend);
+}
+
+/**************************************************************************//**
+ * @brief Write the program:
+ * FILE @stdin,in / IN @stdin,line / FILE @stdout,out / OUT @stdout,line.
+ *
+ * @returns A template running it, or NULL on failure.
+ * */
+static avm_t *
+test_program(void)
+{
+    class_segment_t seg;
+    table_t *code, *strings;
+
+    test_segment_init(&seg,"test_fileio");
+    strings = AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING);
+    avmlib_table_add(strings,avmtype_string_new("line",NULL));
+    avmlib_table_add(strings,avmtype_string_new("in",test_in));
+    avmlib_table_add(strings,avmtype_string_new("out",test_out));
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_FILE,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_IN),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,1),0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_IN,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_IN),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_FILE,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_OUT),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,2),0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_OUT,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_OUT),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+
+    return test_template(&seg);
+}
+
+/**************************************************************************//**
+ * @brief Job completion.
+ * */
+static void
+test_done(
+    avmlib_vm_t *vm,
+    avmlib_vm_status_t status,
+    void *arg
+)
+{
+    *(avmlib_vm_status_t *)arg = status;
+}
+
+/**************************************************************************//**
+ * @brief Run the program's jobs through a pool on the threads backend.
+ * */
+static void
+test_pool(void)
+{
+    char got[TEST_JOBS * sizeof(TEST_LINE) + 1];
+    avmlib_pool_t *pool;
+    avm_t *tmpl;
+    ssize_t n;
+    int fd, i;
+
+    /* Step 1: Input, program, template, pool */
+    if ((0 > (fd = open(test_in,O_WRONLY|O_TRUNC))) ||
+        ((ssize_t)strlen(TEST_LINE) != write(fd,TEST_LINE,strlen(TEST_LINE)))) {
+        TEST_CHECK(0);
+        return;
+    }
+    close(fd);
+    if (0 > truncate(test_out,0)) {
+        TEST_CHECK(0);
+        return;
+    }
+    if (NULL == (tmpl = test_program())) {
+        TEST_CHECK(0);
+        return;
+    }
+    setenv(AVMLIB_POOL_FILEIO_ENV,"threads",1);
+    pool = avmlib_pool_new(tmpl,TEST_WORKERS);
+    TEST_CHECK(NULL != pool);
+    if (!pool) return;
+    for (i=0;i<TEST_WORKERS;i++) TEST_CHECK(NULL != pool->workers[i].io);
+
+    /* Step 2: Run them all */
+    for (i=0;i<TEST_JOBS;i++) {
+        test_status[i] = AVMLIB_VM_READY;
+        avmlib_pool_run(pool,NULL,test_done,&test_status[i]);
+    }
+    avmlib_pool_wait(pool);
+    avmlib_pool_free(pool);
+
+    /* Step 3: Each halted, and wrote its line */
+    for (i=0;i<TEST_JOBS;i++) TEST_CHECK(AVMLIB_VM_HALTED == test_status[i]);
+    if (0 > (fd = open(test_out,O_RDONLY))) {
+        TEST_CHECK(0);
+        return;
+    }
+    n = read(fd,got,sizeof(got));
+    close(fd);
+    TEST_CHECK((ssize_t)(TEST_JOBS * strlen(TEST_LINE)) == n);
+    for (i=0;(i<TEST_JOBS) && ((i + 1) * (ssize_t)strlen(TEST_LINE) <= n);i++) {
+        TEST_CHECK(!memcmp(got + i * strlen(TEST_LINE),TEST_LINE,strlen(TEST_LINE)));
+    }
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    int fd;
+
+    if ((0 > (fd = mkstemp(test_in))) || (0 > close(fd)) ||
+        (0 > (fd = mkstemp(test_out))) || (0 > close(fd))) {
+        return 1;
+    }
+    test_backend(FILEIO_BACKEND_THREADS);
+    test_backend(FILEIO_BACKEND_URING);
+    test_pool();
+    unlink(test_in);
+    unlink(test_out);
+    printf("test_fileio: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_FILEIO_C_ */
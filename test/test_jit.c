@@ -0,0 +1,246 @@
+/**************************************************************************//**
+ * @file test_jit.c
+ *
+ * @brief JIT-compiled code against the interpreter.
+ *
+ * @details One program mixes everything the JIT compiles itself (ADD
+ * and SUB in their one, two and three operand forms, STOR, compact and
+ * wide immediates, 32-bit register wraparound, JZ, JNZ and GOTO, taken
+ * and not) with an instruction it hands back to the interpreter (STOR
+ * into a STRING) inside the hot loop.  It is run interpreted, then
+ * with the JIT on (it compiles partway through the first run), whole
+ * and in budget slices; every register, the string and the retired
+ * count must come out the same each way.  Where the JIT isn't built,
+ * every run interprets and the test still passes.  Exits nonzero on
+ * failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_JIT_C_
+#define _TEST_JIT_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+#define TEST_LOOPS 50000
+#define TEST_BUDGET 777
+
+/* GR0 to GR7 */
+#define TEST_GR(__n) (2 + (__n))
+#define TEST_REGS 8
+
+/* Labels, in unresolved-table order */
+enum { TEST_L_LOOP, TEST_L_NEVER, TEST_L_END };
+static const char *test_labels[] = { "loop", "never", "end" };
+
+/**
+ * What a run leaves behind
+ */
+typedef struct {
+    uint32_t regs[TEST_REGS];
+    char text[32];
+    uint64_t retired;
+} test_result_t;
+
+/**************************************************************************//**
+ * @brief Operand emitters.
+ * */
+static void
+test_reg(
+    table_t *code,
+    int n
+)
+{
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_REGISTER,TEST_GR(n)),0);
+}
+
+static void
+test_imm(
+    table_t *code,
+    int64_t v
+)
+{
+    avmlib_entity_emit(code,avmlib_immediate_new(v),(uint64_t)v);
+}
+
+static void
+test_to(
+    table_t *code,
+    int label
+)
+{
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_UNRESOLVED,label),0);
+}
+
+/**************************************************************************//**
+ * @brief Mark a label at the next instruction.
+ * */
+static void
+test_label(
+    class_segment_t *seg,
+    int label
+)
+{
+    avmlib_table_add(AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL),
+                     avmlib_new_label((char *)test_labels[label],AVMM_SEGMENT_UNLINKED,
+                                      AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION)->size));
+}
+
+/**************************************************************************//**
+ * @brief The program; GR1 is the loop count.
+ *
+ * @details
+ *   loop:  ADD GR1,GR2,GR2       ; three operands
+ *          ADD GR3,0x7FFFFFFF    ; two, wide immediate; wraps
+ *          SUB GR4,-70000        ; wide negative immediate
+ *          ADD GR5,0x123456789,GR6 ; 64-bit immediate; truncated
+ *          ADD GR5               ; one operand
+ *          STOR GR7,GR1          ; register to register
+ *          STOR text,GR1         ; handed to the interpreter
+ *          JZ GR5,never          ; not taken
+ *          SUB GR1
+ *          JNZ GR1,loop
+ *          GOTO end
+ *   never: STOR GR0,1
+ *   end:   NOP
+ * */
+static avm_t *
+test_program(void)
+{
+    class_segment_t seg;
+    table_t *code;
+    int i;
+
+    test_segment_init(&seg,"test_jit");
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING),avmtype_string_new("text",""));
+    for (i=0;i<sizeof(test_labels)/sizeof(test_labels[0]);i++) {
+        avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_UNRESOLVED),
+                         avmlib_unresolved_new((char *)test_labels[i]));
+    }
+
+    test_label(&seg,TEST_L_LOOP);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_ADD,0,3));
+    test_reg(code,1); test_reg(code,2); test_reg(code,2);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_ADD,0,2));
+    test_reg(code,3); test_imm(code,0x7FFFFFFF);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_SUB,0,2));
+    test_reg(code,4); test_imm(code,-70000);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_ADD,0,3));
+    test_reg(code,5); test_imm(code,0x123456789LL); test_reg(code,6);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_ADD,0,1));
+    test_reg(code,5);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_STOR,0,2));
+    test_reg(code,7); test_reg(code,1);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_STOR,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0); test_reg(code,1);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_JZ,0,2));
+    test_reg(code,5); test_to(code,TEST_L_NEVER);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_SUB,0,1));
+    test_reg(code,1);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_JNZ,0,2));
+    test_reg(code,1); test_to(code,TEST_L_LOOP);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_GOTO,0,1));
+    test_to(code,TEST_L_END);
+    test_label(&seg,TEST_L_NEVER);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_STOR,0,2));
+    test_reg(code,0); test_imm(code,1);
+    test_label(&seg,TEST_L_END);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_NOP,0,0));
+
+    return test_template(&seg);
+}
+
+/**************************************************************************//**
+ * @brief Run an instance to the end on a budget.
+ * */
+static void
+test_run(
+    avm_t *tmpl,
+    uint64_t budget,
+    test_result_t *res
+)
+{
+    avmlib_vm_status_t status;
+    class_register_t *gr1;
+    class_string_t *text;
+    table_t *regs;
+    avmlib_vm_t *vm;
+    int i;
+
+    memset(res,0,sizeof(*res));
+    if ((NULL == (vm = avmlib_vm_new(tmpl))) ||
+        (NULL == (gr1 = avmlib_machine_own(vm->avm,AVM_CLASS_REGISTER,TEST_GR(1))))) {
+        TEST_CHECK(!"instance");
+        return;
+    }
+    gr1->value = TEST_LOOPS;
+    while (AVMLIB_VM_YIELDED == (status = avmlib_vm_run(vm,budget)));
+    TEST_CHECK(AVMLIB_VM_HALTED == status);
+    regs = AVM_CLASS_TABLE(vm->avm,AVM_CLASS_REGISTER);
+    for (i=0;i<TEST_REGS;i++) res->regs[i] = ((class_register_t *)regs->entries[TEST_GR(i)])->value;
+    if (NULL != (text = avmlib_machine_local(vm->avm,vm->proc.segment,AVM_CLASS_STRING,0))) {
+        snprintf(res->text,sizeof(res->text),"%s",text->text ? text->text : "");
+    }
+    res->retired = vm->retired;
+    avmlib_vm_free(vm);
+}
+
+/**************************************************************************//**
+ * @brief Two runs agree.
+ * */
+static void
+test_same(
+    const test_result_t *a,
+    const test_result_t *b
+)
+{
+    int i;
+
+    for (i=0;i<TEST_REGS;i++) TEST_CHECK(a->regs[i] == b->regs[i]);
+    TEST_CHECK(!strcmp(a->text,b->text));
+    TEST_CHECK(a->retired == b->retired);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    test_result_t interp, jit;
+    avm_t *tmpl;
+
+    if (NULL == (tmpl = test_program())) {
+        fprintf(stderr,"test_jit: no template\n");
+        return 1;
+    }
+
+    /* Step 1: Interpreted, checked against what the program computes */
+    avmlib_jit_enable(0);
+    test_run(tmpl,AVMLIB_VM_UNLIMITED,&interp);
+    TEST_CHECK(0 == interp.regs[0]);
+    TEST_CHECK(0 == interp.regs[1]);
+    TEST_CHECK((uint32_t)((uint64_t)TEST_LOOPS * (TEST_LOOPS + 1) / 2) == interp.regs[2]);
+    TEST_CHECK((uint32_t)((uint64_t)TEST_LOOPS * 0x7FFFFFFF) == interp.regs[3]);
+    TEST_CHECK((uint32_t)((uint64_t)TEST_LOOPS * 70000) == interp.regs[4]);
+    TEST_CHECK(TEST_LOOPS == interp.regs[5]);
+    TEST_CHECK((uint32_t)(0x123456789LL + TEST_LOOPS - 1) == interp.regs[6]);
+    TEST_CHECK(1 == interp.regs[7]);
+    TEST_CHECK(!strcmp("1",interp.text));
+    TEST_CHECK((uint64_t)TEST_LOOPS * 10 + 2 == interp.retired);
+
+    /* Step 2: JIT, whole and in slices */
+    avmlib_jit_enable(1);
+    test_run(tmpl,AVMLIB_VM_UNLIMITED,&jit);
+    test_same(&interp,&jit);
+    test_run(tmpl,TEST_BUDGET,&jit);
+    test_same(&interp,&jit);
+
+    printf("test_jit: %s%s\n",test_failed?"FAILED":"ok",
+           avmlib_segment_get(tmpl,0)->native ? "" : " (interpreted only)");
+    return test_failed;
+}
+
+#endif /* _TEST_JIT_C_ */
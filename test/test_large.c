@@ -0,0 +1,166 @@
+/**************************************************************************//**
+ * @file test_large.c
+ *
+ * @brief BUFFER entities larger than UINT32_MAX.
+ *
+ * @details Maps a sparse file a little over 4 GiB with marks written
+ * across the 4 GiB line and at the very end, and checks the size,
+ * views and reads past UINT32_MAX, and that serializing refuses a
+ * destination sized for a wrapped length.  The buffer is then written
+ * out through a file port and the result mapped back into a second
+ * buffer, which must match.  Last, a program FILEs the source into a
+ * BUFFER and INs past the 4 GiB line with a 64-bit count, then INs the
+ * mark.  The sparse source reads as zero pages, so only the copy (about
+ * 4 GiB of page cache) costs anything.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_LARGE_C_
+#define _TEST_LARGE_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "test.h"
+
+/* A page past 4 GiB */
+#define TEST_SIZE (((uint64_t)4 << 30) + 4096)
+
+/* Straddles byte 2^32 */
+#define TEST_MARK "ABCDEFGH"
+#define TEST_MARK_AT ((uint64_t)UINT32_MAX - 3)
+
+/* The last bytes */
+#define TEST_END "END!"
+#define TEST_END_AT (TEST_SIZE - 4)
+
+/**************************************************************************//**
+ * @brief Check a buffer's size and both marks.
+ * */
+static void
+test_marks(
+    class_buffer_t *b
+)
+{
+    const void *v;
+    char got[8];
+
+    TEST_CHECK(TEST_SIZE == b->size);
+
+    b->cursor = TEST_MARK_AT;
+    TEST_CHECK((8 == avmtype_buffer_view(b,8,&v)) && !memcmp(v,TEST_MARK,8));
+    TEST_CHECK(TEST_MARK_AT + 8 == b->cursor);
+
+    b->cursor = TEST_END_AT;
+    TEST_CHECK((4 == avmtype_buffer_read(b,got,sizeof(got))) && !memcmp(got,TEST_END,4));
+    TEST_CHECK(TEST_SIZE == b->cursor);
+    TEST_CHECK(0 == avmtype_buffer_view(b,8,&v));
+}
+
+/**************************************************************************//**
+ * @brief Run a program over the source:
+ * FILE big,src / IN big,GR1,TEST_MARK_AT / IN big,mark,8.
+ * */
+static void
+test_vm_in(
+    char *src
+)
+{
+    class_segment_t seg;
+    class_buffer_t *b;
+    class_string_t *mark;
+    avmlib_vm_t *vm;
+    avm_t *tmpl;
+    table_t *code;
+
+    test_segment_init(&seg,"test_large");
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_BUFFER),avmtype_buffer_new("big",0));
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING),avmtype_string_new("src",src));
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING),avmtype_string_new("mark",NULL));
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_FILE,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_BUFFER,0),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_IN,0,3));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_BUFFER,0),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_REGISTER,TEST_GR1),0);
+    avmlib_entity_emit(code,avmlib_immediate_new((int64_t)TEST_MARK_AT),TEST_MARK_AT);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_IN,0,3));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_BUFFER,0),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,1),0);
+    avmlib_entity_emit(code,avmlib_immediate_new(8),0);
+
+    if ((NULL == (tmpl = test_template(&seg))) || (NULL == (vm = avmlib_vm_new(tmpl)))) {
+        TEST_CHECK(!"program");
+        return;
+    }
+
+    TEST_CHECK(AVMLIB_VM_HALTED == avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED));
+    b = avmlib_machine_local(vm->avm,vm->proc.segment,AVM_CLASS_BUFFER,0);
+    mark = avmlib_machine_local(vm->avm,vm->proc.segment,AVM_CLASS_STRING,1);
+    TEST_CHECK(b && (TEST_SIZE == b->size) && (TEST_MARK_AT + 8 == b->cursor));
+    TEST_CHECK(mark && mark->text && !strcmp(mark->text,TEST_MARK));
+    avmlib_vm_free(vm);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char src[] = "/tmp/avm_test_large_srcXXXXXX";
+    char dst[] = "/tmp/avm_test_large_dstXXXXXX";
+    class_buffer_t *b, *c;
+    class_port_t *port;
+    static char bin[1 << 20];
+    int fd;
+
+    /* Step 1: Sparse source with its marks */
+    if ((0 > (fd = mkstemp(src))) || (0 > ftruncate(fd,(off_t)TEST_SIZE)) ||
+        (8 != pwrite(fd,TEST_MARK,8,(off_t)TEST_MARK_AT)) ||
+        (4 != pwrite(fd,TEST_END,4,(off_t)TEST_END_AT))) {
+        perror("test_large");
+        return 1;
+    }
+    close(fd);
+    if (0 > (fd = mkstemp(dst))) {
+        unlink(src);
+        return 1;
+    }
+    close(fd);
+
+    /* Step 2: Map it */
+    b = avmtype_buffer_new("big",0);
+    TEST_CHECK(0 == avmtype_buffer_map(b,src,BUFFER_MAP_COW));
+    test_marks(b);
+
+    /* Step 3: A size wrapped to 32 bits would fit here */
+    errno = 0;
+    TEST_CHECK(-1 == avmtype_buffer_serialize(NULL,(entry_t)b,bin,sizeof(bin)));
+    TEST_CHECK(ENOBUFS == errno);
+
+    /* Step 4: Out through a port, and back in */
+    port = avmlib_port_new("@test",-1,NULL);
+    TEST_CHECK(0 == avmlib_port_open_file(port,dst));
+    TEST_CHECK((ssize_t)TEST_SIZE == avmlib_port_write(port,b->buf,(size_t)b->size));
+    TEST_CHECK(0 == avmlib_port_flush(port));
+    avmlib_port_destroy(NULL,(entry_t)port);
+    c = avmtype_buffer_new("copy",0);
+    TEST_CHECK(0 == avmtype_buffer_map(c,dst,BUFFER_MAP_READONLY));
+    test_marks(c);
+
+    /* Step 5: IN past 4 GiB from a program */
+    test_vm_in(src);
+
+    avmtype_buffer_destroy(NULL,(entry_t)b);
+    avmtype_buffer_destroy(NULL,(entry_t)c);
+    unlink(src);
+    unlink(dst);
+    printf("test_large: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_LARGE_C_ */
@@ -0,0 +1,220 @@
+/**************************************************************************//**
+ * @file test_log.c
+ *
+ * @brief Log levels, targets and asynchronous output.
+ *
+ * @details A debug message prints only at or under the debug level, a
+ * log message only above AVMLIB_LOG_QUIET, and a filtered message
+ * doesn't evaluate its arguments; errors always print, at once, even
+ * with async output on.  A thread's own targets take its messages.
+ * With async output on, several threads logging at once must have
+ * every line written, each thread's in order, by avmlib_log_flush().
+ * Built with AVM_QUIET (test_log_quiet), log and debug messages must
+ * never print or evaluate their arguments, at any level.  Exits
+ * nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_LOG_C_
+#define _TEST_LOG_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "test.h"
+
+#define TEST_THREADS 4
+#define TEST_LINES 20000
+
+#ifdef AVM_QUIET
+#define TEST_NAME "test_log_quiet"
+#define TEST_PRINTS 0
+#else
+#define TEST_NAME "test_log"
+#define TEST_PRINTS 1
+#endif
+
+static int test_evaluated;
+
+/**************************************************************************//**
+ * @brief An argument that counts its evaluations.
+ * */
+static int
+test_arg(void)
+{
+    return ++test_evaluated;
+}
+
+/**************************************************************************//**
+ * @brief Lines written to a target since it was last rewound.
+ * */
+static int
+test_lines(
+    FILE *f
+)
+{
+    char line[256];
+    int n = 0;
+
+    fflush(f);
+    rewind(f);
+    while (fgets(line,sizeof(line),f)) n++;
+    rewind(f);
+    if (0 > ftruncate(fileno(f),0)) TEST_CHECK(!"ftruncate");
+    return n;
+}
+
+/**************************************************************************//**
+ * @brief Levels, and unevaluated arguments.
+ * */
+static void
+test_levels(
+    FILE *log,
+    FILE *err
+)
+{
+    /* Step 1: Debug */
+    test_evaluated = 0;
+    avm_set_debuglevel(2);
+    avm_dbg(2,"TEST","at the level %d\n",test_arg());
+    avm_dbg(1,"TEST","under the level %d\n",test_arg());
+    avm_dbg(3,"TEST","over the level %d\n",test_arg());
+    TEST_CHECK(2 * TEST_PRINTS == test_evaluated);
+    TEST_CHECK(2 * TEST_PRINTS == test_lines(log));
+    avm_set_debuglevel(0);
+
+    /* Step 2: Log */
+    test_evaluated = 0;
+    avm_log("TEST","normal %d\n",test_arg());
+    avm_set_loglevel(AVMLIB_LOG_QUIET);
+    avm_log("TEST","quiet %d\n",test_arg());
+    avm_dbg(1,"TEST","quiet debug %d\n",test_arg());
+    TEST_CHECK(TEST_PRINTS == test_evaluated);
+    TEST_CHECK(TEST_PRINTS == test_lines(log));
+
+    /* Step 3: Errors print anyway */
+    avm_err("TEST","error %d\n",test_arg());
+    TEST_CHECK(1 == test_lines(err));
+    avm_set_loglevel(AVMLIB_LOG_NORMAL);
+}
+
+/**
+ * A logging thread
+ */
+typedef struct {
+    int id;
+    FILE *log; /* Its own target, or NULL */
+} test_thread_t;
+
+/**************************************************************************//**
+ * @brief Log numbered lines.
+ * */
+static void *
+test_logger(
+    void *arg
+)
+{
+    test_thread_t *t = arg;
+    int i;
+
+    if (t->log) avmlib_log_set_thread(t->log,NULL);
+    for (i=0;i<TEST_LINES;i++) avm_log("TEST","%d %d\n",t->id,i);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Every thread's lines, in order.
+ * */
+static void
+test_order(
+    FILE *log,
+    int threads,
+    int lines
+)
+{
+    int next[TEST_THREADS] = { 0 }, id, i, n = 0, bad = 0;
+    char line[256];
+
+    rewind(log);
+    while (fgets(line,sizeof(line),log)) {
+        n++;
+        if ((2 != sscanf(line,"TEST: %d %d",&id,&i)) || (id < 0) || (id >= threads) ||
+            (i != next[id]++)) {
+            bad++;
+        }
+    }
+    TEST_CHECK(!bad);
+    TEST_CHECK(threads * lines == n);
+    for (id=0;id<threads;id++) TEST_CHECK(lines == next[id]);
+    rewind(log);
+    if (0 > ftruncate(fileno(log),0)) TEST_CHECK(!"ftruncate");
+}
+
+/**************************************************************************//**
+ * @brief Threads' own targets, then async output.
+ * */
+static void
+test_threads(
+    FILE *log,
+    FILE *err
+)
+{
+    test_thread_t t[TEST_THREADS];
+    pthread_t thr[TEST_THREADS];
+    FILE *own;
+    int i;
+
+    /* Step 1: A thread's own target */
+    if (NULL == (own = tmpfile())) {
+        TEST_CHECK(!"tmpfile");
+        return;
+    }
+    t[0].id = 0;
+    t[0].log = own;
+    if (pthread_create(&thr[0],NULL,test_logger,&t[0]) || pthread_join(thr[0],NULL)) {
+        TEST_CHECK(!"pthread");
+        return;
+    }
+    TEST_CHECK(0 == test_lines(log));
+    test_order(own,1,TEST_PRINTS * TEST_LINES);
+    fclose(own);
+
+    /* Step 2: Async, from every thread at once */
+    TEST_CHECK(0 == avmlib_log_async(1));
+    for (i=0;i<TEST_THREADS;i++) {
+        t[i].id = i;
+        t[i].log = NULL;
+        if (pthread_create(&thr[i],NULL,test_logger,&t[i])) {
+            TEST_CHECK(!"pthread");
+            return;
+        }
+    }
+    avm_err("TEST","error while async\n");
+    TEST_CHECK(1 == test_lines(err));
+    for (i=0;i<TEST_THREADS;i++) pthread_join(thr[i],NULL);
+    avmlib_log_flush();
+    test_order(log,TEST_THREADS,TEST_PRINTS * TEST_LINES);
+    avmlib_log_async(0);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    FILE *log, *err;
+
+    if ((NULL == (log = tmpfile())) || (NULL == (err = tmpfile()))) return 1;
+    avmlib_log_set_log(log);
+    avmlib_log_set_err(err);
+    test_levels(log,err);
+    test_threads(log,err);
+    avmlib_log_set_log(stdout);
+    avmlib_log_set_err(stderr);
+
+    printf(TEST_NAME ": %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_LOG_C_ */
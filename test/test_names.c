@@ -0,0 +1,136 @@
+/**************************************************************************//**
+ * @file test_names.c
+ *
+ * @brief The interned name table.
+ *
+ * @details The table is per process, so the order matters.  First,
+ * with nothing interned, name blocks as a restored image carries them
+ * must be adopted in place: their offsets resolve, interning finds the
+ * names already there and appends after them, and only an identical
+ * table is accepted a second time.  Then interning must give one
+ * offset per distinct name across several blocks and hash growth,
+ * truncate long names to AVMLIB_NAME_MAX (so they intern the same as
+ * their truncation), and give offset 0 for the anonymous name.  Exits
+ * nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_NAMES_C_
+#define _TEST_NAMES_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+#define TEST_NAMES 20000
+
+/* An image's name block: offset 0 empty, then "alpha" and "beta" */
+static const char test_image[] = "\0alpha\0beta";
+#define TEST_ALPHA 1
+#define TEST_BETA 7
+#define TEST_IMAGE_BYTES sizeof(test_image)
+
+/**************************************************************************//**
+ * @brief Blocks from an image are used in place.
+ * */
+static void
+test_adopt(void)
+{
+    char *block = calloc(1,AVMLIB_NAMES_BLOCK_SIZE);
+    char *again = calloc(1,AVMLIB_NAMES_BLOCK_SIZE);
+    uint32_t off;
+
+    if (!block || !again) {
+        TEST_CHECK(!"calloc");
+        return;
+    }
+    memcpy(block,test_image,TEST_IMAGE_BYTES);
+    memcpy(again,test_image,TEST_IMAGE_BYTES);
+
+    /* Step 1: Nothing interned yet, so the image's offsets hold */
+    TEST_CHECK(0 == avmlib_names_adopt(block,TEST_IMAGE_BYTES));
+    TEST_CHECK(TEST_IMAGE_BYTES == avmlib_names_bytes());
+    TEST_CHECK(!strcmp("alpha",avmlib_name(TEST_ALPHA)));
+    TEST_CHECK(!strcmp("beta",avmlib_name(TEST_BETA)));
+
+    /* Step 2: The same image again; anything else is refused */
+    TEST_CHECK(0 == avmlib_names_adopt(again,TEST_IMAGE_BYTES));
+    again[TEST_BETA] = 'B';
+    TEST_CHECK(0 > avmlib_names_adopt(again,TEST_IMAGE_BYTES));
+    TEST_CHECK(0 > avmlib_names_adopt(again,TEST_IMAGE_BYTES + 1));
+
+    /* Step 3: Interning finds the adopted names, and appends after them */
+    TEST_CHECK(TEST_BETA == avmlib_name_intern("beta"));
+    TEST_CHECK(TEST_ALPHA == avmlib_name_intern("alpha"));
+    TEST_CHECK(TEST_IMAGE_BYTES == (off = avmlib_name_intern("gamma")));
+    TEST_CHECK(!strcmp("gamma",avmlib_name(off)));
+    TEST_CHECK(!strcmp("alpha",avmlib_name(TEST_ALPHA)));
+    free(again);
+}
+
+/**************************************************************************//**
+ * @brief One offset per name, across blocks and rehashes.
+ * */
+static void
+test_dedup(void)
+{
+    static uint32_t offs[TEST_NAMES];
+    char name[32];
+    uint64_t bytes;
+    int i;
+
+    TEST_CHECK(0 == avmlib_name_intern(NULL));
+    TEST_CHECK(0 == avmlib_name_intern(""));
+    TEST_CHECK(!strcmp("",avmlib_name(0)));
+
+    for (i=0;i<TEST_NAMES;i++) {
+        snprintf(name,sizeof(name),"test_name_%d",i);
+        offs[i] = avmlib_name_intern(name);
+        TEST_CHECK(offs[i] && !strcmp(name,avmlib_name(offs[i])));
+    }
+    bytes = avmlib_names_bytes();
+    TEST_CHECK(bytes > 2 * AVMLIB_NAMES_BLOCK_SIZE);
+    for (i=0;i<TEST_NAMES;i++) {
+        snprintf(name,sizeof(name),"test_name_%d",i);
+        TEST_CHECK(offs[i] == avmlib_name_intern(name));
+        if (i) TEST_CHECK(offs[i] != offs[i - 1]);
+    }
+    TEST_CHECK(bytes == avmlib_names_bytes());
+}
+
+/**************************************************************************//**
+ * @brief Long names are cut to AVMLIB_NAME_MAX.
+ * */
+static void
+test_truncate(void)
+{
+    char name[AVMLIB_NAME_MAX * 2];
+    uint32_t off;
+
+    memset(name,'n',sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    off = avmlib_name_intern(name);
+    TEST_CHECK(off && (AVMLIB_NAME_MAX == strlen(avmlib_name(off))));
+    name[AVMLIB_NAME_MAX + 1] = '\0';
+    TEST_CHECK(off == avmlib_name_intern(name));
+    name[AVMLIB_NAME_MAX] = '\0';
+    TEST_CHECK(off == avmlib_name_intern(name));
+    name[AVMLIB_NAME_MAX - 1] = '\0';
+    TEST_CHECK(off != avmlib_name_intern(name));
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    test_adopt();
+    test_dedup();
+    test_truncate();
+
+    printf("test_names: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_NAMES_C_ */
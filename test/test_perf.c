@@ -0,0 +1,192 @@
+/**************************************************************************//**
+ * @file test_perf.c
+ *
+ * @brief perf map output.
+ *
+ * @details Every line of /tmp/perf-<pid>.map must be "<start> <size>
+ * <name>", start and size in bare lowercase hex, as perf reads it.
+ * avmlib_perf_code() must write one such line per nonempty run.
+ * avmlib_perf_segment() must name each labelled run
+ * "avm:<segment>:<label>" (the first label at a word wins; labels on
+ * words that don't start an instruction are skipped), and the code
+ * outside them "avm:<segment>", with runs that tile the code exactly.
+ * Then the JIT, hot on a loop, must name it the same way.  Nothing is
+ * written once output is turned off.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_PERF_C_
+#define _TEST_PERF_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_LINES 64
+#define TEST_WORDS 6
+
+/**
+ * One map line
+ */
+typedef struct {
+    unsigned long start;
+    size_t size;
+    char name[AVMLIB_NAME_MAX * 2 + 8];
+} test_line_t;
+
+static char test_map[64];
+static test_line_t test_lines[TEST_LINES];
+static int test_nlines;
+
+/**************************************************************************//**
+ * @brief Read the map from a line on, checking every line's format.
+ * */
+static void
+test_read(
+    int from
+)
+{
+    char line[256], again[256];
+    test_line_t *l;
+    FILE *f;
+    int n = 0;
+
+    test_nlines = 0;
+    if (NULL == (f = fopen(test_map,"r"))) {
+        TEST_CHECK(!"no map");
+        return;
+    }
+    while (fgets(line,sizeof(line),f)) {
+        if ((n++ < from) || (test_nlines >= TEST_LINES)) continue;
+        l = &test_lines[test_nlines++];
+        TEST_CHECK(3 == sscanf(line,"%lx %zx %s",&l->start,&l->size,l->name));
+        snprintf(again,sizeof(again),"%lx %zx %s\n",l->start,l->size,l->name);
+        TEST_CHECK(!strcmp(line,again));
+    }
+    fclose(f);
+}
+
+/**************************************************************************//**
+ * @brief Lines in the map so far.
+ * */
+static int
+test_count(void)
+{
+    char line[256];
+    FILE *f;
+    int n = 0;
+
+    if (NULL == (f = fopen(test_map,"r"))) return 0;
+    while (fgets(line,sizeof(line),f)) n++;
+    fclose(f);
+    return n;
+}
+
+/**************************************************************************//**
+ * @brief A segment's runs between labels.
+ * */
+static void
+test_segment(void)
+{
+    static const uint32_t at[TEST_WORDS + 1] = { 0,UINT32_MAX,10,UINT32_MAX,20,UINT32_MAX,30 };
+    static const char *expect[] = { "avm:seg:c","avm:seg:a","avm:seg:b","avm:seg" };
+    static uint8_t code[40];
+    class_segment_t seg;
+    table_t *labels;
+    int from = test_count(), i;
+
+    test_segment_init(&seg,"seg");
+    for (i=0;i<TEST_WORDS;i++) {
+        avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION),avmlib_instruction_new(AVM_OP_NOP,0,0));
+    }
+    labels = AVM_CLASS_TABLE(&seg,AVM_CLASS_LABEL);
+    avmlib_table_add(labels,avmlib_new_label("c",0,0));
+    avmlib_table_add(labels,avmlib_new_label("a",0,2));
+    avmlib_table_add(labels,avmlib_new_label("dup",0,2));
+    avmlib_table_add(labels,avmlib_new_label("mid",0,3));
+    avmlib_table_add(labels,avmlib_new_label("b",0,4));
+
+    avmlib_perf_segment(&seg,code,sizeof(code),at);
+    test_read(from);
+    TEST_CHECK(4 == test_nlines);
+    for (i=0;(i<4) && (i<test_nlines);i++) {
+        TEST_CHECK(!strcmp(expect[i],test_lines[i].name));
+        TEST_CHECK((unsigned long)(uintptr_t)(code + 10 * i) == test_lines[i].start);
+        TEST_CHECK(10 == test_lines[i].size);
+    }
+}
+
+/**************************************************************************//**
+ * @brief The JIT names what it makes.
+ * */
+static void
+test_jit(void)
+{
+    class_segment_t seg;
+    class_register_t *gr1;
+    avmlib_vm_t *vm;
+    avm_t *tmpl;
+    int from = test_count(), found = 0, i;
+
+    test_segment_init(&seg,"test_perf");
+    test_loop(&seg);
+    if ((NULL == (tmpl = test_template(&seg))) || (NULL == (vm = avmlib_vm_new(tmpl))) ||
+        (NULL == (gr1 = avmlib_machine_own(vm->avm,AVM_CLASS_REGISTER,TEST_GR1)))) {
+        TEST_CHECK(!"program");
+        return;
+    }
+    gr1->value = AVMLIB_JIT_HOT * 2;
+    TEST_CHECK(AVMLIB_VM_HALTED == avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED));
+    if (!vm->proc.segment->native) {
+        printf("test_perf: no JIT here; skipped its map\n");
+        avmlib_vm_free(vm);
+        return;
+    }
+    test_read(from);
+    for (i=0;i<test_nlines;i++) found += !strcmp("avm:test_perf:loop",test_lines[i].name);
+    TEST_CHECK(1 == found);
+    avmlib_vm_free(vm);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    static uint8_t code[16];
+    int from;
+
+    snprintf(test_map,sizeof(test_map),"/tmp/perf-%d.map",(int)getpid());
+    unlink(test_map);
+    avmlib_perf_enable(AVMLIB_PERF_MAP);
+    TEST_CHECK(AVMLIB_PERF_MAP == avmlib_perf_enabled());
+
+    /* Step 1: One run, and an empty one that isn't written */
+    avmlib_perf_code("one",code,sizeof(code));
+    avmlib_perf_code("empty",code,0);
+    test_read(0);
+    TEST_CHECK(1 == test_nlines);
+    TEST_CHECK(((unsigned long)(uintptr_t)code == test_lines[0].start) &&
+               (sizeof(code) == test_lines[0].size) && !strcmp("one",test_lines[0].name));
+
+    /* Step 2: A segment, label by label */
+    test_segment();
+
+    /* Step 3: JIT code */
+    avmlib_jit_enable(1);
+    test_jit();
+
+    /* Step 4: Off */
+    from = test_count();
+    avmlib_perf_enable(0);
+    avmlib_perf_code("off",code,sizeof(code));
+    TEST_CHECK(from == test_count());
+
+    unlink(test_map);
+    printf("test_perf: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_PERF_C_ */
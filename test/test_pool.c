@@ -0,0 +1,153 @@
+/**************************************************************************//**
+ * @file test_pool.c
+ *
+ * @brief Pool jobs that block on a port park instead of failing.
+ *
+ * @details Each job reads a line from its own pipe into a STRING and
+ * writes it back out to another.  All the jobs go to a single worker
+ * before anything is written to their input pipes, so each one blocks;
+ * the input is then written in reverse order.  Every job must halt
+ * with its own line, which it can only do if the worker parked the
+ * blocked instances and went on to the next job.  Exits nonzero on
+ * failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_POOL_C_
+#define _TEST_POOL_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_JOBS 32
+
+/**
+ * One job's pipes and result
+ */
+typedef struct {
+    int in[2];
+    int out[2];
+    avmlib_vm_status_t status;
+} test_job_t;
+
+static test_job_t test_jobs[TEST_JOBS];
+
+/**************************************************************************//**
+ * @brief The program: IN @stdin,line / OUT @stdout,line.
+ *
+ * @returns A template running it, or NULL on failure.
+ * */
+static avm_t *
+test_program(void)
+{
+    class_segment_t seg;
+    table_t *code;
+
+    test_segment_init(&seg,"test_pool");
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING),avmtype_string_new("line",NULL));
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_IN,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_IN),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_OUT,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_OUT),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+
+    return test_template(&seg);
+}
+
+/**************************************************************************//**
+ * @brief Job setup: point the instance's ports at the job's pipes.
+ * */
+static int
+test_setup(
+    avmlib_vm_t *vm,
+    void *arg
+)
+{
+    test_job_t *job = (test_job_t *)arg;
+    table_t *ports = AVM_CLASS_TABLE(vm->avm,AVM_CLASS_PORT);
+    int in = dup(job->in[0]);
+    int out = dup(job->out[1]);
+
+    if ((0 > avmlib_port_set_fd((class_port_t *)ports->entries[TEST_PORT_IN],in,0)) ||
+        (0 > avmlib_port_set_fd((class_port_t *)ports->entries[TEST_PORT_OUT],out,0))) {
+        close(in);
+        close(out);
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Job completion.
+ * */
+static void
+test_done(
+    avmlib_vm_t *vm,
+    avmlib_vm_status_t status,
+    void *arg
+)
+{
+    ((test_job_t *)arg)->status = status;
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char line[32], got[32];
+    avmlib_pool_t *pool;
+    avm_t *tmpl;
+    ssize_t n;
+    int i;
+
+    /* Step 1: Program, template, one worker */
+    if (NULL == (tmpl = test_program())) return 1;
+    if (NULL == (pool = avmlib_pool_new(tmpl,1))) return 1;
+
+    /* Step 2: Every job blocks on an empty pipe */
+    for (i=0;i<TEST_JOBS;i++) {
+        if ((0 > pipe(test_jobs[i].in)) || (0 > pipe(test_jobs[i].out)) ||
+            (0 > fcntl(test_jobs[i].in[0],F_SETFL,O_NONBLOCK))) {
+            perror("pipe");
+            return 1;
+        }
+        test_jobs[i].status = AVMLIB_VM_READY;
+        avmlib_pool_run(pool,test_setup,test_done,&test_jobs[i]);
+    }
+
+    /* Step 3: Feed them, last first */
+    for (i=TEST_JOBS-1;i>=0;i--) {
+        n = snprintf(line,sizeof(line),"job %d\n",i);
+        TEST_CHECK(n == write(test_jobs[i].in[1],line,n));
+        close(test_jobs[i].in[1]);
+    }
+    avmlib_pool_wait(pool);
+
+    /* Step 4: Each halted with its own line */
+    for (i=0;i<TEST_JOBS;i++) {
+        TEST_CHECK(AVMLIB_VM_HALTED == test_jobs[i].status);
+        n = snprintf(line,sizeof(line),"job %d\n",i);
+        fcntl(test_jobs[i].out[0],F_SETFL,O_NONBLOCK);
+        TEST_CHECK((n == read(test_jobs[i].out[0],got,sizeof(got))) && !memcmp(got,line,n));
+    }
+    TEST_CHECK(TEST_JOBS == pool->workers[0].jobs);
+
+    avmlib_pool_free(pool);
+    for (i=0;i<TEST_JOBS;i++) {
+        close(test_jobs[i].in[0]);
+        close(test_jobs[i].out[0]);
+        close(test_jobs[i].out[1]);
+    }
+    printf("test_pool: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_POOL_C_ */
@@ -0,0 +1,218 @@
+/**************************************************************************//**
+ * @file test_ports.c
+ *
+ * @brief Port output: held bytes survive a failed or blocked drain.
+ *
+ * @details Writes through ports on pipes.  A non-blocking pipe that
+ * fills up must hold the rest and hand every byte over, in order, once
+ * the reader catches up; a buffered port whose reader has gone must
+ * keep its held bytes after the failed flush instead of dropping them.
+ * Then a program OUTs a BUFFER several pieces long to a non-blocking
+ * pipe: each time it blocks the port may hold no more than its buffer's
+ * worth and one piece (not the whole BUFFER), and every byte must
+ * arrive, in order, before it halts.  A FLUSH with no port whose reader
+ * has gone must stop the program with an error.
+ * Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_PORTS_C_
+#define _TEST_PORTS_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_BYTES (1024 * 1024)
+
+/* Several OUT pieces (AVMLIB_VM_OUT_CHUNK), and a bit */
+#define TEST_BIG (3 * 1024 * 1024 + 100)
+
+static char test_data[] = "/tmp/avm_test_ports_dataXXXXXX";
+
+/**************************************************************************//**
+ * @brief A full non-blocking pipe: everything arrives, in order.
+ * */
+static void
+test_backlog(void)
+{
+    static unsigned char out[TEST_BYTES], in[TEST_BYTES];
+    class_port_t *port;
+    size_t got = 0;
+    ssize_t n;
+    int fds[2], rc, i;
+
+    for (i=0;i<TEST_BYTES;i++) out[i] = (unsigned char)(i * 7);
+    if ((0 > pipe(fds)) || (0 > fcntl(fds[1],F_SETFL,O_NONBLOCK))) {
+        TEST_CHECK(!"pipe");
+        return;
+    }
+    port = avmlib_port_new("pipe",fds[1],NULL);
+
+    TEST_CHECK(AVMLIB_IO_WOULDBLOCK == avmlib_port_write(port,out,TEST_BYTES));
+    TEST_CHECK((port->obuf_len > 0) && (port->obuf_len < TEST_BYTES));
+    do {
+        if (0 < (n = read(fds[0],in + got,TEST_BYTES - got))) got += n;
+        rc = avmlib_port_flush(port);
+    } while ((n > 0) && (got < TEST_BYTES) && (0 <= rc || AVMLIB_IO_WOULDBLOCK == rc));
+    TEST_CHECK(TEST_BYTES == got);
+    TEST_CHECK(0 == memcmp(in,out,TEST_BYTES));
+    TEST_CHECK(0 == port->obuf_len);
+
+    avmlib_port_destroy(NULL,(entry_t)port);
+    free(port);
+    close(fds[0]);
+}
+
+/**************************************************************************//**
+ * @brief A buffered port whose reader went away keeps its bytes.
+ * */
+static void
+test_broken(void)
+{
+    class_port_t *port;
+    int fds[2];
+
+    if (0 > pipe(fds)) {
+        TEST_CHECK(!"pipe");
+        return;
+    }
+    port = avmlib_port_new("pipe",fds[1],NULL);
+    TEST_CHECK(0 == avmlib_port_set_buffering(port,PORT_BUFMODE_FULL,4096));
+    TEST_CHECK(10 == avmlib_port_write(port,"0123456789",10));
+    close(fds[0]);
+    TEST_CHECK(-1 == avmlib_port_flush(port));
+    TEST_CHECK(10 == port->obuf_len);
+    TEST_CHECK(0 == memcmp(port->obuf,"0123456789",10));
+
+    /* Let destroy's flush fail quietly, then drop what's held */
+    port->obuf_len = 0;
+    avmlib_port_destroy(NULL,(entry_t)port);
+    free(port);
+}
+
+/**************************************************************************//**
+ * @brief A template running FILE big,data / OUT @stdout,big / FLUSH,
+ * with the file holding the given bytes.
+ *
+ * @returns The template, or NULL on failure.
+ * */
+static avm_t *
+test_program(
+    const unsigned char *data,
+    size_t size
+)
+{
+    class_segment_t seg;
+    table_t *code;
+    int fd;
+
+    if ((0 > (fd = open(test_data,O_WRONLY|O_TRUNC))) || ((ssize_t)size != write(fd,data,size))) {
+        if (0 <= fd) close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    test_segment_init(&seg,"test_ports");
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_BUFFER),avmtype_buffer_new("big",0));
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING),avmtype_string_new("data",test_data));
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_FILE,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_BUFFER,0),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_OUT,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_OUT),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_BUFFER,0),0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_FLUSH,0,0));
+
+    return test_template(&seg);
+}
+
+/**************************************************************************//**
+ * @brief OUT of a large BUFFER to a non-blocking pipe, in pieces.
+ * */
+static void
+test_vm_out(void)
+{
+    static unsigned char out[TEST_BIG], in[TEST_BIG];
+    avmlib_vm_status_t status;
+    class_port_t *port;
+    avmlib_vm_t *vm;
+    avm_t *tmpl;
+    size_t got = 0;
+    ssize_t n;
+    int fds[2], fd, i, blocks = 0;
+
+    for (i=0;i<TEST_BIG;i++) out[i] = (unsigned char)(i * 13);
+    if ((0 > (fd = mkstemp(test_data))) || (0 > close(fd))) {
+        TEST_CHECK(!"mkstemp");
+        return;
+    }
+    if ((NULL == (tmpl = test_program(out,TEST_BIG))) || (NULL == (vm = avmlib_vm_new(tmpl)))) {
+        TEST_CHECK(!"program");
+        unlink(test_data);
+        return;
+    }
+    if ((0 > pipe(fds)) || (0 > fcntl(fds[1],F_SETFL,O_NONBLOCK))) {
+        TEST_CHECK(!"pipe");
+        unlink(test_data);
+        return;
+    }
+    port = (class_port_t *)AVM_CLASS_TABLE(vm->avm,AVM_CLASS_PORT)->entries[TEST_PORT_OUT];
+    TEST_CHECK(0 == avmlib_port_set_fd(port,fds[1],0));
+
+    /* Step 1: Drain the pipe each time it blocks */
+    while (AVMLIB_VM_BLOCKED == (status = avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED))) {
+        blocks++;
+        TEST_CHECK(port->obuf_len <= ((size_t)2 << 20)); /* Its buffer's worth and a piece */
+        n = read(fds[0],in + got,((TEST_BIG - got) > 65536) ? 65536 : (TEST_BIG - got));
+        if (0 < n) got += n;
+    }
+    TEST_CHECK(AVMLIB_VM_HALTED == status);
+    TEST_CHECK(blocks > 1);
+    fcntl(fds[0],F_SETFL,O_NONBLOCK);
+    while (0 < (n = read(fds[0],in + got,TEST_BIG - got))) got += n;
+    TEST_CHECK(TEST_BIG == got);
+    TEST_CHECK(0 == memcmp(in,out,TEST_BIG));
+
+    avmlib_vm_free(vm);
+    close(fds[0]);
+
+    /* Step 2: A held OUT with nobody reading; the FLUSH fails the run */
+    if ((NULL == (tmpl = test_program((const unsigned char *)"0123456789",10))) ||
+        (NULL == (vm = avmlib_vm_new(tmpl))) || (0 > pipe(fds))) {
+        TEST_CHECK(!"program");
+        unlink(test_data);
+        return;
+    }
+    port = (class_port_t *)AVM_CLASS_TABLE(vm->avm,AVM_CLASS_PORT)->entries[TEST_PORT_OUT];
+    TEST_CHECK(0 == avmlib_port_set_fd(port,fds[1],0));
+    TEST_CHECK(0 == avmlib_port_set_buffering(port,PORT_BUFMODE_FULL,4096));
+    close(fds[0]);
+    TEST_CHECK(AVMLIB_VM_ERROR == avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED));
+    TEST_CHECK(10 == port->obuf_len);
+
+    /* Let free's flush fail, then drop what's held */
+    port->obuf_len = 0;
+    avmlib_vm_free(vm);
+    unlink(test_data);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    signal(SIGPIPE,SIG_IGN);
+    test_backlog();
+    test_broken();
+    test_vm_out();
+    printf("test_ports: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_PORTS_C_ */
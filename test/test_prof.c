@@ -0,0 +1,166 @@
+/**************************************************************************//**
+ * @file test_prof.c
+ *
+ * @brief The execution profiler.
+ *
+ * @details Built with AVM_PROFILE against the profiling library
+ * (test_prof_on, from "make prof"): a profiled run of a program with
+ * an unlabelled prologue, a hot loop and a labelled tail must count
+ * every opcode exactly, in the right label region, even past the
+ * point the JIT would have taken over, plus the tail's OUT against
+ * its port; the collapsed stacks must have the loop's ADD.  Built
+ * without it (test_prof), making or attaching a profile must fail
+ * with ENOTSUP and the run must be unaffected.  Exits nonzero on
+ * failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_PROF_C_
+#define _TEST_PROF_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "test.h"
+
+#ifdef AVM_PROFILE
+#define TEST_NAME "test_prof_on"
+#else
+#define TEST_NAME "test_prof"
+#endif
+
+#define TEST_LOOPS (AVMLIB_JIT_HOT * 5)
+
+/**************************************************************************//**
+ * @brief The program: STOR GR2,0 / loop: ADD GR2,GR1,GR2 / SUB GR1 /
+ * JNZ GR1,loop / tail: OUT @stdout,"".
+ * */
+static avm_t *
+test_program(void)
+{
+    class_segment_t seg;
+    table_t *code;
+
+    test_segment_init(&seg,"test_prof");
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING),avmtype_string_new("empty",""));
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_STOR,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_REGISTER,TEST_GR2),0);
+    avmlib_entity_emit(code,avmlib_immediate_new(0),0);
+    test_loop(&seg);
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_LABEL),
+                     avmlib_new_label("tail",AVMM_SEGMENT_UNLINKED,code->size));
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_OUT,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_OUT),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+    return test_template(&seg);
+}
+
+#ifdef AVM_PROFILE
+/**************************************************************************//**
+ * @brief Count for an opcode in the region a label starts.
+ * */
+static uint64_t
+test_count(
+    const avmlib_prof_t *prof,
+    const char *label,
+    uint32_t op
+)
+{
+    const avmlib_prof_seg_t *s;
+    uint32_t r;
+
+    if (1 != prof->nsegs) return UINT64_MAX;
+    s = &prof->segs[0];
+    for (r=0;r<s->nregions;r++) {
+        if (!strcmp(label,s->label[r])) return s->cell[r * AVMLIB_PROF_OPS + op].count;
+    }
+    return UINT64_MAX;
+}
+
+/**************************************************************************//**
+ * @brief Everything counted, where it ran.
+ * */
+static void
+test_counts(
+    const avmlib_prof_t *prof
+)
+{
+    char line[256];
+    uint64_t total = 0;
+    uint32_t r, op;
+    int found = 0;
+    FILE *f;
+
+    TEST_CHECK(!prof->err);
+    TEST_CHECK(1 == test_count(prof,"",AVM_OP_STOR));
+    TEST_CHECK(TEST_LOOPS == test_count(prof,"loop",AVM_OP_ADD));
+    TEST_CHECK(TEST_LOOPS == test_count(prof,"loop",AVM_OP_SUB));
+    TEST_CHECK(TEST_LOOPS == test_count(prof,"loop",AVM_OP_JNZ));
+    TEST_CHECK(1 == test_count(prof,"tail",AVM_OP_OUT));
+    if (1 == prof->nsegs) {
+        TEST_CHECK(3 == prof->segs[0].nregions);
+        for (r=0;r<prof->segs[0].nregions;r++) {
+            for (op=0;op<AVMLIB_PROF_OPS;op++) total += prof->segs[0].cell[r * AVMLIB_PROF_OPS + op].count;
+        }
+    }
+    TEST_CHECK((uint64_t)TEST_LOOPS * 3 + 2 == total);
+    TEST_CHECK((1 == prof->nports) && (AVM_OP_OUT == prof->ports[0].op) && (1 == prof->ports[0].cell.count));
+
+    if (NULL == (f = tmpfile())) {
+        TEST_CHECK(!"tmpfile");
+        return;
+    }
+    TEST_CHECK(0 == avmlib_prof_collapsed(prof,f));
+    rewind(f);
+    while (fgets(line,sizeof(line),f)) found += !strncmp("test_prof;loop;ADD ",line,19);
+    TEST_CHECK(1 == found);
+    fclose(f);
+}
+#endif /* AVM_PROFILE */
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    class_register_t *gr1;
+    avmlib_prof_t *prof;
+    avmlib_vm_t *vm;
+    avm_t *tmpl;
+
+    avmlib_jit_enable(1);
+    if ((NULL == (tmpl = test_program())) || (NULL == (vm = avmlib_vm_new(tmpl))) ||
+        (NULL == (gr1 = avmlib_machine_own(vm->avm,AVM_CLASS_REGISTER,TEST_GR1)))) {
+        fprintf(stderr,TEST_NAME ": setup failed\n");
+        return 1;
+    }
+    gr1->value = TEST_LOOPS;
+
+#ifdef AVM_PROFILE
+    /* Profiled, so interpreted throughout, hot or not: every count is exact */
+    TEST_CHECK(NULL != (prof = avmlib_prof_new()));
+    if (!prof) return 1;
+    TEST_CHECK(0 == avmlib_prof_attach(vm,prof));
+    TEST_CHECK(AVMLIB_VM_HALTED == avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED));
+    test_counts(prof);
+    avmlib_prof_free(prof);
+#else
+    /* Not built in */
+    errno = 0;
+    TEST_CHECK((NULL == (prof = avmlib_prof_new())) && (ENOTSUP == errno));
+    errno = 0;
+    TEST_CHECK((0 > avmlib_prof_attach(vm,NULL)) && (ENOTSUP == errno));
+    TEST_CHECK(AVMLIB_VM_HALTED == avmlib_vm_run(vm,AVMLIB_VM_UNLIMITED));
+#endif
+    TEST_CHECK((uint64_t)TEST_LOOPS * 3 + 2 == vm->retired);
+    TEST_CHECK((uint32_t)((uint64_t)TEST_LOOPS * (TEST_LOOPS + 1) / 2) ==
+               ((class_register_t *)AVM_CLASS_TABLE(vm->avm,AVM_CLASS_REGISTER)->entries[TEST_GR2])->value);
+    avmlib_vm_free(vm);
+
+    printf(TEST_NAME ": %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_PROF_C_ */
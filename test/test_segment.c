@@ -0,0 +1,171 @@
+/**************************************************************************//**
+ * @file test_segment.c
+ *
+ * @brief Segment images: lazy loading and corrupt images.
+ *
+ * @details A registered image must stay cold (no tables) until
+ * avmlib_segment_get() first asks for it, then come back with the same
+ * code, strings and labels, its jump linked to the local label.
+ * Unloaded, it must reload on the next touch.  Copies of the image with
+ * a bad magic, a code length past the end, a section of a class images
+ * can't carry, or cut short inside a section must each fail to load
+ * with EINVAL and stay cold; a missing image fails with ENOENT.  Exits
+ * nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_SEGMENT_C_
+#define _TEST_SEGMENT_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_TEXT "hello"
+
+static char test_path[] = "/tmp/avm_test_segmentXXXXXX";
+static char test_bad[] = "/tmp/avm_test_segment_badXXXXXX";
+
+/**************************************************************************//**
+ * @brief Check a loaded segment against the one it was saved from.
+ * */
+static void
+test_same(
+    class_segment_t *seg,
+    class_segment_t *orig
+)
+{
+    table_t *code = AVM_CLASS_TABLE(seg,AVM_CLASS_INSTRUCTION);
+    table_t *strs = AVM_CLASS_TABLE(seg,AVM_CLASS_STRING);
+    table_t *lbls = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    class_label_t *lbl;
+
+    TEST_CHECK(code->size == AVM_CLASS_TABLE(orig,AVM_CLASS_INSTRUCTION)->size);
+    TEST_CHECK((1 == strs->size) && !strcmp(TEST_TEXT,((class_string_t *)strs->entries[0])->text));
+    TEST_CHECK(1 == lbls->size);
+    if (1 != lbls->size) return;
+    lbl = (class_label_t *)lbls->entries[0];
+    TEST_CHECK((seg->id == lbl->segment) && (0 == lbl->offset));
+    TEST_CHECK(AVM_CLASS_LABEL == avmlib_entity_class(code->entries[code->size - 1]));
+}
+
+/**************************************************************************//**
+ * @brief Cold until touched, then loaded; unloaded, then reloaded.
+ * */
+static void
+test_lazy(
+    avm_t *avm,
+    class_segment_t *orig
+)
+{
+    class_segment_t *seg;
+    int id;
+
+    TEST_CHECK(0 <= (id = avmlib_segment_register(avm,test_path)));
+    if (0 > id) return;
+    seg = (class_segment_t *)AVM_CLASS_TABLE(avm,AVM_CLASS_SEGMENT)->entries[id];
+    TEST_CHECK(AVMM_SEGMENT_COLD == seg->state);
+    TEST_CHECK(NULL == seg->tables.entries);
+
+    TEST_CHECK(seg == avmlib_segment_get(avm,id));
+    TEST_CHECK(AVMM_SEGMENT_RESIDENT == seg->state);
+    test_same(seg,orig);
+    TEST_CHECK(seg == avmlib_segment_get(avm,id));
+
+    TEST_CHECK(0 == avmlib_segment_unload(seg));
+    TEST_CHECK((AVMM_SEGMENT_COLD == seg->state) && (NULL == seg->tables.entries));
+    TEST_CHECK(seg == avmlib_segment_get(avm,id));
+    test_same(seg,orig);
+}
+
+/**************************************************************************//**
+ * @brief An image that must not load.
+ * */
+static void
+test_corrupt(
+    avm_t *avm,
+    const char *image,
+    size_t len
+)
+{
+    class_segment_t *seg;
+    FILE *f;
+    int id;
+
+    if ((NULL == (f = fopen(test_bad,"w"))) || (len != fwrite(image,1,len,f)) || fclose(f)) {
+        TEST_CHECK(!"write");
+        return;
+    }
+    TEST_CHECK(0 <= (id = avmlib_segment_register(avm,test_bad)));
+    if (0 > id) return;
+    seg = (class_segment_t *)AVM_CLASS_TABLE(avm,AVM_CLASS_SEGMENT)->entries[id];
+    errno = 0;
+    TEST_CHECK(NULL == avmlib_segment_get(avm,id));
+    TEST_CHECK(EINVAL == errno);
+    TEST_CHECK((AVMM_SEGMENT_COLD == seg->state) && (NULL == seg->tables.entries));
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    avmlib_segment_image_t *hdr;
+    avmlib_segment_section_t *sec;
+    class_segment_t orig;
+    struct stat st;
+    char *image;
+    avm_t *avm;
+    FILE *f;
+    uint32_t class;
+    int fd, id;
+
+    /* Step 1: Save a segment, and read its image back */
+    test_segment_init(&orig,"test_segment");
+    avmlib_table_add(AVM_CLASS_TABLE(&orig,AVM_CLASS_STRING),avmtype_string_new("s",TEST_TEXT));
+    test_loop(&orig);
+    if ((0 > (fd = mkstemp(test_path))) || (0 > close(fd)) ||
+        (0 > (fd = mkstemp(test_bad))) || (0 > close(fd)) ||
+        (0 > avmlib_segment_save(&orig,test_path,0)) || (0 > stat(test_path,&st)) ||
+        (NULL == (image = malloc(st.st_size))) || (NULL == (f = fopen(test_path,"r"))) ||
+        (1 != fread(image,st.st_size,1,f)) || fclose(f) ||
+        (NULL == (avm = avmlib_machine_new()))) {
+        fprintf(stderr,"test_segment: setup failed\n");
+        return 1;
+    }
+    hdr = (avmlib_segment_image_t *)image;
+    sec = (avmlib_segment_section_t *)(image + sizeof(*hdr) + hdr->code_words * sizeof(uint32_t));
+
+    /* Step 2: Lazy load */
+    test_lazy(avm,&orig);
+
+    /* Step 3: Corrupt images */
+    hdr->magic ^= 1;
+    test_corrupt(avm,image,st.st_size);
+    hdr->magic ^= 1;
+    hdr->code_words += st.st_size;
+    test_corrupt(avm,image,st.st_size);
+    hdr->code_words -= st.st_size;
+    class = sec->class;
+    sec->class = AVM_CLASS_REGISTER;
+    test_corrupt(avm,image,st.st_size);
+    sec->class = class;
+    test_corrupt(avm,image,(char *)(sec + 1) - image + 3);
+
+    /* Step 4: No image at all */
+    unlink(test_bad);
+    TEST_CHECK(0 <= (id = avmlib_segment_register(avm,test_bad)));
+    errno = 0;
+    TEST_CHECK((NULL == avmlib_segment_get(avm,id)) && (ENOENT == errno));
+
+    unlink(test_path);
+    free(image);
+    printf("test_segment: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_SEGMENT_C_ */
@@ -0,0 +1,128 @@
+/**************************************************************************//**
+ * @file test_shmregs.c
+ *
+ * @brief Shared-memory register bank shared by two processes.
+ *
+ * @details Creates a memfd bank and forks.  The child attaches to the
+ * inherited descriptor and counts every register up in turn; the
+ * parent takes snapshots while it does, checking that each one is
+ * consistent (registers are written in order, so no later register
+ * may be ahead of an earlier one).  Finally the child scribbles on the
+ * block header, and the parent checks that neither its own handle nor
+ * a fresh attach trusts the bad count.  Last, a second child takes the
+ * write lock and exits holding it; the parent's next write and
+ * snapshot must get the lock back rather than spin forever.  Exits
+ * nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_SHMREGS_C_
+#define _TEST_SHMREGS_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+#define TEST_REGS 8
+#define TEST_ROUNDS 1000000
+
+/**************************************************************************//**
+ * @brief Child side: attach, count up, then corrupt the header.
+ * */
+static int
+test_writer(
+    int fd,
+    int go
+)
+{
+    avmlib_shmregs_t *bank;
+    uint32_t k, i;
+    char c;
+
+    if (NULL == (bank = avmlib_shmregs_attach(NULL,fd))) return 1;
+    if (1 != read(go,&c,1)) return 1;
+    for (k=1;k<=TEST_ROUNDS;k++) {
+        for (i=0;i<TEST_REGS;i++) avmlib_shmregs_write(bank,i,k);
+    }
+    __atomic_store_n(&bank->block->count,AVMLIB_SHMREGS_MAX * 4,__ATOMIC_RELEASE);
+    avmlib_shmregs_destroy(bank);
+    return 0;
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    avmlib_shmregs_t *bank, *again;
+    uint32_t values[TEST_REGS];
+    uint64_t snaps = 0;
+    pid_t pid;
+    int status, i, go[2];
+
+    /* Step 1: Bank, and a writer on the other side of a fork */
+    if (NULL == (bank = avmlib_shmregs_create(NULL,TEST_REGS))) return 1;
+    if (0 > pipe(go)) return 1;
+    fflush(stdout);
+    if (0 > (pid = fork())) {
+        perror("fork");
+        return 1;
+    }
+    if (0 == pid) _exit(test_writer(dup(bank->fd),go[0]));
+    if (1 != write(go[1],"g",1)) return 1;
+
+    /* Step 2: Snapshots must never tear */
+    do {
+        if (TEST_REGS != avmlib_shmregs_snapshot(bank,0,TEST_REGS,values)) {
+            TEST_CHECK(!"snapshot failed");
+            break;
+        }
+        for (i=1;i<TEST_REGS;i++) {
+            TEST_CHECK(values[i] <= values[i-1]);
+        }
+        TEST_CHECK(values[0] - values[TEST_REGS-1] <= 1);
+        snaps++;
+    } while (!test_failed && (values[TEST_REGS-1] < TEST_ROUNDS));
+
+    /* Step 3: Writer finished cleanly */
+    TEST_CHECK(pid == waitpid(pid,&status,0));
+    TEST_CHECK(WIFEXITED(status) && (0 == WEXITSTATUS(status)));
+    for (i=0;i<TEST_REGS;i++) {
+        TEST_CHECK(TEST_ROUNDS == avmlib_shmregs_read(bank,i));
+    }
+
+    /* Step 4: The header now claims more slots than exist */
+    TEST_CHECK(TEST_REGS == bank->count);
+    TEST_CHECK(0 == avmlib_shmregs_read(bank,AVMLIB_SHMREGS_MAX + 1));
+    TEST_CHECK(0 > avmlib_shmregs_snapshot(bank,0,TEST_REGS + 1,values));
+    again = avmlib_shmregs_attach(NULL,dup(bank->fd));
+    TEST_CHECK(NULL == again);
+    if (again) avmlib_shmregs_destroy(again);
+
+    /* Step 5: A writer dies holding the lock */
+    fflush(stdout);
+    if (0 > (pid = fork())) {
+        perror("fork");
+        return 1;
+    }
+    if (0 == pid) {
+        __atomic_fetch_add(&bank->block->seq,1,__ATOMIC_ACQUIRE);
+        __atomic_store_n(&bank->block->owner,(uint32_t)getpid(),__ATOMIC_RELAXED);
+        _exit(0);
+    }
+    TEST_CHECK(pid == waitpid(pid,&status,0));
+    TEST_CHECK(bank->block->seq & 1);
+    avmlib_shmregs_write(bank,0,7);
+    TEST_CHECK(TEST_REGS == avmlib_shmregs_snapshot(bank,0,TEST_REGS,values));
+    TEST_CHECK((7 == values[0]) && !(bank->block->seq & 1) && (0 == bank->block->owner));
+
+    avmlib_shmregs_destroy(bank);
+    printf("test_shmregs: %s (%llu snapshots)\n",test_failed?"FAILED":"ok",
+           (unsigned long long)snaps);
+    return test_failed;
+}
+
+#endif /* _TEST_SHMREGS_C_ */
@@ -0,0 +1,123 @@
+/**************************************************************************//**
+ * @file test_snapshot.c
+ *
+ * @brief Restoring damaged machine images.
+ *
+ * @details Saves a small machine and restores it twice, the second
+ * time relocated (the first holds the image's address).  Then copies
+ * of the image with one header or list entry pointing past the end are
+ * restored: each must be refused with EINVAL rather than read or
+ * written outside the mapping.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_SNAPSHOT_C_
+#define _TEST_SNAPSHOT_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_STRINGS 16
+
+static char test_path[] = "/tmp/avm_test_snapshotXXXXXX";
+static char test_bad[] = "/tmp/avm_test_snapshot_badXXXXXX";
+
+/**************************************************************************//**
+ * @brief Copy the image, overwrite 8 bytes at off, and try to restore.
+ *
+ * @returns Nonzero if the restore was refused with EINVAL.
+ * */
+static int
+test_damaged(
+    uint64_t off,
+    uint64_t value
+)
+{
+    char buf[65536];
+    ssize_t n;
+    int in, out;
+
+    if ((0 > (in = open(test_path,O_RDONLY))) ||
+        (0 > (out = open(test_bad,O_WRONLY|O_TRUNC)))) {
+        return 0;
+    }
+    while (0 < (n = read(in,buf,sizeof(buf)))) {
+        if (n != write(out,buf,n)) n = -1;
+    }
+    if (sizeof(value) != pwrite(out,&value,sizeof(value),(off_t)off)) n = -1;
+    close(in);
+    close(out);
+    if (n < 0) return 0;
+
+    errno = 0;
+    return (NULL == avmlib_snapshot_restore(test_bad)) && (EINVAL == errno);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    avmlib_snapshot_hdr_t hdr;
+    char name[32];
+    avm_t *avm, *a, *b;
+    uint64_t first;
+    int fd, i;
+
+    /* Step 1: A machine and its image */
+    if ((0 > (fd = mkstemp(test_path))) || (0 > close(fd)) ||
+        (0 > (fd = mkstemp(test_bad))) || (0 > close(fd))) {
+        return 1;
+    }
+    avm = avmlib_machine_new();
+    for (i=0;i<TEST_STRINGS;i++) {
+        snprintf(name,sizeof(name),"s%d",i);
+        avmlib_table_add(AVM_CLASS_TABLE(avm,AVM_CLASS_STRING),avmtype_string_new(name,name));
+    }
+    avmlib_store_build(&avm->store,avm);
+    TEST_CHECK(0 == avmlib_snapshot_save(avm,test_path));
+    if ((0 > (fd = open(test_path,O_RDONLY))) || (sizeof(hdr) != pread(fd,&hdr,sizeof(hdr),0))) {
+        unlink(test_path);
+        unlink(test_bad);
+        return 1;
+    }
+    close(fd);
+    TEST_CHECK(hdr.nrelocs && hdr.nfixups && hdr.nheaders);
+
+    /* Step 2: Restored in place, then relocated */
+    TEST_CHECK(NULL != (a = avmlib_snapshot_restore(test_path)));
+    TEST_CHECK(NULL != (b = avmlib_snapshot_restore(test_path)));
+    if (a && b) {
+        TEST_CHECK(a != b);
+        TEST_CHECK(TEST_STRINGS == AVM_CLASS_TABLE(b,AVM_CLASS_STRING)->size);
+        TEST_CHECK(!strcmp(((class_string_t *)AVM_CLASS_TABLE(b,AVM_CLASS_STRING)->entries[3])->text,"s3"));
+    }
+
+    /* Step 3: Lists that run past the end */
+    TEST_CHECK(test_damaged(offsetof(avmlib_snapshot_hdr_t,nrelocs),(uint64_t)1 << 60));
+    TEST_CHECK(test_damaged(offsetof(avmlib_snapshot_hdr_t,nfixups),hdr.size / sizeof(avmlib_snapshot_fixup_t)));
+    TEST_CHECK(test_damaged(offsetof(avmlib_snapshot_hdr_t,headers),hdr.size));
+    TEST_CHECK(test_damaged(offsetof(avmlib_snapshot_hdr_t,root),hdr.size - 8));
+    TEST_CHECK(test_damaged(offsetof(avmlib_snapshot_hdr_t,name_bytes),hdr.size));
+
+    /* Step 4: Entries that point past the end (relocated, as the image's
+     * address is taken) */
+    TEST_CHECK(test_damaged(hdr.relocs,hdr.size));
+    first = hdr.fixups + offsetof(avmlib_snapshot_fixup_t,slot);
+    TEST_CHECK(test_damaged(first,hdr.size - 4));
+    TEST_CHECK(test_damaged(hdr.fixups + offsetof(avmlib_snapshot_fixup_t,kind),99));
+    TEST_CHECK(test_damaged(hdr.headers,(uint64_t)-8));
+
+    unlink(test_path);
+    unlink(test_bad);
+    printf("test_snapshot: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_SNAPSHOT_C_ */
@@ -0,0 +1,326 @@
+/**************************************************************************//**
+ * @file test_stats.c
+ *
+ * @brief Statistics slots and queue gauges.
+ *
+ * @details Threads that count and exit, one after another and many more
+ * than there are slots, must each get a slot of their own (not the
+ * shared last one) and leave every slot free, with nothing they counted
+ * lost.  Then the ready and parked gauges must follow a process parked
+ * on an event loop port, woken and taken off the run queue; one waiting
+ * on a fileio read; and pool jobs blocked on pipes until they're fed.
+ * Last, a long unlimited run on another thread must show up in the
+ * retired count before it returns.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_STATS_C_
+#define _TEST_STATS_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_THREADS (2 * AVMLIB_STATS_SLOTS)
+#define TEST_JOBS 8
+#define TEST_WORKERS 2
+#define TEST_LOOPS 50000000
+
+static avmlib_stats_block_t *test_block;
+static int test_pipes[TEST_JOBS][2];
+static avmlib_vm_status_t test_status[TEST_JOBS];
+static int test_ran;
+
+/* A gauge, read the way a monitor would */
+#define test_gauge(__field) __atomic_load_n(&test_block->__field,__ATOMIC_ACQUIRE)
+
+/**************************************************************************//**
+ * @brief A thread that counts once and exits.
+ * */
+static void *
+test_counter(
+    void *arg
+)
+{
+    avmlib_stats_add(runs,1);
+    *(int *)arg = (avmlib_stats_mine != &test_block->slot[AVMLIB_STATS_SLOTS - 1]);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Slots are freed when their threads exit.
+ * */
+static void
+test_slots(void)
+{
+    uint64_t runs = 0;
+    pthread_t thr;
+    int own, busy = 0, i;
+
+    for (i=0;i<TEST_THREADS;i++) {
+        own = 0;
+        if (pthread_create(&thr,NULL,test_counter,&own) || pthread_join(thr,NULL)) {
+            TEST_CHECK(!"pthread");
+            return;
+        }
+        TEST_CHECK(own);
+    }
+    for (i=0;i<AVMLIB_STATS_SLOTS;i++) {
+        if (__atomic_load_n(&test_block->slot[i].tid,__ATOMIC_ACQUIRE)) busy++;
+        runs += __atomic_load_n(&test_block->slot[i].runs,__ATOMIC_RELAXED);
+    }
+    TEST_CHECK(0 == busy);
+    TEST_CHECK(TEST_THREADS == runs);
+}
+
+/**************************************************************************//**
+ * @brief A process parked on an event loop port, then on a fileio read.
+ * */
+static void
+test_evloop(void)
+{
+    char path[] = "/tmp/avm_test_statsXXXXXX";
+    avmlib_evloop_t *loop;
+    avmlib_fileio_t *io;
+    class_process_t proc;
+    class_port_t *port, *file;
+    char got[4];
+    int fds[2], fd;
+
+    /* Step 1: Parked, woken, taken */
+    memset(&proc,0,sizeof(proc));
+    if ((0 > pipe(fds)) || (0 > fcntl(fds[0],F_SETFL,O_NONBLOCK))) {
+        TEST_CHECK(!"pipe");
+        return;
+    }
+    loop = avmlib_evloop_new();
+    port = avmlib_port_new("@test",fds[0],NULL);
+    TEST_CHECK(loop && port);
+    if (!loop || !port) return;
+    TEST_CHECK(0 == avmlib_evloop_add_port(loop,port));
+    TEST_CHECK(0 == avmlib_evloop_park(loop,&proc,port,0));
+    TEST_CHECK((1 == test_gauge(parked)) && (0 == test_gauge(ready)));
+    TEST_CHECK(1 == write(fds[1],"x",1));
+    TEST_CHECK(1 == avmlib_evloop_poll(loop,1000));
+    TEST_CHECK((0 == test_gauge(parked)) && (1 == test_gauge(ready)));
+    TEST_CHECK(&proc == avmlib_evloop_next(loop));
+    TEST_CHECK((0 == test_gauge(parked)) && (0 == test_gauge(ready)));
+
+    /* Step 2: Waiting on a fileio read, then on the loop's run queue */
+    if ((0 > (fd = mkstemp(path))) || (4 != write(fd,"data",4)) || (0 > close(fd))) {
+        TEST_CHECK(!"mkstemp");
+        return;
+    }
+    file = avmlib_port_new("@file",-1,NULL);
+    io = avmlib_fileio_new(loop,FILEIO_BACKEND_THREADS,0);
+    TEST_CHECK(file && io);
+    if (!file || !io) return;
+    TEST_CHECK(0 == avmlib_port_open_file(file,path));
+    TEST_CHECK(0 == avmlib_fileio_add_port(io,file));
+    TEST_CHECK(AVMLIB_IO_WOULDBLOCK == avmlib_fileio_read(io,&proc,file,got,sizeof(got)));
+    TEST_CHECK(1 == test_gauge(parked));
+    while (io->inflight && (0 <= avmlib_fileio_poll(io,1)));
+    TEST_CHECK((0 == test_gauge(parked)) && (1 == test_gauge(ready)));
+    TEST_CHECK(&proc == avmlib_evloop_next(loop));
+    TEST_CHECK((4 == proc.io_result) && (0 == test_gauge(ready)));
+
+    avmlib_fileio_destroy(io);
+    avmlib_port_destroy(NULL,(entry_t)file);
+    avmlib_port_destroy(NULL,(entry_t)port);
+    avmlib_evloop_destroy(loop);
+    close(fds[1]);
+    unlink(path);
+}
+
+/**************************************************************************//**
+ * @brief The program: IN @stdin,line / OUT @stdout,line.
+ *
+ * @returns A template running it, or NULL on failure.
+ * */
+static avm_t *
+test_program(void)
+{
+    class_segment_t seg;
+    table_t *code;
+
+    test_segment_init(&seg,"test_stats");
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING),avmtype_string_new("line",NULL));
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_IN,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_IN),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_OUT,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_OUT),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+
+    return test_template(&seg);
+}
+
+/**************************************************************************//**
+ * @brief Job setup: read the job's pipe, write /dev/null.
+ * */
+static int
+test_setup(
+    avmlib_vm_t *vm,
+    void *arg
+)
+{
+    table_t *ports = AVM_CLASS_TABLE(vm->avm,AVM_CLASS_PORT);
+    int in = dup(((int *)arg)[0]);
+    int out = open("/dev/null",O_WRONLY);
+
+    if ((0 > avmlib_port_set_fd((class_port_t *)ports->entries[TEST_PORT_IN],in,0)) ||
+        (0 > avmlib_port_set_fd((class_port_t *)ports->entries[TEST_PORT_OUT],out,0))) {
+        close(in);
+        close(out);
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Job completion.
+ * */
+static void
+test_done(
+    avmlib_vm_t *vm,
+    avmlib_vm_status_t status,
+    void *arg
+)
+{
+    test_status[(int (*)[2])arg - test_pipes] = status;
+}
+
+/**************************************************************************//**
+ * @brief Pool jobs parked on empty pipes, then fed.
+ * */
+static void
+test_pool(void)
+{
+    avmlib_pool_t *pool;
+    avm_t *tmpl;
+    int i;
+
+    /* Step 1: Template and pool */
+    if ((NULL == (tmpl = test_program())) || (NULL == (pool = avmlib_pool_new(tmpl,TEST_WORKERS)))) {
+        TEST_CHECK(!"pool");
+        return;
+    }
+
+    /* Step 2: Every job parked */
+    for (i=0;i<TEST_JOBS;i++) {
+        if ((0 > pipe(test_pipes[i])) || (0 > fcntl(test_pipes[i][0],F_SETFL,O_NONBLOCK))) {
+            TEST_CHECK(!"pipe");
+            return;
+        }
+        avmlib_pool_run(pool,test_setup,test_done,test_pipes[i]);
+    }
+    for (i=0;(i < 5000) && (TEST_JOBS != test_gauge(parked));i++) usleep(1000);
+    TEST_CHECK(TEST_JOBS == test_gauge(parked));
+    TEST_CHECK(TEST_JOBS == test_gauge(pending));
+
+    /* Step 3: Fed, and done */
+    for (i=0;i<TEST_JOBS;i++) TEST_CHECK(2 == write(test_pipes[i][1],"x\n",2));
+    avmlib_pool_wait(pool);
+    for (i=0;i<TEST_JOBS;i++) TEST_CHECK(AVMLIB_VM_HALTED == test_status[i]);
+    TEST_CHECK((0 == test_gauge(parked)) && (0 == test_gauge(ready)) && (0 == test_gauge(pending)));
+
+    avmlib_pool_free(pool);
+    for (i=0;i<TEST_JOBS;i++) {
+        close(test_pipes[i][0]);
+        close(test_pipes[i][1]);
+    }
+}
+
+/**************************************************************************//**
+ * @brief Run an instance to completion, then say so.
+ * */
+static void *
+test_runner(
+    void *arg
+)
+{
+    avmlib_vm_run((avmlib_vm_t *)arg,AVMLIB_VM_UNLIMITED);
+    __atomic_store_n(&test_ran,1,__ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**************************************************************************//**
+ * @brief Total retired over every slot.
+ * */
+static uint64_t
+test_retired(void)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i=0;i<AVMLIB_STATS_SLOTS;i++) {
+        n += __atomic_load_n(&test_block->slot[i].retired,__ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/**************************************************************************//**
+ * @brief An unlimited run is counted while it runs.
+ * */
+static void
+test_live(void)
+{
+    uint64_t base, total = (uint64_t)TEST_LOOPS * 3, n;
+    class_segment_t seg;
+    class_register_t *gr1;
+    avmlib_vm_t *vm;
+    avm_t *tmpl;
+    pthread_t thr;
+    int seen = 0;
+
+    test_segment_init(&seg,"test_stats_loop");
+    test_loop(&seg);
+    if ((NULL == (tmpl = test_template(&seg))) || (NULL == (vm = avmlib_vm_new(tmpl))) ||
+        (NULL == (gr1 = avmlib_machine_own(vm->avm,AVM_CLASS_REGISTER,TEST_GR1)))) {
+        TEST_CHECK(!"program");
+        return;
+    }
+    gr1->value = TEST_LOOPS;
+
+    base = test_retired();
+    if (pthread_create(&thr,NULL,test_runner,vm)) {
+        TEST_CHECK(!"pthread");
+        return;
+    }
+    while (!__atomic_load_n(&test_ran,__ATOMIC_ACQUIRE)) {
+        n = test_retired() - base;
+        if ((0 < n) && (n < total)) seen = 1;
+        sched_yield();
+    }
+    pthread_join(thr,NULL);
+    TEST_CHECK(AVMLIB_VM_HALTED == vm->status);
+    TEST_CHECK(total == vm->retired);
+    TEST_CHECK(total == test_retired() - base);
+    TEST_CHECK(seen);
+    avmlib_vm_free(vm);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    avmlib_stats_t *stats;
+
+    if (NULL == (stats = avmlib_stats_open(NULL))) return 1;
+    test_block = stats->block;
+    test_slots();
+    test_evloop();
+    test_pool();
+    test_live();
+    avmlib_stats_close(stats);
+    printf("test_stats: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_STATS_C_ */
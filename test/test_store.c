@@ -0,0 +1,117 @@
+/**************************************************************************//**
+ * @file test_store.c
+ *
+ * @brief The struct-of-arrays runtime store.
+ *
+ * @details Builds a segment's store from its NUMBER and LABEL tables
+ * and checks every array against the objects, then that a rebuild
+ * drops unflushed values and picks up new entities, that a flush
+ * writes values back, and that a clone's borrowed store copies its
+ * values on the first write and leaves its parent's alone.  Exits
+ * nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_STORE_C_
+#define _TEST_STORE_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+#define TEST_NUMBERS 100
+#define TEST_LABELS 10
+
+/**************************************************************************//**
+ * @brief Every array matches the tables.
+ * */
+static void
+test_matches(
+    avm_store_t *store,
+    class_segment_t *seg
+)
+{
+    table_t *nums = AVM_CLASS_TABLE(seg,AVM_CLASS_NUMBER);
+    table_t *lbls = AVM_CLASS_TABLE(seg,AVM_CLASS_LABEL);
+    uint32_t i;
+
+    TEST_CHECK(nums->size == store->number_count);
+    TEST_CHECK(lbls->size == store->label_count);
+    for (i=0;(i<store->number_count) && (i<nums->size);i++) {
+        class_number_t *n = (class_number_t *)nums->entries[i];
+        TEST_CHECK(n->value == avmlib_store_number(store,i));
+        TEST_CHECK(n->bitwidth == store->number_width[i]);
+    }
+    for (i=0;(i<store->label_count) && (i<lbls->size);i++) {
+        class_label_t *l = (class_label_t *)lbls->entries[i];
+        TEST_CHECK(l->offset == avmlib_store_label_offset(store,i));
+        TEST_CHECK(l->segment == avmlib_store_label_segment(store,i));
+    }
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    table_t *nums, *lbls;
+    avm_store_t store, clone;
+    class_segment_t seg;
+    int i;
+
+    /* Step 1: Empty tables, empty store */
+    test_segment_init(&seg,"test_store");
+    memset(&store,0,sizeof(store));
+    TEST_CHECK(0 == avmlib_store_build(&store,&seg));
+    TEST_CHECK(!store.number_count && !store.number_values && !store.label_count && !store.label_offset);
+
+    /* Step 2: Built from the tables */
+    nums = AVM_CLASS_TABLE(&seg,AVM_CLASS_NUMBER);
+    lbls = AVM_CLASS_TABLE(&seg,AVM_CLASS_LABEL);
+    for (i=0;i<TEST_NUMBERS;i++) {
+        avmlib_table_add(nums,avmlib_number_new("n",(i & 1) ? 64 : 32,(int64_t)i * -0x100000001LL));
+    }
+    for (i=0;i<TEST_LABELS;i++) {
+        avmlib_table_add(lbls,avmlib_new_label("l",(i & 1) ? AVMM_SEGMENT_UNLINKED : i,i * 3));
+    }
+    TEST_CHECK(0 == avmlib_store_build(&store,&seg));
+    test_matches(&store,&seg);
+
+    /* Step 3: Rebuilt: unflushed values are lost, new entities appear */
+    avmlib_store_number_set(&store,5,42);
+    TEST_CHECK(42 == avmlib_store_number(&store,5));
+    avmlib_table_add(nums,avmlib_number_new("m",16,7));
+    TEST_CHECK(0 == avmlib_store_build(&store,&seg));
+    test_matches(&store,&seg);
+    TEST_CHECK(42 != avmlib_store_number(&store,5));
+    TEST_CHECK(TEST_NUMBERS + 1 == store.number_count);
+
+    /* Step 4: Flushed values survive a rebuild */
+    avmlib_store_number_set(&store,5,42);
+    avmlib_store_flush(&store,&seg);
+    TEST_CHECK(42 == ((class_number_t *)nums->entries[5])->value);
+    TEST_CHECK(0 == avmlib_store_build(&store,&seg));
+    TEST_CHECK(42 == avmlib_store_number(&store,5));
+
+    /* Step 5: A clone borrows until it writes */
+    avmlib_store_share(&clone,&store);
+    TEST_CHECK(clone.number_values == store.number_values);
+    TEST_CHECK(clone.label_offset == store.label_offset);
+    TEST_CHECK(0 == avmlib_store_number_set(&clone,5,-1));
+    TEST_CHECK(clone.number_values != store.number_values);
+    TEST_CHECK(clone.label_offset == store.label_offset);
+    TEST_CHECK((-1 == avmlib_store_number(&clone,5)) && (42 == avmlib_store_number(&store,5)));
+    TEST_CHECK(avmlib_store_number(&clone,6) == avmlib_store_number(&store,6));
+    avmlib_store_flush(&clone,&seg);
+    TEST_CHECK(42 == ((class_number_t *)nums->entries[5])->value);
+    avmlib_store_free(&clone);
+    test_matches(&store,&seg);
+
+    avmlib_store_free(&store);
+    TEST_CHECK(!store.number_values && !store.label_offset);
+    printf("test_store: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_STORE_C_ */
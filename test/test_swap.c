@@ -0,0 +1,295 @@
+/**************************************************************************//**
+ * @file test_swap.c
+ *
+ * @brief Swapping a segment under running pool jobs.
+ *
+ * @details Jobs running version 1 of the entry segment (IN a line from
+ * a pipe, OUT it) are left blocked on empty pipes, so they're still
+ * executing in it when it's replaced with version 2 (OUT "v2").  The
+ * replace happens while this thread is inside an epoch critical
+ * section, so it can't be reclaimed on the spot and stays pending.
+ * New jobs must then run version 2, and the workers must reclaim the
+ * pending version between them, without freeing it while the blocked
+ * jobs are still in it.  Once they're fed and finish, version 1 must be
+ * freed before the pool is.  Finally, with no jobs left, version 2 is
+ * unloaded and reloaded.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_SWAP_C_
+#define _TEST_SWAP_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_JOBS 8
+#define TEST_WORKERS 2
+
+/**
+ * One job's pipes and result
+ */
+typedef struct {
+    int in[2];
+    int out[2];
+    avmlib_vm_status_t status;
+} test_job_t;
+
+static test_job_t test_old[TEST_JOBS], test_new[TEST_JOBS];
+
+/* STRINGs of version 1 destroyed, i.e. whether it's been freed */
+static uint32_t test_freed;
+
+/**************************************************************************//**
+ * @brief Write a version of the program.
+ *
+ * @details Version 1 is IN @stdin,line / OUT @stdout,line; version 2
+ * is OUT @stdout,tag with tag "v2\n".
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+test_program(
+    const char *path,
+    int version
+)
+{
+    class_segment_t seg;
+    table_t *code;
+
+    test_segment_init(&seg,"test_swap");
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_STRING),
+                     avmtype_string_new((1 == version) ? "line" : "tag",(1 == version) ? NULL : "v2\n"));
+    code = AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION);
+
+    if (1 == version) {
+        avmlib_table_add(code,avmlib_instruction_new(AVM_OP_IN,0,2));
+        avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_IN),0);
+        avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+    }
+    avmlib_table_add(code,avmlib_instruction_new(AVM_OP_OUT,0,2));
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_PORT,TEST_PORT_OUT),0);
+    avmlib_entity_emit(code,avmlib_entity_new(AVM_CLASS_STRING,0),0);
+
+    return avmlib_segment_save(&seg,path,0);
+}
+
+/**************************************************************************//**
+ * @brief Version 1's STRING destructor; counts it being freed.
+ * */
+static void
+test_string_destroy(
+    table_t *this,
+    entry_t entry
+)
+{
+    __atomic_add_fetch(&test_freed,1,__ATOMIC_RELEASE);
+    avmtype_string_destroy(this,entry);
+}
+
+/**************************************************************************//**
+ * @brief Job setup: point the instance's ports at the job's pipes.
+ * */
+static int
+test_setup(
+    avmlib_vm_t *vm,
+    void *arg
+)
+{
+    test_job_t *job = (test_job_t *)arg;
+    table_t *ports = AVM_CLASS_TABLE(vm->avm,AVM_CLASS_PORT);
+    int in = dup(job->in[0]);
+    int out = dup(job->out[1]);
+
+    if ((0 > avmlib_port_set_fd((class_port_t *)ports->entries[TEST_PORT_IN],in,0)) ||
+        (0 > avmlib_port_set_fd((class_port_t *)ports->entries[TEST_PORT_OUT],out,0))) {
+        close(in);
+        close(out);
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************//**
+ * @brief Job completion.
+ * */
+static void
+test_done(
+    avmlib_vm_t *vm,
+    avmlib_vm_status_t status,
+    void *arg
+)
+{
+    __atomic_store_n(&((test_job_t *)arg)->status,status,__ATOMIC_RELEASE);
+}
+
+/**************************************************************************//**
+ * @brief Make a job's pipes and queue it.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+test_run(
+    avmlib_pool_t *pool,
+    test_job_t *job
+)
+{
+    if ((0 > pipe(job->in)) || (0 > pipe(job->out)) ||
+        (0 > fcntl(job->in[0],F_SETFL,O_NONBLOCK))) {
+        perror("pipe");
+        return -1;
+    }
+    job->status = AVMLIB_VM_READY;
+    return avmlib_pool_run(pool,test_setup,test_done,job);
+}
+
+/**************************************************************************//**
+ * @brief Jobs parked across the pool.
+ * */
+static int
+test_parked(
+    avmlib_pool_t *pool
+)
+{
+    int i, n = 0;
+
+    for (i=0;i<TEST_WORKERS;i++) {
+        pthread_mutex_lock(&pool->workers[i].lock);
+        n += pool->workers[i].parked;
+        pthread_mutex_unlock(&pool->workers[i].lock);
+    }
+    return n;
+}
+
+/**************************************************************************//**
+ * @brief Wait up to a few seconds for a counter to reach zero.
+ *
+ * @returns Nonzero if it did.
+ * */
+static int
+test_drained(
+    uint32_t *counter
+)
+{
+    struct timespec nap = { 0, 1000000 };
+    int i;
+
+    for (i=0;(i < 5000) && __atomic_load_n(counter,__ATOMIC_ACQUIRE);i++) nanosleep(&nap,NULL);
+    return 0 == __atomic_load_n(counter,__ATOMIC_ACQUIRE);
+}
+
+/**************************************************************************//**
+ * @brief Close a job's pipes.
+ * */
+static void
+test_close(
+    test_job_t *job
+)
+{
+    close(job->in[0]);
+    close(job->in[1]);
+    close(job->out[0]);
+    close(job->out[1]);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char v1[] = "/tmp/avm_test_swap1XXXXXX";
+    char v2[] = "/tmp/avm_test_swap2XXXXXX";
+    char line[32], got[32];
+    avmlib_epoch_thread_t *thr;
+    avmlib_epoch_t *dom;
+    class_segment_t *seg;
+    avmlib_pool_t *pool;
+    uint16_t id;
+    avm_t *tmpl;
+    ssize_t n;
+    int fd, i;
+
+    /* Step 1: Both versions, a template on version 1, a pool */
+    if ((0 > (fd = mkstemp(v1))) || (0 > close(fd)) ||
+        (0 > (fd = mkstemp(v2))) || (0 > close(fd))) {
+        return 1;
+    }
+    if ((0 > test_program(v1,1)) || (0 > test_program(v2,2)) ||
+        (NULL == (tmpl = avmlib_machine_new())) ||
+        (0 > avmlib_vm_program(tmpl,v1))) {
+        unlink(v1);
+        unlink(v2);
+        return 1;
+    }
+    id = (uint16_t)tmpl->entrypoint;
+    dom = (avmlib_epoch_t *)tmpl->epoch;
+    seg = (class_segment_t *)AVM_CLASS_TABLE(tmpl,AVM_CLASS_SEGMENT)->entries[id];
+    AVM_CLASS_TABLE(seg,AVM_CLASS_STRING)->destroy = test_string_destroy;
+    if (NULL == (pool = avmlib_pool_new(tmpl,TEST_WORKERS))) return 1;
+
+    /* Step 2: Version 1 jobs, all blocked in it */
+    for (i=0;i<TEST_JOBS;i++) {
+        if (0 > test_run(pool,&test_old[i])) return 1;
+    }
+    while (test_parked(pool) < TEST_JOBS) usleep(1000);
+
+    /* Step 3: Replace it while a reader holds the epoch */
+    TEST_CHECK(NULL != (thr = avmlib_epoch_register(dom)));
+    avmlib_epoch_enter(dom,thr);
+    TEST_CHECK(0 == avmlib_segment_replace(tmpl,id,v2));
+    TEST_CHECK(1 == __atomic_load_n(&dom->pending,__ATOMIC_ACQUIRE));
+    avmlib_epoch_exit(thr);
+    avmlib_epoch_unregister(thr);
+
+    /* Step 4: New jobs run version 2, and the workers reclaim version 1
+     * between them, but don't free it */
+    for (i=0;i<TEST_JOBS;i++) {
+        if (0 > test_run(pool,&test_new[i])) return 1;
+    }
+    TEST_CHECK(test_drained(&dom->pending));
+    for (i=0;i<TEST_JOBS;i++) {
+        while (AVMLIB_VM_READY == __atomic_load_n(&test_new[i].status,__ATOMIC_ACQUIRE)) usleep(1000);
+        TEST_CHECK(AVMLIB_VM_HALTED == test_new[i].status);
+        fcntl(test_new[i].out[0],F_SETFL,O_NONBLOCK);
+        TEST_CHECK((3 == read(test_new[i].out[0],got,sizeof(got))) && !memcmp(got,"v2\n",3));
+    }
+    TEST_CHECK(0 == __atomic_load_n(&test_freed,__ATOMIC_ACQUIRE));
+
+    /* Step 5: Let version 1's jobs finish; the last one out frees it */
+    for (i=0;i<TEST_JOBS;i++) {
+        n = snprintf(line,sizeof(line),"job %d\n",i);
+        TEST_CHECK(n == write(test_old[i].in[1],line,n));
+    }
+    avmlib_pool_wait(pool);
+    for (i=0;i<TEST_JOBS;i++) {
+        TEST_CHECK(AVMLIB_VM_HALTED == test_old[i].status);
+        n = snprintf(line,sizeof(line),"job %d\n",i);
+        fcntl(test_old[i].out[0],F_SETFL,O_NONBLOCK);
+        TEST_CHECK((n == read(test_old[i].out[0],got,sizeof(got))) && !memcmp(got,line,n));
+    }
+    TEST_CHECK(1 == __atomic_load_n(&test_freed,__ATOMIC_ACQUIRE));
+
+    /* Step 6: With nothing in version 2, it can be unloaded and reloaded */
+    avmlib_pool_free(pool);
+    seg = (class_segment_t *)AVM_CLASS_TABLE(tmpl,AVM_CLASS_SEGMENT)->entries[id];
+    TEST_CHECK(1 == seg->version); /* Versions count from 0 */
+    TEST_CHECK(0 == avmlib_segment_unload(seg));
+    TEST_CHECK(AVMM_SEGMENT_COLD == seg->state);
+    TEST_CHECK(seg == avmlib_segment_get(tmpl,id));
+    TEST_CHECK(AVMM_SEGMENT_RESIDENT == seg->state);
+
+    unlink(v1);
+    unlink(v2);
+    for (i=0;i<TEST_JOBS;i++) {
+        test_close(&test_old[i]);
+        test_close(&test_new[i]);
+    }
+    printf("test_swap: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_SWAP_C_ */
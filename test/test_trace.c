@@ -0,0 +1,157 @@
+/**************************************************************************//**
+ * @file test_trace.c
+ *
+ * @brief Segment symbols in trace dumps.
+ *
+ * @details With tracing started, programming a template must put its
+ * segment's name and labels in the dump.  Swapping in a new version of
+ * the segment and calling avmlib_trace_symbols() must add the new
+ * version's, under the same ID, even where it landed at the address of
+ * a freed earlier version; calling it again with nothing new must add
+ * nothing.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_TRACE_C_
+#define _TEST_TRACE_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+#define TEST_SWAPS 16
+#define TEST_SEGS (TEST_SWAPS + 2)
+
+/**
+ * A segment's symbols, as read back from a dump
+ */
+typedef struct {
+    uint32_t id;
+    char name[AVMLIB_NAME_MAX + 1];
+    char label[AVMLIB_NAME_MAX + 1]; /* Its first label */
+} test_sym_t;
+
+static test_sym_t test_syms[TEST_SEGS];
+static int test_nsyms;
+
+/**************************************************************************//**
+ * @brief Save a one-label segment.
+ *
+ * @returns 0 on success, -1 on failure.
+ * */
+static int
+test_image(
+    const char *path,
+    const char *name,
+    const char *label
+)
+{
+    class_segment_t seg;
+
+    test_segment_init(&seg,name);
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_LABEL),avmlib_new_label((char *)label,AVMM_SEGMENT_UNLINKED,0));
+    avmlib_table_add(AVM_CLASS_TABLE(&seg,AVM_CLASS_INSTRUCTION),avmlib_instruction_new(AVM_OP_NOP,0,0));
+    return avmlib_segment_save(&seg,path,0);
+}
+
+/**************************************************************************//**
+ * @brief Dump, and read back the segments in the dump's symbols.
+ * */
+static void
+test_dump(
+    const char *path
+)
+{
+    avmlib_trace_header_t hdr;
+    avmlib_trace_sym_t sym, lbl;
+    uint32_t i;
+    FILE *f;
+
+    test_nsyms = 0;
+    if ((0 > avmlib_trace_dump(path)) || (NULL == (f = fopen(path,"r")))) {
+        TEST_CHECK(!"dump");
+        return;
+    }
+    if ((1 != fread(&hdr,sizeof(hdr),1,f)) || memcmp(AVMLIB_TRACE_MAGIC,hdr.magic,sizeof(hdr.magic)) ||
+        fseek(f,(long)(hdr.rings * (sizeof(avmlib_trace_part_t) + hdr.records * hdr.rec_size)),SEEK_CUR)) {
+        TEST_CHECK(!"header");
+        fclose(f);
+        return;
+    }
+    while ((hdr.sym_size >= sizeof(sym)) && (1 == fread(&sym,sizeof(sym),1,f))) {
+        hdr.sym_size -= sizeof(sym) * (1 + (uint64_t)sym.count);
+        if (test_nsyms < TEST_SEGS) {
+            test_syms[test_nsyms].id = sym.id;
+            snprintf(test_syms[test_nsyms].name,sizeof(test_syms[0].name),"%s",sym.name);
+            test_syms[test_nsyms].label[0] = '\0';
+        }
+        for (i=0;(i<sym.count) && (1 == fread(&lbl,sizeof(lbl),1,f));i++) {
+            if (!i && (test_nsyms < TEST_SEGS)) {
+                snprintf(test_syms[test_nsyms].label,sizeof(test_syms[0].label),"%s",lbl.name);
+            }
+        }
+        test_nsyms++;
+    }
+    TEST_CHECK(0 == hdr.sym_size);
+    fclose(f);
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    char dump[] = "/tmp/avm_test_traceXXXXXX", v1[] = "/tmp/avm_test_trace1XXXXXX";
+    char v2[] = "/tmp/avm_test_trace2XXXXXX";
+    avm_t *tmpl = NULL;
+    uint16_t id;
+    int fd, i;
+
+    /* Step 1: Traced, and a template on version 1 */
+    if ((0 > (fd = mkstemp(dump))) || (0 > close(fd)) || (0 > (fd = mkstemp(v1))) || (0 > close(fd)) ||
+        (0 > (fd = mkstemp(v2))) || (0 > close(fd)) ||
+        (0 > test_image(v1,"first","one")) || (0 > test_image(v2,"second","two")) ||
+        (0 > avmlib_trace_start(64,0,0,dump)) ||
+        (NULL == (tmpl = avmlib_machine_new())) || (0 > avmlib_vm_program(tmpl,v1))) {
+        fprintf(stderr,"test_trace: setup failed\n");
+        unlink(dump);
+        unlink(v1);
+        unlink(v2);
+        return 1;
+    }
+    id = (uint16_t)tmpl->entrypoint;
+    test_dump(dump);
+    TEST_CHECK(1 == test_nsyms);
+    TEST_CHECK((id == test_syms[0].id) && !strcmp("first",test_syms[0].name) && !strcmp("one",test_syms[0].label));
+
+    /* Step 2: Version 2, added once */
+    TEST_CHECK(0 == avmlib_segment_replace(tmpl,id,v2));
+    TEST_CHECK(0 == avmlib_trace_symbols(tmpl));
+    TEST_CHECK(0 == avmlib_trace_symbols(tmpl));
+    test_dump(dump);
+    TEST_CHECK(2 == test_nsyms);
+    TEST_CHECK((id == test_syms[1].id) && !strcmp("second",test_syms[1].name) && !strcmp("two",test_syms[1].label));
+
+    /* Step 3: More versions, back and forth; freed as they're swapped
+     * out (nothing runs in them), so later ones land where earlier ones
+     * were */
+    for (i=0;i<TEST_SWAPS;i++) {
+        TEST_CHECK(0 == avmlib_segment_replace(tmpl,id,(i & 1) ? v2 : v1));
+        TEST_CHECK(0 == avmlib_trace_symbols(tmpl));
+    }
+    test_dump(dump);
+    TEST_CHECK(TEST_SEGS == test_nsyms);
+    for (i=2;(i<TEST_SEGS) && (i<test_nsyms);i++) {
+        TEST_CHECK((id == test_syms[i].id) && !strcmp((i & 1) ? "second" : "first",test_syms[i].name));
+    }
+
+    avmlib_trace_stop();
+    unlink(dump);
+    unlink(v1);
+    unlink(v2);
+    printf("test_trace: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_TRACE_C_ */
@@ -0,0 +1,129 @@
+/**************************************************************************//**
+ * @file test_txn.c
+ *
+ * @brief Register transactions: ordering, growth and failure.
+ *
+ * @details Drives avmlib_txn_* directly against registers whose
+ * handlers log every write.  Checks that nothing is written before
+ * the outermost COMMIT, that a transaction far past AVMLIB_TXN_INIT
+ * writes stay held, that the flush keeps program order (batching only
+ * consecutive writes to one backend), and that a failed batched write
+ * fails the COMMIT.  Exits nonzero on failure.
+ * <em>Copyright (C) 2017, Andrew Kephart.  All rights reserved.</em>
+ * */
+#ifndef _TEST_TXN_C_
+#define _TEST_TXN_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+#define TEST_REGS 4
+#define TEST_WRITES (AVMLIB_TXN_INIT * 5)
+
+/* Write log: which register, and how many writes came in each call */
+static intptr_t test_log[TEST_WRITES * 2];
+static int test_logged;
+static int test_calls;
+static int test_short;
+
+static uint32_t
+test_set(
+    class_register_t *reg,
+    uint32_t value
+)
+{
+    test_log[test_logged++] = reg->private_data;
+    test_calls++;
+    return reg->value = value;
+}
+
+static int
+test_set_many(
+    class_register_t **regs,
+    uint32_t *values,
+    int count
+)
+{
+    int i;
+
+    for (i=0;i<count;i++) {
+        test_log[test_logged++] = regs[i]->private_data;
+        regs[i]->value = values[i];
+    }
+    test_calls++;
+    return test_short ? (count - 1) : count;
+}
+
+int
+main(
+    int argc,
+    char **argv
+)
+{
+    class_register_t regs[TEST_REGS];
+    class_register_t *many[2];
+    uint32_t values[2];
+    avmlib_txn_t txn;
+    int i;
+
+    /* Regs 0 and 1 share a batched backend; 2 and 3 don't batch */
+    memset(regs,0,sizeof(regs));
+    for (i=0;i<TEST_REGS;i++) {
+        regs[i].mode = REGMODE_RW;
+        regs[i].private_data = i;
+        regs[i].set = test_set;
+        if (i < 2) regs[i].set_many = test_set_many;
+    }
+    avmlib_txn_init(&txn);
+
+    /* Step 1: Nothing is written until the outermost COMMIT */
+    avmlib_txn_begin(&txn);
+    avmlib_txn_begin(&txn);
+    for (i=0;i<TEST_WRITES;i++) {
+        TEST_CHECK(0 == avmlib_txn_set(&txn,&regs[i % TEST_REGS],i));
+    }
+    TEST_CHECK(0 == avmlib_txn_commit(&txn));
+    TEST_CHECK(0 == test_logged);
+    TEST_CHECK((uint32_t)(TEST_WRITES - 1) == avmlib_txn_get(&txn,&regs[TEST_REGS - 1]));
+    many[0] = &regs[1];
+    many[1] = &regs[3];
+    TEST_CHECK(2 == avmlib_txn_get_many(&txn,many,values,2));
+    TEST_CHECK((values[0] == TEST_WRITES - 3) && (values[1] == TEST_WRITES - 1));
+
+    /* Step 2: Program order (of last writes); 0 and 1 are one run */
+    TEST_CHECK(TEST_REGS == avmlib_txn_commit(&txn));
+    TEST_CHECK(TEST_REGS == test_logged);
+    for (i=0;i<TEST_REGS;i++) {
+        TEST_CHECK(i == test_log[i]);
+        TEST_CHECK((uint32_t)(TEST_WRITES - TEST_REGS + i) == regs[i].value);
+    }
+    TEST_CHECK(3 == test_calls);
+
+    /* Step 3: A batch split by another backend stays split */
+    test_logged = test_calls = 0;
+    avmlib_txn_begin(&txn);
+    avmlib_txn_set(&txn,&regs[0],1);
+    avmlib_txn_set(&txn,&regs[2],2);
+    avmlib_txn_set(&txn,&regs[1],3);
+    avmlib_txn_set(&txn,&regs[0],4);
+    TEST_CHECK(3 == avmlib_txn_commit(&txn));
+    TEST_CHECK((2 == test_log[0]) && (1 == test_log[1]) && (0 == test_log[2]));
+    TEST_CHECK(2 == test_calls);
+
+    /* Step 4: Failures */
+    TEST_CHECK(0 > avmlib_txn_commit(&txn));
+    test_short = 1;
+    avmlib_txn_begin(&txn);
+    avmlib_txn_set(&txn,&regs[0],1);
+    avmlib_txn_set(&txn,&regs[1],2);
+    TEST_CHECK(0 > avmlib_txn_commit(&txn));
+    TEST_CHECK(0 == txn.depth);
+
+    avmlib_txn_free(&txn);
+    printf("test_txn: %s\n",test_failed?"FAILED":"ok");
+    return test_failed;
+}
+
+#endif /* _TEST_TXN_C_ */